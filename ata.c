@@ -0,0 +1,544 @@
+/*
+ * ata.c - ATA disks on the IDE channels
+ * Drives are found with IDENTIFY on the two legacy channels, or on the
+ * ports a native-mode PCI IDE controller reports. Transfers sleep on
+ * the channel interrupt: PIO moves one sector per interrupt, and when
+ * the controller has a bus-master function, DMA moves a whole request
+ * through a PRD table built from the buffer's physical pages.
+ */
+
+#include "kernel.h"
+
+// Command block registers, from the channel's I/O base
+#define ATA_REG_DATA     0
+#define ATA_REG_ERROR    1
+#define ATA_REG_COUNT    2
+#define ATA_REG_LBA0     3
+#define ATA_REG_LBA1     4
+#define ATA_REG_LBA2     5
+#define ATA_REG_DRIVE    6
+#define ATA_REG_STATUS   7      // Reading it acknowledges the interrupt
+#define ATA_REG_COMMAND  7
+
+// The control base has the alternate status (read) and device control (write)
+#define ATA_CTRL_NIEN    0x02   // Interrupts off
+#define ATA_CTRL_SRST    0x04
+
+#define ATA_STATUS_ERR   0x01
+#define ATA_STATUS_DRQ   0x08
+#define ATA_STATUS_DF    0x20
+#define ATA_STATUS_BSY   0x80
+#define ATA_STATUS_FAIL  (ATA_STATUS_ERR | ATA_STATUS_DF)
+
+#define ATA_CMD_READ_PIO      0x20
+#define ATA_CMD_READ_PIO_EXT  0x24
+#define ATA_CMD_READ_DMA_EXT  0x25
+#define ATA_CMD_WRITE_PIO     0x30
+#define ATA_CMD_WRITE_PIO_EXT 0x34
+#define ATA_CMD_WRITE_DMA_EXT 0x35
+#define ATA_CMD_READ_DMA      0xC8
+#define ATA_CMD_WRITE_DMA     0xCA
+#define ATA_CMD_FLUSH         0xE7
+#define ATA_CMD_FLUSH_EXT     0xEA
+#define ATA_CMD_IDENTIFY      0xEC
+
+// IDENTIFY words
+#define ID_MODEL          27
+#define ID_CAPABILITIES   49
+#define ID_LBA28_SECTORS  60
+#define ID_COMMAND_SETS   83
+#define ID_LBA48_SECTORS  100
+#define ID_CAP_DMA        (1u << 8)
+#define ID_CMD_LBA48      (1u << 10)
+
+#define LBA28_LIMIT       (1u << 28)
+#define ATA_MAX_SECTORS   256   // A sector count register of 0 means 256
+#define ATA_TIMEOUT_MS    5000
+#define ATA_IDENTIFY_MS   100   // For each wait of a probe
+
+// Bus-master IDE registers, 8 per channel from BAR4
+#define BM_REG_COMMAND    0
+#define BM_REG_STATUS     2
+#define BM_REG_PRDT       4
+#define BM_CMD_START      0x01
+#define BM_CMD_TO_MEMORY  0x08  // Device to memory, i.e. a read
+#define BM_STATUS_ERROR   0x02  // Write 1 to clear
+#define BM_STATUS_IRQ     0x04  // Write 1 to clear
+
+#define PCI_CLASS_IDE      0x0101
+#define PCI_IDE_NATIVE_PRIMARY   0x01
+#define PCI_IDE_NATIVE_SECONDARY 0x04
+#define PCI_IDE_BUS_MASTER       0x80
+#define PCI_COMMAND_IO     0x0001
+#define PCI_COMMAND_MASTER 0x0004
+
+// One contiguous piece of a DMA buffer; may not cross a 64KB boundary
+struct prd {
+    uint32_t address;
+    uint16_t bytes;             // 0 means 64KB
+    uint16_t flags;
+};
+
+#define PRD_END           0x8000
+#define ATA_PRD_MAX       (PAGE_SIZE / sizeof(struct prd))
+
+struct ata_channel {
+    uint16_t io;
+    uint16_t ctrl;
+    uint16_t bmide;             // 0 without bus-master DMA
+    uint8_t irq;
+    int irq_ready;              // Waits sleep on the interrupt instead of polling
+    mutex_t lock;               // One command at a time
+    struct prd* prdt;           // One frame, identity mapped
+    struct task* waiter;
+    volatile int irq_done;
+    volatile int timed_out;
+    volatile uint8_t irq_status;
+    volatile uint8_t bm_status;
+    struct timer timeout;
+};
+
+struct ata_drive {
+    struct block_device dev;
+    struct ata_channel* channel;
+    uint8_t slave;
+    uint8_t lba48;
+    uint8_t dma;
+    char name[8];
+    char model[41];
+};
+
+static struct ata_channel channels[2] = {
+    { .io = 0x1F0, .ctrl = 0x3F6, .irq = 14, .lock = MUTEX_INIT("ata-primary") },
+    { .io = 0x170, .ctrl = 0x376, .irq = 15, .lock = MUTEX_INIT("ata-secondary") },
+};
+static struct ata_drive drives[4];
+
+// Find the first IDE controller and take its ports, IRQ and bus-master base
+static void pci_setup_ide(void) {
+    for (uint32_t bus = 0; bus < 256; bus++) {
+        for (uint32_t slot = 0; slot < 32; slot++) {
+            for (uint32_t func = 0; func < 8; func++) {
+                uint32_t id = pci_read(bus, slot, func, 0x00);
+                if ((id & 0xFFFF) == 0xFFFF) {
+                    if (func == 0) {
+                        break;
+                    }
+                    continue;
+                }
+
+                uint32_t class = pci_read(bus, slot, func, 0x08);
+                if (class >> 16 == PCI_CLASS_IDE) {
+                    uint8_t prog_if = class >> 8;
+                    uint8_t irq = pci_read(bus, slot, func, 0x3C) & 0xFF;
+                    if (prog_if & PCI_IDE_NATIVE_PRIMARY) {
+                        channels[0].io = pci_read(bus, slot, func, 0x10) & ~3u;
+                        channels[0].ctrl = (pci_read(bus, slot, func, 0x14) & ~3u) + 2;
+                        channels[0].irq = irq;
+                    }
+                    if (prog_if & PCI_IDE_NATIVE_SECONDARY) {
+                        channels[1].io = pci_read(bus, slot, func, 0x18) & ~3u;
+                        channels[1].ctrl = (pci_read(bus, slot, func, 0x1C) & ~3u) + 2;
+                        channels[1].irq = irq;
+                    }
+
+                    uint32_t bar4 = pci_read(bus, slot, func, 0x20);
+                    if ((prog_if & PCI_IDE_BUS_MASTER) && (bar4 & 1)) {
+                        uint32_t command = pci_read(bus, slot, func, 0x04);
+                        pci_write(bus, slot, func, 0x04, command | PCI_COMMAND_IO | PCI_COMMAND_MASTER);
+                        channels[0].bmide = bar4 & ~3u;
+                        channels[1].bmide = (bar4 & ~3u) + 8;
+                    }
+                    return;
+                }
+
+                // Single-function devices answer for every function number
+                if (func == 0 && !(pci_read(bus, slot, 0, 0x0C) & 0x00800000)) {
+                    break;
+                }
+            }
+        }
+    }
+}
+
+// About 400ns: four reads of the alternate status register
+static void ata_delay(struct ata_channel* ch) {
+    for (int i = 0; i < 4; i++) {
+        inb(ch->ctrl);
+    }
+}
+
+// Poll until BSY clears; returns the status, or -1 after 'ms'
+static int ata_poll(struct ata_channel* ch, uint32_t ms) {
+    uint64_t deadline = ktime_ns() + (uint64_t)ms * 1000000;
+    uint8_t status;
+    while ((status = inb(ch->ctrl)) & ATA_STATUS_BSY) {
+        if (ktime_ns() > deadline) {
+            return -1;
+        }
+        asm volatile("pause");
+    }
+    return status;
+}
+
+static void ata_reset(struct ata_channel* ch) {
+    if (ch->bmide) {
+        outb(ch->bmide + BM_REG_COMMAND, 0);
+    }
+    uint8_t control = ch->irq_ready ? 0 : ATA_CTRL_NIEN;
+    outb(ch->ctrl, control | ATA_CTRL_SRST);
+    ata_delay(ch);
+    outb(ch->ctrl, control);
+    ata_poll(ch, ATA_TIMEOUT_MS);
+}
+
+static void ata_timeout(void* data) {
+    struct ata_channel* ch = data;
+    ch->timed_out = 1;
+    if (ch->waiter) {
+        sched_wake(ch->waiter);
+    }
+}
+
+// Set up for the next interrupt before starting whatever raises it
+static void ata_arm(struct ata_channel* ch) {
+    ch->irq_done = 0;
+    ch->waiter = current_task();
+}
+
+// Sleep until the channel interrupts; returns the status the handler
+// read, or -1 when the command timed out and the channel was reset
+static int ata_wait(struct ata_channel* ch) {
+    if (!ch->irq_ready) {
+        return ata_poll(ch, ATA_TIMEOUT_MS) < 0 ? -1 : inb(ch->io + ATA_REG_STATUS);
+    }
+
+    ch->timed_out = 0;
+    timer_add(&ch->timeout, ATA_TIMEOUT_MS, ata_timeout, ch);
+    while (!ch->irq_done && !ch->timed_out) {
+        sched_block();
+    }
+    timer_cancel(&ch->timeout);
+
+    if (!ch->irq_done) {
+        ata_reset(ch);
+        return -1;
+    }
+    return ch->irq_status;
+}
+
+// Select the drive and load the LBA and sector count registers
+static void ata_setup(struct ata_drive* drive, uint64_t lba, uint32_t count, int ext) {
+    uint16_t io = drive->channel->io;
+    if (ext) {
+        outb(io + ATA_REG_DRIVE, 0x40 | drive->slave << 4);
+        ata_delay(drive->channel);
+        // High bytes first, then low bytes through the same registers
+        outb(io + ATA_REG_COUNT, count >> 8);
+        outb(io + ATA_REG_LBA0, lba >> 24);
+        outb(io + ATA_REG_LBA1, lba >> 32);
+        outb(io + ATA_REG_LBA2, lba >> 40);
+    } else {
+        outb(io + ATA_REG_DRIVE, 0xE0 | drive->slave << 4 | ((lba >> 24) & 0x0F));
+        ata_delay(drive->channel);
+    }
+    outb(io + ATA_REG_COUNT, count & 0xFF);
+    outb(io + ATA_REG_LBA0, lba);
+    outb(io + ATA_REG_LBA1, lba >> 8);
+    outb(io + ATA_REG_LBA2, lba >> 16);
+}
+
+static int ata_pio(struct ata_drive* drive, uint64_t lba, uint32_t count, uint16_t* data, int write, int ext) {
+    struct ata_channel* ch = drive->channel;
+    uint8_t command = write ? (ext ? ATA_CMD_WRITE_PIO_EXT : ATA_CMD_WRITE_PIO)
+                            : (ext ? ATA_CMD_READ_PIO_EXT : ATA_CMD_READ_PIO);
+    ata_setup(drive, lba, count, ext);
+    ata_arm(ch);
+    outb(ch->io + ATA_REG_COMMAND, command);
+
+    for (uint32_t i = 0; i < count; i++, data += SECTOR_SIZE / 2) {
+        int status;
+        if (write) {
+            // The drive asks for each sector with DRQ and interrupts
+            // once it has taken it
+            status = ata_poll(ch, ATA_TIMEOUT_MS);
+            if (status < 0 || (status & ATA_STATUS_FAIL) || !(status & ATA_STATUS_DRQ)) {
+                return -1;
+            }
+            ata_arm(ch);
+            outsw(ch->io + ATA_REG_DATA, data, SECTOR_SIZE / 2);
+            status = ata_wait(ch);
+            if (status < 0 || (status & ATA_STATUS_FAIL)) {
+                return -1;
+            }
+        } else {
+            status = ata_wait(ch);
+            if (status < 0 || (status & ATA_STATUS_FAIL) || !(status & ATA_STATUS_DRQ)) {
+                return -1;
+            }
+            // The next interrupt comes once this sector has been read
+            ata_arm(ch);
+            insw(ch->io + ATA_REG_DATA, data, SECTOR_SIZE / 2);
+        }
+    }
+    return 0;
+}
+
+// Describe 'bytes' at 'buffer' in the channel's PRD table; returns -1
+// when it needs more entries than fit or is not word aligned
+static int ata_build_prdt(struct ata_channel* ch, void* buffer, uint32_t bytes) {
+    uintptr_t virt = (uintptr_t)buffer;
+    uint32_t count = 0;
+    struct prd* prd = NULL;
+
+    if (virt & 1) {
+        return -1;
+    }
+    while (bytes) {
+        uint32_t chunk = PAGE_SIZE - (virt & (PAGE_SIZE - 1));
+        if (chunk > bytes) {
+            chunk = bytes;
+        }
+        // Fault in heap pages before asking for their frames
+        (void)*(volatile uint8_t*)virt;
+        uintptr_t phys = paging_translate(virt);
+        if (!phys) {
+            return -1;
+        }
+
+        uint32_t prd_bytes = prd ? (prd->bytes ? prd->bytes : 0x10000) : 0;
+        if (prd && prd->address + prd_bytes == phys &&
+            prd->address >> 16 == (phys + chunk - 1) >> 16) {
+            prd->bytes = prd_bytes + chunk;     // 64KB wraps to 0
+        } else {
+            if (count == ATA_PRD_MAX) {
+                return -1;
+            }
+            prd = &ch->prdt[count++];
+            prd->address = phys;
+            prd->bytes = chunk;
+            prd->flags = 0;
+        }
+        virt += chunk;
+        bytes -= chunk;
+    }
+    prd->flags = PRD_END;
+    return 0;
+}
+
+// Returns 1 when the buffer cannot be used for DMA and PIO should be tried
+static int ata_dma(struct ata_drive* drive, uint64_t lba, uint32_t count, void* buffer, int write, int ext) {
+    struct ata_channel* ch = drive->channel;
+    if (ata_build_prdt(ch, buffer, count * SECTOR_SIZE) < 0) {
+        return 1;
+    }
+
+    uint16_t bm = ch->bmide;
+    uint8_t direction = write ? 0 : BM_CMD_TO_MEMORY;
+    uint8_t command = write ? (ext ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_WRITE_DMA)
+                            : (ext ? ATA_CMD_READ_DMA_EXT : ATA_CMD_READ_DMA);
+    outb(bm + BM_REG_COMMAND, direction);
+    outl(bm + BM_REG_PRDT, (uintptr_t)ch->prdt);
+    outb(bm + BM_REG_STATUS, inb(bm + BM_REG_STATUS) | BM_STATUS_ERROR | BM_STATUS_IRQ);
+
+    ata_setup(drive, lba, count, ext);
+    ata_arm(ch);
+    outb(ch->io + ATA_REG_COMMAND, command);
+    outb(bm + BM_REG_COMMAND, direction | BM_CMD_START);
+
+    int status = ata_wait(ch);
+    outb(bm + BM_REG_COMMAND, direction);
+    uint8_t bm_status = ch->irq_ready ? ch->bm_status : inb(bm + BM_REG_STATUS);
+    if (status < 0 || (status & ATA_STATUS_FAIL) || (bm_status & BM_STATUS_ERROR)) {
+        return -1;
+    }
+    return 0;
+}
+
+static int ata_transfer(struct block_device* dev, uint64_t lba, uint32_t count, void* buffer, int write) {
+    struct ata_drive* drive = dev->data;
+    struct ata_channel* ch = drive->channel;
+    if (!count || count > ATA_MAX_SECTORS || lba + count > dev->sectors) {
+        return -1;
+    }
+    int ext = lba + count > LBA28_LIMIT;
+
+    mutex_lock(&ch->lock);
+    int result = 1;
+    if (drive->dma) {
+        result = ata_dma(drive, lba, count, buffer, write, ext);
+    }
+    if (result > 0) {
+        result = ata_pio(drive, lba, count, buffer, write, ext);
+    }
+    if (result < 0) {
+        printf("%s: %s of %u sectors at LBA %llu failed (status %#x, error %#x)\n",
+               drive->name, write ? "write" : "read", count, lba,
+               inb(ch->ctrl), inb(ch->io + ATA_REG_ERROR));
+    }
+    mutex_unlock(&ch->lock);
+    return result;
+}
+
+static int ata_read(struct block_device* dev, uint64_t lba, uint32_t count, void* buffer) {
+    return ata_transfer(dev, lba, count, buffer, 0);
+}
+
+static int ata_write(struct block_device* dev, uint64_t lba, uint32_t count, const void* buffer) {
+    return ata_transfer(dev, lba, count, (void*)buffer, 1);
+}
+
+// Make the drive commit its own write cache
+static int ata_flush(struct block_device* dev) {
+    struct ata_drive* drive = dev->data;
+    struct ata_channel* ch = drive->channel;
+
+    mutex_lock(&ch->lock);
+    outb(ch->io + ATA_REG_DRIVE, 0xE0 | drive->slave << 4);
+    ata_delay(ch);
+    ata_arm(ch);
+    outb(ch->io + ATA_REG_COMMAND, drive->lba48 ? ATA_CMD_FLUSH_EXT : ATA_CMD_FLUSH);
+    int status = ata_wait(ch);
+    mutex_unlock(&ch->lock);
+    return status < 0 || (status & ATA_STATUS_FAIL) ? -1 : 0;
+}
+
+static void ata_irq_handler(struct interrupt_frame* frame) {
+    uint8_t irq = frame->vector - IRQ_BASE;
+    for (int i = 0; i < 2; i++) {
+        struct ata_channel* ch = &channels[i];
+        if (!ch->irq_ready || ch->irq != irq) {
+            continue;
+        }
+        if (ch->bmide) {
+            // Native-mode channels share one line; the bus-master
+            // status says which of them raised it
+            uint8_t bm_status = inb(ch->bmide + BM_REG_STATUS);
+            if (!(bm_status & BM_STATUS_IRQ)) {
+                continue;
+            }
+            ch->bm_status = bm_status;
+            outb(ch->bmide + BM_REG_STATUS, bm_status | BM_STATUS_ERROR | BM_STATUS_IRQ);
+        }
+        ch->irq_status = inb(ch->io + ATA_REG_STATUS);
+        ch->irq_done = 1;
+        if (ch->waiter) {
+            sched_wake(ch->waiter);
+        }
+    }
+}
+
+// IDENTIFY by polling, with the channel's interrupt still off
+static int ata_identify(struct ata_channel* ch, uint8_t slave, uint16_t* id) {
+    outb(ch->io + ATA_REG_DRIVE, 0xA0 | slave << 4);
+    ata_delay(ch);
+    outb(ch->io + ATA_REG_COUNT, 0);
+    outb(ch->io + ATA_REG_LBA0, 0);
+    outb(ch->io + ATA_REG_LBA1, 0);
+    outb(ch->io + ATA_REG_LBA2, 0);
+    outb(ch->io + ATA_REG_COMMAND, ATA_CMD_IDENTIFY);
+    if (!inb(ch->io + ATA_REG_STATUS)) {
+        return -1;
+    }
+
+    int status = ata_poll(ch, ATA_IDENTIFY_MS);
+    // ATAPI and SATA devices abort with a signature in the LBA registers
+    if (status < 0 || inb(ch->io + ATA_REG_LBA1) || inb(ch->io + ATA_REG_LBA2)) {
+        return -1;
+    }
+    uint64_t deadline = ktime_ns() + (uint64_t)ATA_IDENTIFY_MS * 1000000;
+    while (!((status = inb(ch->io + ATA_REG_STATUS)) & (ATA_STATUS_DRQ | ATA_STATUS_ERR))) {
+        if (ktime_ns() > deadline) {
+            return -1;
+        }
+        asm volatile("pause");
+    }
+    if (status & ATA_STATUS_ERR) {
+        return -1;
+    }
+    insw(ch->io + ATA_REG_DATA, id, 256);
+    return 0;
+}
+
+static int ata_probe(int channel, uint8_t slave) {
+    struct ata_channel* ch = &channels[channel];
+    uint16_t id[256];
+    if (ata_identify(ch, slave, id) < 0) {
+        return 0;
+    }
+
+    struct ata_drive* drive = &drives[channel * 2 + slave];
+    drive->channel = ch;
+    drive->slave = slave;
+    drive->lba48 = (id[ID_COMMAND_SETS] & ID_CMD_LBA48) != 0;
+    drive->dma = ch->bmide && (id[ID_CAPABILITIES] & ID_CAP_DMA);
+
+    // The model string is stored as big-endian words, space padded
+    for (int i = 0; i < 20; i++) {
+        drive->model[i * 2] = id[ID_MODEL + i] >> 8;
+        drive->model[i * 2 + 1] = id[ID_MODEL + i] & 0xFF;
+    }
+    int len = 40;
+    while (len > 0 && drive->model[len - 1] == ' ') {
+        len--;
+    }
+    drive->model[len] = '\0';
+
+    uint64_t sectors = id[ID_LBA28_SECTORS] | (uint32_t)id[ID_LBA28_SECTORS + 1] << 16;
+    if (drive->lba48) {
+        sectors = id[ID_LBA48_SECTORS] | (uint64_t)id[ID_LBA48_SECTORS + 1] << 16 |
+                  (uint64_t)id[ID_LBA48_SECTORS + 2] << 32 | (uint64_t)id[ID_LBA48_SECTORS + 3] << 48;
+    }
+
+    ksnprintf(drive->name, sizeof(drive->name), "ata%d", channel * 2 + slave);
+    drive->dev.name = drive->name;
+    drive->dev.sectors = sectors;
+    drive->dev.max_sectors = ATA_MAX_SECTORS;
+    drive->dev.read = ata_read;
+    drive->dev.write = ata_write;
+    drive->dev.flush = ata_flush;
+    drive->dev.data = drive;
+    return 1;
+}
+
+// Probe both channels and register what answers; needs the scheduler
+// and timer, since transfers sleep on interrupts with a timeout
+void ata_init(void) {
+    pci_setup_ide();
+
+    for (int c = 0; c < 2; c++) {
+        struct ata_channel* ch = &channels[c];
+        if (inb(ch->io + ATA_REG_STATUS) == 0xFF) {
+            continue;       // Floating bus, nothing attached
+        }
+        outb(ch->ctrl, ATA_CTRL_NIEN);
+
+        int found = ata_probe(c, 0) + ata_probe(c, 1);
+        if (!found) {
+            continue;
+        }
+        if (ch->bmide) {
+            ch->prdt = (struct prd*)pmm_alloc_frame();
+            if (!ch->prdt) {
+                ch->bmide = 0;
+                drives[c * 2].dma = drives[c * 2 + 1].dma = 0;
+            }
+        }
+
+        register_irq_handler(ch->irq, ata_irq_handler);
+        inb(ch->io + ATA_REG_STATUS);
+        ch->irq_ready = 1;
+        outb(ch->ctrl, 0);
+
+        for (int slave = 0; slave < 2; slave++) {
+            struct ata_drive* drive = &drives[c * 2 + slave];
+            if (!drive->channel) {
+                continue;
+            }
+            printf("%s: %s, %u MB%s, %s\n", drive->name, drive->model,
+                   (uint32_t)(drive->dev.sectors >> 11), drive->lba48 ? ", LBA48" : "",
+                   drive->dma ? "DMA" : "PIO");
+            block_register(&drive->dev);
+        }
+    }
+}
@@ -0,0 +1,231 @@
+/*
+ * bench.c - Microbenchmarks behind the bench shell command
+ * Every benchmark is timed with RDTSC over a batch of operations: a
+ * few warmup batches, then BENCH_RUNS measured ones whose median is
+ * reported. Results are printed one per line as "BENCH key=value ..."
+ * so runs can be compared by a script on the host.
+ */
+
+#include "kernel.h"
+
+#define BENCH_WARMUP   2
+#define BENCH_RUNS     9
+#define BENCH_VECTOR   0x80             // Unused software interrupt
+#define BENCH_BUFFER_SIZE (1024 * 1024)
+#define CHURN_SLOTS    64
+
+struct benchmark {
+    const char* name;
+    uint32_t param;                     // Size in bytes, where it applies
+    uint32_t ops;                       // Operations per measured batch
+    int throughput;                     // Report MB/s from param bytes per op
+    void (*run)(uint32_t param, uint32_t ops);
+};
+
+static uint8_t* bench_src;
+static uint8_t* bench_dst;
+static void* churn_slots[CHURN_SLOTS];
+
+static void bench_kmalloc(uint32_t size, uint32_t ops) {
+    for (uint32_t i = 0; i < ops; i += CHURN_SLOTS) {
+        for (int j = 0; j < CHURN_SLOTS; j++) {
+            churn_slots[j] = kmalloc(size);
+        }
+        // Free in a different order than allocated to churn the free lists
+        for (int j = 0; j < CHURN_SLOTS; j += 2) {
+            kfree(churn_slots[j]);
+        }
+        for (int j = 1; j < CHURN_SLOTS; j += 2) {
+            kfree(churn_slots[j]);
+        }
+    }
+}
+
+static void bench_memset(uint32_t size, uint32_t ops) {
+    for (uint32_t i = 0; i < ops; i++) {
+        memset(bench_dst, (int)i, size);
+    }
+}
+
+static void bench_memcpy(uint32_t size, uint32_t ops) {
+    for (uint32_t i = 0; i < ops; i++) {
+        memcpy(bench_dst, bench_src, size);
+    }
+}
+
+static void bench_terminal_write(uint32_t size, uint32_t ops) {
+    for (uint32_t i = 0; i < ops; i++) {
+        terminal_write((const char*)bench_src, size);
+    }
+}
+
+static void bench_terminal_scroll(uint32_t size, uint32_t ops) {
+    UNUSED(size);
+    for (uint32_t i = 0; i < ops; i++) {
+        terminal_scroll();
+        terminal_flush();
+    }
+}
+
+static spinlock_t bench_spinlock = SPINLOCK_INIT("bench");
+static ticketlock_t bench_ticketlock = TICKETLOCK_INIT("bench-ticket");
+
+// Uncontended lock/unlock pairs: the cost every critical section pays
+static void bench_spinlock_pair(uint32_t size, uint32_t ops) {
+    UNUSED(size);
+    for (uint32_t i = 0; i < ops; i++) {
+        spin_lock(&bench_spinlock);
+        spin_unlock(&bench_spinlock);
+    }
+}
+
+static void bench_ticketlock_pair(uint32_t size, uint32_t ops) {
+    UNUSED(size);
+    for (uint32_t i = 0; i < ops; i++) {
+        ticket_lock(&bench_ticketlock);
+        ticket_unlock(&bench_ticketlock);
+    }
+}
+
+static void bench_isr_handler(struct interrupt_frame* frame) {
+    UNUSED(frame);
+}
+
+// Not on the host, where int $0x80 is a system call
+#ifndef HOST_TEST
+static void bench_isr(uint32_t size, uint32_t ops) {
+    UNUSED(size);
+    for (uint32_t i = 0; i < ops; i++) {
+        asm volatile("int %0" : : "i"(BENCH_VECTOR) : "memory");
+    }
+}
+#endif
+
+static void bench_dispatch(uint32_t size, uint32_t ops) {
+    UNUSED(size);
+    for (uint32_t i = 0; i < ops; i++) {
+        process_command("true");
+    }
+}
+
+// Tokenizing with quotes and escapes, two commands per line
+static void bench_parse(uint32_t size, uint32_t ops) {
+    UNUSED(size);
+    for (uint32_t i = 0; i < ops; i++) {
+        process_command("true alpha 'b c' \"d \\\"e\" f\\ g 12345; true x");
+    }
+}
+
+static const struct benchmark benchmarks[] = {
+    { "kmalloc",  16,      1024, 0, bench_kmalloc },
+    { "kmalloc",  256,     1024, 0, bench_kmalloc },
+    { "kmalloc",  2048,    1024, 0, bench_kmalloc },
+    { "kmalloc",  8192,    256,  0, bench_kmalloc },
+    { "memset",   64,      4096, 1, bench_memset },
+    { "memset",   4096,    256,  1, bench_memset },
+    { "memset",   65536,   16,   1, bench_memset },
+    { "memset",   1048576, 2,    1, bench_memset },
+    { "memcpy",   64,      4096, 1, bench_memcpy },
+    { "memcpy",   4096,    256,  1, bench_memcpy },
+    { "memcpy",   65536,   16,   1, bench_memcpy },
+    { "memcpy",   1048576, 2,    1, bench_memcpy },
+    { "termwrite", VGA_WIDTH * VGA_HEIGHT, 4, 0, bench_terminal_write },
+    { "scroll",   0,       64,   0, bench_terminal_scroll },
+    { "spinlock", 0,       4096, 0, bench_spinlock_pair },
+    { "ticketlock", 0,     4096, 0, bench_ticketlock_pair },
+#ifndef HOST_TEST
+    { "isr",      0,       1024, 0, bench_isr },
+#endif
+    { "dispatch", 0,       1024, 0, bench_dispatch },
+    { "parse",    0,       1024, 0, bench_parse },
+};
+
+#define BENCHMARK_COUNT (sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+static uint64_t bench_time(const struct benchmark* bench) {
+    preempt_disable();
+    uint64_t start = rdtsc();
+    bench->run(bench->param, bench->ops);
+    uint64_t cycles = rdtsc() - start;
+    preempt_enable();
+    return cycles;
+}
+
+static void bench_one(const struct benchmark* bench) {
+    uint64_t runs[BENCH_RUNS];
+
+    for (int i = 0; i < BENCH_WARMUP; i++) {
+        bench_time(bench);
+    }
+    // Insertion sort as the samples come in
+    for (int i = 0; i < BENCH_RUNS; i++) {
+        uint64_t cycles = bench_time(bench);
+        int j = i;
+        while (j > 0 && runs[j - 1] > cycles) {
+            runs[j] = runs[j - 1];
+            j--;
+        }
+        runs[j] = cycles;
+    }
+
+    uint64_t median = runs[BENCH_RUNS / 2];
+    printf("BENCH name=%s size=%u ops=%u cycles/op=%u min=%u max=%u",
+           bench->name, bench->param, bench->ops,
+           (uint32_t)div64_u32(median, bench->ops, NULL),
+           (uint32_t)div64_u32(runs[0], bench->ops, NULL),
+           (uint32_t)div64_u32(runs[BENCH_RUNS - 1], bench->ops, NULL));
+
+    uint32_t khz = tsc_khz();
+    uint32_t us = khz ? (uint32_t)div64_u32(median * 1000, khz, NULL) : 0;
+    if (bench->throughput && us) {
+        // Bytes per microsecond is MB/s
+        uint64_t bytes = (uint64_t)bench->param * bench->ops;
+        printf(" MB/s=%u", (uint32_t)div64_u32(bytes, us, NULL));
+    }
+    printf("\n");
+}
+
+static void cmd_bench(int argc, char** argv) {
+    if (!tsc_khz()) {
+        printf("bench: needs a TSC\n");
+        return;
+    }
+    if (argc > 1 && strcmp(argv[1], "list") == 0) {
+        for (size_t i = 0; i < BENCHMARK_COUNT; i++) {
+            printf("%s %u\n", benchmarks[i].name, benchmarks[i].param);
+        }
+        return;
+    }
+
+    // Sources and targets for the memory and terminal benchmarks
+    bench_src = (uint8_t*)pmm_alloc_frames(BENCH_BUFFER_SIZE / PAGE_SIZE, 1);
+    bench_dst = (uint8_t*)pmm_alloc_frames(BENCH_BUFFER_SIZE / PAGE_SIZE, 1);
+    if (!bench_src || !bench_dst) {
+        printf("bench: not enough memory for the buffers\n");
+        if (bench_src) pmm_free_frames((uintptr_t)bench_src);
+        if (bench_dst) pmm_free_frames((uintptr_t)bench_dst);
+        return;
+    }
+    for (uint32_t i = 0; i < BENCH_BUFFER_SIZE; i++) {
+        bench_src[i] = 'a' + i % 26;
+    }
+
+    register_interrupt_handler(BENCH_VECTOR, bench_isr_handler);
+
+    printf("BENCH tsc_khz=%u runs=%u warmup=%u\n", tsc_khz(), BENCH_RUNS, BENCH_WARMUP);
+    for (size_t i = 0; i < BENCHMARK_COUNT; i++) {
+        // An optional argument picks benchmarks by name
+        if (argc > 1 && strcmp(argv[1], benchmarks[i].name) != 0) {
+            continue;
+        }
+        bench_one(&benchmarks[i]);
+    }
+
+    register_interrupt_handler(BENCH_VECTOR, NULL);
+    pmm_free_frames((uintptr_t)bench_src);
+    pmm_free_frames((uintptr_t)bench_dst);
+}
+
+void bench_init(void) {
+    shell_register_command("bench", cmd_bench, "Run microbenchmarks (bench [list|name])");
+}
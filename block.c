@@ -0,0 +1,484 @@
+/*
+ * block.c - Block devices and the block cache
+ * Drivers register a block_device; everything else goes through
+ * block_read and block_write, which work on a cache of 4KB blocks (8
+ * sectors) kept in LRU order. A write only dirties the cached block;
+ * it goes to the device when evicted, on block_sync, or from the flush
+ * task every few seconds. A miss right after the previous miss on the
+ * same device reads ahead, doubling the window up to
+ * BLOCK_READAHEAD_MAX blocks in one transfer.
+ */
+
+#include "kernel.h"
+
+#define BLOCK_SIZE            4096
+#define BLOCK_SHIFT           3         // Sectors per block, as a shift
+#define BLOCK_SECTORS         (1u << BLOCK_SHIFT)
+#define BLOCK_CACHE_BLOCKS    256       // 1MB of cache
+#define BLOCK_HASH_SIZE       512       // Power of two
+#define BLOCK_READAHEAD_MAX   32        // Blocks, 128KB
+#define BLOCK_FLUSH_MS        5000
+#define BLOCK_FLUSH_PRIORITY  24
+
+struct cache_block {
+    struct block_device* dev;   // NULL when unused
+    uint32_t number;            // Block index on dev
+    int dirty;
+    uint8_t* data;
+    struct cache_block* hash_next;
+    struct cache_block* lru_prev;
+    struct cache_block* lru_next;
+};
+
+static struct cache_block cache[BLOCK_CACHE_BLOCKS];
+static struct cache_block* hash_table[BLOCK_HASH_SIZE];
+static struct cache_block* lru_head;        // Most recently used
+static struct cache_block* lru_tail;
+static uint8_t* readahead_buffer;           // BLOCK_READAHEAD_MAX blocks
+static uint32_t dirty_count;
+static int unflushed;                       // Written back since the last device flush
+static mutex_t cache_lock = MUTEX_INIT("block-cache");
+static struct block_device* devices;
+
+static struct {
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t readahead;         // Blocks read beyond the one missed
+    uint32_t reads;             // Device reads issued
+    uint32_t writebacks;
+    uint32_t errors;
+} stats;
+
+static inline uint32_t hash_slot(const struct block_device* dev, uint32_t number) {
+    return (number * 2654435761u ^ (uintptr_t)dev >> 4) & (BLOCK_HASH_SIZE - 1);
+}
+
+// Sectors in block 'number'; the last block of a device may be short
+static uint32_t block_sectors(const struct block_device* dev, uint32_t number) {
+    uint64_t first = (uint64_t)number << BLOCK_SHIFT;
+    uint64_t left = dev->sectors - first;
+    return left < BLOCK_SECTORS ? (uint32_t)left : BLOCK_SECTORS;
+}
+
+static uint32_t device_blocks(const struct block_device* dev) {
+    return (uint32_t)((dev->sectors + BLOCK_SECTORS - 1) >> BLOCK_SHIFT);
+}
+
+static struct cache_block* cache_lookup(struct block_device* dev, uint32_t number) {
+    struct cache_block* block = hash_table[hash_slot(dev, number)];
+    while (block && (block->dev != dev || block->number != number)) {
+        block = block->hash_next;
+    }
+    return block;
+}
+
+static void hash_remove(struct cache_block* block) {
+    struct cache_block** link = &hash_table[hash_slot(block->dev, block->number)];
+    while (*link != block) {
+        link = &(*link)->hash_next;
+    }
+    *link = block->hash_next;
+}
+
+static void lru_unlink(struct cache_block* block) {
+    if (block->lru_prev) {
+        block->lru_prev->lru_next = block->lru_next;
+    } else {
+        lru_head = block->lru_next;
+    }
+    if (block->lru_next) {
+        block->lru_next->lru_prev = block->lru_prev;
+    } else {
+        lru_tail = block->lru_prev;
+    }
+}
+
+static void lru_push_head(struct cache_block* block) {
+    block->lru_prev = NULL;
+    block->lru_next = lru_head;
+    if (lru_head) {
+        lru_head->lru_prev = block;
+    } else {
+        lru_tail = block;
+    }
+    lru_head = block;
+}
+
+static void lru_touch(struct cache_block* block) {
+    if (block != lru_head) {
+        lru_unlink(block);
+        lru_push_head(block);
+    }
+}
+
+static int write_back(struct cache_block* block) {
+    if (!block->dirty) {
+        return 0;
+    }
+    struct block_device* dev = block->dev;
+    uint64_t lba = (uint64_t)block->number << BLOCK_SHIFT;
+    if (dev->write(dev, lba, block_sectors(dev, block->number), block->data) < 0) {
+        stats.errors++;
+        return -1;
+    }
+    block->dirty = 0;
+    dirty_count--;
+    unflushed = 1;
+    stats.writebacks++;
+    return 0;
+}
+
+// Forget a block, e.g. after a failed read into it
+static void cache_drop(struct cache_block* block) {
+    if (block->dev) {
+        hash_remove(block);
+        block->dev = NULL;
+    }
+    lru_unlink(block);
+    block->lru_next = NULL;
+    block->lru_prev = lru_tail;
+    if (lru_tail) {
+        lru_tail->lru_next = block;
+    } else {
+        lru_head = block;
+    }
+    lru_tail = block;
+}
+
+// Recycle the least recently used block other than 'keep' that is
+// clean or can be written back as (dev, number). A block whose
+// write-back fails stays dirty and cached; NULL when no block could be
+// freed. The returned block's data is not valid yet.
+static struct cache_block* cache_assign(struct block_device* dev, uint32_t number,
+                                        const struct cache_block* keep) {
+    struct block_device* failed = NULL;     // Not retried in this walk
+    struct cache_block* block;
+    for (block = lru_tail; block; block = block->lru_prev) {
+        if (block == keep || (block->dirty && block->dev == failed)) {
+            continue;
+        }
+        if (write_back(block) == 0) {
+            break;
+        }
+        printf("block: write-back of %s block %u failed, kept dirty\n",
+               block->dev->name, block->number);
+        failed = block->dev;
+    }
+    if (!block) {
+        return NULL;
+    }
+    if (block->dev) {
+        hash_remove(block);
+    }
+
+    block->dev = dev;
+    block->number = number;
+    uint32_t slot = hash_slot(dev, number);
+    block->hash_next = hash_table[slot];
+    hash_table[slot] = block;
+    lru_touch(block);
+    return block;
+}
+
+// Read the missed block and, for a sequential reader, the ones after it
+static struct cache_block* cache_fill(struct block_device* dev, uint32_t number) {
+    uint32_t window = 1;
+    if (number && number == dev->ra_next) {
+        window = dev->ra_window * 2;
+        if (window > BLOCK_READAHEAD_MAX) {
+            window = BLOCK_READAHEAD_MAX;
+        }
+    }
+    if (window > dev->max_sectors >> BLOCK_SHIFT) {
+        window = dev->max_sectors >> BLOCK_SHIFT;
+    }
+
+    // Stop at the device end or a block that is already cached
+    uint32_t limit = device_blocks(dev);
+    uint32_t count = 1;
+    while (count < window && number + count < limit && !cache_lookup(dev, number + count)) {
+        count++;
+    }
+    dev->ra_window = window;
+    dev->ra_next = number + count;
+
+    uint64_t lba = (uint64_t)number << BLOCK_SHIFT;
+    uint32_t sectors = ((count - 1) << BLOCK_SHIFT) + block_sectors(dev, number + count - 1);
+    struct cache_block* first = cache_assign(dev, number, NULL);
+    if (!first) {
+        return NULL;
+    }
+    stats.reads++;
+
+    if (count == 1) {
+        if (dev->read(dev, lba, sectors, first->data) < 0) {
+            stats.errors++;
+            cache_drop(first);
+            return NULL;
+        }
+        return first;
+    }
+
+    if (dev->read(dev, lba, sectors, readahead_buffer) < 0) {
+        stats.errors++;
+        cache_drop(first);
+        dev->ra_window = 1;
+        return NULL;
+    }
+    memcpy(first->data, readahead_buffer, BLOCK_SIZE);
+    uint32_t cached = 1;
+    while (cached < count) {
+        struct cache_block* block = cache_assign(dev, number + cached, first);
+        if (!block) {
+            break;      // The rest of the read-ahead is simply not kept
+        }
+        memcpy(block->data, readahead_buffer + cached * BLOCK_SIZE, BLOCK_SIZE);
+        cached++;
+    }
+    dev->ra_next = number + cached;
+    stats.readahead += cached - 1;
+
+    // Read-ahead went in at the LRU head; the block asked for belongs there
+    lru_touch(first);
+    return first;
+}
+
+// The cached copy of block 'number'. With fill = 0 the caller is about
+// to overwrite all of it, so a miss does not read the device.
+static struct cache_block* cache_get(struct block_device* dev, uint32_t number, int fill) {
+    struct cache_block* block = cache_lookup(dev, number);
+    if (block) {
+        stats.hits++;
+        lru_touch(block);
+        return block;
+    }
+    stats.misses++;
+    return fill ? cache_fill(dev, number) : cache_assign(dev, number, NULL);
+}
+
+int block_read(struct block_device* dev, uint64_t lba, uint32_t count, void* buffer) {
+    if (lba + count > dev->sectors) {
+        return -1;
+    }
+
+    uint8_t* out = buffer;
+    int result = 0;
+    mutex_lock(&cache_lock);
+    while (count) {
+        uint32_t number = (uint32_t)(lba >> BLOCK_SHIFT);
+        uint32_t offset = (uint32_t)lba & (BLOCK_SECTORS - 1);
+        uint32_t n = BLOCK_SECTORS - offset;
+        if (n > count) {
+            n = count;
+        }
+
+        struct cache_block* block = cache_get(dev, number, 1);
+        if (!block) {
+            result = -1;
+            break;
+        }
+        memcpy(out, block->data + offset * SECTOR_SIZE, n * SECTOR_SIZE);
+        out += n * SECTOR_SIZE;
+        lba += n;
+        count -= n;
+    }
+    mutex_unlock(&cache_lock);
+    return result;
+}
+
+int block_write(struct block_device* dev, uint64_t lba, uint32_t count, const void* buffer) {
+    if (lba + count > dev->sectors) {
+        return -1;
+    }
+
+    const uint8_t* in = buffer;
+    int result = 0;
+    mutex_lock(&cache_lock);
+    while (count) {
+        uint32_t number = (uint32_t)(lba >> BLOCK_SHIFT);
+        uint32_t offset = (uint32_t)lba & (BLOCK_SECTORS - 1);
+        uint32_t n = BLOCK_SECTORS - offset;
+        if (n > count) {
+            n = count;
+        }
+
+        // Partial blocks need the rest of their contents first
+        int whole = offset == 0 && n == block_sectors(dev, number);
+        struct cache_block* block = cache_get(dev, number, !whole);
+        if (!block) {
+            result = -1;
+            break;
+        }
+        memcpy(block->data + offset * SECTOR_SIZE, in, n * SECTOR_SIZE);
+        if (!block->dirty) {
+            block->dirty = 1;
+            dirty_count++;
+        }
+        in += n * SECTOR_SIZE;
+        lba += n;
+        count -= n;
+    }
+    mutex_unlock(&cache_lock);
+    return result;
+}
+
+// Write every dirty block back, then have the devices commit them
+int block_sync(void) {
+    int result = 0;
+    mutex_lock(&cache_lock);
+    for (size_t i = 0; dirty_count && i < BLOCK_CACHE_BLOCKS; i++) {
+        if (cache[i].dev && write_back(&cache[i]) < 0) {
+            result = -1;
+        }
+    }
+    if (unflushed) {
+        unflushed = 0;
+        for (struct block_device* dev = devices; dev; dev = dev->next) {
+            if (dev->flush && dev->flush(dev) < 0) {
+                result = -1;
+            }
+        }
+    }
+    mutex_unlock(&cache_lock);
+    return result;
+}
+
+void block_register(struct block_device* dev) {
+    struct block_device** link = &devices;
+    while (*link) {
+        link = &(*link)->next;
+    }
+    dev->next = NULL;
+    dev->ra_next = 0;
+    dev->ra_window = 1;
+    *link = dev;
+}
+
+struct block_device* block_find(const char* name) {
+    struct block_device* dev = devices;
+    while (dev && strcmp(dev->name, name) != 0) {
+        dev = dev->next;
+    }
+    return dev;
+}
+
+struct block_device* block_list(void) {
+    return devices;
+}
+
+static void block_flush_thread(void* arg) {
+    UNUSED(arg);
+    while (1) {
+        kthread_sleep(BLOCK_FLUSH_MS);
+        block_sync();
+    }
+}
+
+static void disk_dump(struct block_device* dev, uint64_t lba) {
+    uint8_t sector[SECTOR_SIZE];
+    if (block_read(dev, lba, 1, sector) < 0) {
+        printf("disk: read failed\n");
+        return;
+    }
+    for (uint32_t row = 0; row < SECTOR_SIZE; row += 16) {
+        printf("%03x ", row);
+        for (uint32_t i = 0; i < 16; i++) {
+            printf(" %02x", sector[row + i]);
+        }
+        printf("  ");
+        for (uint32_t i = 0; i < 16; i++) {
+            char c = sector[row + i];
+            printf("%c", c >= 32 && c < 127 ? c : '.');
+        }
+        printf("\n");
+    }
+}
+
+// Sequential read of 'mb' megabytes through the cache
+static void disk_bench(struct block_device* dev, uint32_t mb) {
+    uint64_t sectors = (uint64_t)mb << 11;
+    if (sectors > dev->sectors) {
+        sectors = dev->sectors;
+    }
+    uint8_t* buffer = kmalloc(BLOCK_SIZE);
+    if (!buffer) {
+        printf("disk: out of memory\n");
+        return;
+    }
+
+    uint32_t reads = stats.reads;
+    uint64_t start = ktime_ns();
+    for (uint64_t lba = 0; lba < sectors; lba += BLOCK_SECTORS) {
+        uint32_t count = sectors - lba < BLOCK_SECTORS ? (uint32_t)(sectors - lba) : BLOCK_SECTORS;
+        if (block_read(dev, lba, count, buffer) < 0) {
+            printf("disk: read failed at LBA %llu\n", lba);
+            break;
+        }
+    }
+    uint32_t us = (uint32_t)div64_u32(ktime_ns() - start, 1000, NULL);
+    kfree(buffer);
+
+    uint32_t kb = (uint32_t)(sectors >> 1);
+    printf("%u KB in %u us, %u device reads", kb, us, stats.reads - reads);
+    if (us) {
+        printf(", %u KB/s", (uint32_t)div64_u32((uint64_t)kb * 1000000, us, NULL));
+    }
+    printf("\n");
+}
+
+static void cmd_disk(int argc, char** argv) {
+    const char* action = argc > 1 ? argv[1] : "list";
+
+    if (strcmp(action, "list") == 0) {
+        if (!devices) {
+            printf("No block devices\n");
+        }
+        for (struct block_device* dev = devices; dev; dev = dev->next) {
+            printf("%-6s %10llu sectors %6u MB\n", dev->name, dev->sectors,
+                   (uint32_t)(dev->sectors >> 11));
+        }
+    } else if (strcmp(action, "stats") == 0) {
+        uint32_t lookups = stats.hits + stats.misses;
+        printf("Cache: %u blocks of %u bytes, %u dirty\n", BLOCK_CACHE_BLOCKS, BLOCK_SIZE, dirty_count);
+        printf("Hits: %u  Misses: %u  Hit rate: %u%%\n", stats.hits, stats.misses,
+               lookups ? stats.hits * 100 / lookups : 0);
+        printf("Device reads: %u  Read-ahead blocks: %u  Write-backs: %u  Errors: %u\n",
+               stats.reads, stats.readahead, stats.writebacks, stats.errors);
+    } else if (strcmp(action, "sync") == 0) {
+        printf(block_sync() < 0 ? "disk: sync failed\n" : "Cache written back\n");
+    } else if (strcmp(action, "read") == 0 || strcmp(action, "bench") == 0) {
+        struct block_device* dev = argc > 2 ? block_find(argv[2]) : devices;
+        uint32_t value = action[0] == 'r' ? 0 : 1;
+        if (!dev) {
+            printf("disk: no such device\n");
+        } else if (argc > 3 && parse_uint(argv[3], &value) < 0) {
+            printf("disk: bad number '%s'\n", argv[3]);
+        } else if (action[0] == 'r') {
+            if (value >= dev->sectors) {
+                printf("disk: LBA %u is past the end of %s\n", value, dev->name);
+            } else {
+                disk_dump(dev, value);
+            }
+        } else {
+            disk_bench(dev, value);
+        }
+    } else {
+        printf("Usage: disk [list|stats|sync|read <dev> <lba>|bench <dev> <MB>]\n");
+    }
+}
+
+void block_init(void) {
+    uint8_t* data = (uint8_t*)pmm_alloc_frames(BLOCK_CACHE_BLOCKS, 1);
+    readahead_buffer = (uint8_t*)pmm_alloc_frames(BLOCK_READAHEAD_MAX, 1);
+    if (!data || !readahead_buffer) {
+        kernel_panic("block: no memory for the cache");
+    }
+
+    for (size_t i = 0; i < BLOCK_CACHE_BLOCKS; i++) {
+        cache[i].data = data + i * BLOCK_SIZE;
+        lru_push_head(&cache[i]);
+    }
+
+    kthread_create("bflush", block_flush_thread, NULL, BLOCK_FLUSH_PRIORITY);
+    shell_register_command("disk", cmd_disk, "Block devices and cache (disk help)");
+}
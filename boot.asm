@@ -4,60 +4,171 @@
 [BITS 16]           ; We start in 16-bit real mode
 [ORG 0x7C00]        ; BIOS loads us at 0x7C00
 
+KERNEL_SEGMENT  equ 0x1000      ; Kernel is staged at 0x10000 (64KB)
+KERNEL_MAGIC    equ 0x534F594D  ; "MYOS" at offset 4 of kernel.bin
+MAX_SECTORS     equ 1024        ; 0x10000-0x90000, below the stack
+LBA_MAX_CHUNK   equ 127         ; Largest transfer many BIOSes accept
+BOOT_PROFILE_MAGIC equ 0x46525042   ; "BPRF" in EAX: boot stamps below 0x7C00
+
 ; Main bootloader entry point
 start:
     ; Initialize segments
-    cli             ; Clear interrupts
     xor ax, ax      ; Set AX to 0
     mov ds, ax      ; Set Data Segment to 0
     mov es, ax      ; Set Extra Segment to 0
-    mov ss, ax      ; Set Stack Segment to 0
+    mov ss, ax      ; Set Stack Segment to 0 (no interrupt until SP is set)
     mov sp, 0x7C00  ; Set stack pointer below bootloader
     sti             ; Enable interrupts
-    
+    mov [boot_drive], dl    ; BIOS passes the boot drive in DL
+
+    ; Boot profile: each stage pushes the full TSC, so the first stamp
+    ; lands at 0x7BF8 and each later one 8 bytes below the one before
+    rdtsc
+    push edx
+    push eax
+
     ; Print loading message
     mov si, loading_msg
     call print_string
-    
-    ; Load kernel from disk
-    ; We'll load it to 0x10000 (64KB) to avoid conflicts
-    mov ax, 0x1000  ; Load segment (0x1000 * 16 = 0x10000)
-    mov es, ax      ; Set ES to load segment
-    mov bx, 0x0000  ; Offset within segment
-    
-    mov ah, 0x02    ; BIOS read sectors function
-    mov al, 18      ; Number of sectors to read (9KB kernel)
-    mov ch, 0       ; Cylinder 0
-    mov cl, 2       ; Start from sector 2 (sector 1 is bootloader)
-    mov dh, 0       ; Head 0
-    mov dl, 0       ; Drive 0 (floppy A:)
-    
-    int 0x13        ; Call BIOS disk services
-    jc disk_error   ; Jump if carry flag set (error)
-    
-    ; Print success message
-    mov si, success_msg
-    call print_string
-    
+
+    ; Use INT 13h extensions (AH=42h) when the BIOS has them
+    mov ah, 0x41
+    mov bx, 0x55AA
+    mov dl, [boot_drive]
+    int 0x13
+    jc .geometry
+    cmp bx, 0xAA55
+    jne .geometry
+    test cl, 1      ; Packet interface supported?
+    jz .geometry
+    mov byte [use_lba], 1
+
+.geometry:
+    ; Drive geometry for the CHS fallback (defaults are a 1.44MB floppy)
+    mov ah, 0x08
+    mov dl, [boot_drive]
+    int 0x13        ; Clobbers ES:DI for floppies
+    jc .load
+    and cx, 0x3F    ; Sectors per track
+    jz .load
+    mov [sectors_per_track], cx
+    movzx dx, dh    ; Highest head number
+    inc dx
+    mov [heads], dx
+
+.load:
+    ; The first kernel sector holds the header with the image size
+    call read_sectors
+
+    mov ax, KERNEL_SEGMENT
+    mov es, ax
+    cmp dword [es:4], KERNEL_MAGIC
+    jne disk_error
+    mov ax, [es:8]  ; Sectors in the image
+    cmp ax, MAX_SECTORS
+    ja disk_error
+    mov [kernel_sectors], ax
+    dec ax          ; The header sector is already in memory
+    mov [remaining], ax
+    call read_sectors
+    rdtsc           ; Stamp: kernel read
+    push edx
+    push eax
+
     ; Enable A20 line (allows access to memory above 1MB)
     call enable_a20
-    
+    rdtsc           ; Stamp: A20 on
+    push edx
+    push eax
+
     ; Switch to protected mode
     cli             ; Disable interrupts
-    lgdt [gdt_descriptor]   ; Load Global Descriptor Table
-    
+    lgdt [gdt_start]        ; Load Global Descriptor Table
+
     mov eax, cr0    ; Get current CR0
     or eax, 1       ; Set PE bit (Protection Enable)
     mov cr0, eax    ; Enable protected mode
-    
+
     ; Far jump to flush CPU pipeline and switch to 32-bit code
     jmp 0x08:protected_mode
-    
+
 disk_error:
     mov si, error_msg
     call print_string
     hlt             ; Halt the system
 
+; Read [remaining] sectors starting at [dap_lba] into [dap_segment]:0
+; Each call to the BIOS moves as many sectors as the transfer limits allow
+read_sectors:
+    mov ax, [remaining]
+    test ax, ax
+    jz .done
+
+    ; Never cross a 64KB boundary (floppy DMA cannot)
+    mov bx, [dap_segment]
+    shl bx, 4       ; Low 16 bits of the physical address
+    neg bx          ; Bytes left before the boundary (0 = a full 64KB)
+    shr bx, 9
+    jz .clipped
+    cmp ax, bx
+    jbe .clipped
+    mov ax, bx
+.clipped:
+    cmp byte [use_lba], 0
+    je .chs
+
+    ; Extended read through a disk address packet
+    cmp ax, LBA_MAX_CHUNK
+    jbe .lba_count
+    mov ax, LBA_MAX_CHUNK
+.lba_count:
+    mov [dap_count], ax
+    mov si, dap
+    mov ah, 0x42
+    mov dl, [boot_drive]
+    int 0x13
+    jc disk_error
+    jmp .advance
+
+.chs:
+    ; LBA -> CHS, reading no further than the end of the current track
+    mov bx, ax
+    mov ax, [dap_lba]
+    xor dx, dx
+    div word [sectors_per_track]    ; AX = track, DX = sector in track
+    mov cx, [sectors_per_track]
+    sub cx, dx
+    cmp bx, cx
+    jbe .track_count
+    mov bx, cx
+.track_count:
+    mov [dap_count], bx
+    mov cx, dx
+    inc cx          ; CL = sector (1-based)
+    xor dx, dx
+    div word [heads]    ; AX = cylinder, DX = head
+    mov dh, dl
+    mov ch, al      ; Cylinder bits 0-7
+    shl ah, 6
+    or cl, ah       ; Cylinder bits 8-9
+    mov dl, [boot_drive]
+    mov es, [dap_segment]
+    xchg ax, bx     ; AL = sector count (under 256)
+    xor bx, bx
+    mov ah, 0x02    ; BIOS read sectors function
+    int 0x13
+    jc disk_error
+
+.advance:
+    mov ax, [dap_count]
+    add [dap_lba], ax
+    sub [remaining], ax
+    shl ax, 5       ; Sectors to paragraphs
+    add [dap_segment], ax
+    jmp read_sectors
+.done:
+    ret
+
 ; Print string function (16-bit real mode)
 print_string:
     lodsb           ; Load byte from SI into AL
@@ -71,33 +182,36 @@ print_string:
 
 ; Enable A20 line
 enable_a20:
-    ; Try keyboard controller method
-    call .wait_8042
-    mov al, 0xAD    ; Disable keyboard
-    out 0x64, al
-    
-    call .wait_8042
-    mov al, 0xD0    ; Read output port
-    out 0x64, al
-    
-    call .wait_8042_data
-    in al, 0x60     ; Read data
-    push ax         ; Save data
-    
+    ; Fast A20 gate through system control port A
+    in al, 0x92
+    or al, 2        ; Set A20 bit
+    and al, 0xFE    ; Never write the reset bit
+    out 0x92, al
+    call .check
+    jne .done
+
+    ; Fall back to the keyboard controller method
     call .wait_8042
     mov al, 0xD1    ; Write output port
     out 0x64, al
-    
-    call .wait_8042
-    pop ax          ; Restore data
-    or al, 2        ; Set A20 bit
-    out 0x60, al    ; Write data
-    
+
     call .wait_8042
-    mov al, 0xAE    ; Enable keyboard
-    out 0x64, al
-    
+    mov al, 0xDF    ; A20 on, CPU reset line released
+    out 0x60, al
+
     call .wait_8042
+.done:
+    ret
+
+; ZF clear when A20 is on: flip the word at 1MB + 0x7DFE and see whether
+; the boot signature at 0x7DFE flipped with it. Both locations are
+; overwritten later, so nothing is restored.
+.check:
+    mov ax, 0xFFFF
+    mov fs, ax
+    not word [fs:0x7E0E]
+    mov ax, [fs:0x7E0E]
+    cmp ax, [0x7DFE]
     ret
 
 .wait_8042:
@@ -106,41 +220,54 @@ enable_a20:
     jnz .wait_8042  ; Wait if full
     ret
 
-.wait_8042_data:
-    in al, 0x64     ; Read status
-    test al, 1      ; Check if output buffer empty
-    jz .wait_8042_data ; Wait if empty
-    ret
-
 ; 32-bit protected mode code
 [BITS 32]
 protected_mode:
-    ; Set up data segments
+    ; Data segments for the copy; the kernel loads its own stack and
+    ; the rest, but pushes before reloading SS
     mov ax, 0x10    ; Data segment selector
     mov ds, ax
     mov es, ax
-    mov fs, ax
-    mov gs, ax
     mov ss, ax
-    
-    ; Set up stack
-    mov esp, 0x90000    ; Set stack pointer to 576KB
-    
+
     ; Copy kernel to 1MB (0x100000) where it expects to be
     mov esi, 0x10000    ; Source: where we loaded the kernel
     mov edi, 0x100000   ; Destination: 1MB mark
-    mov ecx, 0x2400     ; Copy 9KB (18 sectors * 512 bytes)
-    rep movsb           ; Copy byte by byte
-    
-    ; Jump to kernel
+    movzx ecx, word [kernel_sectors]
+    shl ecx, 7          ; Sectors to dwords
+    cld
+    rep movsd           ; Copy a dword at a time
+
+    ; Jump to kernel, telling it the boot stamps are there
+    mov eax, BOOT_PROFILE_MAGIC
     jmp 0x100000        ; Jump to kernel entry point
 
+; Disk address packet for INT 13h AH=42h
+dap:
+    db 0x10, 0      ; Packet size, reserved
+dap_count:
+    dw 0            ; Sectors to transfer
+    dw 0            ; Buffer offset
+dap_segment:
+    dw KERNEL_SEGMENT   ; Buffer segment, advanced after every read
+dap_lba:
+    dd 1, 0         ; Starting LBA (sector 0 is this bootloader)
+
+; Loader state
+boot_drive          db 0
+use_lba             db 0
+sectors_per_track   dw 18
+heads               dw 2
+remaining           dw 1    ; Starts with the header sector
+kernel_sectors      dw 0
+
 ; Global Descriptor Table
 gdt_start:
-    ; Null descriptor
-    dd 0x0
-    dd 0x0
-    
+    ; The unused null descriptor doubles as the GDT descriptor
+    dw gdt_end - gdt_start - 1  ; GDT size
+    dd gdt_start                ; GDT address
+    dw 0
+
     ; Code segment descriptor
     dw 0xFFFF       ; Limit (low)
     dw 0x0000       ; Base (low)
@@ -148,7 +275,7 @@ gdt_start:
     db 10011010b    ; Access (present, ring 0, code, execute/read)
     db 11001111b    ; Flags (4KB blocks, 32-bit)
     db 0x00         ; Base (high)
-    
+
     ; Data segment descriptor
     dw 0xFFFF       ; Limit (low)
     dw 0x0000       ; Base (low)
@@ -158,16 +285,10 @@ gdt_start:
     db 0x00         ; Base (high)
 gdt_end:
 
-; GDT descriptor
-gdt_descriptor:
-    dw gdt_end - gdt_start - 1  ; GDT size
-    dd gdt_start                ; GDT address
-
 ; Messages
 loading_msg db 'Loading kernel...', 13, 10, 0
-success_msg db 'Kernel loaded! Switching to protected mode...', 13, 10, 0
-error_msg db 'Disk read error!', 13, 10, 0
+error_msg db 'Disk error!', 13, 10, 0
 
 ; Pad to 510 bytes and add boot signature
 times 510-($-$$) db 0
-dw 0xAA55           ; Boot signature
\ No newline at end of file
+dw 0xAA55           ; Boot signature
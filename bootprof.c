@@ -0,0 +1,105 @@
+/*
+ * bootprof.c - Boot-time profile
+ * Every boot stage ends with a TSC stamp: boot.asm pushes three onto
+ * its stack below 0x7C00 and says so with BOOT_PROFILE_MAGIC in EAX,
+ * kernel_main takes one on entry and the init steps add the rest up to
+ * the first shell prompt. The bootprof command shows the durations;
+ * once the prompt is up they also go to COM1, one line per stage.
+ */
+
+#include "kernel.h"
+
+#define BOOT_STAGE_MAX 24
+
+// boot.asm's stamps, newest first: A20 on, kernel read, loader entry
+#define BOOT_LOADER_STAMPS 0x7BE8
+#define BOOT_LOADER_STAMP_COUNT 3
+
+struct boot_stage {
+    const char* name;           // What ran before this stamp
+    uint64_t tsc;
+};
+
+static struct boot_stage boot_stages[BOOT_STAGE_MAX];
+static uint32_t boot_stage_count;
+static int boot_have_tsc;
+
+void bootprof_mark(const char* stage) {
+    if (!boot_have_tsc || boot_stage_count == BOOT_STAGE_MAX) {
+        return;
+    }
+    boot_stages[boot_stage_count].name = stage;
+    boot_stages[boot_stage_count].tsc = rdtsc();
+    boot_stage_count++;
+}
+
+// First thing in kernel_main, while the loader's stamps are still there
+// and nothing else has touched low memory
+void bootprof_start(uint32_t boot_magic) {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    boot_have_tsc = (edx >> 4) & 1;
+
+    if (boot_have_tsc && boot_magic == BOOT_PROFILE_MAGIC) {
+        static const char* const loader_stages[BOOT_LOADER_STAMP_COUNT] = {
+            "firmware", "disk-read", "a20",
+        };
+        const volatile uint64_t* stamps = (const volatile uint64_t*)BOOT_LOADER_STAMPS;
+        for (int i = 0; i < BOOT_LOADER_STAMP_COUNT; i++) {
+            boot_stages[i].name = loader_stages[i];
+            boot_stages[i].tsc = stamps[BOOT_LOADER_STAMP_COUNT - 1 - i];
+        }
+        boot_stage_count = BOOT_LOADER_STAMP_COUNT;
+        bootprof_mark("copy-to-1mb");
+    } else {
+        // Firmware and a Multiboot loader, as one stage
+        bootprof_mark("firmware-loader");
+    }
+}
+
+static uint64_t cycles_to_us(uint64_t cycles) {
+    uint32_t khz = tsc_khz();
+    return khz ? div64_u32(cycles * 1000, khz, NULL) : 0;
+}
+
+// The first stage is timed from TSC 0, which is about when the machine
+// was reset
+static uint64_t stage_cycles(uint32_t i) {
+    return boot_stages[i].tsc - (i ? boot_stages[i - 1].tsc : 0);
+}
+
+// Straight to COM1, whatever the console shows
+void bootprof_report(void) {
+    char line[96];
+    for (uint32_t i = 0; i < boot_stage_count; i++) {
+        uint64_t cycles = stage_cycles(i);
+        int len = ksnprintf(line, sizeof(line), "BOOTPROF stage=%s cycles=%llu us=%llu\n",
+                            boot_stages[i].name, cycles, cycles_to_us(cycles));
+        serial_write(line, len < (int)sizeof(line) ? (size_t)len : sizeof(line) - 1);
+    }
+}
+
+static void cmd_bootprof(int argc, char** argv) {
+    UNUSED(argc);
+    UNUSED(argv);
+    if (!boot_stage_count) {
+        printf("bootprof: needs a TSC\n");
+        return;
+    }
+
+    printf("  %-16s %15s %11s %10s\n", "STAGE", "CYCLES", "US", "END US");
+    for (uint32_t i = 0; i < boot_stage_count; i++) {
+        uint64_t cycles = stage_cycles(i);
+        printf("  %-16s %15llu %11llu %10llu\n", boot_stages[i].name, cycles,
+               cycles_to_us(cycles), cycles_to_us(boot_stages[i].tsc));
+    }
+    // Everything after the first stage, which only the TSC reset times
+    if (boot_stage_count > 1) {
+        uint64_t total = boot_stages[boot_stage_count - 1].tsc - boot_stages[0].tsc;
+        printf("  %-16s %15llu %11llu\n", "total", total, cycles_to_us(total));
+    }
+}
+
+void bootprof_init(void) {
+    shell_register_command("bootprof", cmd_bootprof, "Show how long each boot stage took");
+}
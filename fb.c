@@ -0,0 +1,619 @@
+/*
+ * fb.c - Framebuffer console
+ * A terminal sink that draws text into a 32-bit linear framebuffer with
+ * an 8x16 font: the 8x8 font below with every row shown twice. The
+ * framebuffer is the one a Multiboot 2 loader set up, or a mode set
+ * here on the Bochs/QEMU display adapter (BGA), asked for with
+ * fb=<width>x<height> on the command line or with the fb command.
+ *
+ * Cells are VGA-style character/attribute words kept in RAM twice:
+ * what should be on screen and what is, so a write only draws the
+ * cells that changed. Each attribute in use gets a table with the
+ * eight pixels of every possible glyph row, so drawing a row is eight
+ * stores. On BGA, scrolling pans the display down through the rest of
+ * video memory and only the new bottom row is drawn; elsewhere the
+ * cells that changed are redrawn. Video memory is write-combining, so
+ * nothing here ever reads it back.
+ */
+
+#include "kernel.h"
+
+#define FONT_WIDTH      8
+#define FONT_HEIGHT     16      // Rows of the 8x8 font are doubled
+#define FONT_FIRST      0x20
+#define FONT_LAST       0x7E
+#define FB_MAX_COLUMNS  256
+#define FB_MAX_ROWS     128
+#define FB_COLOR_CACHES 8
+#define CELL_INVALID    0xFFFF  // Never stored: cells hold FONT_FIRST..FONT_LAST
+#define CURSOR_HEIGHT   2
+
+// Bochs/QEMU display adapter
+#define BGA_INDEX            0x1CE
+#define BGA_DATA             0x1CF
+#define BGA_REG_ID           0
+#define BGA_REG_XRES         1
+#define BGA_REG_YRES         2
+#define BGA_REG_BPP          3
+#define BGA_REG_ENABLE       4
+#define BGA_REG_VIRT_WIDTH   6
+#define BGA_REG_VIRT_HEIGHT  7
+#define BGA_REG_Y_OFFSET     9
+#define BGA_REG_VIDEO_MEMORY 10     // In 64KB units
+#define BGA_ID_32BPP         0xB0C2 // First version with 32-bit pixels
+#define BGA_ID_LATEST        0xB0C5
+#define BGA_ENABLED          0x01
+#define BGA_LFB_ENABLED      0x40
+#define BGA_PCI_ID           0x11111234     // Device 1111, vendor 1234
+#define BGA_LEGACY_LFB       0xE0000000
+
+// Basic Latin, one byte per row, bit 0 the leftmost pixel
+static const uint8_t font[FONT_LAST - FONT_FIRST + 1][8] = {
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },    // ' '
+    { 0x18, 0x3C, 0x3C, 0x18, 0x18, 0x00, 0x18, 0x00 },    // !
+    { 0x36, 0x36, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },    // "
+    { 0x36, 0x36, 0x7F, 0x36, 0x7F, 0x36, 0x36, 0x00 },    // #
+    { 0x0C, 0x3E, 0x03, 0x1E, 0x30, 0x1F, 0x0C, 0x00 },    // $
+    { 0x00, 0x63, 0x33, 0x18, 0x0C, 0x66, 0x63, 0x00 },    // %
+    { 0x1C, 0x36, 0x1C, 0x6E, 0x3B, 0x33, 0x6E, 0x00 },    // &
+    { 0x06, 0x06, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00 },    // '
+    { 0x18, 0x0C, 0x06, 0x06, 0x06, 0x0C, 0x18, 0x00 },    // (
+    { 0x06, 0x0C, 0x18, 0x18, 0x18, 0x0C, 0x06, 0x00 },    // )
+    { 0x00, 0x66, 0x3C, 0xFF, 0x3C, 0x66, 0x00, 0x00 },    // *
+    { 0x00, 0x0C, 0x0C, 0x3F, 0x0C, 0x0C, 0x00, 0x00 },    // +
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x0C, 0x0C, 0x06 },    // ,
+    { 0x00, 0x00, 0x00, 0x3F, 0x00, 0x00, 0x00, 0x00 },    // -
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x0C, 0x0C, 0x00 },    // .
+    { 0x60, 0x30, 0x18, 0x0C, 0x06, 0x03, 0x01, 0x00 },    // /
+    { 0x3E, 0x63, 0x73, 0x7B, 0x6F, 0x67, 0x3E, 0x00 },    // 0
+    { 0x0C, 0x0E, 0x0C, 0x0C, 0x0C, 0x0C, 0x3F, 0x00 },    // 1
+    { 0x1E, 0x33, 0x30, 0x1C, 0x06, 0x33, 0x3F, 0x00 },    // 2
+    { 0x1E, 0x33, 0x30, 0x1C, 0x30, 0x33, 0x1E, 0x00 },    // 3
+    { 0x38, 0x3C, 0x36, 0x33, 0x7F, 0x30, 0x78, 0x00 },    // 4
+    { 0x3F, 0x03, 0x1F, 0x30, 0x30, 0x33, 0x1E, 0x00 },    // 5
+    { 0x1C, 0x06, 0x03, 0x1F, 0x33, 0x33, 0x1E, 0x00 },    // 6
+    { 0x3F, 0x33, 0x30, 0x18, 0x0C, 0x0C, 0x0C, 0x00 },    // 7
+    { 0x1E, 0x33, 0x33, 0x1E, 0x33, 0x33, 0x1E, 0x00 },    // 8
+    { 0x1E, 0x33, 0x33, 0x3E, 0x30, 0x18, 0x0E, 0x00 },    // 9
+    { 0x00, 0x0C, 0x0C, 0x00, 0x00, 0x0C, 0x0C, 0x00 },    // :
+    { 0x00, 0x0C, 0x0C, 0x00, 0x00, 0x0C, 0x0C, 0x06 },    // ;
+    { 0x18, 0x0C, 0x06, 0x03, 0x06, 0x0C, 0x18, 0x00 },    // <
+    { 0x00, 0x00, 0x3F, 0x00, 0x00, 0x3F, 0x00, 0x00 },    // =
+    { 0x06, 0x0C, 0x18, 0x30, 0x18, 0x0C, 0x06, 0x00 },    // >
+    { 0x1E, 0x33, 0x30, 0x18, 0x0C, 0x00, 0x0C, 0x00 },    // ?
+    { 0x3E, 0x63, 0x7B, 0x7B, 0x7B, 0x03, 0x1E, 0x00 },    // @
+    { 0x0C, 0x1E, 0x33, 0x33, 0x3F, 0x33, 0x33, 0x00 },    // A
+    { 0x3F, 0x66, 0x66, 0x3E, 0x66, 0x66, 0x3F, 0x00 },    // B
+    { 0x3C, 0x66, 0x03, 0x03, 0x03, 0x66, 0x3C, 0x00 },    // C
+    { 0x1F, 0x36, 0x66, 0x66, 0x66, 0x36, 0x1F, 0x00 },    // D
+    { 0x7F, 0x46, 0x16, 0x1E, 0x16, 0x46, 0x7F, 0x00 },    // E
+    { 0x7F, 0x46, 0x16, 0x1E, 0x16, 0x06, 0x0F, 0x00 },    // F
+    { 0x3C, 0x66, 0x03, 0x03, 0x73, 0x66, 0x7C, 0x00 },    // G
+    { 0x33, 0x33, 0x33, 0x3F, 0x33, 0x33, 0x33, 0x00 },    // H
+    { 0x1E, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x1E, 0x00 },    // I
+    { 0x78, 0x30, 0x30, 0x30, 0x33, 0x33, 0x1E, 0x00 },    // J
+    { 0x67, 0x66, 0x36, 0x1E, 0x36, 0x66, 0x67, 0x00 },    // K
+    { 0x0F, 0x06, 0x06, 0x06, 0x46, 0x66, 0x7F, 0x00 },    // L
+    { 0x63, 0x77, 0x7F, 0x7F, 0x6B, 0x63, 0x63, 0x00 },    // M
+    { 0x63, 0x67, 0x6F, 0x7B, 0x73, 0x63, 0x63, 0x00 },    // N
+    { 0x1C, 0x36, 0x63, 0x63, 0x63, 0x36, 0x1C, 0x00 },    // O
+    { 0x3F, 0x66, 0x66, 0x3E, 0x06, 0x06, 0x0F, 0x00 },    // P
+    { 0x1E, 0x33, 0x33, 0x33, 0x3B, 0x1E, 0x38, 0x00 },    // Q
+    { 0x3F, 0x66, 0x66, 0x3E, 0x36, 0x66, 0x67, 0x00 },    // R
+    { 0x1E, 0x33, 0x07, 0x0E, 0x38, 0x33, 0x1E, 0x00 },    // S
+    { 0x3F, 0x2D, 0x0C, 0x0C, 0x0C, 0x0C, 0x1E, 0x00 },    // T
+    { 0x33, 0x33, 0x33, 0x33, 0x33, 0x33, 0x3F, 0x00 },    // U
+    { 0x33, 0x33, 0x33, 0x33, 0x33, 0x1E, 0x0C, 0x00 },    // V
+    { 0x63, 0x63, 0x63, 0x6B, 0x7F, 0x77, 0x63, 0x00 },    // W
+    { 0x63, 0x63, 0x36, 0x1C, 0x1C, 0x36, 0x63, 0x00 },    // X
+    { 0x33, 0x33, 0x33, 0x1E, 0x0C, 0x0C, 0x1E, 0x00 },    // Y
+    { 0x7F, 0x63, 0x31, 0x18, 0x4C, 0x66, 0x7F, 0x00 },    // Z
+    { 0x1E, 0x06, 0x06, 0x06, 0x06, 0x06, 0x1E, 0x00 },    // [
+    { 0x03, 0x06, 0x0C, 0x18, 0x30, 0x60, 0x40, 0x00 },    // backslash
+    { 0x1E, 0x18, 0x18, 0x18, 0x18, 0x18, 0x1E, 0x00 },    // ]
+    { 0x08, 0x1C, 0x36, 0x63, 0x00, 0x00, 0x00, 0x00 },    // ^
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xFF },    // _
+    { 0x0C, 0x0C, 0x18, 0x00, 0x00, 0x00, 0x00, 0x00 },    // `
+    { 0x00, 0x00, 0x1E, 0x30, 0x3E, 0x33, 0x6E, 0x00 },    // a
+    { 0x07, 0x06, 0x06, 0x3E, 0x66, 0x66, 0x3B, 0x00 },    // b
+    { 0x00, 0x00, 0x1E, 0x33, 0x03, 0x33, 0x1E, 0x00 },    // c
+    { 0x38, 0x30, 0x30, 0x3E, 0x33, 0x33, 0x6E, 0x00 },    // d
+    { 0x00, 0x00, 0x1E, 0x33, 0x3F, 0x03, 0x1E, 0x00 },    // e
+    { 0x1C, 0x36, 0x06, 0x0F, 0x06, 0x06, 0x0F, 0x00 },    // f
+    { 0x00, 0x00, 0x6E, 0x33, 0x33, 0x3E, 0x30, 0x1F },    // g
+    { 0x07, 0x06, 0x36, 0x6E, 0x66, 0x66, 0x67, 0x00 },    // h
+    { 0x0C, 0x00, 0x0E, 0x0C, 0x0C, 0x0C, 0x1E, 0x00 },    // i
+    { 0x30, 0x00, 0x30, 0x30, 0x30, 0x33, 0x33, 0x1E },    // j
+    { 0x07, 0x06, 0x66, 0x36, 0x1E, 0x36, 0x67, 0x00 },    // k
+    { 0x0E, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x1E, 0x00 },    // l
+    { 0x00, 0x00, 0x33, 0x7F, 0x7F, 0x6B, 0x63, 0x00 },    // m
+    { 0x00, 0x00, 0x1F, 0x33, 0x33, 0x33, 0x33, 0x00 },    // n
+    { 0x00, 0x00, 0x1E, 0x33, 0x33, 0x33, 0x1E, 0x00 },    // o
+    { 0x00, 0x00, 0x3B, 0x66, 0x66, 0x3E, 0x06, 0x0F },    // p
+    { 0x00, 0x00, 0x6E, 0x33, 0x33, 0x3E, 0x30, 0x78 },    // q
+    { 0x00, 0x00, 0x3B, 0x6E, 0x66, 0x06, 0x0F, 0x00 },    // r
+    { 0x00, 0x00, 0x3E, 0x03, 0x1E, 0x30, 0x1F, 0x00 },    // s
+    { 0x08, 0x0C, 0x3E, 0x0C, 0x0C, 0x2C, 0x18, 0x00 },    // t
+    { 0x00, 0x00, 0x33, 0x33, 0x33, 0x33, 0x6E, 0x00 },    // u
+    { 0x00, 0x00, 0x33, 0x33, 0x33, 0x1E, 0x0C, 0x00 },    // v
+    { 0x00, 0x00, 0x63, 0x6B, 0x7F, 0x7F, 0x36, 0x00 },    // w
+    { 0x00, 0x00, 0x63, 0x36, 0x1C, 0x36, 0x63, 0x00 },    // x
+    { 0x00, 0x00, 0x33, 0x33, 0x33, 0x3E, 0x30, 0x1F },    // y
+    { 0x00, 0x00, 0x3F, 0x19, 0x0C, 0x26, 0x3F, 0x00 },    // z
+    { 0x38, 0x0C, 0x0C, 0x07, 0x0C, 0x0C, 0x38, 0x00 },    // {
+    { 0x18, 0x18, 0x18, 0x00, 0x18, 0x18, 0x18, 0x00 },    // |
+    { 0x07, 0x0C, 0x0C, 0x38, 0x0C, 0x0C, 0x07, 0x00 },    // }
+    { 0x6E, 0x3B, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },    // ~
+};
+
+// The VGA text palette
+static const uint8_t vga_rgb[16][3] = {
+    { 0x00, 0x00, 0x00 }, { 0x00, 0x00, 0xAA }, { 0x00, 0xAA, 0x00 }, { 0x00, 0xAA, 0xAA },
+    { 0xAA, 0x00, 0x00 }, { 0xAA, 0x00, 0xAA }, { 0xAA, 0x55, 0x00 }, { 0xAA, 0xAA, 0xAA },
+    { 0x55, 0x55, 0x55 }, { 0x55, 0x55, 0xFF }, { 0x55, 0xFF, 0x55 }, { 0x55, 0xFF, 0xFF },
+    { 0xFF, 0x55, 0x55 }, { 0xFF, 0x55, 0xFF }, { 0xFF, 0xFF, 0x55 }, { 0xFF, 0xFF, 0xFF },
+};
+
+// Pixels for every 8-bit glyph row in one attribute's colors
+struct color_cache {
+    int attr;                   // -1 while unused
+    uint32_t used;              // Stamp for LRU replacement
+    uint32_t rows[256][FONT_WIDTH];
+};
+
+// Mode
+static uint32_t* fb_base;
+static uintptr_t fb_phys;
+static uint32_t fb_width, fb_height;
+static uint32_t fb_stride;              // Pixels per scanline
+static uint32_t fb_virtual_height;      // Scanlines the display can pan over
+static uint32_t fb_top;                 // First scanline shown
+static int fb_pan_pending;
+static const char* fb_source;
+static uint32_t palette[16];
+
+// Text
+static uint16_t* cells;                 // What the screen should show
+static uint16_t* shown;                 // What it does show
+static uint32_t columns, rows;
+static uint32_t cursor_row, cursor_column;
+static uint32_t cursor_shown = CELL_INVALID;    // Cell with the cursor drawn in it
+static uint32_t dirty_first = FB_MAX_ROWS, dirty_last;
+
+static struct color_cache* color_caches;
+static struct color_cache* color_last;
+static uint32_t color_clock;
+
+// Counters for the fb command
+static uint32_t glyphs_drawn;
+static uint32_t scrolls;
+static uint32_t pans;
+static uint32_t full_redraws;
+static uint32_t color_misses;
+
+static void fb_sink_write(const char* data, size_t size);
+static void fb_sink_clear(void);
+static struct terminal_sink fb_sink = { "fb", fb_sink_write, NULL, fb_sink_clear, 0, NULL };
+static int fb_sink_added;
+
+static inline void bga_write(uint16_t reg, uint16_t value) {
+    outw(BGA_INDEX, reg);
+    outw(BGA_DATA, value);
+}
+
+static inline uint16_t bga_read(uint16_t reg) {
+    outw(BGA_INDEX, reg);
+    return inw(BGA_DATA);
+}
+
+static inline uint16_t blank_cell(uint8_t attr) {
+    return vga_entry(' ', attr);
+}
+
+static inline void mark_dirty(uint32_t first, uint32_t last) {
+    if (first < dirty_first) {
+        dirty_first = first;
+    }
+    if (last > dirty_last) {
+        dirty_last = last;
+    }
+}
+
+static struct color_cache* color_cache_get(uint8_t attr) {
+    if (color_last && color_last->attr == attr) {
+        return color_last;
+    }
+
+    struct color_cache* victim = &color_caches[0];
+    for (int i = 0; i < FB_COLOR_CACHES; i++) {
+        struct color_cache* cache = &color_caches[i];
+        if (cache->attr == attr) {
+            cache->used = ++color_clock;
+            color_last = cache;
+            return cache;
+        }
+        if (cache->used < victim->used) {
+            victim = cache;
+        }
+    }
+
+    color_misses++;
+    uint32_t fg = palette[attr & 0x0F];
+    uint32_t bg = palette[attr >> 4];
+    for (uint32_t bits = 0; bits < 256; bits++) {
+        for (uint32_t x = 0; x < FONT_WIDTH; x++) {
+            victim->rows[bits][x] = (bits >> x) & 1 ? fg : bg;
+        }
+    }
+    victim->attr = attr;
+    victim->used = ++color_clock;
+    color_last = victim;
+    return victim;
+}
+
+static inline uint32_t* cell_pixels(uint32_t x, uint32_t y) {
+    return fb_base + (fb_top + y * FONT_HEIGHT) * fb_stride + x * FONT_WIDTH;
+}
+
+static inline void store_row(uint32_t* dest, const uint32_t* pixels) {
+    dest[0] = pixels[0];
+    dest[1] = pixels[1];
+    dest[2] = pixels[2];
+    dest[3] = pixels[3];
+    dest[4] = pixels[4];
+    dest[5] = pixels[5];
+    dest[6] = pixels[6];
+    dest[7] = pixels[7];
+}
+
+static void draw_cell(uint32_t x, uint32_t y, uint16_t cell) {
+    const struct color_cache* cache = color_cache_get(cell >> 8);
+    const uint8_t* glyph = font[(cell & 0xFF) - FONT_FIRST];
+    uint32_t* dest = cell_pixels(x, y);
+    for (int row = 0; row < 8; row++) {
+        const uint32_t* pixels = cache->rows[glyph[row]];
+        store_row(dest, pixels);
+        store_row(dest + fb_stride, pixels);
+        dest += 2 * fb_stride;
+    }
+    glyphs_drawn++;
+}
+
+// An underline in the cell's foreground color
+static void draw_cursor(uint32_t x, uint32_t y) {
+    const struct color_cache* cache = color_cache_get(cells[y * columns + x] >> 8);
+    uint32_t* dest = cell_pixels(x, y) + (FONT_HEIGHT - CURSOR_HEIGHT) * fb_stride;
+    for (int row = 0; row < CURSOR_HEIGHT; row++) {
+        store_row(dest, cache->rows[0xFF]);
+        dest += fb_stride;
+    }
+}
+
+// Draw the cells that differ from the screen, then pan if scrolled
+static void fb_flush(void) {
+    uint32_t cursor = cursor_row * columns + cursor_column;
+    if (cursor_shown != CELL_INVALID) {
+        shown[cursor_shown] = CELL_INVALID;
+        mark_dirty(cursor_shown / columns, cursor_shown / columns);
+    }
+
+    for (uint32_t y = dirty_first; y <= dirty_last && y < rows; y++) {
+        uint16_t* want = cells + y * columns;
+        uint16_t* have = shown + y * columns;
+        for (uint32_t x = 0; x < columns; x++) {
+            if (want[x] != have[x]) {
+                draw_cell(x, y, want[x]);
+                have[x] = want[x];
+            }
+        }
+    }
+    dirty_first = FB_MAX_ROWS;
+    dirty_last = 0;
+
+    draw_cursor(cursor_column, cursor_row);
+    cursor_shown = cursor;
+
+    // The new rows were drawn below the old screen; show them at once
+    if (fb_pan_pending) {
+        bga_write(BGA_REG_Y_OFFSET, fb_top);
+        fb_pan_pending = 0;
+    }
+}
+
+// Black out scanlines [first, end), margins included
+static void clear_scanlines(uint32_t first, uint32_t end) {
+    for (uint32_t y = first; y < end; y++) {
+        for (uint32_t x = 0; x < fb_width; x++) {
+            fb_base[y * fb_stride + x] = palette[VGA_COLOR_BLACK];
+        }
+    }
+}
+
+// What is on screen moved up a row along with the text
+static void shift_shown(void) {
+    memmove(shown, shown + columns, (rows - 1) * columns * sizeof(uint16_t));
+    memset16(shown + (rows - 1) * columns, CELL_INVALID, columns);
+    if (cursor_shown != CELL_INVALID) {
+        cursor_shown = cursor_shown >= columns ? cursor_shown - columns : CELL_INVALID;
+    }
+}
+
+static void fb_scroll(void) {
+    memmove(cells, cells + columns, (rows - 1) * columns * sizeof(uint16_t));
+    memset16(cells + (rows - 1) * columns, blank_cell(terminal_getcolor()), columns);
+    scrolls++;
+
+    if (fb_virtual_height < fb_height + FONT_HEIGHT) {
+        // No room to pan. Copying the pixels up would read all of video
+        // memory back uncached; instead the flush redraws each cell that
+        // differs from the row above it, which only writes.
+    } else if (fb_top + fb_height + FONT_HEIGHT <= fb_virtual_height) {
+        fb_top += FONT_HEIGHT;
+        shift_shown();
+        fb_pan_pending = 1;
+        pans++;
+    } else {
+        // Out of video memory: start again at the top
+        fb_top = 0;
+        memset16(shown, CELL_INVALID, rows * columns);
+        cursor_shown = CELL_INVALID;
+        fb_pan_pending = 1;
+        full_redraws++;
+    }
+    // A height that is not a whole number of rows leaves scanlines under
+    // the last row, which still hold what was drawn there before
+    if (fb_pan_pending) {
+        clear_scanlines(fb_top + rows * FONT_HEIGHT, fb_top + fb_height);
+    }
+    mark_dirty(0, rows - 1);
+}
+
+static void fb_newline(void) {
+    cursor_column = 0;
+    if (++cursor_row == rows) {
+        fb_scroll();
+        cursor_row = rows - 1;
+    }
+}
+
+// Same control characters as the VGA sink
+static void fb_putc(char c) {
+    if (c == '\n') {
+        fb_newline();
+    } else if (c == '\b') {
+        if (cursor_column > 0) {
+            cursor_column--;
+        } else if (cursor_row > 0) {
+            cursor_row--;
+            cursor_column = columns - 1;
+        }
+    } else {
+        unsigned char glyph = c;
+        if (glyph < FONT_FIRST || glyph > FONT_LAST) {
+            glyph = '?';
+        }
+        cells[cursor_row * columns + cursor_column] = vga_entry(glyph, terminal_getcolor());
+        mark_dirty(cursor_row, cursor_row);
+        if (++cursor_column == columns) {
+            fb_newline();
+        }
+    }
+}
+
+static void fb_sink_write(const char* data, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        fb_putc(data[i]);
+    }
+    fb_flush();
+}
+
+static void fb_sink_clear(void) {
+    memset16(cells, blank_cell(terminal_getcolor()), rows * columns);
+    cursor_row = cursor_column = 0;
+    mark_dirty(0, rows - 1);
+    fb_flush();
+}
+
+static inline uint32_t rgb_pixel(const uint8_t rgb[3], const struct multiboot_framebuffer* mode) {
+    return (uint32_t)rgb[0] << mode->red_shift | (uint32_t)rgb[1] << mode->green_shift |
+           (uint32_t)rgb[2] << mode->blue_shift;
+}
+
+// Take over the console on a mapped 32-bit framebuffer; 'virtual_height'
+// is the scanlines the display can be panned over, or the height
+static int fb_start(const struct multiboot_framebuffer* mode, uint32_t virtual_height,
+                    const char* source) {
+    if (mode->width < VGA_WIDTH * FONT_WIDTH || mode->height < VGA_HEIGHT * FONT_HEIGHT) {
+        printf("fb: %ux%u is smaller than the text screen\n", mode->width, mode->height);
+        return -1;
+    }
+    if (!cells) {
+        cells = kmalloc(FB_MAX_COLUMNS * FB_MAX_ROWS * sizeof(uint16_t));
+        shown = kmalloc(FB_MAX_COLUMNS * FB_MAX_ROWS * sizeof(uint16_t));
+        color_caches = kmalloc(FB_COLOR_CACHES * sizeof(struct color_cache));
+        if (!cells || !shown || !color_caches) {
+            printf("fb: out of memory\n");
+            return -1;
+        }
+    }
+    uint32_t* base = map_framebuffer(mode->address, (size_t)mode->pitch * virtual_height);
+    if (!base) {
+        printf("fb: cannot map %ux%u at %p\n", mode->width, mode->height, (void*)(uintptr_t)mode->address);
+        return -1;
+    }
+
+    // Stop drawing on the old mode before changing any of it
+    fb_sink.enabled = 0;
+    fb_phys = mode->address;
+    fb_base = base;
+    fb_width = mode->width;
+    fb_height = mode->height;
+    fb_stride = mode->pitch / sizeof(uint32_t);
+    fb_virtual_height = virtual_height;
+    fb_top = 0;
+    fb_pan_pending = 0;
+    fb_source = source;
+    columns = fb_width / FONT_WIDTH < FB_MAX_COLUMNS ? fb_width / FONT_WIDTH : FB_MAX_COLUMNS;
+    rows = fb_height / FONT_HEIGHT < FB_MAX_ROWS ? fb_height / FONT_HEIGHT : FB_MAX_ROWS;
+    for (int i = 0; i < 16; i++) {
+        palette[i] = rgb_pixel(vga_rgb[i], mode);
+    }
+    for (int i = 0; i < FB_COLOR_CACHES; i++) {
+        color_caches[i].attr = -1;
+        color_caches[i].used = 0;
+    }
+    color_last = NULL;
+
+    // Black screen and margins over everything panning can show, then
+    // the text screen so far in the top-left corner
+    clear_scanlines(0, fb_virtual_height);
+    memset16(cells, blank_cell(terminal_getcolor()), rows * columns);
+    memset16(shown, CELL_INVALID, rows * columns);
+    size_t row, column;
+    terminal_read_screen(cells, columns, &row, &column);
+    for (uint32_t i = 0; i < VGA_HEIGHT * columns; i++) {
+        uint8_t c = cells[i] & 0xFF;
+        if (c < FONT_FIRST || c > FONT_LAST) {
+            cells[i] = vga_entry(c ? '?' : ' ', cells[i] >> 8);
+        }
+    }
+    cursor_row = row;
+    cursor_column = column;
+    cursor_shown = CELL_INVALID;
+    mark_dirty(0, rows - 1);
+    fb_flush();
+
+    // Text mode is gone, so VGA output would go nowhere
+    for (struct terminal_sink* sink = terminal_sink_list(); sink; sink = sink->next) {
+        if (strcmp(sink->name, "vga") == 0) {
+            sink->enabled = 0;
+        }
+    }
+    fb_sink.enabled = 1;
+    if (!fb_sink_added) {
+        terminal_add_sink(&fb_sink);
+        fb_sink_added = 1;
+    }
+    printf("Framebuffer console: %ux%u from %s, %ux%u characters\n", fb_width, fb_height,
+           fb_source, columns, rows);
+    return 0;
+}
+
+// The adapter's linear framebuffer is BAR 0 of its PCI function
+static uintptr_t bga_framebuffer(void) {
+    for (uint32_t bus = 0; bus < 256; bus++) {
+        for (uint32_t slot = 0; slot < 32; slot++) {
+            if (pci_read(bus, slot, 0, 0x00) == BGA_PCI_ID) {
+                return pci_read(bus, slot, 0, 0x10) & ~0xFu;
+            }
+        }
+    }
+    return BGA_LEGACY_LFB;
+}
+
+static int bga_start(uint32_t width, uint32_t height) {
+    uint16_t id = bga_read(BGA_REG_ID);
+    if (id < BGA_ID_32BPP || id > BGA_ID_LATEST) {
+        printf("fb: no Bochs/QEMU display adapter\n");
+        return -1;
+    }
+
+    bga_write(BGA_REG_ENABLE, 0);
+    bga_write(BGA_REG_XRES, width);
+    bga_write(BGA_REG_YRES, height);
+    bga_write(BGA_REG_BPP, 32);
+    bga_write(BGA_REG_ENABLE, BGA_ENABLED | BGA_LFB_ENABLED);
+    if (bga_read(BGA_REG_XRES) != width || bga_read(BGA_REG_YRES) != height) {
+        bga_write(BGA_REG_ENABLE, 0);
+        printf("fb: the adapter cannot do %ux%u\n", width, height);
+        return -1;
+    }
+
+    // Make the rest of video memory scanlines to pan over
+    uint32_t memory = (uint32_t)bga_read(BGA_REG_VIDEO_MEMORY) * 65536;
+    uint32_t virtual_height = memory / (width * 4);
+    if (virtual_height > 0xFFFF) {
+        virtual_height = 0xFFFF;
+    }
+    bga_write(BGA_REG_VIRT_WIDTH, width);
+    bga_write(BGA_REG_VIRT_HEIGHT, virtual_height);
+    virtual_height = bga_read(BGA_REG_VIRT_HEIGHT);
+    if (virtual_height < height) {
+        virtual_height = height;
+    }
+    bga_write(BGA_REG_Y_OFFSET, 0);
+
+    struct multiboot_framebuffer mode = {
+        .address = bga_framebuffer(), .pitch = width * 4, .width = width, .height = height,
+        .bpp = 32, .red_shift = 16, .green_shift = 8, .blue_shift = 0,
+    };
+    return fb_start(&mode, virtual_height, "bga");
+}
+
+// "<width>x<height>"
+static int parse_mode(const char* text, uint32_t* width, uint32_t* height) {
+    char number[12];
+    size_t len = 0;
+    while (text[len] && text[len] != 'x' && len < sizeof(number) - 1) {
+        number[len] = text[len];
+        len++;
+    }
+    number[len] = '\0';
+    if (text[len] != 'x' || parse_uint(number, width) < 0 || parse_uint(text + len + 1, height) < 0) {
+        return -1;
+    }
+    return *width && *height && *width <= 4096 && *height <= 4096 ? 0 : -1;
+}
+
+// fb [<width>x<height>]: show the console, or switch the adapter's mode
+static void cmd_fb(int argc, char** argv) {
+    if (argc > 1) {
+        uint32_t width, height;
+        if (parse_mode(argv[1], &width, &height) < 0) {
+            printf("Usage: fb [<width>x<height>]\n");
+            return;
+        }
+        if (fb_source && strcmp(fb_source, "bga") != 0) {
+            printf("fb: the mode was set by the boot loader\n");
+            return;
+        }
+        bga_start(width, height);
+        return;
+    }
+
+    if (!fb_source) {
+        printf("No framebuffer console; try fb 1600x900 on QEMU\n");
+        return;
+    }
+    printf("Framebuffer: %ux%ux32 at %p from %s, %ux%u characters\n", fb_width, fb_height,
+           (void*)fb_phys, fb_source, columns, rows);
+    if (fb_virtual_height >= fb_height + FONT_HEIGHT) {
+        printf("Scrolling: panning over %u scanlines\n", fb_virtual_height);
+    } else {
+        printf("Scrolling: copies pixels\n");
+    }
+    printf("Glyphs drawn: %u, scrolls: %u, pans: %u, full redraws: %u\n", glyphs_drawn,
+           scrolls, pans, full_redraws);
+    printf("Color tables built: %u (%u kept)\n", color_misses, FB_COLOR_CACHES);
+}
+
+// Use the loader's framebuffer, or set a BGA mode if fb=WxH was given
+void fb_init(void) {
+    shell_register_command("fb", cmd_fb, "Framebuffer console (fb [<width>x<height>])");
+
+    const struct multiboot_framebuffer* mode = multiboot_framebuffer();
+    if (mode) {
+        fb_start(mode, mode->height, "boot loader");
+        return;
+    }
+
+    char option[16];
+    uint32_t width, height;
+    if (multiboot_option("fb", option, sizeof(option))) {
+        if (parse_mode(option, &width, &height) == 0) {
+            bga_start(width, height);
+        } else {
+            printf("fb: bad mode '%s'\n", option);
+        }
+    }
+}
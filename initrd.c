@@ -0,0 +1,179 @@
+/*
+ * initrd.c - Initial RAM disk
+ * Takes the image from a Multiboot module when the loader passed one,
+ * used where it lies, or else reads it from INITRD_LBA of the first
+ * disk that has one there. Lookups go through the image's own hash
+ * index, so opening a file costs no scan of the entry table.
+ */
+
+#include "kernel.h"
+#include "initrd.h"
+
+static const uint8_t* image;
+static const struct initrd_header* header;
+static const struct initrd_entry* entries;
+static const uint32_t* index_slots;
+static const char* names;
+
+static const char* entry_name(const struct initrd_entry* entry) {
+    return names + entry->name_offset;
+}
+
+static int initrd_lookup(const char* path, uint32_t* node, uint32_t* size) {
+    uint32_t hash = initrd_hash(path);
+    uint32_t mask = header->index_slots - 1;
+    for (uint32_t slot = hash & mask; index_slots[slot]; slot = (slot + 1) & mask) {
+        const struct initrd_entry* entry = &entries[index_slots[slot] - 1];
+        if (entry->hash == hash && strcmp(entry_name(entry), path) == 0) {
+            *node = index_slots[slot] - 1;
+            *size = entry->size;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static const void* initrd_map(uint32_t node) {
+    return image + entries[node].data_offset;
+}
+
+static int initrd_readdir(uint32_t index, struct vfs_dirent* dirent) {
+    if (index >= header->file_count) {
+        return -1;
+    }
+    dirent->name = entry_name(&entries[index]);
+    dirent->size = entries[index].size;
+    return 0;
+}
+
+static const struct filesystem initrd_fs = {
+    .name = "initrd",
+    .lookup = initrd_lookup,
+    .map = initrd_map,
+    .readdir = initrd_readdir,
+};
+
+static int magic_ok(const void* data) {
+    return memcmp(data, INITRD_MAGIC, sizeof(header->magic)) == 0;
+}
+
+// Everything the lookups trust has to lie inside the image
+static int image_valid(const uint8_t* data, uint32_t size) {
+    const struct initrd_header* h = (const struct initrd_header*)data;
+    if (size < sizeof(*h) || !magic_ok(h) || h->version != INITRD_VERSION || h->total_size > size) {
+        return 0;
+    }
+    size = h->total_size;
+    if (h->index_slots == 0 || (h->index_slots & (h->index_slots - 1)) ||
+        h->index_slots < h->file_count * 2) {
+        return 0;
+    }
+    if (h->entries_offset > size ||
+        h->file_count > (size - h->entries_offset) / sizeof(struct initrd_entry) ||
+        h->index_offset > size || h->index_slots > (size - h->index_offset) / sizeof(uint32_t) ||
+        h->names_offset >= size) {
+        return 0;
+    }
+
+    const struct initrd_entry* e = (const struct initrd_entry*)(data + h->entries_offset);
+    const uint32_t* slots = (const uint32_t*)(data + h->index_offset);
+    for (uint32_t i = 0; i < h->file_count; i++) {
+        if (e[i].name_offset >= size - h->names_offset || e[i].data_offset > size ||
+            e[i].size > size - e[i].data_offset) {
+            return 0;
+        }
+    }
+    // One slot per file, so an empty slot always ends a probe, and each
+    // file found by probing from its own hash
+    uint32_t used = 0;
+    for (uint32_t i = 0; i < h->index_slots; i++) {
+        if (slots[i] > h->file_count) {
+            return 0;
+        }
+        used += slots[i] != 0;
+    }
+    if (used != h->file_count) {
+        return 0;
+    }
+    uint32_t mask = h->index_slots - 1;
+    for (uint32_t i = 0; i < h->file_count; i++) {
+        uint32_t slot = e[i].hash & mask;
+        while (slots[slot] && slots[slot] != i + 1) {
+            slot = (slot + 1) & mask;
+        }
+        if (!slots[slot]) {
+            return 0;
+        }
+    }
+    // Each name must end inside the image
+    for (uint32_t i = 0; i < h->file_count; i++) {
+        const uint8_t* name = data + h->names_offset + e[i].name_offset;
+        while (name < data + size && *name) {
+            name++;
+        }
+        if (name == data + size) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int mount(const uint8_t* data, uint32_t size, const char* source) {
+    if (!image_valid(data, size)) {
+        printf("initrd: bad image in %s\n", source);
+        return 0;
+    }
+    image = data;
+    header = (const struct initrd_header*)data;
+    entries = (const struct initrd_entry*)(data + header->entries_offset);
+    index_slots = (const uint32_t*)(data + header->index_offset);
+    names = (const char*)(data + header->names_offset);
+    vfs_mount_root(&initrd_fs);
+    printf("initrd: %u files from %s\n", header->file_count, source);
+    return 1;
+}
+
+static int load_from_modules(void) {
+    for (size_t i = 0; i < multiboot_module_count(); i++) {
+        const struct multiboot_module* mod = multiboot_module(i);
+        const uint8_t* data = (const uint8_t*)(uintptr_t)mod->start;
+        uint32_t size = mod->end - mod->start;
+        if (size >= sizeof(struct initrd_header) && magic_ok(data)) {
+            return mount(data, size, mod->name[0] ? mod->name : "module");
+        }
+    }
+    return 0;
+}
+
+static int load_from_disk(void) {
+    static uint8_t sector[SECTOR_SIZE];
+    for (struct block_device* dev = block_list(); dev; dev = dev->next) {
+        if (block_read(dev, INITRD_LBA, 1, sector) < 0 || !magic_ok(sector)) {
+            continue;
+        }
+        uint32_t size = ((const struct initrd_header*)sector)->total_size;
+        uint32_t count = (size + SECTOR_SIZE - 1) / SECTOR_SIZE;
+        if (size < sizeof(struct initrd_header) || INITRD_LBA + count > dev->sectors) {
+            printf("initrd: bad image on %s\n", dev->name);
+            continue;
+        }
+
+        size_t pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+        uint8_t* data = (uint8_t*)pmm_alloc_frames(pages, 1);
+        if (!data) {
+            printf("initrd: no memory for %u bytes\n", size);
+            return 0;
+        }
+        if (block_read(dev, INITRD_LBA, count, data) == 0 && mount(data, size, dev->name)) {
+            return 1;
+        }
+        pmm_free_frames((uintptr_t)data);
+    }
+    return 0;
+}
+
+void initrd_init(void) {
+    if (!load_from_modules() && !load_from_disk()) {
+        printf("initrd: none found\n");
+    }
+}
@@ -0,0 +1,48 @@
+/*
+ * initrd.h - Format of the initial RAM disk
+ * Shared by the kernel (initrd.c) and the host packer
+ * (tools/mkinitrd.c); include it after the fixed-width integer types.
+ *
+ * An image is the header, the entry table, the hashed name index and
+ * the names, then every file's data starting on a page boundary from
+ * the start of the image, so a file can be mapped where it lies.
+ */
+
+#ifndef INITRD_H
+#define INITRD_H
+
+#define INITRD_MAGIC     "MYINITRD"
+#define INITRD_VERSION   1
+#define INITRD_ALIGN     4096
+#define INITRD_LBA       1024       // Where the Makefile writes it into myos.img
+
+struct initrd_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t file_count;
+    uint32_t entries_offset;        // file_count struct initrd_entry
+    uint32_t index_offset;          // index_slots words: entry number + 1, 0 = empty
+    uint32_t index_slots;           // Power of two, at least twice file_count
+    uint32_t names_offset;          // NUL-terminated paths without a leading '/'
+    uint32_t total_size;
+    uint32_t reserved;
+};
+
+struct initrd_entry {
+    uint32_t name_offset;           // From names_offset
+    uint32_t hash;                  // initrd_hash of the name
+    uint32_t data_offset;           // From the start of the image
+    uint32_t size;
+};
+
+// FNV-1a; the index is probed linearly from hash & (index_slots - 1)
+static inline uint32_t initrd_hash(const char* name) {
+    uint32_t hash = 2166136261u;
+    while (*name) {
+        hash ^= (uint8_t)*name++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+#endif // INITRD_H
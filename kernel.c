@@ -3,44 +3,13 @@
  * A simple kernel that provides basic screen output and memory management
  */
 
-// Define our own types since we can't use standard library
-typedef unsigned char uint8_t;
-typedef unsigned short uint16_t;
-typedef unsigned int uint32_t;
-typedef unsigned long long uint64_t;
-typedef signed char int8_t;
-typedef signed short int16_t;
-typedef signed int int32_t;
-typedef signed long long int64_t;
-typedef uint32_t size_t;
-typedef uint32_t uintptr_t;
-
-#define NULL ((void*)0)
-
-// VGA text mode constants
-#define VGA_WIDTH 80
-#define VGA_HEIGHT 25
-#define VGA_MEMORY 0xB8000
-
-// VGA color constants - Fixed: use consistent enum declaration
-enum vga_color {
-    VGA_COLOR_BLACK = 0,
-    VGA_COLOR_BLUE = 1,
-    VGA_COLOR_GREEN = 2,
-    VGA_COLOR_CYAN = 3,
-    VGA_COLOR_RED = 4,
-    VGA_COLOR_MAGENTA = 5,
-    VGA_COLOR_BROWN = 6,
-    VGA_COLOR_LIGHT_GREY = 7,
-    VGA_COLOR_DARK_GREY = 8,
-    VGA_COLOR_LIGHT_BLUE = 9,
-    VGA_COLOR_LIGHT_GREEN = 10,
-    VGA_COLOR_LIGHT_CYAN = 11,
-    VGA_COLOR_LIGHT_RED = 12,
-    VGA_COLOR_LIGHT_MAGENTA = 13,
-    VGA_COLOR_LIGHT_BROWN = 14,
-    VGA_COLOR_WHITE = 15,
-};
+#include "kernel.h"
+
+// CRTC registers holding the hardware cursor position
+#define VGA_CRTC_INDEX  0x3D4
+#define VGA_CRTC_DATA   0x3D5
+#define VGA_CURSOR_HIGH 0x0E
+#define VGA_CURSOR_LOW  0x0F
 
 // Terminal state
 static size_t terminal_row;
@@ -48,226 +17,240 @@ static size_t terminal_column;
 static uint8_t terminal_color;
 static uint16_t* terminal_buffer;
 
-// Simple memory allocator state
-static uint8_t* heap_start = (uint8_t*)0x200000;  // Start heap at 2MB
-static uint8_t* heap_end = (uint8_t*)0x400000;    // End heap at 4MB
-static uint8_t* heap_current = (uint8_t*)0x200000;
+// Glyphs are rendered into a RAM shadow of the screen laid out as a ring
+// of rows: terminal_head is the shadow row shown at the top, so scrolling
+// only advances the head. Rows touched since the last flush are tracked
+// as a range of screen rows and copied to VGA memory in one go.
+static uint16_t terminal_shadow[VGA_HEIGHT][VGA_WIDTH] __attribute__((aligned(4)));
+static size_t terminal_head;
+static size_t terminal_dirty_first = VGA_HEIGHT;  // Empty range when first > last
+static size_t terminal_dirty_last;
+
+// Output goes to every enabled sink; VGA is always registered first
+static void vga_sink_write(const char* data, size_t size);
+static void terminal_update_cursor(void);
+static struct terminal_sink vga_sink = { "vga", vga_sink_write, NULL, NULL, 1, NULL };
+static struct terminal_sink* terminal_sinks = &vga_sink;
 
-// Function declarations - Fixed: added missing declarations
-void init_interrupts(void);
-void init_shell(void);
+// Serializes the sinks and the shadow buffer, so lines printed on
+// different CPUs come out whole and in turn
+static ticketlock_t terminal_lock = TICKETLOCK_INIT("terminal");
 
-// VGA helper functions
-static inline uint8_t vga_entry_color(enum vga_color fg, enum vga_color bg) {
-    return fg | bg << 4;
+// Shadow row holding screen row y
+static inline uint16_t* terminal_shadow_row(size_t y) {
+    size_t row = terminal_head + y;
+    if (row >= VGA_HEIGHT) {
+        row -= VGA_HEIGHT;
+    }
+    return terminal_shadow[row];
 }
 
-static inline uint16_t vga_entry(unsigned char uc, uint8_t color) {
-    return (uint16_t) uc | (uint16_t) color << 8;
+static inline void terminal_mark_dirty(size_t first, size_t last) {
+    if (first < terminal_dirty_first) {
+        terminal_dirty_first = first;
+    }
+    if (last > terminal_dirty_last) {
+        terminal_dirty_last = last;
+    }
 }
 
-// String utility functions
-size_t strlen(const char* str) {
-    size_t len = 0;
-    while (str[len])
-        len++;
-    return len;
+static inline void terminal_fill_row(uint16_t* row, uint8_t color) {
+    memset16(row, vga_entry(' ', color), VGA_WIDTH);
 }
 
-void* memset(void* bufptr, int value, size_t size) {
-    unsigned char* buf = (unsigned char*) bufptr;
-    for (size_t i = 0; i < size; i++)
-        buf[i] = (unsigned char) value;
-    return bufptr;
+// Copy the dirty rows of the shadow buffer to VGA memory
+void terminal_flush(void) {
+    if (terminal_dirty_first > terminal_dirty_last) {
+        return;
+    }
+
+    // Rows that are contiguous in the shadow ring go out in one copy
+    size_t y = terminal_dirty_first;
+    while (y <= terminal_dirty_last) {
+        size_t row = terminal_shadow_row(y) - terminal_shadow[0];
+        row /= VGA_WIDTH;
+
+        size_t span = terminal_dirty_last - y + 1;
+        if (span > VGA_HEIGHT - row) {
+            span = VGA_HEIGHT - row;
+        }
+
+        memcpy(terminal_buffer + y * VGA_WIDTH, terminal_shadow[row], span * VGA_WIDTH * sizeof(uint16_t));
+        y += span;
+    }
+
+    terminal_dirty_first = VGA_HEIGHT;
+    terminal_dirty_last = 0;
 }
 
 // Terminal initialization and control
 void terminal_initialize(void) {
-    terminal_row = 0;
-    terminal_column = 0;
     terminal_color = vga_entry_color(VGA_COLOR_LIGHT_GREY, VGA_COLOR_BLACK);
     terminal_buffer = (uint16_t*) VGA_MEMORY;
-    
-    // Clear the screen
+    terminal_clear();
+}
+
+void terminal_clear(void) {
+    uint32_t flags = ticket_lock_irqsave(&terminal_lock);
+    terminal_row = 0;
+    terminal_column = 0;
+    terminal_head = 0;
+
     for (size_t y = 0; y < VGA_HEIGHT; y++) {
-        for (size_t x = 0; x < VGA_WIDTH; x++) {
-            const size_t index = y * VGA_WIDTH + x;
-            terminal_buffer[index] = vga_entry(' ', terminal_color);
+        terminal_fill_row(terminal_shadow[y], terminal_color);
+    }
+    terminal_mark_dirty(0, VGA_HEIGHT - 1);
+    terminal_flush();
+    terminal_update_cursor();
+    for (struct terminal_sink* sink = terminal_sinks; sink; sink = sink->next) {
+        if (sink->enabled && sink->clear) {
+            sink->clear();
         }
     }
+    ticket_unlock_irqrestore(&terminal_lock, flags);
 }
 
 void terminal_setcolor(uint8_t color) {
     terminal_color = color;
 }
 
+uint8_t terminal_getcolor(void) {
+    return terminal_color;
+}
+
+// Copy the text screen, VGA_WIDTH cells per row at 'stride' apart, and
+// the output position, so another sink can start where VGA is
+void terminal_read_screen(uint16_t* cells, size_t stride, size_t* row, size_t* column) {
+    uint32_t flags = ticket_lock_irqsave(&terminal_lock);
+    for (size_t y = 0; y < VGA_HEIGHT; y++) {
+        memcpy(cells + y * stride, terminal_shadow_row(y), VGA_WIDTH * sizeof(uint16_t));
+    }
+    *row = terminal_row;
+    *column = terminal_column;
+    ticket_unlock_irqrestore(&terminal_lock, flags);
+}
+
 void terminal_putentryat(char c, uint8_t color, size_t x, size_t y) {
-    const size_t index = y * VGA_WIDTH + x;
-    terminal_buffer[index] = vga_entry(c, color);
+    terminal_shadow_row(y)[x] = vga_entry(c, color);
+    terminal_mark_dirty(y, y);
 }
 
 void terminal_scroll(void) {
-    // Move all lines up by one
-    for (size_t y = 0; y < VGA_HEIGHT - 1; y++) {
-        for (size_t x = 0; x < VGA_WIDTH; x++) {
-            terminal_buffer[y * VGA_WIDTH + x] = terminal_buffer[(y + 1) * VGA_WIDTH + x];
-        }
+    uint64_t start = TRACE_BEGIN();
+
+    // The old top row becomes the new, blank bottom row
+    terminal_fill_row(terminal_shadow[terminal_head], terminal_color);
+    if (++terminal_head == VGA_HEIGHT) {
+        terminal_head = 0;
     }
-    
-    // Clear the last line
-    for (size_t x = 0; x < VGA_WIDTH; x++) {
-        terminal_buffer[(VGA_HEIGHT - 1) * VGA_WIDTH + x] = vga_entry(' ', terminal_color);
+
+    // Every screen row now shows different shadow contents
+    terminal_mark_dirty(0, VGA_HEIGHT - 1);
+    TRACE_END(TRACE_SCROLL, terminal_head, start);
+}
+
+static void terminal_newline(void) {
+    terminal_column = 0;
+    if (++terminal_row == VGA_HEIGHT) {
+        terminal_scroll();
+        terminal_row = VGA_HEIGHT - 1;
     }
 }
 
-void terminal_putchar(char c) {
+// Render one character into the shadow buffer without flushing
+static void terminal_putc(char c) {
     if (c == '\n') {
-        terminal_column = 0;
-        if (++terminal_row == VGA_HEIGHT) {
-            terminal_scroll();
-            terminal_row = VGA_HEIGHT - 1;
+        terminal_newline();
+    } else if (c == '\b') {
+        // Back one cell, onto the previous row for wrapped lines
+        if (terminal_column > 0) {
+            terminal_column--;
+        } else if (terminal_row > 0) {
+            terminal_row--;
+            terminal_column = VGA_WIDTH - 1;
         }
     } else {
         terminal_putentryat(c, terminal_color, terminal_column, terminal_row);
         if (++terminal_column == VGA_WIDTH) {
-            terminal_column = 0;
-            if (++terminal_row == VGA_HEIGHT) {
-                terminal_scroll();
-                terminal_row = VGA_HEIGHT - 1;
-            }
+            terminal_newline();
         }
     }
 }
 
-void terminal_write(const char* data, size_t size) {
-    for (size_t i = 0; i < size; i++)
-        terminal_putchar(data[i]);
+// Move the hardware cursor to the output position if it changed
+static void terminal_update_cursor(void) {
+    static uint16_t shown = 0xFFFF;
+    uint16_t pos = terminal_row * VGA_WIDTH + terminal_column;
+    if (pos != shown) {
+        shown = pos;
+        outb(VGA_CRTC_INDEX, VGA_CURSOR_LOW);
+        outb(VGA_CRTC_DATA, pos & 0xFF);
+        outb(VGA_CRTC_INDEX, VGA_CURSOR_HIGH);
+        outb(VGA_CRTC_DATA, pos >> 8);
+    }
 }
 
-void terminal_writestring(const char* data) {
-    terminal_write(data, strlen(data));
+static void vga_sink_write(const char* data, size_t size) {
+    for (size_t i = 0; i < size; i++)
+        terminal_putc(data[i]);
+    terminal_flush();
+    terminal_update_cursor();
 }
 
-// Simple printf implementation - Fixed: simplified to avoid varargs issues
-void printf(const char* format) {
-    // Simple implementation that just prints the format string
-    // For a full printf, you'd need to implement stdarg.h functionality
-    terminal_writestring(format);
+void terminal_putchar(char c) {
+    terminal_write(&c, 1);
 }
 
-// Overloaded printf functions for different argument types
-void printf_str(const char* format, const char* str) {
-    const char* p = format;
-    while (*p) {
-        if (*p == '%' && *(p + 1) == 's') {
-            terminal_writestring(str);
-            p += 2;
-        } else {
-            terminal_putchar(*p);
-            p++;
+void terminal_write(const char* data, size_t size) {
+    uint32_t flags = ticket_lock_irqsave(&terminal_lock);
+    for (struct terminal_sink* sink = terminal_sinks; sink; sink = sink->next) {
+        if (sink->enabled) {
+            sink->write(data, size);
         }
     }
+    ticket_unlock_irqrestore(&terminal_lock, flags);
 }
 
-void printf_int(const char* format, int value) {
-    const char* p = format;
-    while (*p) {
-        if (*p == '%' && (*(p + 1) == 'd' || *(p + 1) == 'x')) {
-            // Simple integer to string conversion
-            if (value == 0) {
-                terminal_putchar('0');
-            } else {
-                char buffer[32];
-                int i = 0;
-                int temp = value;
-                int is_negative = 0;
-                
-                if (temp < 0) {
-                    is_negative = 1;
-                    temp = -temp;
-                }
-                
-                // Convert to string
-                while (temp > 0) {
-                    if (*(p + 1) == 'x') {
-                        // Hexadecimal
-                        int digit = temp % 16;
-                        if (digit < 10) {
-                            buffer[i++] = '0' + digit;
-                        } else {
-                            buffer[i++] = 'a' + (digit - 10);
-                        }
-                        temp /= 16;
-                    } else {
-                        // Decimal
-                        buffer[i++] = '0' + (temp % 10);
-                        temp /= 10;
-                    }
-                }
-                
-                if (is_negative) {
-                    buffer[i++] = '-';
-                }
-                
-                // Print in reverse order
-                for (int j = i - 1; j >= 0; j--) {
-                    terminal_putchar(buffer[j]);
-                }
-            }
-            p += 2;
-        } else {
-            terminal_putchar(*p);
-            p++;
-        }
+// Append an output sink; it receives everything written from now on
+void terminal_add_sink(struct terminal_sink* sink) {
+    struct terminal_sink** link = &terminal_sinks;
+    while (*link) {
+        link = &(*link)->next;
     }
+    sink->next = NULL;
+    *link = sink;
 }
 
-// Simple memory allocator
-void* kmalloc(size_t size) {
-    if (heap_current + size > heap_end) {
-        return NULL;  // Out of memory
-    }
-    
-    void* ptr = heap_current;
-    heap_current += size;
-    
-    // Align to 4-byte boundary
-    if ((uintptr_t)heap_current % 4 != 0) {
-        heap_current += 4 - ((uintptr_t)heap_current % 4);
-    }
-    
-    return ptr;
+struct terminal_sink* terminal_sink_list(void) {
+    return terminal_sinks;
 }
 
-void kfree(void* ptr) {
-    // Simple allocator doesn't support freeing individual blocks
-    // In a real OS, you'd implement a proper memory manager
-    (void)ptr;  // Suppress unused parameter warning
+// Push out anything the sinks still have queued, e.g. before halting
+void terminal_sync(void) {
+    for (struct terminal_sink* sink = terminal_sinks; sink; sink = sink->next) {
+        if (sink->enabled && sink->sync) {
+            sink->sync();
+        }
+    }
 }
 
-// Memory information functions
-void print_memory_info(void) {
-    printf("Memory Information:\n");
-    printf("Heap start: 0x");
-    printf_int("%x", (int)(uintptr_t)heap_start);
-    printf("\n");
-    printf("Heap end: 0x");
-    printf_int("%x", (int)(uintptr_t)heap_end);
-    printf("\n");
-    printf("Heap current: 0x");
-    printf_int("%x", (int)(uintptr_t)heap_current);
-    printf("\n");
-    printf("Available memory: ");
-    printf_int("%d", (int)(heap_end - heap_current));
-    printf(" bytes\n");
+void terminal_writestring(const char* data) {
+    terminal_write(data, strlen(data));
 }
 
 // Kernel panic function
 void kernel_panic(const char* message) {
+    smp_halt_others();
+    // A stopped CPU, or this one, may have died holding the terminal
+    terminal_lock.owner = terminal_lock.next;
     terminal_setcolor(vga_entry_color(VGA_COLOR_WHITE, VGA_COLOR_RED));
     printf("\nKERNEL PANIC: ");
-    printf(message);
+    terminal_writestring(message);
     printf("\nSystem halted.\n");
+    terminal_sync();
+#ifdef HOST_TEST
+    host_panic();
+#endif
     
     // Halt the system
     while (1) {
@@ -275,22 +258,107 @@ void kernel_panic(const char* message) {
     }
 }
 
-// Stub implementations for missing functions
-void init_interrupts(void) {
-    // Placeholder for interrupt initialization
-    printf("Interrupt system initialized.\n");
-}
+// Everything below only exists in the real kernel
+#ifndef HOST_TEST
 
-void init_shell(void) {
-    // Placeholder for shell initialization
-    printf("Shell initialized.\n");
-}
+// Boot header and entry stub, linked first at 0x100000. The bootloader
+// reads the header from the first kernel sector: a "MYOS" magic at
+// offset 4 and the image size in sectors (computed by linker.ld) at 8.
+// Multiboot 1 and 2 headers follow so GRUB and QEMU -kernel can load
+// kernel.elf directly; QEMU only understands the first. Only the second
+// asks for a graphics mode: QEMU complains about the video flag in the
+// first, and its -kernel path sets no mode anyway (see fb.c).
+asm(
+    ".section .text.entry, \"ax\"\n"
+    ".global _start\n"
+    "kernel_entry:\n"
+    "    jmp _start\n"
+    "    .org 4\n"
+    "    .long 0x534F594D\n"           // "MYOS"
+    "    .long kernel_load_sectors\n"
+    "    .balign 4\n"
+    "multiboot1_header:\n"
+    "    .long 0x1BADB002\n"
+    "    .long 0x00000003\n"           // Page-aligned modules, memory info
+    "    .long -(0x1BADB002 + 0x00000003)\n"
+    "    .balign 8\n"
+    "multiboot2_header:\n"
+    "    .long 0xE85250D6\n"
+    "    .long 0\n"                    // i386
+    "    .long multiboot2_header_end - multiboot2_header\n"
+    "    .long -(0xE85250D6 + (multiboot2_header_end - multiboot2_header))\n"
+    "    .word 1, 0\n"                 // Information request:
+    "    .long 12\n"
+    "    .long 6\n"                    // the memory map
+    "    .balign 8\n"
+    "    .word 5, 1\n"                 // Framebuffer, optional:
+    "    .long 20\n"
+    "    .long 1600, 900, 32\n"        // preferred mode
+    "    .balign 8\n"
+    "    .word 0, 0\n"                 // End tag
+    "    .long 8\n"
+    "multiboot2_header_end:\n"
+    "_start:\n"
+    "    cli\n"
+    "    cld\n"
+    "    mov $stack_top, %esp\n"
+    "    push %ebx\n"                  // Boot info and magic for kernel_main
+    "    push %eax\n"
+    "    lgdt kernel_gdt_descriptor\n" // A Multiboot loader's GDT is unknown
+    "    ljmp $0x08, $2f\n"
+    "2:  mov $0x10, %cx\n"
+    "    mov %cx, %ds\n"
+    "    mov %cx, %es\n"
+    "    mov %cx, %fs\n"
+    "    mov %cx, %gs\n"
+    "    mov %cx, %ss\n"
+    "    mov $bss_start, %edi\n"       // .bss is not part of kernel.bin
+    "    mov $bss_end, %ecx\n"
+    "    sub %edi, %ecx\n"
+    "    xor %eax, %eax\n"
+    "    rep stosb\n"
+    "    call kernel_main\n"
+    "1:  cli\n"
+    "    hlt\n"
+    "    jmp 1b\n"
+    ".previous\n"
+);
+
+// Flat 4GB code (0x08) and data (0x10) segments, then one %fs segment
+// per CPU, filled in by smp.c
+ASMLINKAGE uint64_t kernel_gdt[GDT_CPU_FIRST + SMP_MAX_CPUS] __attribute__((aligned(8))) = {
+    0,
+    0x00CF9A000000FFFFULL,
+    0x00CF92000000FFFFULL,
+};
+
+ASMLINKAGE struct gdt_descriptor kernel_gdt_descriptor = {
+    sizeof(kernel_gdt) - 1, (uint32_t)kernel_gdt
+};
+
+// Main kernel entry point. boot_magic and boot_info are what a Multiboot
+// loader left in EAX and EBX; boot.asm passes BOOT_PROFILE_MAGIC in EAX
+// and nothing meaningful in EBX.
+ASMLINKAGE void kernel_main(uint32_t boot_magic, uint32_t boot_info) {
+    // Stamp the entry, and keep the loader's stamps before anything
+    // reuses low memory
+    bootprof_start(boot_magic);
 
-// Main kernel entry point - Fixed: removed syntax errors
-void kernel_main(void) {
-    // Initialize terminal
+    // Per-CPU state first; even memcpy looks at it
+    smp_early_init();
+
+    // Pick the string routines before anything starts copying
+    string_init();
+
+    // Copy out the loader's information before the pmm can reuse it
+    multiboot_init(boot_magic, boot_info);
+    bootprof_mark("early");
+
+    // Initialize terminal, and mirror it to COM1 when there is one
     terminal_initialize();
-    
+    serial_init();
+    bootprof_mark("terminal");
+
     // Print welcome message
     terminal_setcolor(vga_entry_color(VGA_COLOR_LIGHT_GREEN, VGA_COLOR_BLACK));
     printf("Welcome to MyOS!\n");
@@ -299,18 +367,66 @@ void kernel_main(void) {
     terminal_setcolor(vga_entry_color(VGA_COLOR_LIGHT_GREY, VGA_COLOR_BLACK));
     printf("Kernel loaded successfully!\n");
     printf("Terminal initialized.\n");
-    printf("Memory allocator ready.\n");
+    if (multiboot_protocol()) {
+        printf("Booted by %s (Multiboot %d)\n", multiboot_loader_name(), multiboot_protocol());
+        if (multiboot_cmdline()[0]) {
+            printf("Command line: %s\n", multiboot_cmdline());
+        }
+    }
+    if (string_has_sse2()) {
+        printf("Using SSE2 memory routines.\n");
+    }
     
-    // Initialize interrupt system
+    // Frames first, then the IDT so paging can take page faults
+    pmm_init();
+    bootprof_mark("frames");
     init_interrupts();
+    serial_enable_irq();
+    bootprof_mark("interrupts");
+    paging_init();
+
+    // The heap window is populated on demand, so keep it within what
+    // the frame allocator can actually back
+    uintptr_t heap_size = pmm_free_count() / 2 * PAGE_SIZE;
+    if (heap_size > HEAP_SIZE) {
+        heap_size = HEAP_SIZE;
+    }
+    heap_init(HEAP_START, HEAP_START + heap_size);
+    printf("Memory allocator ready.\n");
+    bootprof_mark("paging-heap");
+
+    // A graphics console, if there is a framebuffer to draw on
+    fb_init();
+    bootprof_mark("framebuffer");
+
+    // The boot context becomes the "main" task before the tick starts
+    sched_init();
+    
+    // Start the system timer, then the other CPUs with their own ticks
+    timer_init();
+    smp_init();
+    bootprof_mark("timer-cpus");
+
+    // Disks, and the cache every disk access goes through
+    block_init();
+    ata_init();
+    bootprof_mark("disks");
+
+    // Files, from the initrd
+    vfs_init();
+    initrd_init();
+    bootprof_mark("files");
+
+    trace_init();
+    sync_init();
+    bench_init();
+    bootprof_init();
     
     // Test memory allocator
     printf("Testing memory allocator...\n");
     void* test_ptr = kmalloc(100);
     if (test_ptr) {
-        printf("Successfully allocated 100 bytes at address: 0x");
-        printf_int("%x", (int)(uintptr_t)test_ptr);
-        printf("\n");
+        printf("Successfully allocated 100 bytes at address: %p\n", test_ptr);
     } else {
         printf("Failed to allocate memory!\n");
     }
@@ -319,15 +435,22 @@ void kernel_main(void) {
     print_memory_info();
     
     printf("\nKernel initialization complete!\n");
+    bootprof_mark("services");
     
     // Initialize and start shell
     init_shell();
     
     printf("Kernel is ready.\n");
     
-    // Keep the kernel running
+    // Keep the kernel running: keyboard input is queued by IRQ1 and the
+    // shell runs here, outside interrupt context. The task blocks while
+    // the ring is empty and the idle task halts the CPU.
     printf("\nKernel is now running. Press Ctrl+Alt+Del to restart.\n");
     while (1) {
-        asm volatile("hlt");  // Halt until next interrupt
+        keyboard_process_input();
+        serial_process_input();
+        input_wait();
     }
-}
\ No newline at end of file
+}
+
+#endif // HOST_TEST
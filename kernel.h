@@ -15,18 +15,34 @@ typedef signed char int8_t;
 typedef signed short int16_t;
 typedef signed int int32_t;
 typedef signed long long int64_t;
+#ifdef HOST_TEST
+// Native build for the host test harness in tests/, where pointers are
+// 64 bits; the harness stands in for the hardware (tests/host.h)
+typedef unsigned long size_t;
+typedef unsigned long uintptr_t;
+#else
 typedef uint32_t size_t;
 typedef uint32_t uintptr_t;
+#endif
 
 #define NULL ((void*)0)
 
+#ifdef HOST_TEST
+#include "tests/host.h"
+#endif
+
 // VGA Constants
 #define VGA_WIDTH 80
 #define VGA_HEIGHT 25
+#ifdef HOST_TEST
+#define VGA_MEMORY ((uintptr_t)host_vga_memory)
+#else
 #define VGA_MEMORY 0xB8000
+#endif
+#define VGA_MEMORY_SIZE 0x8000
 
 // VGA Colors
-typedef enum {
+typedef enum vga_color {
     VGA_COLOR_BLACK = 0,
     VGA_COLOR_BLUE = 1,
     VGA_COLOR_GREEN = 2,
@@ -46,44 +62,875 @@ typedef enum {
 } vga_color;
 
 // Memory Management
-#define HEAP_START 0x200000  // 2MB
-#define HEAP_END   0x400000  // 4MB
+// The heap is a virtual window backed with frames on first touch; at
+// boot it is sized to at most half of the free physical memory
+#define HEAP_START 0xD0000000
+#define HEAP_END   0xD4000000  // 64MB window
 #define HEAP_SIZE  (HEAP_END - HEAP_START)
+#define PAGE_SIZE  4096
+
+// Page table entry bits
+#define PAGE_PRESENT 0x001
+#define PAGE_WRITE   0x002
+#define PAGE_USER    0x004
+#define PAGE_PWT     0x008
+#define PAGE_PCD     0x010
+#define PAGE_LARGE   0x080   // PDE: 4MB page
+#define PAGE_GLOBAL  0x100
+
+// Heap size classes: 16, 32, ... 2048 bytes are served from slabs,
+// anything larger comes from the coalescing free-list allocator
+#define HEAP_MIN_CLASS_SHIFT 4
+#define HEAP_MAX_CLASS_SHIFT 11
+#define HEAP_CLASS_COUNT (HEAP_MAX_CLASS_SHIFT - HEAP_MIN_CLASS_SHIFT + 1)
+#define HEAP_MAX_SMALL_SIZE (1 << HEAP_MAX_CLASS_SHIFT)
+
+// Per-CPU stack of free objects of one size class, so most small
+// allocations and frees stay off the heap lock
+#define HEAP_CACHE_SIZE  16
+#define HEAP_CACHE_BATCH 8      // Objects moved per refill or flush
+
+struct heap_cache {
+    uint32_t count;
+    void* objects[HEAP_CACHE_SIZE];
+};
 
 // Function Declarations
 
 // String utilities
+void string_init(void);
+int string_has_sse2(void);
 size_t strlen(const char* str);
 void* memset(void* bufptr, int value, size_t size);
+void* memset16(void* dest, uint16_t value, size_t count);
+void* memcpy(void* dest, const void* src, size_t n);
+void* memmove(void* dest, const void* src, size_t n);
 int strcmp(const char* str1, const char* str2);
+int strncmp(const char* str1, const char* str2, size_t n);
+int memcmp(const void* ptr1, const void* ptr2, size_t size);
 char* strcpy(char* dest, const char* src);
+int parse_uint(const char* str, uint32_t* value);
+
+// Terminal functions: output fans out to the enabled sinks
+struct terminal_sink {
+    const char* name;
+    void (*write)(const char* data, size_t size);
+    void (*sync)(void);         // Drain queued output; may be NULL
+    void (*clear)(void);        // Blank the screen; may be NULL
+    int enabled;
+    struct terminal_sink* next;
+};
 
-// Terminal functions
 void terminal_initialize(void);
 void terminal_setcolor(uint8_t color);
+uint8_t terminal_getcolor(void);
+void terminal_read_screen(uint16_t* cells, size_t stride, size_t* row, size_t* column);
 void terminal_putchar(char c);
 void terminal_write(const char* data, size_t size);
 void terminal_writestring(const char* data);
 void terminal_clear(void);
 void terminal_scroll(void);
+void terminal_flush(void);
+void terminal_add_sink(struct terminal_sink* sink);
+struct terminal_sink* terminal_sink_list(void);
+void terminal_sync(void);
 
-// Output functions
-void printf(const char* format, ...);
+// Framebuffer console (fb.c)
+void fb_init(void);
+
+// Serial console on COM1
+void serial_init(void);
+void serial_enable_irq(void);
+int serial_has_input(void);
+void serial_process_input(void);
+void serial_write(const char* data, size_t size);   // Even with the sink off
+
+// Output functions (printf.c): %d %i %u %x %X %o %p %s %c with flags,
+// width and precision; the ll modifier selects 64-bit arguments
+#define PRINTF_FORMAT(fmt, args) __attribute__((format(printf, fmt, args)))
+void printf(const char* format, ...) PRINTF_FORMAT(1, 2);
+int kprintf(const char* format, ...) PRINTF_FORMAT(1, 2);
+int kvprintf(const char* format, __builtin_va_list args);
+int ksnprintf(char* buffer, size_t size, const char* format, ...) PRINTF_FORMAT(3, 4);
+int kvsnprintf(char* buffer, size_t size, const char* format, __builtin_va_list args);
 void putchar(char c);
 void puts(const char* str);
 
-// Memory management
+// Memory management. Built with HEAP_PROFILE the heap keeps size
+// histograms, per-call-site counts, live and peak bytes, and checks a
+// canary after every block on kfree; print_heap_profile reports them.
+void heap_init(uintptr_t start, uintptr_t end);
 void* kmalloc(size_t size);
 void kfree(void* ptr);
 void* kmalloc_aligned(size_t size, size_t alignment);
 void print_memory_info(void);
+void print_heap_profile(void);
 size_t get_available_memory(void);
 
+// Paging
+void paging_init(void);
+void paging_init_cpu(void);
+int paging_map_page(uintptr_t virt, uintptr_t phys, uint32_t flags);
+void paging_unmap_page(uintptr_t virt);
+uintptr_t paging_translate(uintptr_t virt);
+void* map_mmio(uintptr_t phys, size_t size);
+void* map_framebuffer(uintptr_t phys, size_t size);
+size_t paging_heap_pages(void);
+
+// Physical page-frame allocator
+void pmm_init(void);
+void pmm_reserve_range(uintptr_t start, uintptr_t end);
+uintptr_t pmm_alloc_frame(void);
+uintptr_t pmm_alloc_frames(size_t count, size_t align_frames);
+void pmm_free_frames(uintptr_t address);
+int pmm_owns(uintptr_t address);
+size_t pmm_free_count(void);
+size_t pmm_total_count(void);
+
+// Boot information from a Multiboot 1 or 2 loader, copied at entry
+#define MULTIBOOT_MAX_REGIONS 32
+#define MULTIBOOT_MAX_MODULES 8
+
+// Usable RAM as reported by the loader's memory map
+struct multiboot_region {
+    uint64_t base;
+    uint64_t length;
+};
+
+// A file the loader placed in memory; [start, end) is physical
+struct multiboot_module {
+    uintptr_t start;
+    uintptr_t end;
+    char name[64];
+};
+
+void multiboot_init(uint32_t magic, uintptr_t info);
+int multiboot_protocol(void);
+size_t multiboot_memory_map(const struct multiboot_region** map);
+size_t multiboot_module_count(void);
+const struct multiboot_module* multiboot_module(size_t index);
+// A linear framebuffer the loader set up; only 32-bit RGB is used
+struct multiboot_framebuffer {
+    uint64_t address;
+    uint32_t pitch;             // Bytes per scanline
+    uint32_t width;
+    uint32_t height;
+    uint8_t bpp;
+    uint8_t red_shift;
+    uint8_t green_shift;
+    uint8_t blue_shift;
+};
+
+const char* multiboot_cmdline(void);
+int multiboot_option(const char* name, char* value, size_t size);
+const char* multiboot_loader_name(void);
+const struct multiboot_framebuffer* multiboot_framebuffer(void);
+
+// Interrupts
+
+// Register state saved by the common interrupt stub, lowest address first
+struct interrupt_frame {
+    uint32_t gs, fs, es, ds;
+    uint32_t edi, esi, ebp, esp_unused, ebx, edx, ecx, eax;  // pusha
+    uint32_t vector, error_code;
+    uint32_t eip, cs, eflags;   // Pushed by the CPU
+};
+
+typedef void (*interrupt_handler_t)(struct interrupt_frame* frame);
+
+#define IRQ_BASE 32                 // PIC IRQ n arrives on vector IRQ_BASE + n
+
+void init_interrupts(void);
+void idt_load(void);
+void register_interrupt_handler(uint8_t vector, interrupt_handler_t handler);
+void register_irq_handler(uint8_t irq, interrupt_handler_t handler);
+uint32_t spurious_irq_total(void);
+void irq_stats_reset(void);
+void exception_panic(struct interrupt_frame* frame);
+void set_idt_entry(int num, uint32_t handler, uint16_t selector, uint8_t flags);
+void irq_unmask(uint8_t irq);
+void irq_mask(uint8_t irq);
+void send_eoi(uint8_t irq);
+// Keyboard: keycodes below 0x80 are scancode set 1 make codes, the
+// E0-prefixed keys get these codes. Line-editing keys reach
+// shell_input_char as their keycode.
+#define KEY_UP           0x80
+#define KEY_DOWN         0x81
+#define KEY_LEFT         0x82
+#define KEY_RIGHT        0x83
+#define KEY_HOME         0x84
+#define KEY_END          0x85
+#define KEY_PAGE_UP      0x86
+#define KEY_PAGE_DOWN    0x87
+#define KEY_INSERT       0x88
+#define KEY_DELETE       0x89
+#define KEY_KP_ENTER     0x8A
+#define KEY_KP_SLASH     0x8B
+#define KEY_RCTRL        0x8C
+#define KEY_RALT         0x8D
+#define KEY_LGUI         0x8E
+#define KEY_RGUI         0x8F
+#define KEY_MENU         0x90
+#define KEY_PAUSE        0x91
+#define KEY_PRINT_SCREEN 0x92
+
+#define KEY_MOD_SHIFT 0x01
+#define KEY_MOD_CTRL  0x02
+#define KEY_MOD_ALT   0x04
+#define KEY_MOD_CAPS  0x08      // Caps lock is on
+
+struct key_event {
+    uint8_t keycode;
+    uint8_t modifiers;          // KEY_MOD_* at the time of the event
+    uint8_t released;
+    uint8_t reserved;
+};
+
+int keyboard_translate(struct key_event event);
+int keyboard_has_input(void);
+void keyboard_process_input(void);
+uint32_t keyboard_dropped_count(void);
+void input_wait(void);
+void input_wake(void);
+void shell_input_char(int c);
+int in_interrupt(void);
+
+// Timer: 1ms ticks from the local APIC timer or the PIT, nanosecond
+// clock from the calibrated TSC
+#define TIMER_HZ 1000
+
+typedef void (*timer_callback_t)(void* data);
+
+// Deferred callback in the timer wheel; embed it and keep it alive
+// until it fires or is cancelled
+struct timer {
+    struct timer* next;
+    struct timer* prev;
+    uint32_t expires;           // Tick at which the callback runs
+    timer_callback_t callback;
+    void* data;
+};
+
+void timer_init(void);
+uint64_t timer_ticks(void);
+uint64_t ktime_ns(void);
+uint32_t tsc_khz(void);
+const char* timer_source(void);
+void sleep_ms(uint32_t ms);
+void timer_add(struct timer* timer, uint32_t delay_ms, timer_callback_t callback, void* data);
+int timer_cancel(struct timer* timer);
+void timer_run_expired(void);
+
+// Local APIC of the calling CPU, set up by timer_init on the BSP and
+// timer_init_cpu on the others
+#define LAPIC_TIMER_VECTOR    0xF0
+#define LAPIC_SPURIOUS_VECTOR 0xFF
+
+void timer_init_cpu(void);
+int lapic_present(void);
+uint32_t lapic_id(void);
+void lapic_send_ipi(uint32_t apic_id, uint32_t command);
+void lapic_eoi(void);
+
+// Scheduler: preemptive kernel threads in 32 priority levels, 0 highest
+#define SCHED_PRIORITIES       32
+#define SCHED_DEFAULT_PRIORITY 16
+
+enum task_state {
+    TASK_RUNNING,
+    TASK_READY,
+    TASK_SLEEPING,
+    TASK_BLOCKED,
+    TASK_DEAD
+};
+
+struct cpu;
+
+struct task {
+    uint32_t esp;               // Saved stack pointer; must stay first
+    uint32_t id;
+    const char* name;
+    uint8_t priority;
+    enum task_state state;
+    struct task* run_next;      // Runqueue, sleep list or dead list
+    struct task* all_next;      // Every task, for ps
+    uintptr_t stack_base;       // Lowest address of the kernel stack
+    uint32_t wake_tick;         // Tick a sleeping task is due
+    volatile int wake_pending;  // sched_wake arrived while not blocked
+    void (*entry)(void* arg);
+    void* arg;
+    uint32_t ticks;             // Timer ticks spent running
+    uint32_t switches;          // Times switched in
+    struct cpu* cpu;            // CPU whose runqueue lock guards the task
+};
+
+void sched_init(void);
+struct task* kthread_create(const char* name, void (*entry)(void*), void* arg, uint8_t priority);
+void kthread_exit(void);
+void kthread_yield(void);
+void kthread_sleep(uint32_t ms);
+void schedule(void);
+void sched_block(void);
+void sched_wake(struct task* task);
+void sched_tick(uint32_t now);
+void sched_preempt(void);
+int sched_active(void);
+void preempt_disable(void);
+void preempt_enable(void);
+struct task* current_task(void);
+uintptr_t sched_init_cpu(struct cpu* cpu);
+void sched_start_cpu(struct cpu* cpu);
+
+// Keeps the compiler from moving ring accesses across an index update
+#define ring_barrier() asm volatile("" : : : "memory")
+
+// Interrupt flag save/restore around short critical sections
+#ifdef HOST_TEST
+static inline uint32_t irq_save(void) {
+    return 0;
+}
+
+static inline void irq_restore(uint32_t flags) {
+    (void)flags;
+}
+
+static inline void irq_enable(void) {
+}
+#else
+static inline uint32_t irq_save(void) {
+    uint32_t flags;
+    asm volatile("pushf; pop %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+static inline void irq_restore(uint32_t flags) {
+    asm volatile("push %0; popf" : : "r"(flags) : "memory", "cc");
+}
+
+static inline void irq_enable(void) {
+    asm volatile("sti");
+}
+#endif
+
+// Time-stamp counter
+static inline uint64_t rdtsc(void) {
+    uint32_t lo, hi;
+    asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+// Synchronization (sync.c). Spinlocks and ticket locks leave the
+// interrupt flag alone; the _irqsave forms also disable interrupts,
+// for locks an interrupt handler on the same CPU may take. Ticket
+// locks hand the lock over in arrival order, for locks every CPU
+// fights over. Built with LOCK_STATS each lock counts acquisitions,
+// contended acquisitions, spins and its longest hold in cycles; the
+// locks command lists them.
+struct lock_stats {
+    const char* name;
+    struct lock_stats* next;    // Listed on first acquisition
+    int listed;
+    uint32_t acquisitions;
+    uint32_t contended;
+    uint32_t spins;
+    uint32_t max_hold;
+    uint64_t acquired_at;
+};
+
+#ifdef LOCK_STATS
+#define LOCK_STATS_FIELD struct lock_stats stats;
+#define LOCK_STATS_INIT(lock_name) , { .name = (lock_name) }
+#define lock_stats_name(lock, lock_name) ((lock)->stats.name = (lock_name))
+#define lock_acquired(lock, waited) lock_stats_acquired(&(lock)->stats, waited)
+#define lock_released(lock) lock_stats_released(&(lock)->stats)
+void lock_stats_acquired(struct lock_stats* stats, uint32_t spins);
+void lock_stats_released(struct lock_stats* stats);
+#else
+#define LOCK_STATS_FIELD
+#define LOCK_STATS_INIT(lock_name)
+#define lock_stats_name(lock, lock_name) ((void)(lock_name))
+#define lock_acquired(lock, waited) ((void)(waited))
+#define lock_released(lock) ((void)0)
+#endif
+
+typedef struct {
+    volatile uint32_t locked;
+    LOCK_STATS_FIELD
+} spinlock_t;
+
+// Ticket n may enter once owner reaches n; next is the ticket to hand out
+typedef struct {
+    union {
+        volatile uint32_t value;
+        struct {
+            volatile uint16_t owner;
+            volatile uint16_t next;
+        };
+    };
+    LOCK_STATS_FIELD
+} ticketlock_t;
+
+#define SPINLOCK_INIT(name) { 0 LOCK_STATS_INIT(name) }
+#define TICKETLOCK_INIT(name) { { 0 } LOCK_STATS_INIT(name) }
+
+// Slow paths; both return the number of spins
+uint32_t spin_lock_wait(volatile uint32_t* locked);
+uint32_t ticket_lock_wait(volatile uint16_t* owner, uint16_t ticket);
+
+static inline void spin_lock_init(spinlock_t* lock, const char* name) {
+    *lock = (spinlock_t)SPINLOCK_INIT(NULL);
+    lock_stats_name(lock, name);
+}
+
+static inline void spin_lock(spinlock_t* lock) {
+    uint32_t spins = 0;
+    if (__sync_lock_test_and_set(&lock->locked, 1)) {
+        spins = spin_lock_wait(&lock->locked);
+    }
+    lock_acquired(lock, spins);
+}
+
+static inline int spin_trylock(spinlock_t* lock) {
+    if (__sync_lock_test_and_set(&lock->locked, 1)) {
+        return 0;
+    }
+    lock_acquired(lock, 0);
+    return 1;
+}
+
+static inline void spin_unlock(spinlock_t* lock) {
+    lock_released(lock);
+    __sync_lock_release(&lock->locked);
+}
+
+static inline uint32_t spin_lock_irqsave(spinlock_t* lock) {
+    uint32_t flags = irq_save();
+    spin_lock(lock);
+    return flags;
+}
+
+static inline void spin_unlock_irqrestore(spinlock_t* lock, uint32_t flags) {
+    spin_unlock(lock);
+    irq_restore(flags);
+}
+
+static inline void ticket_lock(ticketlock_t* lock) {
+    uint16_t ticket = __sync_fetch_and_add(&lock->value, 0x10000) >> 16;
+    uint32_t spins = 0;
+    if (lock->owner != ticket) {
+        spins = ticket_lock_wait(&lock->owner, ticket);
+    }
+    lock_acquired(lock, spins);
+}
+
+static inline int ticket_trylock(ticketlock_t* lock) {
+    uint32_t value = lock->value;
+    if ((value & 0xFFFF) != value >> 16 ||
+        !__sync_bool_compare_and_swap(&lock->value, value, value + 0x10000)) {
+        return 0;
+    }
+    lock_acquired(lock, 0);
+    return 1;
+}
+
+// Only the holder writes owner, so a plain store hands the lock on
+static inline void ticket_unlock(ticketlock_t* lock) {
+    lock_released(lock);
+    ring_barrier();
+    lock->owner = lock->owner + 1;
+}
+
+static inline uint32_t ticket_lock_irqsave(ticketlock_t* lock) {
+    uint32_t flags = irq_save();
+    ticket_lock(lock);
+    return flags;
+}
+
+static inline void ticket_unlock_irqrestore(ticketlock_t* lock, uint32_t flags) {
+    ticket_unlock(lock);
+    irq_restore(flags);
+}
+
+// Seqlock: writers serialize on the spinlock and make the sequence odd
+// while they work; readers never block them and retry instead
+//     do { seq = read_seqbegin(&l); ...copy...; } while (read_seqretry(&l, seq));
+typedef struct {
+    volatile uint32_t sequence;
+    spinlock_t writer;
+} seqlock_t;
+
+#define SEQLOCK_INIT(name) { 0, SPINLOCK_INIT(name) }
+
+static inline uint32_t read_seqbegin(const seqlock_t* lock) {
+    uint32_t sequence;
+    while ((sequence = lock->sequence) & 1) {
+        asm volatile("pause");
+    }
+    ring_barrier();
+    return sequence;
+}
+
+static inline int read_seqretry(const seqlock_t* lock, uint32_t sequence) {
+    ring_barrier();
+    return lock->sequence != sequence;
+}
+
+static inline void write_seqlock(seqlock_t* lock) {
+    spin_lock(&lock->writer);
+    lock->sequence++;
+    ring_barrier();
+}
+
+static inline void write_sequnlock(seqlock_t* lock) {
+    ring_barrier();
+    lock->sequence++;
+    spin_unlock(&lock->writer);
+}
+
+// Read-mostly tables. Readers run between rcu_read_lock/unlock and
+// load published pointers with rcu_dereference; writers fill in an
+// entry before publishing it with rcu_assign_pointer, and call
+// synchronize_rcu before reusing anything a reader may still hold.
+#define rcu_read_lock() preempt_disable()
+#define rcu_read_unlock() preempt_enable()
+#define rcu_dereference(p) (*(__typeof__(p) volatile*)&(p))
+#define rcu_assign_pointer(p, v) do { \
+    ring_barrier(); \
+    *(__typeof__(p) volatile*)&(p) = (v); \
+} while (0)
+
+void synchronize_rcu(void);
+
+// Sleeping lock for task context, held across waits such as disk I/O.
+// Unlock hands the mutex straight to the oldest waiter.
+struct mutex_waiter;
+
+typedef struct {
+    spinlock_t lock;
+    struct task* owner;
+    struct mutex_waiter* waiters;
+    struct mutex_waiter* waiters_tail;
+} mutex_t;
+
+#define MUTEX_INIT(name) { SPINLOCK_INIT(name), NULL, NULL, NULL }
+
+void mutex_lock(mutex_t* mutex);
+void mutex_unlock(mutex_t* mutex);
+void sync_init(void);
+
+// SMP: CPUs come from the ACPI MADT. Each one reaches its struct cpu
+// through %fs, loaded with a per-CPU segment based at the structure.
+#define SMP_MAX_CPUS          8
+#define SMP_RESCHEDULE_VECTOR 0xF1
+#define GDT_CPU_FIRST         3     // GDT index of CPU 0's %fs segment
+
+struct gdt_descriptor {
+    uint16_t limit;
+    uint32_t base;
+} __attribute__((packed));
+
+struct cpu {
+    struct cpu* self;           // At %fs:0
+    struct task* current;
+    uint32_t index;             // 0 is the bootstrap CPU
+    uint32_t apic_id;
+    volatile int online;
+    volatile int need_resched;
+    volatile int preempt_count;
+    uint32_t interrupt_depth;
+    int xmm_busy;               // An SSE2 copy owns the xmm registers
+
+    // Scheduler state, guarded by lock
+    spinlock_t lock;
+    struct task* idle;          // Runs when nothing is ready; never queued
+    struct task* runqueue_head[SCHED_PRIORITIES];
+    struct task* runqueue_tail[SCHED_PRIORITIES];
+    uint32_t runqueue_bitmap;   // Bit n: runqueue n is non-empty
+    volatile uint32_t nr_ready;
+    struct task* sleep_list;    // Sleeping tasks by wake tick
+    struct task* dead_list;     // Exited here, stack not yet freed
+    uint32_t slice_left;
+    uint32_t ticks;
+    uint32_t idle_ticks;
+    uint32_t steals;            // Tasks taken from other runqueues
+    volatile uint32_t quiescent;    // Times seen outside any RCU reader
+
+    struct heap_cache heap_cache[HEAP_CLASS_COUNT];
+};
+
+extern uint64_t kernel_gdt[GDT_CPU_FIRST + SMP_MAX_CPUS];
+extern struct gdt_descriptor kernel_gdt_descriptor;
+
+void smp_early_init(void);
+void smp_init(void);
+size_t smp_cpu_count(void);
+struct cpu* smp_cpu(size_t index);
+void smp_send_reschedule(struct cpu* cpu);
+void smp_halt_others(void);
+
+#ifdef HOST_TEST
+static inline struct cpu* this_cpu(void) {
+    return &host_cpu;
+}
+
+#define this_cpu_read(field) (host_cpu.field)
+#else
+static inline struct cpu* this_cpu(void) {
+    struct cpu* cpu;
+    asm volatile("mov %%fs:0, %0" : "=r"(cpu));
+    return cpu;
+}
+
+// Read a 32-bit field of this CPU's struct cpu in one instruction, so
+// a task that migrates meanwhile cannot see another CPU's copy
+#define this_cpu_read(field) ({ \
+    __typeof__(((struct cpu*)0)->field) this_cpu_value_; \
+    asm volatile("mov %%fs:%c1, %0" : "=r"(this_cpu_value_) \
+                 : "i"(__builtin_offsetof(struct cpu, field))); \
+    this_cpu_value_; \
+})
+#endif
+
+// Block devices: 512-byte sectors, read and written through an LRU
+// cache of 4KB blocks with write-back and sequential read-ahead
+#define SECTOR_SIZE 512
+
+struct block_device {
+    const char* name;
+    uint64_t sectors;
+    uint32_t max_sectors;       // Largest single transfer
+    // Driver entry points; return 0, or -1 on a device error
+    int (*read)(struct block_device* dev, uint64_t lba, uint32_t count, void* buffer);
+    int (*write)(struct block_device* dev, uint64_t lba, uint32_t count, const void* buffer);
+    int (*flush)(struct block_device* dev);     // May be NULL
+    void* data;
+    struct block_device* next;
+    // Read-ahead state, owned by block.c
+    uint32_t ra_next;           // Block a sequential reader misses on next
+    uint32_t ra_window;
+};
+
+void block_init(void);
+void block_register(struct block_device* dev);
+struct block_device* block_find(const char* name);
+struct block_device* block_list(void);
+int block_read(struct block_device* dev, uint64_t lba, uint32_t count, void* buffer);
+int block_write(struct block_device* dev, uint64_t lba, uint32_t count, const void* buffer);
+int block_sync(void);
+
+// ATA disks on the IDE channels, with bus-master DMA when a PCI IDE
+// controller offers it; registered as block devices ata0..ata3
+void ata_init(void);
+
+// Files: a small VFS with one read-only filesystem, the initrd, at /.
+// Descriptors are global; vfs_mmap returns the file's bytes in place,
+// valid for as long as the system runs.
+#define VFS_MAX_OPEN 32
+
+struct vfs_dirent {
+    const char* name;           // Full path without the leading '/'
+    uint32_t size;
+};
+
+// What a filesystem provides; nodes are its own file numbers
+struct filesystem {
+    const char* name;
+    int (*lookup)(const char* path, uint32_t* node, uint32_t* size);
+    const void* (*map)(uint32_t node);
+    int (*readdir)(uint32_t index, struct vfs_dirent* entry);
+};
+
+void vfs_init(void);
+void vfs_mount_root(const struct filesystem* fs);
+int vfs_open(const char* path);
+int vfs_read(int fd, void* buffer, size_t size);
+int vfs_seek(int fd, uint32_t offset);
+const void* vfs_mmap(int fd, size_t* size);
+int vfs_close(int fd);
+int vfs_stat(const char* path, uint32_t* size);
+int vfs_readdir(uint32_t index, struct vfs_dirent* entry);
+
+// Initial RAM disk from a Multiboot module or the boot disk
+void initrd_init(void);
+
+// Trace: TSC-stamped events from fixed probe points. A disabled probe
+// costs one predicted-not-taken branch on trace_enabled.
+enum trace_event_id {
+    TRACE_IRQ_ENTER,            // arg0: IRQ
+    TRACE_IRQ_EXIT,             // arg0: IRQ, arg1: cycles in the handler
+    TRACE_KMALLOC,              // arg0: size, arg1: cycles
+    TRACE_KFREE,                // arg0: pointer, arg1: cycles
+    TRACE_SCROLL,               // arg1: cycles
+    TRACE_COMMAND,              // arg0: command name, arg1: cycles
+    TRACE_LOCK_WAIT,            // arg0: lock, arg1: cycles spent spinning
+    TRACE_EVENT_COUNT
+};
+
+extern int trace_enabled;
+
+void trace_init(void);
+void trace_record(uint32_t id, uint32_t arg0, uint32_t arg1);
+
+// Microbenchmarks
+void bench_init(void);
+
+// Boot profile: TSC stamps from boot.asm to the first shell prompt.
+// boot.asm leaves this in EAX when its stamps are below 0x7C00.
+#define BOOT_PROFILE_MAGIC 0x46525042   // "BPRF"
+
+void bootprof_start(uint32_t boot_magic);
+void bootprof_mark(const char* stage);     // End of the named stage
+void bootprof_report(void);
+void bootprof_init(void);
+
+#define TRACE(id, arg0, arg1) do { \
+    if (__builtin_expect(trace_enabled, 0)) \
+        trace_record((id), (uint32_t)(arg0), (uint32_t)(arg1)); \
+} while (0)
+
+// Start a span: the TSC when tracing, otherwise 0
+#define TRACE_BEGIN() (__builtin_expect(trace_enabled, 0) ? rdtsc() : 0)
+
+// End a span started with TRACE_BEGIN; arg1 is the elapsed cycles
+#define TRACE_END(id, arg0, start) do { \
+    uint64_t trace_start_ = (start); \
+    if (__builtin_expect(trace_start_ != 0, 0)) \
+        trace_record((id), (uint32_t)(arg0), (uint32_t)(rdtsc() - trace_start_)); \
+} while (0)
+
+// Shell
+typedef void (*shell_command_fn)(int argc, char** argv);
+
+void init_shell(void);
+int shell_register_command(const char* name, shell_command_fn handler, const char* help);
+void show_prompt(void);
+void clear_screen(void);
+void process_command(const char* input);
+void shell_execute(int argc, char** argv);
+
 // System functions
 void kernel_panic(const char* message);
 void kernel_halt(void);
 void kernel_reboot(void);
 
+// Port I/O
+#ifdef HOST_TEST
+static inline void outb(uint16_t port, uint8_t value) {
+    host_port_out(port, value);
+}
+
+static inline uint8_t inb(uint16_t port) {
+    return host_port_in(port);
+}
+
+static inline void outw(uint16_t port, uint16_t value) {
+    host_port_out(port, value);
+}
+
+static inline uint16_t inw(uint16_t port) {
+    return host_port_in(port);
+}
+
+static inline void outl(uint16_t port, uint32_t value) {
+    host_port_out(port, value);
+}
+
+static inline uint32_t inl(uint16_t port) {
+    return host_port_in(port);
+}
+
+static inline void insw(uint16_t port, void* buffer, size_t count) {
+    for (uint16_t* word = buffer; count--; word++) {
+        *word = host_port_in(port);
+    }
+}
+
+static inline void outsw(uint16_t port, const void* buffer, size_t count) {
+    for (const uint16_t* word = buffer; count--; word++) {
+        host_port_out(port, *word);
+    }
+}
+#else
+static inline void outb(uint16_t port, uint8_t value) {
+    asm volatile("outb %0, %1" : : "a"(value), "Nd"(port));
+}
+
+static inline uint8_t inb(uint16_t port) {
+    uint8_t ret;
+    asm volatile("inb %1, %0" : "=a"(ret) : "Nd"(port));
+    return ret;
+}
+
+static inline void outw(uint16_t port, uint16_t value) {
+    asm volatile("outw %0, %1" : : "a"(value), "Nd"(port));
+}
+
+static inline uint16_t inw(uint16_t port) {
+    uint16_t ret;
+    asm volatile("inw %1, %0" : "=a"(ret) : "Nd"(port));
+    return ret;
+}
+
+static inline void outl(uint16_t port, uint32_t value) {
+    asm volatile("outl %0, %1" : : "a"(value), "Nd"(port));
+}
+
+static inline uint32_t inl(uint16_t port) {
+    uint32_t ret;
+    asm volatile("inl %1, %0" : "=a"(ret) : "Nd"(port));
+    return ret;
+}
+
+// 'count' 16-bit words between a port and memory
+static inline void insw(uint16_t port, void* buffer, size_t count) {
+    asm volatile("rep insw" : "+D"(buffer), "+c"(count) : "d"(port) : "memory");
+}
+
+static inline void outsw(uint16_t port, const void* buffer, size_t count) {
+    asm volatile("rep outsw" : "+S"(buffer), "+c"(count) : "d"(port) : "memory");
+}
+#endif
+
+// PCI configuration space through mechanism 1
+#define PCI_CONFIG_ADDRESS 0xCF8
+#define PCI_CONFIG_DATA    0xCFC
+
+static inline uint32_t pci_read(uint32_t bus, uint32_t slot, uint32_t func, uint32_t offset) {
+    outl(PCI_CONFIG_ADDRESS, 0x80000000u | bus << 16 | slot << 11 | func << 8 | (offset & 0xFC));
+    return inl(PCI_CONFIG_DATA);
+}
+
+static inline void pci_write(uint32_t bus, uint32_t slot, uint32_t func, uint32_t offset, uint32_t value) {
+    outl(PCI_CONFIG_ADDRESS, 0x80000000u | bus << 16 | slot << 11 | func << 8 | (offset & 0xFC));
+    outl(PCI_CONFIG_DATA, value);
+}
+
+// 64-by-32 division without libgcc's __udivdi3, as two divl steps
+static inline uint64_t div64_u32(uint64_t dividend, uint32_t divisor, uint32_t* remainder) {
+    uint32_t high = dividend >> 32;
+    uint32_t low = (uint32_t)dividend;
+    uint32_t q_high = high / divisor;
+    uint32_t q_low, rem;
+    high %= divisor;
+    asm("divl %4" : "=a"(q_low), "=d"(rem) : "a"(low), "d"(high), "rm"(divisor));
+    if (remainder) {
+        *remainder = rem;
+    }
+    return ((uint64_t)q_high << 32) | q_low;
+}
+
+// (value * mult) >> shift with a 96-bit intermediate, shift <= 32
+static inline uint64_t mul_u64_u32_shr(uint64_t value, uint32_t mult, unsigned shift) {
+    uint64_t low = (uint64_t)(uint32_t)value * mult;
+    uint64_t high = (uint64_t)(uint32_t)(value >> 32) * mult;
+    return (low >> shift) + (shift ? high << (32 - shift) : high << 32);
+}
+
+// CPU identification
+static inline void cpuid(uint32_t leaf, uint32_t* eax, uint32_t* ebx, uint32_t* ecx, uint32_t* edx) {
+    asm volatile("cpuid" : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx) : "a"(leaf), "c"(0));
+}
+
 // VGA helper functions
 static inline uint8_t vga_entry_color(enum vga_color fg, enum vga_color bg) {
     return fg | bg << 4;
@@ -95,6 +942,8 @@ static inline uint16_t vga_entry(unsigned char uc, uint8_t color) {
 
 // Utility macros
 #define UNUSED(x) ((void)(x))
+// For C functions only referenced from asm() blocks, which LTO cannot see
+#define ASMLINKAGE __attribute__((used, externally_visible))
 #define PANIC(msg) kernel_panic(msg)
 #define ASSERT(condition) do { \
     if (!(condition)) { \
@@ -0,0 +1,827 @@
+/*
+ * memory.c - Kernel heap
+ * Size-class slabs for small objects, coalescing free list for large blocks.
+ * Small objects pass through per-CPU caches; the shared structures are
+ * only touched under heap_lock.
+ */
+
+#include "kernel.h"
+
+// Large block layout: [header][payload ...][footer]
+// The footer repeats the size word so a freed block can find its neighbour
+#define BLOCK_USED      0x1
+#define BLOCK_MAGIC     0x4B4D454D  // "MEMK"
+#define BLOCK_ALIGN     8
+#define BLOCK_MIN_SIZE  32
+#define BLOCK_OVERHEAD  (sizeof(struct block_header) + sizeof(uint32_t))
+#define FREE_BIN_COUNT  32
+#define BIN_SEARCH_DEPTH 8
+
+// Slabs are aligned to their own size so kfree can find the header by masking
+#define SLAB_HEADER_SIZE ((sizeof(struct slab) + 15) & ~15)
+#define SLAB_SMALL_SIZE  PAGE_SIZE        // Classes up to 256 bytes
+#define SLAB_LARGE_SIZE  (4 * PAGE_SIZE)  // 512, 1024 and 2048 byte classes
+
+struct block_header {
+    uint32_t size;          // Total block size including header and footer
+    uint32_t magic;         // BLOCK_MAGIC, checked on free
+};
+
+// Free blocks keep their bin links in the payload
+struct free_block {
+    struct block_header header;
+    struct free_block* next;
+    struct free_block* prev;
+};
+
+struct slab {
+    struct slab* next;      // Partial list links
+    struct slab* prev;
+    void* free_list;        // Objects handed back by kfree
+    uint8_t* unused;        // Next never-used object, NULL once carved out
+    uint8_t* limit;         // End of the object area
+    uint16_t in_use;
+    uint16_t capacity;
+    uint8_t class_index;
+};
+
+struct size_class {
+    uint32_t object_size;
+    uint32_t slab_size;
+    struct slab* partial;   // Slabs with at least one free object
+    uint32_t slabs;
+    uint32_t empty_slabs;
+    uint32_t in_use;
+    uint32_t capacity;
+};
+
+// Heap state
+static uint8_t* heap_start;
+static uint8_t* heap_end;
+static uint8_t* heap_page_map;  // Per heap page: 0 = block memory, n = slab of class n-1
+static struct size_class size_classes[HEAP_CLASS_COUNT];
+static struct free_block* free_bins[FREE_BIN_COUNT];
+static uint32_t free_bin_map;   // Bit n set when free_bins[n] is non-empty
+static size_t heap_free_bytes;
+static uint32_t heap_free_blocks;
+static ticketlock_t heap_lock = TICKETLOCK_INIT("heap");
+#ifdef HEAP_PROFILE
+static size_t heap_free_low;    // Fewest free block bytes seen after an allocation
+#endif
+
+static inline uint32_t size_log2(uint32_t value) {
+    return 31 - __builtin_clz(value);
+}
+
+static inline uint32_t block_size(const struct block_header* block) {
+    return block->size & ~BLOCK_USED;
+}
+
+static inline void block_set(struct block_header* block, uint32_t size, uint32_t used) {
+    block->size = size | used;
+    block->magic = BLOCK_MAGIC;
+    *(uint32_t*)((uint8_t*)block + size - sizeof(uint32_t)) = size | used;
+}
+
+static inline uint32_t block_request_size(size_t size) {
+    uint32_t total = (size + BLOCK_OVERHEAD + BLOCK_ALIGN - 1) & ~(BLOCK_ALIGN - 1);
+    return total < BLOCK_MIN_SIZE ? BLOCK_MIN_SIZE : total;
+}
+
+// Free bins are segregated by power of two; bin n holds sizes [2^n, 2^(n+1))
+static void bin_insert(struct free_block* block) {
+    uint32_t size = block_size(&block->header);
+    uint32_t bin = size_log2(size);
+
+    block->prev = NULL;
+    block->next = free_bins[bin];
+    if (block->next) {
+        block->next->prev = block;
+    }
+    free_bins[bin] = block;
+    free_bin_map |= 1u << bin;
+
+    heap_free_bytes += size;
+    heap_free_blocks++;
+}
+
+static void bin_remove(struct free_block* block) {
+    uint32_t size = block_size(&block->header);
+    uint32_t bin = size_log2(size);
+
+    if (block->prev) {
+        block->prev->next = block->next;
+    } else {
+        free_bins[bin] = block->next;
+    }
+    if (block->next) {
+        block->next->prev = block->prev;
+    }
+    if (!free_bins[bin]) {
+        free_bin_map &= ~(1u << bin);
+    }
+
+    heap_free_bytes -= size;
+    heap_free_blocks--;
+}
+
+static struct free_block* bin_find(uint32_t size) {
+    uint32_t bin = size_log2(size);
+
+    // The home bin may hold blocks smaller than the request, so only
+    // look at a few of them before moving to a bin that always fits
+    int depth = 0;
+    for (struct free_block* b = free_bins[bin]; b && depth < BIN_SEARCH_DEPTH; b = b->next, depth++) {
+        if (block_size(&b->header) >= size) {
+            return b;
+        }
+    }
+
+    uint32_t larger = free_bin_map & ~((2u << bin) - 1);
+    if (larger) {
+        return free_bins[__builtin_ctz(larger)];
+    }
+
+    // Last resort: walk the rest of the home bin
+    for (struct free_block* b = free_bins[bin]; b; b = b->next) {
+        if (block_size(&b->header) >= size) {
+            return b;
+        }
+    }
+    return NULL;
+}
+
+// Take a free block off its bin, split off the tail and mark it used
+static void* block_use(struct free_block* block, uint32_t size) {
+    bin_remove(block);
+
+    uint32_t total = block_size(&block->header);
+    if (total - size >= BLOCK_MIN_SIZE) {
+        struct block_header* rest = (struct block_header*)((uint8_t*)block + size);
+        block_set(rest, total - size, 0);
+        bin_insert((struct free_block*)rest);
+        total = size;
+    }
+
+    block_set(&block->header, total, BLOCK_USED);
+    return (uint8_t*)block + sizeof(struct block_header);
+}
+
+static void* large_alloc(size_t size) {
+    uint32_t needed = block_request_size(size);
+    struct free_block* block = bin_find(needed);
+    return block ? block_use(block, needed) : NULL;
+}
+
+// Allocate a block whose payload sits on an 'align' boundary (power of two)
+static void* large_alloc_aligned(size_t size, size_t align) {
+    uint32_t needed = block_request_size(size);
+    struct free_block* block = bin_find(needed + align + BLOCK_MIN_SIZE);
+    if (!block) {
+        return NULL;
+    }
+
+    uintptr_t payload = (uintptr_t)block + sizeof(struct block_header);
+    uintptr_t aligned = (payload + align - 1) & ~(align - 1);
+    if (aligned != payload && aligned - payload < BLOCK_MIN_SIZE) {
+        aligned += align;
+    }
+
+    if (aligned != payload) {
+        // Hand the leading gap back to the bins as its own block
+        uint32_t gap = aligned - payload;
+        uint32_t total = block_size(&block->header);
+
+        bin_remove(block);
+        block_set(&block->header, gap, 0);
+        bin_insert(block);
+
+        block = (struct free_block*)(aligned - sizeof(struct block_header));
+        block_set(&block->header, total - gap, 0);
+        bin_insert(block);
+    }
+
+    return block_use(block, needed);
+}
+
+static void large_free(struct block_header* block) {
+    uint32_t size = block_size(block);
+
+    // Merge with the following block
+    struct block_header* next = (struct block_header*)((uint8_t*)block + size);
+    if (!(next->size & BLOCK_USED)) {
+        bin_remove((struct free_block*)next);
+        size += block_size(next);
+    }
+
+    // Merge with the preceding block through its footer
+    uint32_t prev_tag = *((uint32_t*)block - 1);
+    if (!(prev_tag & BLOCK_USED)) {
+        struct block_header* prev = (struct block_header*)((uint8_t*)block - prev_tag);
+        bin_remove((struct free_block*)prev);
+        size += prev_tag;
+        block = prev;
+    }
+
+    block_set(block, size, 0);
+    bin_insert((struct free_block*)block);
+}
+
+// Size class index for a small request (16 -> 0, 32 -> 1, ... 2048 -> 7)
+static inline uint32_t size_class_index(size_t size) {
+    if (size <= (1u << HEAP_MIN_CLASS_SHIFT)) {
+        return 0;
+    }
+    return size_log2(size - 1) + 1 - HEAP_MIN_CLASS_SHIFT;
+}
+
+static void slab_list_push(struct size_class* sc, struct slab* slab) {
+    slab->prev = NULL;
+    slab->next = sc->partial;
+    if (slab->next) {
+        slab->next->prev = slab;
+    }
+    sc->partial = slab;
+}
+
+static void slab_list_remove(struct size_class* sc, struct slab* slab) {
+    if (slab->prev) {
+        slab->prev->next = slab->next;
+    } else {
+        sc->partial = slab->next;
+    }
+    if (slab->next) {
+        slab->next->prev = slab->prev;
+    }
+    slab->next = slab->prev = NULL;
+}
+
+static void slab_mark_pages(struct slab* slab, uint32_t slab_size, uint8_t value) {
+    uint32_t first = ((uint8_t*)slab - heap_start) / PAGE_SIZE;
+    for (uint32_t i = 0; i < slab_size / PAGE_SIZE; i++) {
+        heap_page_map[first + i] = value;
+    }
+}
+
+static struct slab* slab_create(uint32_t index) {
+    struct size_class* sc = &size_classes[index];
+    struct slab* slab = large_alloc_aligned(sc->slab_size, sc->slab_size);
+    if (!slab) {
+        return NULL;
+    }
+
+    // Objects are carved lazily from 'unused' so creating a slab is O(1)
+    slab->free_list = NULL;
+    slab->unused = (uint8_t*)slab + SLAB_HEADER_SIZE;
+    slab->capacity = (sc->slab_size - SLAB_HEADER_SIZE) / sc->object_size;
+    slab->limit = slab->unused + slab->capacity * sc->object_size;
+    slab->in_use = 0;
+    slab->class_index = index;
+
+    slab_mark_pages(slab, sc->slab_size, index + 1);
+    slab_list_push(sc, slab);
+
+    sc->slabs++;
+    sc->empty_slabs++;
+    sc->capacity += slab->capacity;
+    return slab;
+}
+
+static void slab_destroy(struct size_class* sc, struct slab* slab) {
+    slab_list_remove(sc, slab);
+    slab_mark_pages(slab, sc->slab_size, 0);
+
+    sc->slabs--;
+    sc->capacity -= slab->capacity;
+    large_free((struct block_header*)((uint8_t*)slab - sizeof(struct block_header)));
+}
+
+static void* slab_alloc(uint32_t index) {
+    struct size_class* sc = &size_classes[index];
+    struct slab* slab = sc->partial;
+    if (!slab && !(slab = slab_create(index))) {
+        return NULL;
+    }
+
+    void* obj;
+    if (slab->free_list) {
+        obj = slab->free_list;
+        slab->free_list = *(void**)obj;
+    } else {
+        obj = slab->unused;
+        slab->unused += sc->object_size;
+        if (slab->unused == slab->limit) {
+            slab->unused = NULL;
+        }
+    }
+
+    if (slab->in_use++ == 0) {
+        sc->empty_slabs--;
+    }
+    sc->in_use++;
+
+    // Full slabs leave the partial list until something is freed
+    if (!slab->free_list && !slab->unused) {
+        slab_list_remove(sc, slab);
+    }
+    return obj;
+}
+
+static struct slab* slab_of(void* ptr, uint32_t index) {
+    struct size_class* sc = &size_classes[index];
+    struct slab* slab = (struct slab*)((uintptr_t)ptr & ~(uintptr_t)(sc->slab_size - 1));
+
+    uintptr_t offset = (uintptr_t)ptr - (uintptr_t)slab - SLAB_HEADER_SIZE;
+    if ((offset & (sc->object_size - 1)) || (uint8_t*)ptr >= slab->limit) {
+        kernel_panic("kfree: pointer is not a heap object");
+    }
+    return slab;
+}
+
+static void slab_free(void* ptr, uint32_t index) {
+    struct size_class* sc = &size_classes[index];
+    struct slab* slab = slab_of(ptr, index);
+
+    int was_full = !slab->free_list && !slab->unused;
+    *(void**)ptr = slab->free_list;
+    slab->free_list = ptr;
+    slab->in_use--;
+    sc->in_use--;
+
+    if (was_full) {
+        slab_list_push(sc, slab);
+    }
+
+    if (slab->in_use == 0) {
+        // Keep one empty slab per class so alloc/free ping-pong stays cheap
+        if (sc->empty_slabs > 0) {
+            slab_destroy(sc, slab);
+        } else {
+            sc->empty_slabs++;
+        }
+    }
+}
+
+// Small allocations come from this CPU's cache, refilled in batches
+// under the heap lock. Interrupts stay off so the cache cannot change
+// hands or be re-entered from an ISR meanwhile.
+static void* small_alloc(uint32_t index) {
+    uint32_t flags = irq_save();
+    struct heap_cache* cache = &this_cpu()->heap_cache[index];
+    if (cache->count == 0) {
+        ticket_lock(&heap_lock);
+        while (cache->count < HEAP_CACHE_BATCH) {
+            void* obj = slab_alloc(index);
+            if (!obj) {
+                break;
+            }
+            cache->objects[cache->count++] = obj;
+        }
+        ticket_unlock(&heap_lock);
+    }
+    void* obj = cache->count ? cache->objects[--cache->count] : NULL;
+    irq_restore(flags);
+    return obj;
+}
+
+// Freed objects go back to this CPU's cache; a full cache hands a
+// batch back to the slabs
+static void small_free(void* ptr, uint32_t index) {
+    slab_of(ptr, index);    // Validates the pointer
+
+    uint32_t flags = irq_save();
+    struct heap_cache* cache = &this_cpu()->heap_cache[index];
+    if (cache->count == HEAP_CACHE_SIZE) {
+        ticket_lock(&heap_lock);
+        while (cache->count > HEAP_CACHE_SIZE - HEAP_CACHE_BATCH) {
+            slab_free(cache->objects[--cache->count], index);
+        }
+        ticket_unlock(&heap_lock);
+    }
+    cache->objects[cache->count++] = ptr;
+    irq_restore(flags);
+}
+
+// Free-list allocations, serialized by the heap lock
+static void* locked_large_alloc(size_t size, size_t align) {
+    uint32_t flags = ticket_lock_irqsave(&heap_lock);
+    void* ptr = align ? large_alloc_aligned(size, align) : large_alloc(size);
+    ticket_unlock_irqrestore(&heap_lock, flags);
+    return ptr;
+}
+
+// Set up the heap over [start, end)
+void heap_init(uintptr_t start, uintptr_t end) {
+    heap_start = (uint8_t*)start;
+    heap_end = (uint8_t*)end;
+
+    for (int i = 0; i < HEAP_CLASS_COUNT; i++) {
+        size_classes[i].object_size = 1u << (HEAP_MIN_CLASS_SHIFT + i);
+        size_classes[i].slab_size = size_classes[i].object_size <= 256 ? SLAB_SMALL_SIZE : SLAB_LARGE_SIZE;
+        size_classes[i].partial = NULL;
+        size_classes[i].slabs = 0;
+        size_classes[i].empty_slabs = 0;
+        size_classes[i].in_use = 0;
+        size_classes[i].capacity = 0;
+    }
+    memset(free_bins, 0, sizeof(free_bins));
+    free_bin_map = 0;
+    heap_free_bytes = 0;
+    heap_free_blocks = 0;
+
+    // The page map lives at the bottom of the heap itself
+    uint32_t pages = (end - start) / PAGE_SIZE;
+    heap_page_map = heap_start;
+    memset(heap_page_map, 0, pages);
+
+    // A used prologue tag and a zero-sized used epilogue header fence the
+    // block area so coalescing never walks off either end
+    uintptr_t first = (start + pages + sizeof(uint32_t) + BLOCK_ALIGN - 1) & ~(BLOCK_ALIGN - 1);
+    uintptr_t last = (end - sizeof(struct block_header)) & ~(BLOCK_ALIGN - 1);
+
+    *((uint32_t*)first - 1) = BLOCK_USED;
+    struct block_header* epilogue = (struct block_header*)last;
+    epilogue->size = BLOCK_USED;
+    epilogue->magic = BLOCK_MAGIC;
+
+    struct block_header* block = (struct block_header*)first;
+    block_set(block, last - first, 0);
+    bin_insert((struct free_block*)block);
+#ifdef HEAP_PROFILE
+    heap_free_low = heap_free_bytes;
+#endif
+}
+
+// Heap profile (HEAP_PROFILE): each kmalloc'd block is entered in a
+// table of live blocks keyed by address, with its requested size and
+// call site, and carries a canary word just past the requested bytes
+// that kfree checks. Whole frames from kmalloc_aligned go without one,
+// as it would cost a frame of its own. Blocks the table has no room for
+// are counted but not tracked. Sites are return addresses; addr2line maps them to code.
+#ifdef HEAP_PROFILE
+#define PROFILE_SLOTS   4096        // Live blocks tracked; power of two
+#define PROFILE_SITES   64          // The last one collects all later sites
+#define PROFILE_SHOWN   16          // Sites meminfo -v lists
+#define PROFILE_BUCKETS 32          // Requested sizes by log2
+#define PROFILE_CANARY  0x5AFEC0DEu
+#define PROFILE_PAD     sizeof(uint32_t)
+
+struct profile_block {
+    uint8_t* ptr;                   // NULL = empty slot
+    uint32_t size;
+    uint32_t site;
+};
+
+struct profile_site {
+    uintptr_t caller;               // 0 for the overflow site
+    uint32_t allocs;
+    uint64_t bytes;
+    uint32_t live;
+    uint32_t live_bytes;
+};
+
+struct profile_totals {
+    uint32_t allocs;
+    uint32_t frees;
+    uint32_t failed;
+    uint32_t untracked;
+    uint32_t live;
+    uint32_t live_peak;
+    size_t live_bytes;
+    size_t live_bytes_peak;
+};
+
+static struct profile_block profile_blocks[PROFILE_SLOTS];
+static struct profile_site profile_sites[PROFILE_SITES];
+static uint32_t profile_site_count;
+static uint32_t profile_sizes[PROFILE_BUCKETS];
+static struct profile_totals profile;
+static spinlock_t profile_lock = SPINLOCK_INIT("heap-profile");
+
+static inline uint32_t profile_slot(const void* ptr) {
+    return (uint32_t)((uintptr_t)ptr >> 3) * 2654435761u >> (32 - __builtin_ctz(PROFILE_SLOTS));
+}
+
+static uint32_t profile_site_index(uintptr_t caller) {
+    for (uint32_t i = 0; i < profile_site_count; i++) {
+        if (profile_sites[i].caller == caller) {
+            return i;
+        }
+    }
+    if (profile_site_count == PROFILE_SITES - 1) {
+        return PROFILE_SITES - 1;
+    }
+    profile_sites[profile_site_count].caller = caller;
+    return profile_site_count++;
+}
+
+// Frame blocks are the ones outside the heap
+static inline int has_canary(const void* ptr) {
+    return (const uint8_t*)ptr >= heap_start && (const uint8_t*)ptr < heap_end;
+}
+
+// Unaligned: the canary sits right after the caller's bytes
+static inline void canary_set(uint8_t* ptr, uint32_t size) {
+    uint32_t canary = PROFILE_CANARY;
+    memcpy(ptr + size, &canary, sizeof(canary));
+}
+
+static inline int canary_ok(const uint8_t* ptr, uint32_t size) {
+    uint32_t canary;
+    memcpy(&canary, ptr + size, sizeof(canary));
+    return canary == PROFILE_CANARY;
+}
+
+static void profile_alloc(void* ptr, size_t size, uintptr_t caller) {
+    uint32_t flags = spin_lock_irqsave(&profile_lock);
+    if (!ptr) {
+        profile.failed++;
+        spin_unlock_irqrestore(&profile_lock, flags);
+        return;
+    }
+    profile.allocs++;
+    profile_sizes[size_log2(size)]++;
+    if (heap_free_bytes < heap_free_low) {
+        heap_free_low = heap_free_bytes;
+    }
+
+    uint32_t site = profile_site_index(caller);
+    struct profile_site* ps = &profile_sites[site];
+    ps->allocs++;
+    ps->bytes += size;
+
+    // Alive blocks never exceed the table, so a free slot exists unless full
+    if (profile.live - profile.untracked < PROFILE_SLOTS / 2) {
+        uint32_t slot = profile_slot(ptr);
+        while (profile_blocks[slot].ptr) {
+            slot = (slot + 1) & (PROFILE_SLOTS - 1);
+        }
+        profile_blocks[slot].ptr = ptr;
+        profile_blocks[slot].size = size;
+        profile_blocks[slot].site = site;
+        if (has_canary(ptr)) {
+            canary_set(ptr, size);
+        }
+        ps->live++;
+        ps->live_bytes += size;
+        profile.live_bytes += size;
+        if (profile.live_bytes > profile.live_bytes_peak) {
+            profile.live_bytes_peak = profile.live_bytes;
+        }
+    } else {
+        profile.untracked++;
+    }
+    if (++profile.live > profile.live_peak) {
+        profile.live_peak = profile.live;
+    }
+    spin_unlock_irqrestore(&profile_lock, flags);
+}
+
+static void profile_free(void* ptr) {
+    uint32_t flags = spin_lock_irqsave(&profile_lock);
+    profile.frees++;
+    profile.live--;
+
+    uint32_t slot = profile_slot(ptr);
+    while (profile_blocks[slot].ptr && profile_blocks[slot].ptr != ptr) {
+        slot = (slot + 1) & (PROFILE_SLOTS - 1);
+    }
+    struct profile_block* block = &profile_blocks[slot];
+    if (!block->ptr) {
+        if (profile.untracked == 0) {
+            kernel_panic("kfree: invalid pointer or double free");
+        }
+        profile.untracked--;
+        spin_unlock_irqrestore(&profile_lock, flags);
+        return;
+    }
+    if (has_canary(ptr) && !canary_ok(block->ptr, block->size)) {
+        printf("kfree: %u-byte block at %p from %p overran its end\n", (unsigned)block->size,
+               ptr, (void*)profile_sites[block->site].caller);
+        kernel_panic("kfree: heap canary overwritten");
+    }
+
+    struct profile_site* ps = &profile_sites[block->site];
+    ps->live--;
+    ps->live_bytes -= block->size;
+    profile.live_bytes -= block->size;
+
+    // Backward-shift deletion keeps every probe chain unbroken
+    uint32_t hole = slot;
+    for (uint32_t next = (slot + 1) & (PROFILE_SLOTS - 1); profile_blocks[next].ptr;
+         next = (next + 1) & (PROFILE_SLOTS - 1)) {
+        uint32_t home = profile_slot(profile_blocks[next].ptr);
+        if (((next - home) & (PROFILE_SLOTS - 1)) >= ((next - hole) & (PROFILE_SLOTS - 1))) {
+            profile_blocks[hole] = profile_blocks[next];
+            hole = next;
+        }
+    }
+    profile_blocks[hole].ptr = NULL;
+    spin_unlock_irqrestore(&profile_lock, flags);
+}
+
+// Entry points stay out of line so the return address is the caller's
+#define HEAP_ENTRY __attribute__((noinline))
+#define PROFILE_PAD_SIZE(size) ((size) ? (size) + PROFILE_PAD : 0)
+#define PROFILE_ALLOC(ptr, size) profile_alloc(ptr, size, (uintptr_t)__builtin_return_address(0))
+#define PROFILE_FREE(ptr) profile_free(ptr)
+#else
+#define HEAP_ENTRY
+#define PROFILE_PAD_SIZE(size) (size)
+#define PROFILE_ALLOC(ptr, size) ((void)0)
+#define PROFILE_FREE(ptr) ((void)0)
+#endif
+
+static void* heap_alloc(size_t size) {
+    if (size == 0) {
+        return NULL;
+    }
+    if (size <= HEAP_MAX_SMALL_SIZE) {
+        return small_alloc(size_class_index(size));
+    }
+    if (size > (size_t)(heap_end - heap_start)) {
+        return NULL;
+    }
+    return locked_large_alloc(size, 0);
+}
+
+HEAP_ENTRY void* kmalloc(size_t size) {
+    uint64_t start = TRACE_BEGIN();
+    void* ptr = heap_alloc(PROFILE_PAD_SIZE(size));
+    if (size) {
+        PROFILE_ALLOC(ptr, size);
+    }
+    TRACE_END(TRACE_KMALLOC, size, start);
+    return ptr;
+}
+
+static void* heap_alloc_aligned(size_t size, size_t alignment) {
+    if (alignment <= 16 && size <= HEAP_MAX_SMALL_SIZE) {
+        return small_alloc(size_class_index(size));
+    }
+    if (alignment < PAGE_SIZE) {
+        if (alignment <= BLOCK_ALIGN) {
+            return heap_alloc(size);
+        }
+        if (size > (size_t)(heap_end - heap_start)) {
+            return NULL;
+        }
+        return locked_large_alloc(size, alignment);
+    }
+
+    size_t frames = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+    return (void*)pmm_alloc_frames(frames, alignment / PAGE_SIZE);
+}
+
+// Allocate with a power-of-two alignment. Slab objects are already
+// 16-byte aligned; page alignment and above is served by whole frames
+HEAP_ENTRY void* kmalloc_aligned(size_t size, size_t alignment) {
+    if (size == 0 || alignment == 0 || (alignment & (alignment - 1))) {
+        return NULL;
+    }
+    void* ptr = heap_alloc_aligned(alignment < PAGE_SIZE ? PROFILE_PAD_SIZE(size) : size,
+                                   alignment);
+    PROFILE_ALLOC(ptr, size);
+    return ptr;
+}
+
+static void heap_free(void* ptr) {
+
+    uint8_t* p = (uint8_t*)ptr;
+    if (p < heap_start || p >= heap_end) {
+        // Page-aligned buffers from kmalloc_aligned come straight from the frame allocator
+        if (pmm_owns((uintptr_t)ptr)) {
+            pmm_free_frames((uintptr_t)ptr);
+            return;
+        }
+        kernel_panic("kfree: pointer outside the heap");
+    }
+
+    uint8_t slab_class = heap_page_map[(p - heap_start) / PAGE_SIZE];
+    if (slab_class) {
+        small_free(ptr, slab_class - 1);
+        return;
+    }
+
+    struct block_header* block = (struct block_header*)(p - sizeof(struct block_header));
+    uint32_t flags = ticket_lock_irqsave(&heap_lock);
+    if (block->magic != BLOCK_MAGIC || !(block->size & BLOCK_USED)) {
+        kernel_panic("kfree: invalid pointer or double free");
+    }
+    large_free(block);
+    ticket_unlock_irqrestore(&heap_lock, flags);
+}
+
+void kfree(void* ptr) {
+    if (!ptr) {
+        return;
+    }
+    uint64_t start = TRACE_BEGIN();
+    PROFILE_FREE(ptr);
+    heap_free(ptr);
+    TRACE_END(TRACE_KFREE, (uintptr_t)ptr, start);
+}
+
+// Largest free block, found in the highest non-empty bin
+static uint32_t largest_free_block(void) {
+    if (!free_bin_map) {
+        return 0;
+    }
+
+    uint32_t largest = 0;
+    for (struct free_block* b = free_bins[size_log2(free_bin_map)]; b; b = b->next) {
+        if (block_size(&b->header) > largest) {
+            largest = block_size(&b->header);
+        }
+    }
+    return largest;
+}
+
+// Free heap bytes plus free physical frames
+size_t get_available_memory(void) {
+    return heap_free_bytes + pmm_free_count() * PAGE_SIZE;
+}
+
+// Memory information functions
+void print_memory_info(void) {
+    printf("Memory Information:\n");
+    printf("Heap start: %p\n", (void*)heap_start);
+    printf("Heap end: %p\n", (void*)heap_end);
+
+    printf("Size classes (size: slabs, objects used/total, in CPU caches):\n");
+    for (int i = 0; i < HEAP_CLASS_COUNT; i++) {
+        struct size_class* sc = &size_classes[i];
+        uint32_t cached = 0;
+        for (size_t cpu = 0; cpu < smp_cpu_count(); cpu++) {
+            cached += smp_cpu(cpu)->heap_cache[i].count;
+        }
+        printf("  %4u: %u slabs, %u/%u, %u cached\n", (unsigned)sc->object_size,
+               (unsigned)sc->slabs, (unsigned)sc->in_use, (unsigned)sc->capacity, cached);
+    }
+
+    uint32_t largest = largest_free_block();
+    uint32_t free_scaled = heap_free_bytes >> 8;
+    uint32_t fragmentation = free_scaled ? 100 - (largest >> 8) * 100 / free_scaled : 0;
+
+    printf("Free blocks: %u, largest %u bytes\n", (unsigned)heap_free_blocks, (unsigned)largest);
+    printf("Fragmentation: %u%%\n", (unsigned)fragmentation);
+    printf("Physical frames: %u/%u free\n", (unsigned)pmm_free_count(), (unsigned)pmm_total_count());
+    printf("Available memory: %u bytes\n", (unsigned)get_available_memory());
+}
+
+// Allocation profile for meminfo -v
+void print_heap_profile(void) {
+#ifdef HEAP_PROFILE
+    static struct profile_site sites[PROFILE_SITES];
+    static uint32_t sizes[PROFILE_BUCKETS];
+
+    uint32_t flags = spin_lock_irqsave(&profile_lock);
+    struct profile_totals totals = profile;
+    uint32_t site_count = profile_site_count;
+    if (profile_sites[PROFILE_SITES - 1].allocs) {
+        site_count = PROFILE_SITES;
+    }
+    memcpy(sites, profile_sites, sizeof(sites));
+    memcpy(sizes, profile_sizes, sizeof(sizes));
+    spin_unlock_irqrestore(&profile_lock, flags);
+
+    size_t heap_size = heap_end - heap_start;
+    printf("Allocations: %u, frees: %u, failed: %u, untracked: %u\n", totals.allocs,
+           totals.frees, totals.failed, totals.untracked);
+    printf("Live: %u blocks, %u bytes (peak %u blocks, %u bytes)\n", totals.live,
+           (unsigned)totals.live_bytes, totals.live_peak, (unsigned)totals.live_bytes_peak);
+    printf("Heap in use: peak %u of %u bytes\n", (unsigned)(heap_size - heap_free_low),
+           (unsigned)heap_size);
+
+    printf("Requested sizes:\n");
+    for (uint32_t i = 0; i < PROFILE_BUCKETS; i++) {
+        if (sizes[i]) {
+            printf("  %7u-%-7u %u\n", 1u << i, (2u << i) - 1, sizes[i]);
+        }
+    }
+
+    // Busiest sites first; a site with live blocks at idle is a leak suspect
+    printf("Call sites:     allocs      bytes   live  live bytes\n");
+    for (uint32_t shown = 0; shown < PROFILE_SHOWN; shown++) {
+        uint32_t best = PROFILE_SITES;
+        for (uint32_t i = 0; i < site_count; i++) {
+            if (sites[i].allocs && (best == PROFILE_SITES || sites[i].allocs > sites[best].allocs)) {
+                best = i;
+            }
+        }
+        if (best == PROFILE_SITES) {
+            break;
+        }
+        struct profile_site* ps = &sites[best];
+        if (ps->caller) {
+            printf("  %p", (void*)ps->caller);
+        } else {
+            printf("  (others)  ");
+        }
+        printf(" %9u %10llu %6u %11u\n", ps->allocs, ps->bytes, ps->live, ps->live_bytes);
+        ps->allocs = 0;
+    }
+#else
+    printf("Heap profiling is off; build with HEAP_PROFILE=1\n");
+#endif
+}
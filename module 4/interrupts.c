@@ -3,19 +3,7 @@
  * Handles CPU interrupts including keyboard input
  */
 
-// Define our own types since we can't use standard library
-typedef unsigned char uint8_t;
-typedef unsigned short uint16_t;
-typedef unsigned int uint32_t;
-typedef unsigned long long uint64_t;
-typedef signed char int8_t;
-typedef signed short int16_t;
-typedef signed int int32_t;
-typedef signed long long int64_t;
-typedef uint32_t size_t;
-typedef uint32_t uintptr_t;
-
-#define NULL ((void*)0)
+#include "kernel.h"
 
 // Interrupt constants
 #define IDT_SIZE 256
@@ -25,17 +13,9 @@ typedef uint32_t uintptr_t;
 #define PIC2_COMMAND 0xA0
 #define PIC2_DATA 0xA1
 #define PIC_EOI 0x20
-
-// Port I/O functions
-static inline void outb(uint16_t port, uint8_t value) {
-    asm volatile("outb %0, %1" : : "a"(value), "Nd"(port));
-}
-
-static inline uint8_t inb(uint16_t port) {
-    uint8_t ret;
-    asm volatile("inb %1, %0" : "=a"(ret) : "Nd"(port));
-    return ret;
-}
+#define PIC_READ_ISR 0x0B          // OCW3: next command-port read returns the ISR
+#define IRQ_COUNT 16
+#define ISR_STUB_SIZE 16
 
 // IDT Entry structure
 struct idt_entry {
@@ -56,34 +36,94 @@ struct idt_ptr {
 static struct idt_entry idt[IDT_SIZE];
 static struct idt_ptr idtp;
 
-// Keyboard scancode to ASCII mapping
-static char scancode_to_ascii[] = {
-    0,   0,   '1', '2', '3', '4', '5', '6', '7', '8', '9', '0', '-', '=', '\b',
-    '\t', 'q', 'w', 'e', 'r', 't', 'y', 'u', 'i', 'o', 'p', '[', ']', '\n',
-    0,   'a', 's', 'd', 'f', 'g', 'h', 'j', 'k', 'l', ';', '\'', '`',
-    0,   '\\', 'z', 'x', 'c', 'v', 'b', 'n', 'm', ',', '.', '/', 0,
-    '*', 0, ' '
+// Keyboard: the ISR turns scancode set 1 into key events (keycode,
+// modifiers, press/release) with lookups only; characters are resolved
+// later, outside interrupt context. Plain keys keep their scancode as
+// keycode, E0-prefixed keys map to the KEY_* codes from 0x80 up.
+#define KEYMAP_SIZE 0x80
+
+// Characters per keycode, with numlock assumed on for the keypad
+static const char keymap_normal[KEYMAP_SIZE] =
+    "\0\x1b" "1234567890-=\b\t"             // 0x00
+    "qwertyuiop[]\n\0as"                    // 0x10
+    "dfghjkl;'`\0\\zxcv"                    // 0x20
+    "bnm,./\0*\0 \0\0\0\0\0\0"              // 0x30
+    "\0\0\0\0\0\0\0" "789-456+1230.";       // 0x40
+
+static const char keymap_shift[KEYMAP_SIZE] =
+    "\0\x1b" "!@#$%^&*()_+\b\t"
+    "QWERTYUIOP{}\n\0AS"
+    "DFGHJKL:\"~\0|ZXCV"
+    "BNM<>?\0*\0 \0\0\0\0\0\0"
+    "\0\0\0\0\0\0\0" "789-456+1230.";
+
+static const char keymap_caps[KEYMAP_SIZE] =
+    "\0\x1b" "1234567890-=\b\t"
+    "QWERTYUIOP[]\n\0AS"
+    "DFGHJKL;'`\0\\ZXCV"
+    "BNM,./\0*\0 \0\0\0\0\0\0"
+    "\0\0\0\0\0\0\0" "789-456+1230.";
+
+// Keycodes of E0-prefixed scancodes; 0 drops the key (e.g. the fake
+// shifts around Print Screen)
+static const uint8_t extended_keycodes[KEYMAP_SIZE] = {
+    [0x1C] = KEY_KP_ENTER, [0x1D] = KEY_RCTRL, [0x35] = KEY_KP_SLASH,
+    [0x37] = KEY_PRINT_SCREEN, [0x38] = KEY_RALT,
+    [0x47] = KEY_HOME, [0x48] = KEY_UP, [0x49] = KEY_PAGE_UP,
+    [0x4B] = KEY_LEFT, [0x4D] = KEY_RIGHT,
+    [0x4F] = KEY_END, [0x50] = KEY_DOWN, [0x51] = KEY_PAGE_DOWN,
+    [0x52] = KEY_INSERT, [0x53] = KEY_DELETE,
+    [0x5B] = KEY_LGUI, [0x5C] = KEY_RGUI, [0x5D] = KEY_MENU,
 };
 
-// Keyboard state
-static int shift_pressed = 0;
-static int caps_lock = 0;
-static int ctrl_pressed = 0;
-static int alt_pressed = 0;
+// Held-key bits of the modifier keys, indexed by keycode
+#define HELD_LSHIFT 0x01
+#define HELD_RSHIFT 0x02
+#define HELD_LCTRL  0x04
+#define HELD_RCTRL  0x08
+#define HELD_LALT   0x10
+#define HELD_RALT   0x20
 
-// Input buffer
-#define INPUT_BUFFER_SIZE 256
-static char input_buffer[INPUT_BUFFER_SIZE];
-static int input_index = 0;
+static const uint8_t modifier_bits[256] = {
+    [0x2A] = HELD_LSHIFT, [0x36] = HELD_RSHIFT, [0x1D] = HELD_LCTRL,
+    [0x38] = HELD_LALT, [KEY_RCTRL] = HELD_RCTRL, [KEY_RALT] = HELD_RALT,
+};
+
+// KEY_MOD_* flags for every combination of held modifier keys
+static const uint8_t held_to_modifiers[64] = {
+#define M(h) ((((h) & 0x03) ? KEY_MOD_SHIFT : 0) | (((h) & 0x0C) ? KEY_MOD_CTRL : 0) | \
+              (((h) & 0x30) ? KEY_MOD_ALT : 0))
+#define M4(h) M(h), M((h) + 1), M((h) + 2), M((h) + 3)
+#define M16(h) M4(h), M4((h) + 4), M4((h) + 8), M4((h) + 12)
+    M16(0), M16(16), M16(32), M16(48)
+#undef M16
+#undef M4
+#undef M
+};
+
+#define CAPS_LOCK_SCANCODE 0x3A
+#define E1_SEQUENCE_LENGTH 6        // Pause: E1 1D 45 E1 9D C5
 
-// External functions (from kernel.c)
-extern void terminal_putchar(char c);
-extern void terminal_writestring(const char* str);
-extern void printf(const char* format, ...);
+// Decoder state, only touched by the ISR
+static uint8_t keyboard_prefix;     // 0xE0 after an E0 byte
+static uint8_t keyboard_skip;       // Bytes of an E1 sequence still to come
+static uint8_t keyboard_held;       // HELD_* bits
+static uint8_t keyboard_caps;
+
+// Key events go from IRQ1 to the main loop through a lock-free
+// single-producer/single-consumer ring: only the ISR writes
+// key_head and only keyboard_process_input writes key_tail.
+// The indices run freely and are masked on access.
+#define KEY_RING_SIZE 256       // Must be a power of two
+static struct key_event key_ring[KEY_RING_SIZE];
+static volatile uint32_t key_head;
+static volatile uint32_t key_tail;
+static volatile uint32_t key_dropped;
+static struct task* input_reader;       // Task blocked in input_wait
 
 // Forward declarations
-void keyboard_handler(void);
-void handle_keyboard_input(uint8_t scancode);
+static void keyboard_handler(struct interrupt_frame* frame);
+static void keyboard_handle_event(struct key_event event);
 
 // Set an IDT entry
 void set_idt_entry(int num, uint32_t handler, uint16_t selector, uint8_t flags) {
@@ -96,10 +136,6 @@ void set_idt_entry(int num, uint32_t handler, uint16_t selector, uint8_t flags)
 
 // Initialize the PIC (Programmable Interrupt Controller)
 void init_pic(void) {
-    // Save masks
-    uint8_t mask1 = inb(PIC1_DATA);
-    uint8_t mask2 = inb(PIC2_DATA);
-    
     // Start initialization sequence
     outb(PIC1_COMMAND, 0x11);  // ICW1: Initialize
     outb(PIC2_COMMAND, 0x11);
@@ -116,12 +152,27 @@ void init_pic(void) {
     outb(PIC1_DATA, 0x01);     // 8086 mode
     outb(PIC2_DATA, 0x01);
     
-    // Restore masks (disable all interrupts initially)
-    outb(PIC1_DATA, 0xFF);
+    // Mask everything but the cascade; lines are unmasked as
+    // handlers get registered
+    outb(PIC1_DATA, 0xFB);
     outb(PIC2_DATA, 0xFF);
-    
-    // Enable keyboard interrupt (IRQ1)
-    outb(PIC1_DATA, 0xFD);     // Enable IRQ1 (keyboard)
+}
+
+// Let a PIC line through (IRQs on PIC2 also need the cascade on IRQ2)
+void irq_unmask(uint8_t irq) {
+    if (irq >= 8) {
+        outb(PIC2_DATA, inb(PIC2_DATA) & ~(1 << (irq - 8)));
+        irq = 2;
+    }
+    outb(PIC1_DATA, inb(PIC1_DATA) & ~(1 << irq));
+}
+
+void irq_mask(uint8_t irq) {
+    if (irq >= 8) {
+        outb(PIC2_DATA, inb(PIC2_DATA) | (1 << (irq - 8)));
+    } else {
+        outb(PIC1_DATA, inb(PIC1_DATA) | (1 << irq));
+    }
 }
 
 // Send End of Interrupt signal
@@ -132,35 +183,301 @@ void send_eoi(uint8_t irq) {
     outb(PIC1_COMMAND, PIC_EOI);
 }
 
-// Assembly wrapper for keyboard interrupt
+// One 16-byte stub per vector: push a dummy error code where the CPU
+// does not supply one, push the vector, and join the common path that
+// saves the rest of struct interrupt_frame and calls interrupt_dispatch
+// (the host test build has no IDT and gets isr_stubs from tests/stubs.c)
+#ifndef HOST_TEST
 asm(
-    ".global keyboard_interrupt_wrapper\n"
-    "keyboard_interrupt_wrapper:\n"
-    "    pusha\n"                    // Save all registers
-    "    call keyboard_handler\n"    // Call C handler
-    "    popa\n"                     // Restore registers
-    "    iret\n"                     // Return from interrupt
+    ".section .text\n"
+    ".balign 16\n"
+    ".global isr_stubs\n"
+    "isr_stubs:\n"
+    ".set isr_vector, 0\n"
+    ".rept 256\n"
+    "    .balign 16\n"
+    "    .if isr_vector != 8 && (isr_vector < 10 || isr_vector > 14) && isr_vector != 17 && isr_vector != 21 && isr_vector != 29 && isr_vector != 30\n"
+    "    push $0\n"
+    "    .endif\n"
+    "    push $isr_vector\n"
+    "    jmp interrupt_common\n"
+    "    .set isr_vector, isr_vector + 1\n"
+    ".endr\n"
+    "interrupt_common:\n"
+    "    pusha\n"
+    "    push %ds\n"
+    "    push %es\n"
+    "    push %fs\n"
+    "    push %gs\n"
+    "    mov $0x10, %ax\n"           // Kernel data segment
+    "    mov %ax, %ds\n"
+    "    mov %ax, %es\n"
+    "    cld\n"                      // C code expects DF clear
+    "    push %esp\n"                // struct interrupt_frame*
+    "    call interrupt_dispatch\n"
+    "    add $4, %esp\n"
+    "    pop %gs\n"
+    "    add $4, %esp\n"            // %fs belongs to the CPU, not the task
+    "    pop %es\n"
+    "    pop %ds\n"
+    "    popa\n"
+    "    add $8, %esp\n"             // Vector and error code
+    "    iret\n"
 );
+#endif
+
+extern uint8_t isr_stubs[];
+
+// Registered handlers, indexed by vector. interrupt_dispatch reads
+// them without a lock, RCU-style: interrupts cannot be preempted.
+static interrupt_handler_t interrupt_handlers[IDT_SIZE];
+
+// Per-CPU, per-vector statistics, kept by interrupt_dispatch. Times are
+// TSC cycles from entering interrupt_dispatch, which is as close to the
+// interrupt being raised as software gets; time spent with interrupts
+// off before that is not seen. 'eoi' is only known for PIC IRQs, which
+// get their EOI here rather than in the handler.
+struct irq_stat {
+    uint32_t count;
+    uint32_t spurious;          // PIC IRQ7/15 not in service, or no handler
+    uint64_t cycles;            // In the handler, summed
+    uint32_t max_cycles;
+    uint32_t max_eoi;           // Entry to EOI
+};
+
+static struct irq_stat irq_stats[SMP_MAX_CPUS][IDT_SIZE];
+
+static const char* exception_names[32] = {
+    "Divide error", "Debug", "NMI", "Breakpoint",
+    "Overflow", "BOUND range exceeded", "Invalid opcode", "Device not available",
+    "Double fault", "Coprocessor segment overrun", "Invalid TSS", "Segment not present",
+    "Stack-segment fault", "General protection fault", "Page fault", "Reserved",
+    "x87 floating-point exception", "Alignment check", "Machine check", "SIMD floating-point exception",
+    "Virtualization exception", "Control protection exception", "Reserved", "Reserved",
+    "Reserved", "Reserved", "Reserved", "Reserved",
+    "Hypervisor injection exception", "VMM communication exception", "Security exception", "Reserved"
+};
+
+// Once this returns, no CPU is still running a handler it replaced,
+// so the caller may tear down whatever that handler used
+void register_interrupt_handler(uint8_t vector, interrupt_handler_t handler) {
+    interrupt_handler_t old = interrupt_handlers[vector];
+    rcu_assign_pointer(interrupt_handlers[vector], handler);
+    if (old && old != handler) {
+        synchronize_rcu();
+    }
+}
+
+// Install a PIC IRQ handler and let the line through
+void register_irq_handler(uint8_t irq, interrupt_handler_t handler) {
+    register_interrupt_handler(IRQ_BASE + irq, handler);
+    irq_unmask(irq);
+}
+
+uint32_t spurious_irq_total(void) {
+    uint32_t total = 0;
+    for (size_t cpu = 0; cpu < smp_cpu_count(); cpu++) {
+        for (int vector = 0; vector < IDT_SIZE; vector++) {
+            total += irq_stats[cpu][vector].spurious;
+        }
+    }
+    return total;
+}
+
+void irq_stats_reset(void) {
+    memset(irq_stats, 0, sizeof(irq_stats));
+}
+
+static inline void irq_account(struct irq_stat* stat, uint64_t entry, uint64_t handled) {
+    uint32_t cycles = (uint32_t)(handled - entry);
+    stat->count++;
+    stat->cycles += cycles;
+    if (cycles > stat->max_cycles) {
+        stat->max_cycles = cycles;
+    }
+}
+
+static uint8_t pic_read_isr(uint16_t command_port) {
+    outb(command_port, PIC_READ_ISR);
+    return inb(command_port);
+}
+
+// IRQ7 and IRQ15 are also what a PIC reports when the request went
+// away before the CPU acknowledged it; such an IRQ is not in service
+// and must not get an EOI on its own PIC
+static int irq_is_spurious(uint8_t irq) {
+    if (irq == 7 && !(pic_read_isr(PIC1_COMMAND) & 0x80)) {
+        return 1;
+    }
+    if (irq == 15 && !(pic_read_isr(PIC2_COMMAND) & 0x80)) {
+        outb(PIC1_COMMAND, PIC_EOI);    // The cascade IRQ2 was real
+        return 1;
+    }
+    return 0;
+}
+
+// Report an exception nobody could handle and stop
+void exception_panic(struct interrupt_frame* frame) {
+    uintptr_t cr2;
+    asm volatile("mov %%cr2, %0" : "=r"(cr2));
+
+    terminal_setcolor(vga_entry_color(VGA_COLOR_WHITE, VGA_COLOR_RED));
+    printf("\nException %u (%s), error code 0x%x\n", frame->vector,
+           exception_names[frame->vector], frame->error_code);
+    printf("EIP=%08x CS=%04x EFLAGS=%08x CR2=%08x\n", frame->eip,
+           frame->cs, frame->eflags, (uint32_t)cr2);
+    printf("EAX=%08x EBX=%08x ECX=%08x EDX=%08x\n", frame->eax,
+           frame->ebx, frame->ecx, frame->edx);
+    printf("ESI=%08x EDI=%08x EBP=%08x\n", frame->esi,
+           frame->edi, frame->ebp);
+    kernel_panic(exception_names[frame->vector]);
+}
+
+// Common C entry for every vector. Statistics are taken before
+// sched_preempt, which may switch to another task.
+ASMLINKAGE void interrupt_dispatch(struct interrupt_frame* frame) {
+    uint64_t entry = rdtsc();
+    uint32_t vector = frame->vector;
+    interrupt_handler_t handler = rcu_dereference(interrupt_handlers[vector]);
+    struct cpu* cpu = this_cpu();
+    struct irq_stat* stat = &irq_stats[cpu->index][vector];
+
+    if (vector < 32) {
+        if (handler) {
+            handler(frame);
+            irq_account(stat, entry, rdtsc());
+        } else {
+            exception_panic(frame);
+        }
+        return;
+    }
+
+    if (vector < IRQ_BASE + IRQ_COUNT) {
+        uint8_t irq = vector - IRQ_BASE;
+        if (irq_is_spurious(irq)) {
+            stat->spurious++;
+            return;
+        }
+        cpu->interrupt_depth++;
+        if (handler) {
+            handler(frame);
+        } else {
+            stat->spurious++;
+        }
+        uint64_t handled = rdtsc();
+        send_eoi(irq);
+        uint32_t eoi = (uint32_t)(rdtsc() - entry);
+        cpu->interrupt_depth--;
+        irq_account(stat, entry, handled);
+        if (eoi > stat->max_eoi) {
+            stat->max_eoi = eoi;
+        }
+        sched_preempt();
+        return;
+    }
+
+    // Local APIC and software vectors acknowledge in their own handlers
+    cpu->interrupt_depth++;
+    if (handler) {
+        handler(frame);
+    } else {
+        stat->spurious++;
+    }
+    cpu->interrupt_depth--;
+    irq_account(stat, entry, rdtsc());
+    sched_preempt();
+}
+
+static void vector_name(uint32_t vector, char* name, size_t size) {
+    if (vector < 32) {
+        ksnprintf(name, size, "%s", exception_names[vector]);
+    } else if (vector < IRQ_BASE + IRQ_COUNT) {
+        ksnprintf(name, size, "IRQ%u%s", vector - IRQ_BASE,
+                  vector - IRQ_BASE == KEYBOARD_IRQ ? " keyboard" : "");
+    } else if (vector == LAPIC_TIMER_VECTOR) {
+        ksnprintf(name, size, "LAPIC timer");
+    } else if (vector == SMP_RESCHEDULE_VECTOR) {
+        ksnprintf(name, size, "Reschedule IPI");
+    } else if (vector == LAPIC_SPURIOUS_VECTOR) {
+        ksnprintf(name, size, "LAPIC spurious");
+    } else {
+        ksnprintf(name, size, "Vector %u", vector);
+    }
+}
+
+// irqstat [reset]: every vector taken since boot or the last reset,
+// summed over CPUs; times are TSC cycles
+static void cmd_irqstat(int argc, char** argv) {
+    if (argc > 1) {
+        if (strcmp(argv[1], "reset") != 0) {
+            printf("Usage: irqstat [reset]\n");
+            return;
+        }
+        irq_stats_reset();
+        printf("IRQ statistics reset\n");
+        return;
+    }
+
+    printf("Vec  Name                     Count  Spurious   Avg cyc   Max cyc   Max EOI\n");
+    for (int vector = 0; vector < IDT_SIZE; vector++) {
+        struct irq_stat sum = { 0, 0, 0, 0, 0 };
+        for (size_t i = 0; i < smp_cpu_count(); i++) {
+            const struct irq_stat* stat = &irq_stats[i][vector];
+            sum.count += stat->count;
+            sum.spurious += stat->spurious;
+            sum.cycles += stat->cycles;
+            if (stat->max_cycles > sum.max_cycles) {
+                sum.max_cycles = stat->max_cycles;
+            }
+            if (stat->max_eoi > sum.max_eoi) {
+                sum.max_eoi = stat->max_eoi;
+            }
+        }
+        if (!sum.count && !sum.spurious) {
+            continue;
+        }
+
+        char name[24];
+        vector_name(vector, name, sizeof(name));
+        uint32_t avg = sum.count ? (uint32_t)div64_u32(sum.cycles, sum.count, NULL) : 0;
+        printf("%3u  %-22s %8u %9u %9u %9u", vector, name, sum.count, sum.spurious, avg,
+               sum.max_cycles);
+        if (sum.max_eoi) {
+            printf(" %9u\n", sum.max_eoi);
+        } else {
+            printf("         -\n");
+        }
+    }
+    if (tsc_khz()) {
+        printf("TSC: %u kHz\n", tsc_khz());
+    }
+}
 
-// External declaration for assembly wrapper
-extern void keyboard_interrupt_wrapper(void);
+// True while a device interrupt handler is running on this CPU
+int in_interrupt(void) {
+    return this_cpu_read(interrupt_depth) != 0;
+}
 
 // Initialize IDT
 void init_idt(void) {
     // Set up IDT pointer
     idtp.limit = sizeof(idt) - 1;
-    idtp.base = (uint32_t)&idt;
+    idtp.base = (uintptr_t)&idt;
     
-    // Clear IDT
+    // Every vector gets its stub; unhandled ones end up in
+    // interrupt_dispatch instead of triple-faulting
     for (int i = 0; i < IDT_SIZE; i++) {
-        set_idt_entry(i, 0, 0, 0);
+        set_idt_entry(i, (uintptr_t)(isr_stubs + i * ISR_STUB_SIZE), 0x08, 0x8E);
     }
     
-    // Set keyboard interrupt handler (IRQ1 = interrupt 33)
-    set_idt_entry(33, (uint32_t)keyboard_interrupt_wrapper, 0x08, 0x8E);
-    
-    // Load IDT
+    idt_load();
+}
+
+// Every CPU shares the one IDT
+void idt_load(void) {
+#ifndef HOST_TEST
     asm volatile("lidt %0" : : "m"(idtp));
+#endif
 }
 
 // Initialize interrupt system
@@ -172,165 +489,139 @@ void init_interrupts(void) {
     
     // Initialize PIC
     init_pic();
+    register_irq_handler(KEYBOARD_IRQ, keyboard_handler);
+    shell_register_command("irqstat", cmd_irqstat, "Interrupt counts and handler cycles (irqstat [reset])");
     
     // Enable interrupts
-    asm volatile("sti");
+    irq_enable();
     
     printf("Interrupts enabled!\n");
 }
 
-// Keyboard interrupt handler
-void keyboard_handler(void) {
-    uint8_t scancode = inb(0x60);  // Read scancode from keyboard port
-    handle_keyboard_input(scancode);
-    send_eoi(KEYBOARD_IRQ);        // Send End of Interrupt
+static void keyboard_push(uint8_t keycode, uint8_t released) {
+    uint32_t head = key_head;
+    if (head - key_tail < KEY_RING_SIZE) {
+        struct key_event* event = &key_ring[head & (KEY_RING_SIZE - 1)];
+        event->keycode = keycode;
+        event->modifiers = held_to_modifiers[keyboard_held] | keyboard_caps;
+        event->released = released;
+        ring_barrier();
+        key_head = head + 1;    // Publish only after the slot is written
+    } else {
+        key_dropped++;
+    }
 }
 
-// Convert character to uppercase
-char to_upper(char c) {
-    if (c >= 'a' && c <= 'z') {
-        return c - 'a' + 'A';
+// Keyboard interrupt handler: decode the scancode into a key event and
+// return, the shell runs later from the main loop
+static void keyboard_handler(struct interrupt_frame* frame) {
+    UNUSED(frame);
+    uint64_t start = TRACE_BEGIN();
+    TRACE(TRACE_IRQ_ENTER, KEYBOARD_IRQ, 0);
+    uint8_t scancode = inb(0x60);  // Read scancode from keyboard port
+
+    if (keyboard_skip) {
+        keyboard_skip--;
+    } else if (scancode == 0xE0) {
+        keyboard_prefix = 0xE0;
+    } else if (scancode == 0xE1) {
+        // Pause has no release code; report it once and eat the rest
+        keyboard_skip = E1_SEQUENCE_LENGTH - 1;
+        keyboard_push(KEY_PAUSE, 0);
+    } else {
+        uint8_t released = scancode >> 7;
+        uint8_t code = scancode & 0x7F;
+        uint8_t keycode = keyboard_prefix ? extended_keycodes[code] : code;
+        keyboard_prefix = 0;
+
+        uint8_t bit = modifier_bits[keycode];
+        keyboard_held = released ? keyboard_held & ~bit : keyboard_held | bit;
+        if (keycode == CAPS_LOCK_SCANCODE && !released) {
+            keyboard_caps ^= KEY_MOD_CAPS;
+        }
+        if (keycode) {
+            keyboard_push(keycode, released);
+        }
     }
-    return c;
+
+    input_wake();
+    TRACE_END(TRACE_IRQ_EXIT, KEYBOARD_IRQ, start);
 }
 
-// Convert character to lowercase
-char to_lower(char c) {
-    if (c >= 'A' && c <= 'Z') {
-        return c - 'A' + 'a';
-    }
-    return c;
+// True when key events are waiting in the ring
+int keyboard_has_input(void) {
+    return key_head != key_tail;
 }
 
-// Handle keyboard input
-void handle_keyboard_input(uint8_t scancode) {
-    // Check for key release (high bit set)
-    if (scancode & 0x80) {
-        // Key released
-        scancode &= 0x7F;  // Remove release bit
-        
-        // Handle modifier key releases
-        switch (scancode) {
-            case 0x2A: case 0x36: // Shift
-                shift_pressed = 0;
-                break;
-            case 0x1D: // Ctrl
-                ctrl_pressed = 0;
-                break;
-            case 0x38: // Alt
-                alt_pressed = 0;
-                break;
-        }
-        return;
+// Run the input handler for every queued key event (main loop only)
+void keyboard_process_input(void) {
+    uint32_t tail = key_tail;
+    while (tail != key_head) {
+        ring_barrier();
+        struct key_event event = key_ring[tail & (KEY_RING_SIZE - 1)];
+        ring_barrier();
+        key_tail = ++tail;      // Hand the slot back before the slow part
+        keyboard_handle_event(event);
     }
-    
-    // Handle special keys
-    switch (scancode) {
-        case 0x2A: case 0x36: // Shift
-            shift_pressed = 1;
-            return;
-        case 0x1D: // Ctrl
-            ctrl_pressed = 1;
-            return;
-        case 0x38: // Alt
-            alt_pressed = 1;
-            return;
-        case 0x3A: // Caps Lock
-            caps_lock = !caps_lock;
-            return;
-        case 0x0E: // Backspace
-            if (input_index > 0) {
-                input_index--;
-                input_buffer[input_index] = '\0';
-                terminal_putchar('\b');
-                terminal_putchar(' ');
-                terminal_putchar('\b');
-            }
-            return;
-        case 0x1C: // Enter
-            input_buffer[input_index] = '\0';
-            terminal_putchar('\n');
-            process_command(input_buffer);
-            input_index = 0;
-            show_prompt();
-            return;
+}
+
+// Block the calling task until a key or a serial character is queued
+void input_wait(void) {
+    input_reader = current_task();
+    while (!keyboard_has_input() && !serial_has_input()) {
+        sched_block();
     }
-    
-    // Convert scancode to ASCII
-    if (scancode < sizeof(scancode_to_ascii)) {
-        char c = scancode_to_ascii[scancode];
-        if (c != 0) {
-            // Handle shift and caps lock
-            if (shift_pressed) {
-                // Shift pressed - handle special characters
-                switch (c) {
-                    case '1': c = '!'; break;
-                    case '2': c = '@'; break;
-                    case '3': c = '#'; break;
-                    case '4': c = '$'; break;
-                    case '5': c = '%'; break;
-                    case '6': c = '^'; break;
-                    case '7': c = '&'; break;
-                    case '8': c = '*'; break;
-                    case '9': c = '('; break;
-                    case '0': c = ')'; break;
-                    case '-': c = '_'; break;
-                    case '=': c = '+'; break;
-                    case '[': c = '{'; break;
-                    case ']': c = '}'; break;
-                    case ';': c = ':'; break;
-                    case '\'': c = '"'; break;
-                    case '`': c = '~'; break;
-                    case '\\': c = '|'; break;
-                    case ',': c = '<'; break;
-                    case '.': c = '>'; break;
-                    case '/': c = '?'; break;
-                    default:
-                        if (c >= 'a' && c <= 'z') {
-                            c = to_upper(c);
-                        }
-                        break;
-                }
-            } else if (caps_lock && c >= 'a' && c <= 'z') {
-                c = to_upper(c);
-            }
-            
-            // Handle Ctrl combinations
-            if (ctrl_pressed) {
-                switch (c) {
-                    case 'c': case 'C':
-                        terminal_writestring("^C\n");
-                        input_index = 0;
-                        show_prompt();
-                        return;
-                    case 'l': case 'L':
-                        clear_screen();
-                        show_prompt();
-                        return;
-                }
-            }
-            
-            // Add character to input buffer
-            if (input_index < INPUT_BUFFER_SIZE - 1) {
-                input_buffer[input_index++] = c;
-                terminal_putchar(c);
-            }
-        }
+}
+
+// Wake the task in input_wait; called by the input interrupt handlers
+void input_wake(void) {
+    if (input_reader) {
+        sched_wake(input_reader);
     }
 }
 
-// Get current input buffer
-char* get_input_buffer(void) {
-    return input_buffer;
+// Key events lost because the ring was full
+uint32_t keyboard_dropped_count(void) {
+    return key_dropped;
 }
 
-// Clear input buffer
-void clear_input_buffer(void) {
-    input_index = 0;
-    input_buffer[0] = '\0';
+// Character for a key press given the modifiers. Returns 0 for keys
+// without one; editing keys are passed through as their KEY_* code.
+int keyboard_translate(struct key_event event) {
+    uint8_t keycode = event.keycode;
+    if (keycode >= KEYMAP_SIZE) {
+        switch (keycode) {
+            case KEY_KP_ENTER: return '\n';
+            case KEY_KP_SLASH: return '/';
+            case KEY_RCTRL: case KEY_RALT: case KEY_LGUI: case KEY_RGUI:
+            case KEY_PRINT_SCREEN: case KEY_PAUSE:
+                return 0;
+            default:
+                return keycode;
+        }
+    }
+
+    int shift = event.modifiers & KEY_MOD_SHIFT;
+    int caps = event.modifiers & KEY_MOD_CAPS;
+    const char* map = shift ? keymap_shift : caps ? keymap_caps : keymap_normal;
+    if (shift && caps && keymap_caps[keycode] != keymap_normal[keycode]) {
+        map = keymap_normal;    // Shift undoes caps lock on letters
+    }
+    char c = map[keycode];
+
+    // Ctrl+letter gives the ASCII control character
+    if ((event.modifiers & KEY_MOD_CTRL) && keymap_caps[keycode] != keymap_normal[keycode]) {
+        c = keymap_caps[keycode] - 'A' + 1;
+    }
+    return (uint8_t)c;
 }
 
-// Check if input buffer is empty
-int is_input_empty(void) {
-    return input_index == 0;
-}
\ No newline at end of file
+static void keyboard_handle_event(struct key_event event) {
+    if (event.released) {
+        return;
+    }
+    int c = keyboard_translate(event);
+    if (c) {
+        shell_input_char(c);
+    }
+}
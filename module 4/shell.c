@@ -3,66 +3,7 @@
  * Provides basic commands and user interaction
  */
 
-// Define our own types since we can't use standard library
-typedef unsigned char uint8_t;
-typedef unsigned short uint16_t;
-typedef unsigned int uint32_t;
-typedef unsigned long long uint64_t;
-typedef signed char int8_t;
-typedef signed short int16_t;
-typedef signed int int32_t;
-typedef signed long long int64_t;
-typedef uint32_t size_t;
-typedef uint32_t uintptr_t;
-
-#define NULL ((void*)0)
-
-// External functions
-extern void terminal_putchar(char c);
-extern void terminal_writestring(const char* str);
-extern void printf(const char* format, ...);
-extern void terminal_initialize(void);
-extern void terminal_setcolor(uint8_t color);
-extern void print_memory_info(void);
-extern void* kmalloc(size_t size);
-extern void kfree(void* ptr);
-extern size_t strlen(const char* str);
-extern void kernel_panic(const char* message);
-
-// VGA colors
-#define VGA_COLOR_BLACK 0
-#define VGA_COLOR_BLUE 1
-#define VGA_COLOR_GREEN 2
-#define VGA_COLOR_CYAN 3
-#define VGA_COLOR_RED 4
-#define VGA_COLOR_MAGENTA 5
-#define VGA_COLOR_BROWN 6
-#define VGA_COLOR_LIGHT_GREY 7
-#define VGA_COLOR_DARK_GREY 8
-#define VGA_COLOR_LIGHT_BLUE 9
-#define VGA_COLOR_LIGHT_GREEN 10
-#define VGA_COLOR_LIGHT_CYAN 11
-#define VGA_COLOR_LIGHT_RED 12
-#define VGA_COLOR_LIGHT_MAGENTA 13
-#define VGA_COLOR_YELLOW 14
-#define VGA_COLOR_WHITE 15
-
-// Helper function to create VGA color
-static inline uint8_t vga_entry_color(uint8_t fg, uint8_t bg) {
-    return fg | bg << 4;
-}
-
-// String comparison function
-int strcmp(const char* str1, const char* str2) {
-    while (*str1 && *str2) {
-        if (*str1 != *str2) {
-            return *str1 - *str2;
-        }
-        str1++;
-        str2++;
-    }
-    return *str1 - *str2;
-}
+#include "kernel.h"
 
 // String comparison function (case insensitive)
 int strcmpi(const char* str1, const char* str2) {
@@ -101,80 +42,243 @@ int starts_with(const char* str, const char* prefix) {
     return 1;
 }
 
-// Simple tokenizer - splits command line into arguments
-#define MAX_ARGS 16
-static char* args[MAX_ARGS];
-static int arg_count = 0;
+// Tokenizer: a command line is split into commands at ';' and '|', and
+// each command into arguments. Arguments are separated by blanks; quotes
+// ('...' literal, "..." with escapes) and backslash escapes keep blanks
+// and separators inside one argument. Arguments are views into the
+// line, which is never modified; everything lives in a per-call
+// shell_invocation, so commands may run process_command themselves.
+#define SHELL_LINE_SIZE 256
+#define SHELL_MAX_ARGS 32
 
-void tokenize_command(char* input) {
-    arg_count = 0;
-    char* current = input;
-    
-    while (*current && arg_count < MAX_ARGS - 1) {
-        // Skip whitespace
-        while (*current == ' ' || *current == '\t') {
-            current++;
+struct shell_arg {
+    const char* text;           // Start within the command line
+    size_t len;                 // Length in the line, quotes included
+    int quoted;                 // Quotes or escapes still to be removed
+};
+
+struct shell_invocation {
+    struct shell_arg args[SHELL_MAX_ARGS];
+    int argc;
+    char* argv[SHELL_MAX_ARGS + 1];     // What handlers get
+    char strings[SHELL_LINE_SIZE + SHELL_MAX_ARGS];
+};
+
+#define SHELL_PARSE_UNTERMINATED -1
+#define SHELL_PARSE_TOO_MANY     -2
+
+static inline int shell_is_blank(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+// Parse the command at *cursor into 'inv' and advance past its
+// separator. Returns the separator ('\0', ';' or '|') or an error.
+static int shell_parse(const char** cursor, struct shell_invocation* inv) {
+    const char* p = *cursor;
+    inv->argc = 0;
+
+    for (;;) {
+        while (shell_is_blank(*p)) {
+            p++;
         }
-        
-        if (*current == '\0') break;
-        
-        // Start of argument
-        args[arg_count++] = current;
-        
-        // Find end of argument
-        while (*current && *current != ' ' && *current != '\t') {
-            current++;
+        if (*p == '\0' || *p == ';' || *p == '|') {
+            break;
         }
-        
-        // Null-terminate argument
-        if (*current) {
-            *current = '\0';
-            current++;
+        if (inv->argc == SHELL_MAX_ARGS) {
+            return SHELL_PARSE_TOO_MANY;
+        }
+
+        struct shell_arg* arg = &inv->args[inv->argc++];
+        arg->text = p;
+        arg->quoted = 0;
+        char quote = 0;
+        for (; *p; p++) {
+            char c = *p;
+            if (quote) {
+                if (c == quote) {
+                    quote = 0;
+                } else if (c == '\\' && quote == '"' && p[1]) {
+                    p++;
+                }
+            } else if (c == '\'' || c == '"') {
+                quote = c;
+                arg->quoted = 1;
+            } else if (c == '\\') {
+                arg->quoted = 1;
+                if (p[1]) {
+                    p++;
+                }
+            } else if (shell_is_blank(c) || c == ';' || c == '|') {
+                break;
+            }
         }
+        if (quote) {
+            return SHELL_PARSE_UNTERMINATED;
+        }
+        arg->len = p - arg->text;
     }
-    
-    args[arg_count] = NULL;
+
+    int separator = *p;
+    if (separator) {
+        p++;
+    }
+    *cursor = p;
+    return separator;
+}
+
+// NUL-terminated copies of the argument views, quotes and escapes removed
+static void shell_build_argv(struct shell_invocation* inv) {
+    char* out = inv->strings;
+    for (int i = 0; i < inv->argc; i++) {
+        const struct shell_arg* arg = &inv->args[i];
+        inv->argv[i] = out;
+        if (!arg->quoted) {
+            memcpy(out, arg->text, arg->len);
+            out += arg->len;
+        } else {
+            char quote = 0;
+            for (size_t j = 0; j < arg->len; j++) {
+                char c = arg->text[j];
+                if (quote && c == quote) {
+                    quote = 0;
+                } else if (!quote && (c == '\'' || c == '"')) {
+                    quote = c;
+                } else if (c == '\\' && quote != '\'' && j + 1 < arg->len) {
+                    *out++ = arg->text[++j];
+                } else {
+                    *out++ = c;
+                }
+            }
+        }
+        *out++ = '\0';
+    }
+    inv->argv[inv->argc] = NULL;
+}
+
+// Command registry: commands live in registration order in
+// shell_commands (which is what help lists), and an open-addressing
+// table indexed by a case-insensitive FNV-1a hash of the name finds
+// them in O(1)
+#define SHELL_MAX_COMMANDS 64
+#define SHELL_HASH_SIZE 128         // Power of two, at most half full
+#define SHELL_HELP_COLUMN 10
+
+struct shell_command {
+    const char* name;
+    shell_command_fn handler;
+    const char* help;
+};
+
+// Commands are never removed. Registration fills in an entry before
+// publishing it in the hash table and the count, so lookups need no
+// lock; writers serialize on shell_register_lock.
+static struct shell_command shell_commands[SHELL_MAX_COMMANDS];
+static int shell_command_count = 0;
+static uint8_t shell_hash_table[SHELL_HASH_SIZE];   // Index + 1, 0 = empty
+static spinlock_t shell_register_lock = SPINLOCK_INIT("commands");
+
+static inline char to_lower_ascii(char c) {
+    return (c >= 'A' && c <= 'Z') ? c + 32 : c;
+}
+
+static uint32_t shell_hash(const char* name) {
+    uint32_t hash = 2166136261u;
+    while (*name) {
+        hash ^= (uint8_t)to_lower_ascii(*name++);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Slot holding 'name', or the empty slot where it would go
+static uint32_t shell_hash_slot(const char* name) {
+    uint32_t slot = shell_hash(name) & (SHELL_HASH_SIZE - 1);
+    while (shell_hash_table[slot] &&
+           strcmpi(shell_commands[shell_hash_table[slot] - 1].name, name) != 0) {
+        slot = (slot + 1) & (SHELL_HASH_SIZE - 1);
+    }
+    return slot;
+}
+
+static const struct shell_command* shell_find_command(const char* name) {
+    uint8_t entry = rcu_dereference(shell_hash_table[shell_hash_slot(name)]);
+    return entry ? &shell_commands[entry - 1] : NULL;
+}
+
+// Add a command; returns 0, or -1 when the name is taken or the table is full
+int shell_register_command(const char* name, shell_command_fn handler, const char* help) {
+    uint32_t flags = spin_lock_irqsave(&shell_register_lock);
+    uint32_t slot = shell_hash_slot(name);
+    if (shell_command_count == SHELL_MAX_COMMANDS || shell_hash_table[slot]) {
+        spin_unlock_irqrestore(&shell_register_lock, flags);
+        return -1;
+    }
+
+    struct shell_command* command = &shell_commands[shell_command_count];
+    command->name = name;
+    command->handler = handler;
+    command->help = help;
+    rcu_assign_pointer(shell_hash_table[slot], shell_command_count + 1);
+    rcu_assign_pointer(shell_command_count, shell_command_count + 1);
+    spin_unlock_irqrestore(&shell_register_lock, flags);
+    return 0;
 }
 
 // Built-in commands
-void cmd_help(void) {
+void cmd_help(int argc, char** argv) {
+    UNUSED(argc);
+    UNUSED(argv);
+
     printf("Available commands:\n");
-    printf("  help      - Show this help message\n");
-    printf("  clear     - Clear the screen\n");
-    printf("  echo      - Echo arguments\n");
-    printf("  meminfo   - Show memory information\n");
-    printf("  memtest   - Test memory allocator\n");
-    printf("  color     - Change text color\n");
-    printf("  about     - Show system information\n");
-    printf("  panic     - Trigger kernel panic (for testing)\n");
-    printf("  reboot    - Reboot the system\n");
-    printf("  shutdown  - Shutdown the system\n");
-}
-
-void cmd_clear(void) {
+    for (int i = 0; i < shell_command_count; i++) {
+        printf("  %-*s- %s\n", SHELL_HELP_COLUMN, shell_commands[i].name,
+               shell_commands[i].help);
+    }
+}
+
+void cmd_clear(int argc, char** argv) {
+    UNUSED(argc);
+    UNUSED(argv);
     terminal_initialize();
 }
 
-void cmd_echo(void) {
-    for (int i = 1; i < arg_count; i++) {
+// Does nothing; a cheap command for scripts and the dispatch benchmark
+void cmd_true(int argc, char** argv) {
+    UNUSED(argc);
+    UNUSED(argv);
+}
+
+void cmd_echo(int argc, char** argv) {
+    for (int i = 1; i < argc; i++) {
         if (i > 1) printf(" ");
-        printf("%s", args[i]);
+        printf("%s", argv[i]);
     }
     printf("\n");
 }
 
-void cmd_meminfo(void) {
+void cmd_meminfo(int argc, char** argv) {
+    int verbose = argc > 1 && strcmp(argv[1], "-v") == 0;
+    if (argc > 1 && !verbose) {
+        printf("Usage: meminfo [-v]\n");
+        return;
+    }
     print_memory_info();
+    if (verbose) {
+        print_heap_profile();
+    }
 }
 
-void cmd_memtest(void) {
+void cmd_memtest(int argc, char** argv) {
+    UNUSED(argc);
+    UNUSED(argv);
+
     printf("Testing memory allocator...\n");
     
     // Test 1: Basic allocation
     printf("Test 1: Basic allocation\n");
     void* ptr1 = kmalloc(100);
     if (ptr1) {
-        printf("  Allocated 100 bytes at 0x%x\n", (uint32_t)ptr1);
+        printf("  Allocated 100 bytes at %p\n", ptr1);
     } else {
         printf("  Failed to allocate 100 bytes\n");
         return;
@@ -188,8 +292,7 @@ void cmd_memtest(void) {
     
     if (ptr2 && ptr3 && ptr4) {
         printf("  Allocated multiple blocks successfully\n");
-        printf("  Block 1: 0x%x, Block 2: 0x%x, Block 3: 0x%x\n", 
-               (uint32_t)ptr2, (uint32_t)ptr3, (uint32_t)ptr4);
+        printf("  Block 1: %p, Block 2: %p, Block 3: %p\n", ptr2, ptr3, ptr4);
     } else {
         printf("  Failed to allocate multiple blocks\n");
     }
@@ -198,16 +301,25 @@ void cmd_memtest(void) {
     printf("Test 3: Large allocation\n");
     void* ptr5 = kmalloc(1024);
     if (ptr5) {
-        printf("  Allocated 1024 bytes at 0x%x\n", (uint32_t)ptr5);
+        printf("  Allocated 1024 bytes at %p\n", ptr5);
     } else {
         printf("  Failed to allocate 1024 bytes\n");
     }
+
+    // Test 4: Everything goes back
+    printf("Test 4: Free\n");
+    kfree(ptr1);
+    kfree(ptr2);
+    kfree(ptr3);
+    kfree(ptr4);
+    kfree(ptr5);
+    printf("  Freed all blocks\n");
     
     printf("Memory test completed!\n");
 }
 
-void cmd_color(void) {
-    if (arg_count < 2) {
+void cmd_color(int argc, char** argv) {
+    if (argc < 2) {
         printf("Usage: color <color_name>\n");
         printf("Available colors: red, green, blue, yellow, cyan, magenta, white, grey\n");
         return;
@@ -215,32 +327,62 @@ void cmd_color(void) {
     
     uint8_t color = vga_entry_color(VGA_COLOR_LIGHT_GREY, VGA_COLOR_BLACK);
     
-    if (strcmpi(args[1], "red") == 0) {
+    if (strcmpi(argv[1], "red") == 0) {
         color = vga_entry_color(VGA_COLOR_LIGHT_RED, VGA_COLOR_BLACK);
-    } else if (strcmpi(args[1], "green") == 0) {
+    } else if (strcmpi(argv[1], "green") == 0) {
         color = vga_entry_color(VGA_COLOR_LIGHT_GREEN, VGA_COLOR_BLACK);
-    } else if (strcmpi(args[1], "blue") == 0) {
+    } else if (strcmpi(argv[1], "blue") == 0) {
         color = vga_entry_color(VGA_COLOR_LIGHT_BLUE, VGA_COLOR_BLACK);
-    } else if (strcmpi(args[1], "yellow") == 0) {
+    } else if (strcmpi(argv[1], "yellow") == 0) {
         color = vga_entry_color(VGA_COLOR_YELLOW, VGA_COLOR_BLACK);
-    } else if (strcmpi(args[1], "cyan") == 0) {
+    } else if (strcmpi(argv[1], "cyan") == 0) {
         color = vga_entry_color(VGA_COLOR_LIGHT_CYAN, VGA_COLOR_BLACK);
-    } else if (strcmpi(args[1], "magenta") == 0) {
+    } else if (strcmpi(argv[1], "magenta") == 0) {
         color = vga_entry_color(VGA_COLOR_LIGHT_MAGENTA, VGA_COLOR_BLACK);
-    } else if (strcmpi(args[1], "white") == 0) {
+    } else if (strcmpi(argv[1], "white") == 0) {
         color = vga_entry_color(VGA_COLOR_WHITE, VGA_COLOR_BLACK);
-    } else if (strcmpi(args[1], "grey") == 0) {
+    } else if (strcmpi(argv[1], "grey") == 0) {
         color = vga_entry_color(VGA_COLOR_LIGHT_GREY, VGA_COLOR_BLACK);
     } else {
-        printf("Unknown color: %s\n", args[1]);
+        printf("Unknown color: %s\n", argv[1]);
         return;
     }
     
     terminal_setcolor(color);
-    printf("Color changed to %s\n", args[1]);
+    printf("Color changed to %s\n", argv[1]);
 }
 
-void cmd_about(void) {
+// Show or switch the terminal output sinks
+void cmd_console(int argc, char** argv) {
+    if (argc < 2) {
+        for (struct terminal_sink* sink = terminal_sink_list(); sink; sink = sink->next) {
+            printf("  %-8s %s\n", sink->name, sink->enabled ? "on" : "off");
+        }
+        return;
+    }
+
+    int enabled_count = 0;
+    int found = 0;
+    for (struct terminal_sink* sink = terminal_sink_list(); sink; sink = sink->next) {
+        int enable = strcmpi(argv[1], "both") == 0 || strcmpi(argv[1], sink->name) == 0;
+        found |= enable;
+        enabled_count += enable;
+    }
+    if (!found) {
+        printf("Usage: console [vga|serial|fb|both]\n");
+        return;
+    }
+
+    for (struct terminal_sink* sink = terminal_sink_list(); sink; sink = sink->next) {
+        sink->enabled = strcmpi(argv[1], "both") == 0 || strcmpi(argv[1], sink->name) == 0;
+    }
+    printf("Console output: %s (%d sink%s)\n", argv[1], enabled_count, enabled_count == 1 ? "" : "s");
+}
+
+void cmd_about(int argc, char** argv) {
+    UNUSED(argc);
+    UNUSED(argv);
+
     printf("MyOS - A Simple Operating System\n");
     printf("Version: 0.1.0\n");
     printf("Author: OS Developer\n");
@@ -254,18 +396,21 @@ void cmd_about(void) {
     printf("\nThis is a minimal kernel for educational purposes.\n");
 }
 
-void cmd_panic(void) {
-    if (arg_count > 1) {
-        kernel_panic(args[1]);
+void cmd_panic(int argc, char** argv) {
+    if (argc > 1) {
+        kernel_panic(argv[1]);
     } else {
         kernel_panic("User-requested panic for testing");
     }
 }
 
-void cmd_reboot(void) {
+void cmd_reboot(int argc, char** argv) {
+    UNUSED(argc);
+    UNUSED(argv);
+
     printf("Rebooting system...\n");
-    // Wait a moment
-    for (volatile int i = 0; i < 10000000; i++);
+    // Give the message a moment on screen
+    sleep_ms(500);
     
     // Reboot via keyboard controller
     uint8_t good = 0x02;
@@ -274,12 +419,26 @@ void cmd_reboot(void) {
     }
     outb(0x64, 0xFE);
     
-    // If that fails, try triple fault
-    asm volatile("int $0x00");
+    // If that fails, triple fault: with an empty IDT the exception
+    // can't be delivered (the dispatcher would just report it)
+    struct {
+        uint16_t limit;
+        uint32_t base;
+    } __attribute__((packed)) empty_idt = { 0, 0 };
+    asm volatile("lidt %0; int $0x03" : : "m"(empty_idt));
 }
 
-void cmd_shutdown(void) {
+void cmd_shutdown(int argc, char** argv) {
+    UNUSED(argc);
+    UNUSED(argv);
+
     printf("Shutting down system...\n");
+    terminal_sync();
+
+    // ACPI power-off on QEMU (and older QEMU/Bochs), so batch runs exit
+    outw(0x604, 0x2000);
+    outw(0xB004, 0x2000);
+
     printf("It's now safe to power off your computer.\n");
     
     // Halt the CPU
@@ -289,17 +448,6 @@ void cmd_shutdown(void) {
     }
 }
 
-// Port I/O functions (needed for reboot)
-static inline void outb(uint16_t port, uint8_t value) {
-    asm volatile("outb %0, %1" : : "a"(value), "Nd"(port));
-}
-
-static inline uint8_t inb(uint16_t port) {
-    uint8_t ret;
-    asm volatile("inb %1, %0" : "=a"(ret) : "Nd"(port));
-    return ret;
-}
-
 // Show command prompt
 void show_prompt(void) {
     terminal_setcolor(vga_entry_color(VGA_COLOR_LIGHT_GREEN, VGA_COLOR_BLACK));
@@ -313,62 +461,471 @@ void clear_screen(void) {
     terminal_initialize();
 }
 
+// Run one parsed command; argv[argc] must be NULL
+void shell_execute(int argc, char** argv) {
+    const struct shell_command* command = shell_find_command(argv[0]);
+    if (command) {
+        uint64_t start = TRACE_BEGIN();
+        command->handler(argc, argv);
+        TRACE_END(TRACE_COMMAND, (uintptr_t)command->name, start);
+    } else {
+        printf("Unknown command: %s\n", argv[0]);
+        printf("Type 'help' for available commands.\n");
+    }
+}
+
 // Process a command
-void process_command(char* input) {
-    // Skip empty commands
-    if (!input || *input == '\0') {
+void process_command(const char* input) {
+    if (!input) {
         return;
     }
-    
-    // Remove trailing whitespace
-    char* end = input + strlen(input) - 1;
-    while (end > input && (*end == ' ' || *end == '\t' || *end == '\n')) {
-        *end = '\0';
-        end--;
+    // Arguments are copied out, so a line fits the per-call storage
+    if (strlen(input) >= SHELL_LINE_SIZE) {
+        printf("Command line too long (max %d characters)\n", SHELL_LINE_SIZE - 1);
+        return;
     }
-    
-    // Skip empty commands after trimming
-    if (*input == '\0') {
+
+    struct shell_invocation inv;
+    const char* cursor = input;
+    int separator;
+    do {
+        separator = shell_parse(&cursor, &inv);
+        if (separator == SHELL_PARSE_UNTERMINATED) {
+            printf("Unterminated quote\n");
+            return;
+        }
+        if (separator == SHELL_PARSE_TOO_MANY) {
+            printf("Too many arguments (max %d)\n", SHELL_MAX_ARGS);
+            return;
+        }
+        if (separator == '|') {
+            // Commands print straight to the terminal; there is no
+            // output stream to connect yet
+            printf("Pipes are not supported\n");
+            return;
+        }
+        if (inv.argc == 0) {
+            continue;
+        }
+
+        shell_build_argv(&inv);
+        shell_execute(inv.argc, inv.argv);
+    } while (separator == ';');
+}
+
+// Scripts: 'run' hands a file's lines to process_command in one go, with
+// no line editor or keyboard involved. Blank lines and lines starting
+// with '#' are skipped; every other line is echoed after "+ " so a log
+// shows what produced each output. Scripts may run scripts, to a depth.
+#define SHELL_SCRIPT_DEPTH 4
+#define SHELL_AUTORUN "etc/autorun"
+
+static int script_depth;
+
+// Returns -1 when the file cannot be opened
+static int shell_run_script(const char* path) {
+    if (script_depth == SHELL_SCRIPT_DEPTH) {
+        printf("run: scripts nested too deeply\n");
+        return 0;
+    }
+    int fd = vfs_open(path);
+    if (fd < 0) {
+        return -1;
+    }
+    size_t size;
+    const char* text = vfs_mmap(fd, &size);
+
+    script_depth++;
+    char buffer[SHELL_LINE_SIZE];
+    uint32_t number = 0;
+    size_t pos = 0;
+    while (pos < size) {
+        size_t start = pos;
+        while (pos < size && text[pos] != '\n') {
+            pos++;
+        }
+        size_t len = pos - start;
+        pos++;
+        number++;
+
+        while (len && shell_is_blank(text[start])) {
+            start++;
+            len--;
+        }
+        while (len && shell_is_blank(text[start + len - 1])) {
+            len--;
+        }
+        if (len == 0 || text[start] == '#') {
+            continue;
+        }
+        if (len >= SHELL_LINE_SIZE) {
+            printf("%s:%u: line too long\n", path, number);
+            continue;
+        }
+        memcpy(buffer, text + start, len);
+        buffer[len] = '\0';
+        printf("+ %s\n", buffer);
+        process_command(buffer);
+    }
+    script_depth--;
+    vfs_close(fd);
+    return 0;
+}
+
+static void cmd_run(int argc, char** argv) {
+    if (argc < 2) {
+        printf("Usage: run <file>...\n");
         return;
     }
-    
-    // Tokenize the command
-    tokenize_command(input);
-    
-    if (arg_count == 0) {
+    for (int i = 1; i < argc; i++) {
+        if (shell_run_script(argv[i]) < 0) {
+            printf("run: %s: no such file\n", argv[i]);
+        }
+    }
+}
+
+static void cmd_repeat(int argc, char** argv) {
+    uint32_t count;
+    if (argc < 3 || parse_uint(argv[1], &count) < 0) {
+        printf("Usage: repeat <count> <command> [args...]\n");
         return;
     }
-    
-    // Execute built-in commands
-    if (strcmpi(args[0], "help") == 0) {
-        cmd_help();
-    } else if (strcmpi(args[0], "clear") == 0) {
-        cmd_clear();
-    } else if (strcmpi(args[0], "echo") == 0) {
-        cmd_echo();
-    } else if (strcmpi(args[0], "meminfo") == 0) {
-        cmd_meminfo();
-    } else if (strcmpi(args[0], "memtest") == 0) {
-        cmd_memtest();
-    } else if (strcmpi(args[0], "color") == 0) {
-        cmd_color();
-    } else if (strcmpi(args[0], "about") == 0) {
-        cmd_about();
-    } else if (strcmpi(args[0], "panic") == 0) {
-        cmd_panic();
-    } else if (strcmpi(args[0], "reboot") == 0) {
-        cmd_reboot();
-    } else if (strcmpi(args[0], "shutdown") == 0) {
-        cmd_shutdown();
-    } else {
-        printf("Unknown command: %s\n", args[0]);
-        printf("Type 'help' for available commands.\n");
+    for (uint32_t i = 0; i < count; i++) {
+        shell_execute(argc - 2, argv + 2);
+    }
+}
+
+static void cmd_time(int argc, char** argv) {
+    if (argc < 2) {
+        printf("Usage: time <command> [args...]\n");
+        return;
+    }
+    uint64_t start = rdtsc();
+    shell_execute(argc - 1, argv + 1);
+    uint64_t cycles = rdtsc() - start;
+
+    uint32_t khz = tsc_khz();
+    printf("time: %llu cycles", cycles);
+    if (khz) {
+        uint32_t us = (uint32_t)div64_u32(cycles * 1000, khz, NULL);
+        printf(", %u.%03u ms", us / 1000, us % 1000);
+    }
+    printf("\n");
+}
+
+// The boot script: autorun=<file> on the kernel command line, autorun=none
+// to skip it, otherwise etc/autorun when the initrd has one
+static void shell_autorun(void) {
+    char path[SHELL_LINE_SIZE];
+    if (!multiboot_option("autorun", path, sizeof(path))) {
+        strcpy(path, SHELL_AUTORUN);
+    }
+
+    if (strcmp(path, "none") == 0) {
+        return;
+    }
+    uint32_t size;
+    if (vfs_stat(path, &size) == 0) {
+        printf("Running %s\n", path);
+        shell_run_script(path);
+    } else if (strcmp(path, SHELL_AUTORUN) != 0) {
+        printf("autorun: %s: no such file\n", path);
+    }
+}
+
+// Line editor: the line being typed, a ring of previous lines and the
+// screen position of the cursor within the line. Every edit redraws
+// only the changed tail of the line in a single terminal_write.
+#define SHELL_HISTORY_SIZE 16       // Must be a power of two
+
+static char line[SHELL_LINE_SIZE];
+static size_t line_len;
+static size_t line_cursor;          // Insert position
+static size_t line_shown;           // Where the terminal cursor is
+
+static char history[SHELL_HISTORY_SIZE][SHELL_LINE_SIZE];
+static uint32_t history_count;      // Lines ever added; runs freely
+static uint32_t history_back;       // 0 = editing, n = n-th newest entry
+static char history_draft[SHELL_LINE_SIZE];
+
+// Output for one redraw: move back, the new text, blanks and back again
+static char redraw_buffer[SHELL_LINE_SIZE * 3];
+
+// Bring the screen up to date from line position 'from' onwards, where
+// the line used to be 'old_len' characters long
+static void line_redraw(size_t from, size_t old_len) {
+    size_t n = 0;
+    size_t pos = line_shown;
+
+    while (pos > from) {
+        redraw_buffer[n++] = '\b';
+        pos--;
+    }
+    // Moving forward is done by rewriting the characters passed over
+    for (; pos < line_len; pos++) {
+        redraw_buffer[n++] = line[pos];
+    }
+    for (; pos < old_len; pos++) {
+        redraw_buffer[n++] = ' ';
+    }
+    while (pos > line_cursor) {
+        redraw_buffer[n++] = '\b';
+        pos--;
+    }
+
+    if (n) {
+        terminal_write(redraw_buffer, n);
+    }
+    line_shown = line_cursor;
+}
+
+// Cursor movement only: back up, or step over the characters passed
+static void line_move(size_t cursor) {
+    size_t n = 0;
+    while (line_shown > cursor) {
+        redraw_buffer[n++] = '\b';
+        line_shown--;
+    }
+    while (line_shown < cursor) {
+        redraw_buffer[n++] = line[line_shown++];
+    }
+    if (n) {
+        terminal_write(redraw_buffer, n);
+    }
+    line_cursor = cursor;
+}
+
+static void line_insert(const char* text, size_t len) {
+    if (len > SHELL_LINE_SIZE - 1 - line_len) {
+        len = SHELL_LINE_SIZE - 1 - line_len;
+    }
+    if (!len) {
+        return;
+    }
+    size_t from = line_cursor;
+    memmove(line + from + len, line + from, line_len - from);
+    memcpy(line + from, text, len);
+    line_len += len;
+    line_cursor += len;
+    line_redraw(from, line_len);
+}
+
+static void line_delete(size_t at) {
+    if (at >= line_len) {
+        return;
+    }
+    size_t old_len = line_len;
+    memmove(line + at, line + at + 1, line_len - at - 1);
+    line_len--;
+    line_cursor = at;
+    line_redraw(at, old_len);
+}
+
+// Replace the whole line, e.g. with a history entry
+static void line_set(const char* text) {
+    size_t old_len = line_len;
+    line_len = strlen(text);
+    memcpy(line, text, line_len);
+    line_cursor = line_len;
+    line_redraw(0, old_len);
+}
+
+static void line_reset(void) {
+    line_len = line_cursor = line_shown = 0;
+    history_back = 0;
+}
+
+static void history_add(void) {
+    if (!line_len) {
+        return;
+    }
+    line[line_len] = '\0';
+    if (history_count &&
+        strcmp(history[(history_count - 1) & (SHELL_HISTORY_SIZE - 1)], line) == 0) {
+        return;     // Don't store immediate repeats
+    }
+    memcpy(history[history_count++ & (SHELL_HISTORY_SIZE - 1)], line, line_len + 1);
+}
+
+// Step through history: +1 is older, -1 is newer
+static void history_step(int direction) {
+    uint32_t stored = history_count < SHELL_HISTORY_SIZE ? history_count : SHELL_HISTORY_SIZE;
+    uint32_t back = history_back + direction;
+    if ((direction > 0 && back > stored) || (direction < 0 && history_back == 0)) {
+        return;
+    }
+
+    if (history_back == 0) {
+        line[line_len] = '\0';
+        memcpy(history_draft, line, line_len + 1);
+    }
+    history_back = back;
+    line_set(back ? history[(history_count - back) & (SHELL_HISTORY_SIZE - 1)] : history_draft);
+}
+
+static int name_starts_with(const char* name, const char* prefix, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (!name[i] || to_lower_ascii(name[i]) != to_lower_ascii(prefix[i])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Complete the command name before the cursor from the registry: a
+// unique match is filled in, several are extended to their common
+// prefix or listed when that adds nothing
+static void line_complete(void) {
+    for (size_t i = 0; i < line_cursor; i++) {
+        if (line[i] == ' ') {
+            return;     // Only the command name is completed
+        }
+    }
+
+    const char* first = NULL;
+    size_t common = 0;
+    int matches = 0;
+    for (int i = 0; i < shell_command_count; i++) {
+        const char* name = shell_commands[i].name;
+        if (!name_starts_with(name, line, line_cursor)) {
+            continue;
+        }
+        if (!first) {
+            first = name;
+            common = strlen(name);
+        } else {
+            size_t j = line_cursor;
+            while (j < common && to_lower_ascii(name[j]) == to_lower_ascii(first[j])) {
+                j++;
+            }
+            common = j;
+        }
+        matches++;
+    }
+
+    if (matches == 1) {
+        line_insert(first + line_cursor, common - line_cursor);
+        line_insert(" ", 1);
+    } else if (common > line_cursor) {
+        line_insert(first + line_cursor, common - line_cursor);
+    } else if (matches > 1) {
+        terminal_putchar('\n');
+        for (int i = 0; i < shell_command_count; i++) {
+            if (name_starts_with(shell_commands[i].name, line, line_cursor)) {
+                printf("%s  ", shell_commands[i].name);
+            }
+        }
+        terminal_putchar('\n');
+        show_prompt();
+        line_shown = 0;
+        line_redraw(0, 0);
+    }
+}
+
+// Line input shared by the keyboard and the serial console: ASCII
+// characters plus the KEY_* editing keys
+void shell_input_char(int c) {
+    switch (c) {
+        case '\b':
+            if (line_cursor > 0) {
+                line_delete(line_cursor - 1);
+            }
+            return;
+        case KEY_DELETE:
+            line_delete(line_cursor);
+            return;
+        case KEY_LEFT:
+            if (line_cursor > 0) {
+                line_move(line_cursor - 1);
+            }
+            return;
+        case KEY_RIGHT:
+            if (line_cursor < line_len) {
+                line_move(line_cursor + 1);
+            }
+            return;
+        case KEY_HOME:
+        case 0x01:  // Ctrl+A
+            line_move(0);
+            return;
+        case KEY_END:
+        case 0x05:  // Ctrl+E
+            line_move(line_len);
+            return;
+        case KEY_UP:
+            history_step(1);
+            return;
+        case KEY_DOWN:
+            history_step(-1);
+            return;
+        case '\t':
+            line_complete();
+            return;
+        case '\n':
+            line_move(line_len);
+            terminal_putchar('\n');
+            history_add();
+            line[line_len] = '\0';
+            line_reset();
+            process_command(line);
+            show_prompt();
+            return;
+        case 0x03:  // Ctrl+C
+            line_move(line_len);
+            terminal_writestring("^C\n");
+            line_reset();
+            show_prompt();
+            return;
+        case 0x0C:  // Ctrl+L
+            clear_screen();
+            show_prompt();
+            line_shown = 0;
+            line_redraw(0, 0);
+            return;
+    }
+
+    if (c >= ' ' && c < 0x7F) {
+        char ch = c;
+        line_insert(&ch, 1);
+    }
+}
+
+static void cmd_history(int argc, char** argv) {
+    UNUSED(argc);
+    UNUSED(argv);
+
+    uint32_t stored = history_count < SHELL_HISTORY_SIZE ? history_count : SHELL_HISTORY_SIZE;
+    for (uint32_t i = history_count - stored; i < history_count; i++) {
+        printf("%4u  %s\n", i + 1, history[i & (SHELL_HISTORY_SIZE - 1)]);
     }
 }
 
 // Initialize shell
 void init_shell(void) {
+    shell_register_command("help", cmd_help, "Show this help message");
+    shell_register_command("clear", cmd_clear, "Clear the screen");
+    shell_register_command("history", cmd_history, "List previous command lines");
+    shell_register_command("echo", cmd_echo, "Echo arguments");
+    shell_register_command("true", cmd_true, "Do nothing");
+    shell_register_command("run", cmd_run, "Run the commands in a file");
+    shell_register_command("repeat", cmd_repeat, "Run a command N times (repeat N cmd...)");
+    shell_register_command("time", cmd_time, "Time a command in TSC cycles");
+    shell_register_command("meminfo", cmd_meminfo, "Show memory information (-v: allocation profile)");
+    shell_register_command("memtest", cmd_memtest, "Test memory allocator");
+    shell_register_command("color", cmd_color, "Change text color");
+    shell_register_command("console", cmd_console, "Pick output sinks (vga, serial, fb, both)");
+    shell_register_command("about", cmd_about, "Show system information");
+    shell_register_command("panic", cmd_panic, "Trigger kernel panic (for testing)");
+    shell_register_command("reboot", cmd_reboot, "Reboot the system");
+    shell_register_command("shutdown", cmd_shutdown, "Shutdown the system");
+
     printf("\nWelcome to MyOS Shell!\n");
     printf("Type 'help' for available commands.\n\n");
+    bootprof_mark("shell");
+    shell_autorun();
+    bootprof_mark("autorun");
+
+    // Boot is over once the first prompt is up
+    bootprof_report();
     show_prompt();
 }
\ No newline at end of file
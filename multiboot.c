@@ -0,0 +1,281 @@
+/*
+ * multiboot.c - Boot information from Multiboot 1 and 2 loaders
+ * GRUB and QEMU -kernel pass a memory map, the command line and
+ * modules. Everything needed later is copied out at entry, before the
+ * frame allocator can reuse the memory it lives in.
+ */
+
+#include "kernel.h"
+
+#define MULTIBOOT1_BOOT_MAGIC 0x2BADB002
+#define MULTIBOOT2_BOOT_MAGIC 0x36D76289
+
+// Multiboot 1 info flags
+#define MB1_INFO_MEMORY     (1u << 0)
+#define MB1_INFO_CMDLINE    (1u << 2)
+#define MB1_INFO_MODULES    (1u << 3)
+#define MB1_INFO_MMAP       (1u << 6)
+#define MB1_INFO_LOADER     (1u << 9)
+#define MB1_INFO_FRAMEBUFFER (1u << 12)
+
+// Multiboot 2 tag types
+#define MB2_TAG_END         0
+#define MB2_TAG_CMDLINE     1
+#define MB2_TAG_LOADER      2
+#define MB2_TAG_MODULE      3
+#define MB2_TAG_MEMINFO     4
+#define MB2_TAG_MMAP        6
+#define MB2_TAG_FRAMEBUFFER 8
+
+#define FRAMEBUFFER_TYPE_RGB 1      // As opposed to indexed or EGA text
+
+#define MEMORY_AVAILABLE    1       // mmap entry type for usable RAM
+
+struct mb1_info {
+    uint32_t flags;
+    uint32_t mem_lower, mem_upper;  // KB below 1MB and above 1MB
+    uint32_t boot_device;
+    uint32_t cmdline;
+    uint32_t mods_count, mods_addr;
+    uint32_t syms[4];
+    uint32_t mmap_length, mmap_addr;
+    uint32_t drives_length, drives_addr;
+    uint32_t config_table;
+    uint32_t boot_loader_name;
+    uint32_t apm_table;
+    uint32_t vbe_control_info, vbe_mode_info;
+    uint16_t vbe_mode, vbe_interface_seg, vbe_interface_off, vbe_interface_len;
+    struct mb_framebuffer {
+        uint64_t address;
+        uint32_t pitch, width, height;
+        uint8_t bpp, type;
+    } __attribute__((packed)) framebuffer;
+    struct mb_rgb_format {
+        uint8_t red_position, red_size;
+        uint8_t green_position, green_size;
+        uint8_t blue_position, blue_size;
+    } framebuffer_rgb;
+} __attribute__((packed));
+
+struct mb1_module {
+    uint32_t start, end;
+    uint32_t string;
+    uint32_t reserved;
+};
+
+// The size field is not counted in itself
+struct mb1_mmap_entry {
+    uint32_t size;
+    uint64_t base;
+    uint64_t length;
+    uint32_t type;
+} __attribute__((packed));
+
+struct mb2_tag {
+    uint32_t type;
+    uint32_t size;
+};
+
+struct mb2_mmap_entry {
+    uint64_t base;
+    uint64_t length;
+    uint32_t type;
+    uint32_t reserved;
+};
+
+static int boot_protocol;
+static struct multiboot_region regions[MULTIBOOT_MAX_REGIONS];
+static size_t region_count;
+static struct multiboot_module modules[MULTIBOOT_MAX_MODULES];
+static size_t module_count;
+static char boot_cmdline[128];
+static char boot_loader[64];
+static struct multiboot_framebuffer framebuffer;
+static int have_framebuffer;
+
+static void copy_string(char* dest, size_t size, const char* src) {
+    size_t len = 0;
+    while (src[len] && len < size - 1) {
+        len++;
+    }
+    memcpy(dest, src, len);
+    dest[len] = '\0';
+}
+
+static void add_region(uint64_t base, uint64_t length, uint32_t type) {
+    if (type == MEMORY_AVAILABLE && length && region_count < MULTIBOOT_MAX_REGIONS) {
+        regions[region_count].base = base;
+        regions[region_count].length = length;
+        region_count++;
+    }
+}
+
+// Both protocols describe the mode the same way; Multiboot 2 has two
+// reserved bytes before the color layout
+static void set_framebuffer(const struct mb_framebuffer* fb, const struct mb_rgb_format* rgb) {
+    if (fb->type != FRAMEBUFFER_TYPE_RGB || fb->bpp != 32) {
+        return;
+    }
+    framebuffer.address = fb->address;
+    framebuffer.pitch = fb->pitch;
+    framebuffer.width = fb->width;
+    framebuffer.height = fb->height;
+    framebuffer.bpp = fb->bpp;
+    framebuffer.red_shift = rgb->red_position;
+    framebuffer.green_shift = rgb->green_position;
+    framebuffer.blue_shift = rgb->blue_position;
+    have_framebuffer = 1;
+}
+
+static void add_module(uint32_t start, uint32_t end, const char* name) {
+    if (module_count < MULTIBOOT_MAX_MODULES) {
+        modules[module_count].start = start;
+        modules[module_count].end = end;
+        copy_string(modules[module_count].name, sizeof(modules[0].name), name ? name : "");
+        module_count++;
+    }
+}
+
+static void parse_multiboot1(const struct mb1_info* info) {
+    if (info->flags & MB1_INFO_MMAP) {
+        uintptr_t entry = info->mmap_addr;
+        uintptr_t end = info->mmap_addr + info->mmap_length;
+        while (entry < end) {
+            const struct mb1_mmap_entry* e = (const struct mb1_mmap_entry*)entry;
+            add_region(e->base, e->length, e->type);
+            entry += e->size + sizeof(e->size);
+        }
+    } else if (info->flags & MB1_INFO_MEMORY) {
+        // No map: the contiguous RAM above 1MB is all we know about
+        add_region(0x100000, (uint64_t)info->mem_upper * 1024, MEMORY_AVAILABLE);
+    }
+
+    if (info->flags & MB1_INFO_CMDLINE) {
+        copy_string(boot_cmdline, sizeof(boot_cmdline), (const char*)(uintptr_t)info->cmdline);
+    }
+    if (info->flags & MB1_INFO_LOADER) {
+        copy_string(boot_loader, sizeof(boot_loader), (const char*)(uintptr_t)info->boot_loader_name);
+    }
+    if (info->flags & MB1_INFO_MODULES) {
+        const struct mb1_module* mod = (const struct mb1_module*)(uintptr_t)info->mods_addr;
+        for (uint32_t i = 0; i < info->mods_count; i++) {
+            add_module(mod[i].start, mod[i].end, (const char*)(uintptr_t)mod[i].string);
+        }
+    }
+    if (info->flags & MB1_INFO_FRAMEBUFFER) {
+        set_framebuffer(&info->framebuffer, &info->framebuffer_rgb);
+    }
+}
+
+static void parse_multiboot2(uintptr_t info) {
+    uint32_t total_size = *(const uint32_t*)info;
+    uintptr_t tag_addr = info + 8;
+    uintptr_t end = info + total_size;
+    int have_mmap = 0;
+
+    while (tag_addr + sizeof(struct mb2_tag) <= end) {
+        const struct mb2_tag* tag = (const struct mb2_tag*)tag_addr;
+        if (tag->type == MB2_TAG_END) {
+            break;
+        }
+        const uint32_t* body = (const uint32_t*)(tag + 1);
+
+        switch (tag->type) {
+            case MB2_TAG_CMDLINE:
+                copy_string(boot_cmdline, sizeof(boot_cmdline), (const char*)body);
+                break;
+            case MB2_TAG_LOADER:
+                copy_string(boot_loader, sizeof(boot_loader), (const char*)body);
+                break;
+            case MB2_TAG_MODULE:
+                add_module(body[0], body[1], (const char*)&body[2]);
+                break;
+            case MB2_TAG_MEMINFO:
+                if (!have_mmap && !region_count) {
+                    add_region(0x100000, (uint64_t)body[1] * 1024, MEMORY_AVAILABLE);
+                }
+                break;
+            case MB2_TAG_MMAP: {
+                uint32_t entry_size = body[0];
+                uintptr_t entry = (uintptr_t)&body[2];
+                uintptr_t entries_end = tag_addr + tag->size;
+                region_count = 0;   // Supersedes basic meminfo
+                have_mmap = 1;
+                for (; entry + entry_size <= entries_end; entry += entry_size) {
+                    const struct mb2_mmap_entry* e = (const struct mb2_mmap_entry*)entry;
+                    add_region(e->base, e->length, e->type);
+                }
+                break;
+            }
+            case MB2_TAG_FRAMEBUFFER:
+                set_framebuffer((const struct mb_framebuffer*)body,
+                                (const struct mb_rgb_format*)((const uint8_t*)body +
+                                                              sizeof(struct mb_framebuffer) + 2));
+                break;
+        }
+
+        // Tags are padded to 8 bytes
+        tag_addr += (tag->size + 7) & ~7u;
+    }
+}
+
+// Record what the boot loader handed over; 'magic' is EAX at entry
+void multiboot_init(uint32_t magic, uintptr_t info) {
+    if (magic == MULTIBOOT1_BOOT_MAGIC && info) {
+        boot_protocol = 1;
+        parse_multiboot1((const struct mb1_info*)info);
+    } else if (magic == MULTIBOOT2_BOOT_MAGIC && info) {
+        boot_protocol = 2;
+        parse_multiboot2(info);
+    }
+}
+
+// 0 when started by boot.asm, otherwise the Multiboot version
+int multiboot_protocol(void) {
+    return boot_protocol;
+}
+
+// Usable RAM regions; 0 when the loader passed none
+size_t multiboot_memory_map(const struct multiboot_region** map) {
+    *map = regions;
+    return region_count;
+}
+
+size_t multiboot_module_count(void) {
+    return module_count;
+}
+
+const struct multiboot_module* multiboot_module(size_t index) {
+    return index < module_count ? &modules[index] : NULL;
+}
+
+const char* multiboot_cmdline(void) {
+    return boot_cmdline;
+}
+
+// Value of name=value on the command line; 0 when it is not there
+int multiboot_option(const char* name, char* value, size_t size) {
+    size_t name_len = strlen(name);
+    for (const char* p = boot_cmdline; *p; p++) {
+        if ((p == boot_cmdline || p[-1] == ' ') && memcmp(p, name, name_len) == 0 &&
+            p[name_len] == '=') {
+            p += name_len + 1;
+            size_t len = 0;
+            while (p[len] && p[len] != ' ' && len < size - 1) {
+                len++;
+            }
+            memcpy(value, p, len);
+            value[len] = '\0';
+            return 1;
+        }
+    }
+    return 0;
+}
+
+const struct multiboot_framebuffer* multiboot_framebuffer(void) {
+    return have_framebuffer ? &framebuffer : NULL;
+}
+
+const char* multiboot_loader_name(void) {
+    return boot_loader[0] ? boot_loader : "unknown loader";
+}
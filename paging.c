@@ -0,0 +1,227 @@
+/*
+ * paging.c - Paging setup and the demand-paged heap window
+ * Identity maps RAM (4MB PSE pages above the first 4MB), maps the VGA
+ * text buffer write-combining through PAT and backs the heap window
+ * with frames from the page-fault handler
+ */
+
+#include "kernel.h"
+
+#define PAGE_ENTRIES      1024
+#define LARGE_PAGE_SIZE   0x400000
+#define PDE_INDEX(addr)   ((uintptr_t)(addr) >> 22)
+#define PTE_INDEX(addr)   (((uintptr_t)(addr) >> 12) & 0x3FF)
+#define PAGE_FRAME(entry) ((entry) & ~(uintptr_t)(PAGE_SIZE - 1))
+
+#define PAGE_FAULT_VECTOR 14
+#define PF_PRESENT        0x1   // Error code: fault on a present page
+
+#define CR0_PG  (1u << 31)
+#define CR0_WP  (1u << 16)
+#define CR4_PSE (1u << 4)
+#define CR4_PGE (1u << 7)
+
+#define CPUID_EDX_PSE (1u << 3)
+#define CPUID_EDX_PGE (1u << 13)
+#define CPUID_EDX_PAT (1u << 16)
+
+// PAT entry 1 (PWT=1, PCD=0) is changed from write-through to
+// write-combining; the other seven keep their power-on types
+#define IA32_PAT_MSR 0x277
+#define PAT_VALUE    0x0007040600070106ULL
+
+static uint32_t page_directory[PAGE_ENTRIES] __attribute__((aligned(PAGE_SIZE)));
+static uint32_t low_page_table[PAGE_ENTRIES] __attribute__((aligned(PAGE_SIZE)));
+
+static int have_pse;
+static uint32_t global_flag;        // PAGE_GLOBAL when the CPU has PGE
+static uint32_t write_combining;    // PTE bits selecting WC, 0 without PAT
+static uint32_t heap_pages_mapped;
+static spinlock_t heap_fault_lock = SPINLOCK_INIT("heap-fault");
+
+static inline void invlpg(uintptr_t addr) {
+    asm volatile("invlpg (%0)" : : "r"(addr) : "memory");
+}
+
+// Page table covering 'virt', allocating an empty one if 'create'
+static uint32_t* page_table_for(uintptr_t virt, int create) {
+    uint32_t* pde = &page_directory[PDE_INDEX(virt)];
+    if (*pde & PAGE_PRESENT) {
+        if (*pde & PAGE_LARGE) {
+            kernel_panic("paging: 4KB mapping inside a large page");
+        }
+        return (uint32_t*)PAGE_FRAME(*pde);
+    }
+    if (!create) {
+        return NULL;
+    }
+
+    // Frames are identity mapped, so the table is usable right away
+    uintptr_t table = pmm_alloc_frame();
+    if (!table) {
+        return NULL;
+    }
+    memset((void*)table, 0, PAGE_SIZE);
+    *pde = table | PAGE_PRESENT | PAGE_WRITE;
+    return (uint32_t*)table;
+}
+
+// Map one 4KB page; returns 0, or -1 when no page table could be allocated
+int paging_map_page(uintptr_t virt, uintptr_t phys, uint32_t flags) {
+    uint32_t* table = page_table_for(virt, 1);
+    if (!table) {
+        return -1;
+    }
+    table[PTE_INDEX(virt)] = PAGE_FRAME(phys) | flags | PAGE_PRESENT;
+    invlpg(virt);
+    return 0;
+}
+
+void paging_unmap_page(uintptr_t virt) {
+    uint32_t* table = page_table_for(virt, 0);
+    if (table) {
+        table[PTE_INDEX(virt)] = 0;
+        invlpg(virt);
+    }
+}
+
+// Physical address behind 'virt', or 0 when it is not mapped
+uintptr_t paging_translate(uintptr_t virt) {
+    uint32_t pde = page_directory[PDE_INDEX(virt)];
+    if (!(pde & PAGE_PRESENT)) {
+        return 0;
+    }
+    if (pde & PAGE_LARGE) {
+        return (pde & ~(uintptr_t)(LARGE_PAGE_SIZE - 1)) | (virt & (LARGE_PAGE_SIZE - 1));
+    }
+    uint32_t pte = ((uint32_t*)PAGE_FRAME(pde))[PTE_INDEX(virt)];
+    return (pte & PAGE_PRESENT) ? PAGE_FRAME(pte) | (virt & (PAGE_SIZE - 1)) : 0;
+}
+
+// Identity map [start, end) with large pages where the CPU allows it
+static void identity_map(uintptr_t start, uintptr_t end, uint32_t flags) {
+    uintptr_t addr = start & ~(uintptr_t)(PAGE_SIZE - 1);
+    while (addr < end) {
+        if (have_pse && !(addr & (LARGE_PAGE_SIZE - 1)) && end - addr >= LARGE_PAGE_SIZE &&
+            !(page_directory[PDE_INDEX(addr)] & PAGE_PRESENT)) {
+            page_directory[PDE_INDEX(addr)] = addr | flags | PAGE_LARGE | PAGE_PRESENT;
+            addr += LARGE_PAGE_SIZE;
+        } else {
+            if (paging_map_page(addr, addr, flags) < 0) {
+                kernel_panic("paging: out of memory for page tables");
+            }
+            addr += PAGE_SIZE;
+        }
+    }
+}
+
+static void* map_device(uintptr_t phys, size_t size, uint32_t flags) {
+    uintptr_t end = phys + size;
+    for (uintptr_t addr = phys & ~(uintptr_t)(PAGE_SIZE - 1); addr < end; addr += PAGE_SIZE) {
+        if (paging_translate(addr) != addr) {
+            if (paging_map_page(addr, addr, flags) < 0) {
+                return NULL;
+            }
+        }
+    }
+    return (void*)phys;
+}
+
+// Uncached identity mapping for device registers
+void* map_mmio(uintptr_t phys, size_t size) {
+    return map_device(phys, size, PAGE_WRITE | PAGE_PCD | PAGE_PWT);
+}
+
+// Video memory: PWT selects PAT entry 1, which paging_init_cpu makes
+// write-combining, or plain write-through on a CPU without PAT. Reads
+// of write-combining memory are uncached, so fb.c only ever writes it.
+void* map_framebuffer(uintptr_t phys, size_t size) {
+    return map_device(phys, size, PAGE_WRITE | PAGE_PWT);
+}
+
+// Heap pages are backed by a frame on first touch; everything else is a
+// bug. Two CPUs may fault on the same page, so the second one finds it
+// already mapped.
+static void page_fault_handler(struct interrupt_frame* frame) {
+    uintptr_t addr;
+    asm volatile("mov %%cr2, %0" : "=r"(addr));
+
+    if (!(frame->error_code & PF_PRESENT) && addr >= HEAP_START && addr < HEAP_END) {
+        spin_lock(&heap_fault_lock);
+        int mapped = paging_translate(addr) != 0;
+        if (!mapped) {
+            uintptr_t page = pmm_alloc_frame();
+            if (page && paging_map_page(addr, page, PAGE_WRITE | global_flag) == 0) {
+                heap_pages_mapped++;
+                mapped = 1;
+            }
+        }
+        spin_unlock(&heap_fault_lock);
+        if (mapped) {
+            return;
+        }
+        printf("\nHeap page at %p could not be backed\n", (void*)addr);
+    }
+    exception_panic(frame);
+}
+
+void paging_init(void) {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    have_pse = (edx & CPUID_EDX_PSE) != 0;
+    global_flag = (edx & CPUID_EDX_PGE) ? PAGE_GLOBAL : 0;
+    write_combining = (edx & CPUID_EDX_PAT) ? PAGE_PWT : 0;
+
+    // The first 4MB holds the kernel, the VGA buffer and the null page,
+    // which need per-page attributes, so it gets a 4KB table. Page 0
+    // stays unmapped to catch NULL dereferences.
+    page_directory[0] = (uintptr_t)low_page_table | PAGE_PRESENT | PAGE_WRITE;
+    for (uintptr_t addr = PAGE_SIZE; addr < LARGE_PAGE_SIZE; addr += PAGE_SIZE) {
+        low_page_table[PTE_INDEX(addr)] = addr | PAGE_PRESENT | PAGE_WRITE | global_flag;
+    }
+    for (uintptr_t addr = VGA_MEMORY; addr < VGA_MEMORY + VGA_MEMORY_SIZE; addr += PAGE_SIZE) {
+        low_page_table[PTE_INDEX(addr)] = addr | PAGE_PRESENT | PAGE_WRITE | global_flag | write_combining;
+    }
+
+    // The rest of RAM, where frames and page tables come from. RAM from
+    // the heap window up would collide with it and is not used.
+    uintptr_t ram_end = (uintptr_t)pmm_total_count() * PAGE_SIZE;
+    if (ram_end > HEAP_START) {
+        pmm_reserve_range(HEAP_START, ram_end);
+        ram_end = HEAP_START;
+    }
+    identity_map(LARGE_PAGE_SIZE, ram_end, PAGE_WRITE | global_flag);
+
+    register_interrupt_handler(PAGE_FAULT_VECTOR, page_fault_handler);
+    paging_init_cpu();
+
+    printf("Paging enabled: %u MB identity mapped%s%s\n", (unsigned)(ram_end >> 20),
+           have_pse ? " with 4MB pages" : "", write_combining ? ", VGA write-combining" : "");
+}
+
+// Turn on paging with the shared page directory on the calling CPU.
+// PAT and the CR4 feature bits are per CPU, so each one sets its own.
+void paging_init_cpu(void) {
+    if (write_combining) {
+        asm volatile("wbinvd" : : : "memory");
+        asm volatile("wrmsr" : : "c"(IA32_PAT_MSR), "a"((uint32_t)PAT_VALUE),
+                     "d"((uint32_t)(PAT_VALUE >> 32)));
+    }
+
+    uintptr_t cr4;
+    asm volatile("mov %%cr4, %0" : "=r"(cr4));
+    cr4 |= (have_pse ? CR4_PSE : 0) | (global_flag ? CR4_PGE : 0);
+    asm volatile("mov %0, %%cr4" : : "r"(cr4));
+
+    asm volatile("mov %0, %%cr3" : : "r"(page_directory) : "memory");
+
+    uintptr_t cr0;
+    asm volatile("mov %%cr0, %0" : "=r"(cr0));
+    cr0 |= CR0_PG | CR0_WP;
+    asm volatile("mov %0, %%cr0" : : "r"(cr0) : "memory");
+}
+
+// Heap window pages backed so far
+size_t paging_heap_pages(void) {
+    return heap_pages_mapped;
+}
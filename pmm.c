@@ -0,0 +1,278 @@
+/*
+ * pmm.c - Physical page-frame allocator
+ * Tracks 4KB frames with a bitmap placed right after the kernel image.
+ * RAM is sized from the boot loader's memory map, or CMOS without one.
+ */
+
+#include "kernel.h"
+
+// CMOS memory size registers
+#define CMOS_ADDRESS        0x70
+#define CMOS_DATA           0x71
+#define CMOS_EXT_MEM_LOW    0x30    // KB above 1MB (capped at 64MB)
+#define CMOS_EXT_MEM_HIGH   0x31
+#define CMOS_HIGH_MEM_LOW   0x34    // 64KB blocks above 16MB
+#define CMOS_HIGH_MEM_HIGH  0x35
+
+#define FRAME_SHIFT 12
+#define BITS_PER_WORD 32
+
+// Provided by linker.ld
+extern uint8_t kernel_end[];
+
+// A set bit in frame_bitmap means the frame is in use; run_start_bitmap
+// and run_end_bitmap mark the first and last frame of every allocation,
+// so kfree can tell a run from reserved memory and release all of it
+static uint32_t* frame_bitmap;
+static uint32_t* run_start_bitmap;
+static uint32_t* run_end_bitmap;
+static uint32_t frame_count;
+static uint32_t frame_words;
+static uint32_t free_frames;
+static uint32_t next_free_word;   // No free frame lives below this word
+static spinlock_t pmm_lock = SPINLOCK_INIT("pmm");
+
+static inline void frame_set(uint32_t* map, uint32_t frame) {
+    map[frame / BITS_PER_WORD] |= 1u << (frame % BITS_PER_WORD);
+}
+
+static inline void frame_clear(uint32_t* map, uint32_t frame) {
+    map[frame / BITS_PER_WORD] &= ~(1u << (frame % BITS_PER_WORD));
+}
+
+static inline int frame_test(const uint32_t* map, uint32_t frame) {
+    return (map[frame / BITS_PER_WORD] >> (frame % BITS_PER_WORD)) & 1;
+}
+
+static uint8_t cmos_read(uint8_t reg) {
+    outb(CMOS_ADDRESS, reg);
+    return inb(CMOS_DATA);
+}
+
+// Installed RAM as reported by the BIOS in CMOS
+static uint32_t detect_memory_end(void) {
+    uint32_t high_blocks = cmos_read(CMOS_HIGH_MEM_LOW) | (cmos_read(CMOS_HIGH_MEM_HIGH) << 8);
+    if (high_blocks) {
+        uint32_t end = 0x1000000 + high_blocks * 0x10000;
+        // 0xFFFF blocks would wrap a 32-bit address
+        return end < 0x1000000 ? 0xFFFFF000 : end;
+    }
+
+    uint32_t ext_kb = cmos_read(CMOS_EXT_MEM_LOW) | (cmos_read(CMOS_EXT_MEM_HIGH) << 8);
+    return 0x100000 + ext_kb * 1024;
+}
+
+// End of the highest usable region below 4GB in the loader's map, or 0
+static uint32_t map_memory_end(const struct multiboot_region* map, size_t count) {
+    uint64_t end = 0;
+    for (size_t i = 0; i < count; i++) {
+        uint64_t region_end = map[i].base + map[i].length;
+        if (map[i].base < 0xFFFFF000 && region_end > end) {
+            end = region_end;
+        }
+    }
+    return end > 0xFFFFF000 ? 0xFFFFF000 : (uint32_t)end;
+}
+
+// Release the whole frames inside a usable region
+static void free_region(const struct multiboot_region* region) {
+    uint64_t start = (region->base + PAGE_SIZE - 1) >> FRAME_SHIFT;
+    uint64_t end = (region->base + region->length) >> FRAME_SHIFT;
+    if (end > frame_count) {
+        end = frame_count;
+    }
+    for (uint32_t frame = start; frame < end; frame++) {
+        if (frame_test(frame_bitmap, frame)) {
+            frame_clear(frame_bitmap, frame);
+            free_frames++;
+        }
+    }
+}
+
+void pmm_init(void) {
+    // Prefer the loader's memory map; it also knows about holes
+    const struct multiboot_region* map;
+    size_t regions = multiboot_memory_map(&map);
+    uint32_t memory_end = regions ? map_memory_end(map, regions) : 0;
+    if (!memory_end) {
+        regions = 0;
+        memory_end = detect_memory_end();
+    }
+    memory_end &= ~(PAGE_SIZE - 1);
+
+    frame_count = memory_end >> FRAME_SHIFT;
+    frame_words = (frame_count + BITS_PER_WORD - 1) / BITS_PER_WORD;
+
+    // The bitmaps go on the first page boundary after the kernel and
+    // any boot modules, which must survive until they are read
+    uintptr_t image_end = (uintptr_t)kernel_end;
+    for (size_t i = 0; i < multiboot_module_count(); i++) {
+        if (multiboot_module(i)->end > image_end) {
+            image_end = multiboot_module(i)->end;
+        }
+    }
+    uintptr_t maps = (image_end + PAGE_SIZE - 1) & ~(uintptr_t)(PAGE_SIZE - 1);
+    frame_bitmap = (uint32_t*)maps;
+    run_start_bitmap = frame_bitmap + frame_words;
+    run_end_bitmap = run_start_bitmap + frame_words;
+    uintptr_t first_free = ((uintptr_t)(run_end_bitmap + frame_words) + PAGE_SIZE - 1) & ~(uintptr_t)(PAGE_SIZE - 1);
+
+    memset(run_start_bitmap, 0, frame_words * sizeof(uint32_t));
+    memset(run_end_bitmap, 0, frame_words * sizeof(uint32_t));
+    next_free_word = 0;
+    if (regions) {
+        // Everything is in use until the map says otherwise
+        memset(frame_bitmap, 0xFF, frame_words * sizeof(uint32_t));
+        free_frames = 0;
+        for (size_t i = 0; i < regions; i++) {
+            free_region(&map[i]);
+        }
+    } else {
+        memset(frame_bitmap, 0, frame_words * sizeof(uint32_t));
+        free_frames = frame_count;
+
+        // Frames past the end of RAM in the last word are never available
+        for (uint32_t frame = frame_count; frame < frame_words * BITS_PER_WORD; frame++) {
+            frame_set(frame_bitmap, frame);
+        }
+    }
+
+    // Low memory, the kernel image, the modules and the bitmaps themselves
+    pmm_reserve_range(0, first_free);
+}
+
+// Mark [start, end) as permanently in use
+void pmm_reserve_range(uintptr_t start, uintptr_t end) {
+    uint32_t flags = spin_lock_irqsave(&pmm_lock);
+    uint32_t first = start >> FRAME_SHIFT;
+    uint32_t last = (end + PAGE_SIZE - 1) >> FRAME_SHIFT;
+    if (last > frame_count) {
+        last = frame_count;
+    }
+
+    for (uint32_t frame = first; frame < last; frame++) {
+        if (!frame_test(frame_bitmap, frame)) {
+            frame_set(frame_bitmap, frame);
+            free_frames--;
+        }
+    }
+    spin_unlock_irqrestore(&pmm_lock, flags);
+}
+
+static uintptr_t alloc_frame_locked(void) {
+    for (uint32_t word = next_free_word; word < frame_words; word++) {
+        if (frame_bitmap[word] != 0xFFFFFFFF) {
+            uint32_t frame = word * BITS_PER_WORD + __builtin_ctz(~frame_bitmap[word]);
+            frame_set(frame_bitmap, frame);
+            frame_set(run_start_bitmap, frame);
+            frame_set(run_end_bitmap, frame);
+            free_frames--;
+            next_free_word = word;
+            return (uintptr_t)frame << FRAME_SHIFT;
+        }
+    }
+
+    next_free_word = frame_words;
+    return 0;
+}
+
+// Allocate one frame; returns its physical address or 0
+uintptr_t pmm_alloc_frame(void) {
+    uint32_t flags = spin_lock_irqsave(&pmm_lock);
+    uintptr_t frame = alloc_frame_locked();
+    spin_unlock_irqrestore(&pmm_lock, flags);
+    return frame;
+}
+
+static uintptr_t alloc_run_locked(uint32_t count, uint32_t align_frames) {
+    uint32_t start = next_free_word * BITS_PER_WORD;
+    start = (start + align_frames - 1) & ~(align_frames - 1);
+
+    while (start + count <= frame_count) {
+        uint32_t run = 0;
+        while (run < count && !frame_test(frame_bitmap, start + run)) {
+            run++;
+        }
+
+        if (run == count) {
+            for (uint32_t i = 0; i < count; i++) {
+                frame_set(frame_bitmap, start + i);
+            }
+            frame_set(run_start_bitmap, start);
+            frame_set(run_end_bitmap, start + count - 1);
+            free_frames -= count;
+            return (uintptr_t)start << FRAME_SHIFT;
+        }
+
+        // Restart on the next aligned frame past the one in use
+        start = (start + run + align_frames) & ~(align_frames - 1);
+    }
+    return 0;
+}
+
+// Allocate 'count' contiguous frames starting on an 'align_frames' boundary
+uintptr_t pmm_alloc_frames(size_t count, size_t align_frames) {
+    if (count == 0) {
+        return 0;
+    }
+    if (count == 1 && align_frames <= 1) {
+        return pmm_alloc_frame();
+    }
+    if (align_frames == 0) {
+        align_frames = 1;
+    }
+
+    uint32_t flags = spin_lock_irqsave(&pmm_lock);
+    uintptr_t frames = alloc_run_locked(count, align_frames);
+    spin_unlock_irqrestore(&pmm_lock, flags);
+    return frames;
+}
+
+// The first frame of a live run; callers hold pmm_lock
+static int run_start_locked(uintptr_t address) {
+    uint32_t frame = address >> FRAME_SHIFT;
+    return !(address & (PAGE_SIZE - 1)) && frame < frame_count &&
+           frame_test(run_start_bitmap, frame);
+}
+
+// Release a run returned by pmm_alloc_frame or pmm_alloc_frames
+void pmm_free_frames(uintptr_t address) {
+    uint32_t flags = spin_lock_irqsave(&pmm_lock);
+    if (!run_start_locked(address)) {
+        kernel_panic("pmm: freeing a frame that is not allocated");
+    }
+
+    uint32_t frame = address >> FRAME_SHIFT;
+    frame_clear(run_start_bitmap, frame);
+    int last;
+    do {
+        if (!frame_test(frame_bitmap, frame)) {
+            kernel_panic("pmm: run contains a free frame");
+        }
+        last = frame_test(run_end_bitmap, frame);
+        frame_clear(run_end_bitmap, frame);
+        frame_clear(frame_bitmap, frame);
+        free_frames++;
+        if (frame / BITS_PER_WORD < next_free_word) {
+            next_free_word = frame / BITS_PER_WORD;
+        }
+        frame++;
+    } while (!last && frame < frame_count);
+    spin_unlock_irqrestore(&pmm_lock, flags);
+}
+
+// True when 'address' is the start of a run the allocator handed out
+int pmm_owns(uintptr_t address) {
+    uint32_t flags = spin_lock_irqsave(&pmm_lock);
+    int owned = run_start_locked(address);
+    spin_unlock_irqrestore(&pmm_lock, flags);
+    return owned;
+}
+
+size_t pmm_free_count(void) {
+    return free_frames;
+}
+
+size_t pmm_total_count(void) {
+    return frame_count;
+}
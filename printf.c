@@ -0,0 +1,329 @@
+/*
+ * printf.c - Formatted output
+ * kvsnprintf does the formatting; kprintf/printf format into a stack
+ * buffer and hand the result to the terminal in one terminal_write
+ */
+
+#include "kernel.h"
+
+// Output is written to the terminal whenever this much is pending
+#define PRINTF_BUFFER_SIZE 256
+
+// Flags parsed from a conversion specification
+#define FLAG_LEFT  0x01     // '-'
+#define FLAG_ZERO  0x02     // '0'
+#define FLAG_PLUS  0x04     // '+'
+#define FLAG_SPACE 0x08     // ' '
+#define FLAG_ALT   0x10     // '#'
+#define FLAG_UPPER 0x20     // %X
+
+static const char digits_lower[] = "0123456789abcdef";
+static const char digits_upper[] = "0123456789ABCDEF";
+
+// "00" "01" ... "99", for converting two decimal digits per division
+static const char digit_pairs[201] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+// Where formatted characters go: a fixed buffer that is either
+// truncated (ksnprintf) or drained through 'flush' when full (kprintf)
+struct printf_out {
+    char* buffer;
+    size_t size;
+    size_t pos;
+    size_t total;                   // Characters produced so far
+    void (*flush)(struct printf_out* out);
+};
+
+static inline void out_char(struct printf_out* out, char c) {
+    if (out->pos == out->size && out->flush) {
+        out->flush(out);
+    }
+    if (out->pos < out->size) {
+        out->buffer[out->pos++] = c;
+    }
+    out->total++;
+}
+
+static void out_repeat(struct printf_out* out, char c, int count) {
+    while (count-- > 0) {
+        out_char(out, c);
+    }
+}
+
+static void out_string(struct printf_out* out, const char* str, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        out_char(out, str[i]);
+    }
+}
+
+// Write the digits of 'value' ending at 'end'; returns the first digit
+static char* format_unsigned(char* end, uint64_t value, unsigned base, int upper) {
+    const char* digits = upper ? digits_upper : digits_lower;
+    char* p = end;
+
+    if (base == 10) {
+        // Peel off 32-bit chunks so the rest is plain 32-bit arithmetic
+        while (value > 0xFFFFFFFFu) {
+            uint32_t chunk;
+            value = div64_u32(value, 1000000000, &chunk);
+            for (int i = 0; i < 9; i++) {
+                *--p = '0' + chunk % 10;
+                chunk /= 10;
+            }
+        }
+
+        uint32_t v = (uint32_t)value;
+        while (v >= 100) {
+            const char* pair = &digit_pairs[(v % 100) * 2];
+            v /= 100;
+            *--p = pair[1];
+            *--p = pair[0];
+        }
+        if (v >= 10) {
+            *--p = digit_pairs[v * 2 + 1];
+            *--p = digit_pairs[v * 2];
+        } else {
+            *--p = '0' + v;
+        }
+        return p;
+    }
+
+    // Hex and octal only need shifts and masks
+    unsigned shift = base == 16 ? 4 : 3;
+    do {
+        *--p = digits[value & (base - 1)];
+        value >>= shift;
+    } while (value);
+    return p;
+}
+
+// Emit one converted number with sign, prefix, precision and padding
+static void out_number(struct printf_out* out, uint64_t value, int negative, unsigned base,
+                       int flags, int width, int precision) {
+    char buffer[24];
+    char* end = buffer + sizeof(buffer);
+    char* digits = end;
+    if (value || precision != 0) {
+        digits = format_unsigned(end, value, base, flags & FLAG_UPPER);
+    }
+    int len = end - digits;
+
+    char sign = 0;
+    if (negative) {
+        sign = '-';
+    } else if (flags & FLAG_PLUS) {
+        sign = '+';
+    } else if (flags & FLAG_SPACE) {
+        sign = ' ';
+    }
+
+    const char* prefix = "";
+    if ((flags & FLAG_ALT) && value) {
+        prefix = base == 16 ? ((flags & FLAG_UPPER) ? "0X" : "0x") : base == 8 ? "0" : "";
+    }
+    int prefix_len = strlen(prefix);
+
+    int zeros = precision > len ? precision - len : 0;
+    int body = (sign ? 1 : 0) + prefix_len + zeros + len;
+    int pad = width > body ? width - body : 0;
+
+    // '0' only pads with zeros when no precision was given
+    if ((flags & FLAG_ZERO) && !(flags & FLAG_LEFT) && precision < 0) {
+        zeros += pad;
+        pad = 0;
+    }
+
+    if (!(flags & FLAG_LEFT)) {
+        out_repeat(out, ' ', pad);
+    }
+    if (sign) {
+        out_char(out, sign);
+    }
+    out_string(out, prefix, prefix_len);
+    out_repeat(out, '0', zeros);
+    out_string(out, digits, len);
+    if (flags & FLAG_LEFT) {
+        out_repeat(out, ' ', pad);
+    }
+}
+
+static void format(struct printf_out* out, const char* fmt, __builtin_va_list args) {
+    while (*fmt) {
+        if (*fmt != '%') {
+            // Copy the literal run up to the next conversion
+            const char* start = fmt;
+            while (*fmt && *fmt != '%') {
+                fmt++;
+            }
+            out_string(out, start, fmt - start);
+            continue;
+        }
+        fmt++;
+
+        int flags = 0;
+        for (;; fmt++) {
+            if (*fmt == '-') flags |= FLAG_LEFT;
+            else if (*fmt == '0') flags |= FLAG_ZERO;
+            else if (*fmt == '+') flags |= FLAG_PLUS;
+            else if (*fmt == ' ') flags |= FLAG_SPACE;
+            else if (*fmt == '#') flags |= FLAG_ALT;
+            else break;
+        }
+
+        int width = 0;
+        if (*fmt == '*') {
+            width = __builtin_va_arg(args, int);
+            if (width < 0) {
+                flags |= FLAG_LEFT;
+                width = -width;
+            }
+            fmt++;
+        } else {
+            while (*fmt >= '0' && *fmt <= '9') {
+                width = width * 10 + (*fmt++ - '0');
+            }
+        }
+
+        int precision = -1;
+        if (*fmt == '.') {
+            fmt++;
+            precision = 0;
+            if (*fmt == '*') {
+                precision = __builtin_va_arg(args, int);
+                fmt++;
+            } else {
+                while (*fmt >= '0' && *fmt <= '9') {
+                    precision = precision * 10 + (*fmt++ - '0');
+                }
+            }
+        }
+
+        // 'l' is the same size as int here; 'll' and 'z' are accepted too
+        int longlong = 0;
+        while (*fmt == 'l' || *fmt == 'z' || *fmt == 'h') {
+            if (fmt[0] == 'l' && fmt[1] == 'l') {
+                longlong = 1;
+                fmt++;
+            }
+            fmt++;
+        }
+
+        char conversion = *fmt;
+        if (!conversion) {
+            break;
+        }
+        fmt++;
+
+        switch (conversion) {
+            case 'd': case 'i': {
+                int64_t value = longlong ? __builtin_va_arg(args, int64_t)
+                                         : __builtin_va_arg(args, int);
+                uint64_t magnitude = value < 0 ? -(uint64_t)value : (uint64_t)value;
+                out_number(out, magnitude, value < 0, 10, flags, width, precision);
+                break;
+            }
+            case 'u': case 'x': case 'X': case 'o': {
+                uint64_t value = longlong ? __builtin_va_arg(args, uint64_t)
+                                          : __builtin_va_arg(args, unsigned int);
+                unsigned base = conversion == 'u' ? 10 : conversion == 'o' ? 8 : 16;
+                if (conversion == 'X') {
+                    flags |= FLAG_UPPER;
+                }
+                out_number(out, value, 0, base, flags, width, precision);
+                break;
+            }
+            case 'p': {
+                uintptr_t value = (uintptr_t)__builtin_va_arg(args, void*);
+                out_number(out, value, 0, 16, flags | FLAG_ALT | FLAG_ZERO,
+                           2 + 2 * sizeof(void*), -1);
+                break;
+            }
+            case 's': {
+                const char* str = __builtin_va_arg(args, const char*);
+                if (!str) {
+                    str = "(null)";
+                }
+                int len = 0;
+                while (str[len] && (precision < 0 || len < precision)) {
+                    len++;
+                }
+                if (!(flags & FLAG_LEFT)) {
+                    out_repeat(out, ' ', width - len);
+                }
+                out_string(out, str, len);
+                if (flags & FLAG_LEFT) {
+                    out_repeat(out, ' ', width - len);
+                }
+                break;
+            }
+            case 'c':
+                if (!(flags & FLAG_LEFT)) {
+                    out_repeat(out, ' ', width - 1);
+                }
+                out_char(out, (char)__builtin_va_arg(args, int));
+                if (flags & FLAG_LEFT) {
+                    out_repeat(out, ' ', width - 1);
+                }
+                break;
+            case '%':
+                out_char(out, '%');
+                break;
+            default:
+                // Unknown conversion: print it as written
+                out_char(out, '%');
+                out_char(out, conversion);
+                break;
+        }
+    }
+}
+
+// Format into 'buffer', always NUL-terminating when size > 0. Returns
+// the length the full output would have had.
+int kvsnprintf(char* buffer, size_t size, const char* fmt, __builtin_va_list args) {
+    struct printf_out out = { buffer, size ? size - 1 : 0, 0, 0, NULL };
+    format(&out, fmt, args);
+    if (size) {
+        buffer[out.pos] = '\0';
+    }
+    return out.total;
+}
+
+int ksnprintf(char* buffer, size_t size, const char* fmt, ...) {
+    __builtin_va_list args;
+    __builtin_va_start(args, fmt);
+    int len = kvsnprintf(buffer, size, fmt, args);
+    __builtin_va_end(args);
+    return len;
+}
+
+static void terminal_out_flush(struct printf_out* out) {
+    terminal_write(out->buffer, out->pos);
+    out->pos = 0;
+}
+
+int kvprintf(const char* fmt, __builtin_va_list args) {
+    char buffer[PRINTF_BUFFER_SIZE];
+    struct printf_out out = { buffer, sizeof(buffer), 0, 0, terminal_out_flush };
+    format(&out, fmt, args);
+    if (out.pos) {
+        terminal_out_flush(&out);
+    }
+    return out.total;
+}
+
+int kprintf(const char* fmt, ...) {
+    __builtin_va_list args;
+    __builtin_va_start(args, fmt);
+    int len = kvprintf(fmt, args);
+    __builtin_va_end(args);
+    return len;
+}
+
+void printf(const char* fmt, ...) {
+    __builtin_va_list args;
+    __builtin_va_start(args, fmt);
+    kvprintf(fmt, args);
+    __builtin_va_end(args);
+}
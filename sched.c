@@ -0,0 +1,510 @@
+/*
+ * sched.c - Preemptive kernel-thread scheduler
+ * Every CPU has one FIFO runqueue per priority with a bitmap of
+ * non-empty queues, so picking the next task is a single ctz. An idle
+ * CPU steals from the busiest other runqueue. The timer tick wakes
+ * sleepers and ends time slices; the switch itself happens on
+ * interrupt exit.
+ */
+
+#include "kernel.h"
+
+#define SCHED_STACK_PAGES   4               // 16KB per task, like the boot stack
+#define SCHED_STACK_MAGIC   0x5354414B      // "STAK" at the bottom of every stack
+#define SCHED_TIME_SLICE    10              // Ticks before a task is rotated
+#define EFLAGS_IF           0x200
+
+static struct task boot_task;
+static struct task* task_list;              // All tasks, newest first
+static spinlock_t task_list_lock = SPINLOCK_INIT("tasks");
+static uint32_t next_task_id;
+
+static int sched_running;
+
+static const char* task_state_names[] = { "run", "ready", "sleep", "block", "dead" };
+
+// Save callee-saved registers on the old stack, switch stacks, restore
+// and return into the new task. New tasks start in kthread_start.
+void switch_context(uint32_t* old_esp, uint32_t new_esp);
+asm(
+    ".global switch_context\n"
+    "switch_context:\n"
+    "    mov 4(%esp), %eax\n"
+    "    mov 8(%esp), %edx\n"
+    "    push %ebp\n"
+    "    push %ebx\n"
+    "    push %esi\n"
+    "    push %edi\n"
+    "    mov %esp, (%eax)\n"
+    "    mov %edx, %esp\n"
+    "    pop %edi\n"
+    "    pop %esi\n"
+    "    pop %ebx\n"
+    "    pop %ebp\n"
+    "    ret\n"
+);
+
+// Queue a ready task on 'cpu', which must be locked by the caller
+static void runqueue_push(struct cpu* cpu, struct task* task) {
+    uint8_t prio = task->priority;
+    task->state = TASK_READY;
+    task->cpu = cpu;
+    task->run_next = NULL;
+    if (cpu->runqueue_tail[prio]) {
+        cpu->runqueue_tail[prio]->run_next = task;
+    } else {
+        cpu->runqueue_head[prio] = task;
+    }
+    cpu->runqueue_tail[prio] = task;
+    cpu->runqueue_bitmap |= 1u << prio;
+    cpu->nr_ready++;
+
+    struct task* running = cpu->current;
+    if (running && (running == cpu->idle || prio < running->priority)) {
+        cpu->need_resched = 1;
+        if (cpu != this_cpu()) {
+            smp_send_reschedule(cpu);
+        }
+    }
+}
+
+static struct task* runqueue_pop(struct cpu* cpu) {
+    if (!cpu->runqueue_bitmap) {
+        return NULL;
+    }
+    uint32_t prio = __builtin_ctz(cpu->runqueue_bitmap);
+    struct task* task = cpu->runqueue_head[prio];
+    cpu->runqueue_head[prio] = task->run_next;
+    if (!cpu->runqueue_head[prio]) {
+        cpu->runqueue_tail[prio] = NULL;
+        cpu->runqueue_bitmap &= ~(1u << prio);
+    }
+    cpu->nr_ready--;
+    task->run_next = NULL;
+    return task;
+}
+
+// Lock the CPU a task belongs to; it may move while we wait
+static struct cpu* task_lock(struct task* task) {
+    while (1) {
+        struct cpu* cpu = task->cpu;
+        spin_lock(&cpu->lock);
+        if (task->cpu == cpu) {
+            return cpu;
+        }
+        spin_unlock(&cpu->lock);
+    }
+}
+
+// Busiest other CPU with tasks waiting, or NULL
+static struct cpu* steal_victim(struct cpu* cpu) {
+    struct cpu* victim = NULL;
+    uint32_t most = 0;
+    for (size_t i = 0; i < smp_cpu_count(); i++) {
+        struct cpu* other = smp_cpu(i);
+        if (other != cpu && other->online && other->nr_ready > most) {
+            victim = other;
+            most = other->nr_ready;
+        }
+    }
+    return victim;
+}
+
+// Take the next ready task of the busiest other CPU. The caller holds
+// its own lock, so the victim's is only tried, never waited for.
+static struct task* steal_task(struct cpu* cpu) {
+    struct cpu* victim = steal_victim(cpu);
+    if (!victim || !spin_trylock(&victim->lock)) {
+        return NULL;
+    }
+    struct task* task = runqueue_pop(victim);
+    if (task) {
+        task->cpu = cpu;
+        cpu->steals++;
+    }
+    spin_unlock(&victim->lock);
+    return task;
+}
+
+// Free the stacks of tasks that exited on this CPU. Every one of them
+// has been switched away from, so none is still on its stack.
+static void reap_dead_tasks(struct cpu* cpu) {
+    if (!cpu->dead_list) {
+        return;
+    }
+    spin_lock(&cpu->lock);
+    struct task* dead = cpu->dead_list;
+    cpu->dead_list = NULL;
+    spin_unlock(&cpu->lock);
+
+    while (dead) {
+        struct task* task = dead;
+        dead = task->run_next;
+
+        spin_lock(&task_list_lock);
+        struct task** link = &task_list;
+        while (*link != task) {
+            link = &(*link)->all_next;
+        }
+        *link = task->all_next;
+        spin_unlock(&task_list_lock);
+
+        pmm_free_frames(task->stack_base);
+        kfree(task);
+    }
+}
+
+// Pick the next task for 'cpu' and switch to it. Called with interrupts
+// off and cpu->lock held; the lock is dropped once the switch is done,
+// by whichever task runs next, so no other CPU can pick up the previous
+// task before its registers are saved.
+static void schedule_locked(struct cpu* cpu) {
+    cpu->need_resched = 0;
+    cpu->quiescent++;           // No RCU reader gets here
+
+    struct task* prev = cpu->current;
+    if (*(uint32_t*)prev->stack_base != SCHED_STACK_MAGIC) {
+        kernel_panic("sched: kernel stack overflow");
+    }
+    if (prev == cpu->idle) {
+        prev->state = TASK_READY;
+    } else if (prev->state == TASK_RUNNING) {
+        runqueue_push(cpu, prev);
+    }
+
+    struct task* next = runqueue_pop(cpu);
+    if (!next) {
+        next = steal_task(cpu);
+    }
+    if (!next) {
+        next = cpu->idle;
+    }
+    next->state = TASK_RUNNING;
+    next->cpu = cpu;
+    cpu->slice_left = SCHED_TIME_SLICE;
+
+    if (next != prev) {
+        next->switches++;
+        cpu->current = next;
+        switch_context(&prev->esp, next->esp);
+        // Back on prev's stack, possibly on another CPU by now
+        cpu = this_cpu();
+    }
+    spin_unlock(&cpu->lock);
+    reap_dead_tasks(cpu);
+}
+
+// Pick the highest-priority ready task and switch to it. The current
+// task is requeued if it is still runnable.
+void schedule(void) {
+    uint32_t flags = irq_save();
+    struct cpu* cpu = this_cpu();
+    spin_lock(&cpu->lock);
+    schedule_locked(cpu);
+    irq_restore(flags);
+}
+
+// First code a new task runs, entered from switch_context's ret with
+// the runqueue lock of the switching CPU still held
+static void kthread_start(void) {
+    struct cpu* cpu = this_cpu();
+    spin_unlock(&cpu->lock);
+    reap_dead_tasks(cpu);
+    asm volatile("sti");
+
+    struct task* self = current_task();
+    self->entry(self->arg);
+    kthread_exit();
+}
+
+// Rescheduling is driven by the tick and by reschedule IPIs, both of
+// which preempt the idle task on their way out
+static void idle_task(void* arg) {
+    UNUSED(arg);
+    while (1) {
+        asm volatile("sti; hlt");
+    }
+}
+
+// Allocate a task and its stack, ready for its first switch_context
+static struct task* task_create(const char* name, void (*entry)(void*), void* arg, uint8_t priority) {
+    struct task* task = kmalloc(sizeof(struct task));
+    if (!task) {
+        return NULL;
+    }
+    uintptr_t stack = pmm_alloc_frames(SCHED_STACK_PAGES, 1);
+    if (!stack) {
+        kfree(task);
+        return NULL;
+    }
+
+    memset(task, 0, sizeof(*task));
+    task->name = name;
+    task->priority = priority;
+    task->entry = entry;
+    task->arg = arg;
+    task->stack_base = stack;
+    task->state = TASK_READY;
+    *(uint32_t*)stack = SCHED_STACK_MAGIC;
+
+    // Initial frame for switch_context: edi, esi, ebx, ebp, return address
+    uint32_t* sp = (uint32_t*)(stack + SCHED_STACK_PAGES * PAGE_SIZE);
+    *--sp = 0;                          // Fake return address of kthread_start
+    *--sp = (uint32_t)kthread_start;
+    *--sp = 0;                          // ebp
+    *--sp = 0;                          // ebx
+    *--sp = 0;                          // esi
+    *--sp = 0;                          // edi
+    task->esp = (uint32_t)sp;
+
+    uint32_t flags = spin_lock_irqsave(&task_list_lock);
+    task->id = next_task_id++;
+    task->all_next = task_list;
+    task_list = task;
+    spin_unlock_irqrestore(&task_list_lock, flags);
+    return task;
+}
+
+// Online CPU with the fewest tasks running or waiting
+static struct cpu* least_loaded_cpu(void) {
+    struct cpu* best = this_cpu();
+    uint32_t best_load = 0xFFFFFFFF;
+    for (size_t i = 0; i < smp_cpu_count(); i++) {
+        struct cpu* cpu = smp_cpu(i);
+        uint32_t load = cpu->nr_ready + (cpu->current != cpu->idle);
+        if (cpu->online && load < best_load) {
+            best = cpu;
+            best_load = load;
+        }
+    }
+    return best;
+}
+
+// Create a task and make it ready; priority 0 is the highest
+struct task* kthread_create(const char* name, void (*entry)(void*), void* arg, uint8_t priority) {
+    if (priority >= SCHED_PRIORITIES) {
+        priority = SCHED_PRIORITIES - 1;
+    }
+
+    struct task* task = task_create(name, entry, arg, priority);
+    if (!task) {
+        return NULL;
+    }
+
+    uint32_t flags = irq_save();
+    struct cpu* cpu = least_loaded_cpu();
+    spin_lock(&cpu->lock);
+    runqueue_push(cpu, task);
+    spin_unlock(&cpu->lock);
+    irq_restore(flags);
+    return task;
+}
+
+// Terminate the calling task
+void kthread_exit(void) {
+    asm volatile("cli");
+    struct cpu* cpu = this_cpu();
+    spin_lock(&cpu->lock);
+    struct task* self = cpu->current;
+    self->state = TASK_DEAD;
+    self->run_next = cpu->dead_list;
+    cpu->dead_list = self;
+    schedule_locked(cpu);
+    kernel_panic("sched: dead task was scheduled");
+}
+
+// Let other tasks of the same or higher priority run
+void kthread_yield(void) {
+    schedule();
+}
+
+// Sleep for at least 'ms' milliseconds
+void kthread_sleep(uint32_t ms) {
+    uint32_t flags = irq_save();
+    struct cpu* cpu = this_cpu();
+    spin_lock(&cpu->lock);
+    struct task* self = cpu->current;
+    self->wake_tick = (uint32_t)timer_ticks() + ms + 1;
+    self->state = TASK_SLEEPING;
+
+    struct task** link = &cpu->sleep_list;
+    while (*link && (int32_t)((*link)->wake_tick - self->wake_tick) <= 0) {
+        link = &(*link)->run_next;
+    }
+    self->run_next = *link;
+    *link = self;
+
+    schedule_locked(cpu);
+    irq_restore(flags);
+}
+
+// Block until sched_wake; returns at once if a wakeup already arrived
+void sched_block(void) {
+    uint32_t flags = irq_save();
+    struct cpu* cpu = this_cpu();
+    spin_lock(&cpu->lock);
+    struct task* self = cpu->current;
+    if (self->wake_pending) {
+        self->wake_pending = 0;
+        spin_unlock(&cpu->lock);
+    } else {
+        self->state = TASK_BLOCKED;
+        schedule_locked(cpu);
+    }
+    irq_restore(flags);
+}
+
+// Make a blocked task runnable; safe from interrupt handlers and
+// from any CPU
+void sched_wake(struct task* task) {
+    uint32_t flags = irq_save();
+    struct cpu* cpu = task_lock(task);
+    if (task->state == TASK_BLOCKED) {
+        runqueue_push(cpu, task);
+    } else if (task->state != TASK_DEAD) {
+        task->wake_pending = 1;
+    }
+    spin_unlock(&cpu->lock);
+    irq_restore(flags);
+}
+
+// True when another CPU has tasks waiting that this one could take
+static int work_to_steal(struct cpu* cpu) {
+    return steal_victim(cpu) != NULL;
+}
+
+// Timer tick on every CPU, in interrupt context: wake this CPU's
+// sleepers, end time slices, and send an idle CPU stealing
+void sched_tick(uint32_t now) {
+    struct cpu* cpu = this_cpu();
+    // Interrupted with preemption enabled, so not inside an RCU reader
+    if (cpu->preempt_count == 0 && cpu->interrupt_depth == 1) {
+        cpu->quiescent++;
+    }
+    if (!sched_running || !cpu->current) {
+        return;
+    }
+
+    spin_lock(&cpu->lock);
+    struct task* running = cpu->current;
+    running->ticks++;
+    cpu->ticks++;
+
+    while (cpu->sleep_list && (int32_t)(now - cpu->sleep_list->wake_tick) >= 0) {
+        struct task* task = cpu->sleep_list;
+        cpu->sleep_list = task->run_next;
+        runqueue_push(cpu, task);
+    }
+
+    if (running == cpu->idle) {
+        cpu->idle_ticks++;
+        if (!cpu->runqueue_bitmap && work_to_steal(cpu)) {
+            cpu->need_resched = 1;
+        }
+    } else if (cpu->slice_left && --cpu->slice_left == 0) {
+        // Rotate only when something of equal or higher priority is waiting
+        if (cpu->runqueue_bitmap & ((2u << running->priority) - 1)) {
+            cpu->need_resched = 1;
+        } else {
+            cpu->slice_left = SCHED_TIME_SLICE;
+        }
+    }
+    spin_unlock(&cpu->lock);
+}
+
+// Called on the way out of an interrupt handler
+void sched_preempt(void) {
+    struct cpu* cpu = this_cpu();
+    if (sched_running && cpu->current && cpu->need_resched && cpu->preempt_count == 0) {
+        schedule();
+    }
+}
+
+// The count is per CPU and changed in one instruction, so an interrupt
+// or a migration cannot split the update
+void preempt_disable(void) {
+    asm volatile("incl %%fs:%c0" : : "i"(__builtin_offsetof(struct cpu, preempt_count)) : "memory");
+}
+
+void preempt_enable(void) {
+    asm volatile("decl %%fs:%c0" : : "i"(__builtin_offsetof(struct cpu, preempt_count)) : "memory");
+
+    uint32_t flags;
+    asm volatile("pushf; pop %0" : "=r"(flags));
+    if (this_cpu_read(preempt_count) == 0 && this_cpu_read(need_resched) &&
+        (flags & EFLAGS_IF) && !in_interrupt()) {
+        schedule();
+    }
+}
+
+struct task* current_task(void) {
+    return this_cpu_read(current);
+}
+
+// True once sched_init has run and blocking calls may switch tasks
+int sched_active(void) {
+    return sched_running;
+}
+
+static void cmd_ps(int argc, char** argv) {
+    UNUSED(argc);
+    UNUSED(argv);
+
+    printf("  ID  PRI CPU STATE   TICKS SWITCHES NAME\n");
+    uint32_t flags = spin_lock_irqsave(&task_list_lock);
+    for (struct task* task = task_list; task; task = task->all_next) {
+        printf("%4u %4u %3u %-5s %7u %8u %s\n", task->id, task->priority,
+               task->cpu ? task->cpu->index : 0, task_state_names[task->state],
+               task->ticks, task->switches, task->name);
+    }
+    spin_unlock_irqrestore(&task_list_lock, flags);
+}
+
+// Give 'cpu' its idle task; returns the top of the idle stack, which
+// an application processor starts on, or 0 when out of memory
+uintptr_t sched_init_cpu(struct cpu* cpu) {
+    struct task* idle = task_create("idle", idle_task, NULL, SCHED_PRIORITIES - 1);
+    if (!idle) {
+        return 0;
+    }
+    idle->cpu = cpu;
+    cpu->idle = idle;
+    return idle->stack_base + SCHED_STACK_PAGES * PAGE_SIZE;
+}
+
+// Become the idle task of an application processor; does not return
+void sched_start_cpu(struct cpu* cpu) {
+    struct task* idle = cpu->idle;
+    idle->state = TASK_RUNNING;
+    idle->switches++;
+    cpu->slice_left = SCHED_TIME_SLICE;
+    cpu->current = idle;
+    __sync_synchronize();
+    cpu->online = 1;
+    idle_task(NULL);
+}
+
+// Turn the boot context into the first task and start the idle task
+void sched_init(void) {
+    extern uint8_t stack_top[];
+    struct cpu* cpu = this_cpu();
+
+    boot_task.name = "main";
+    boot_task.priority = SCHED_DEFAULT_PRIORITY;
+    boot_task.state = TASK_RUNNING;
+    boot_task.stack_base = (uintptr_t)stack_top - SCHED_STACK_PAGES * PAGE_SIZE;
+    *(uint32_t*)boot_task.stack_base = SCHED_STACK_MAGIC;
+    boot_task.id = next_task_id++;
+    boot_task.all_next = NULL;
+    boot_task.cpu = cpu;
+    task_list = &boot_task;
+    cpu->current = &boot_task;
+    cpu->slice_left = SCHED_TIME_SLICE;
+
+    if (!sched_init_cpu(cpu)) {
+        kernel_panic("sched: cannot create the idle task");
+    }
+
+    shell_register_command("ps", cmd_ps, "List kernel threads");
+    sched_running = 1;
+}
@@ -0,0 +1,280 @@
+/*
+ * serial.c - COM1 console on a 16550 UART
+ * Output is queued in a ring and fed to the 16-byte transmit FIFO from
+ * the THRE interrupt; received characters go to the shell like keys.
+ * Until interrupts are set up the ring is drained by polling.
+ */
+
+#include "kernel.h"
+
+#define COM1_PORT   0x3F8
+#define COM1_IRQ    4
+#define SERIAL_BAUD 115200
+
+// Register offsets from the base port
+#define UART_DATA   0       // RBR/THR, divisor low with DLAB
+#define UART_IER    1       // Interrupt enable, divisor high with DLAB
+#define UART_IIR    2       // Interrupt identification (read)
+#define UART_FCR    2       // FIFO control (write)
+#define UART_LCR    3
+#define UART_MCR    4
+#define UART_LSR    5
+#define UART_MSR    6
+
+#define IER_RX      0x01
+#define IER_THRE    0x02
+#define LCR_8N1     0x03
+#define LCR_DLAB    0x80
+#define FCR_ENABLE  0xC7    // Enable and clear both FIFOs, 14-byte RX trigger
+#define MCR_DTR_RTS 0x03
+#define MCR_OUT2    0x08    // Gates the UART interrupt onto the IRQ line
+#define MCR_LOOP    0x10
+#define LSR_DATA    0x01
+#define LSR_THRE    0x20
+#define IIR_NONE    0x01
+
+#define UART_FIFO_SIZE 16
+
+#define SERIAL_TX_SIZE 4096     // Must be a power of two
+#define SERIAL_RX_SIZE 256      // Must be a power of two
+
+static char tx_ring[SERIAL_TX_SIZE];
+static uint32_t tx_head;
+static uint32_t tx_tail;
+static spinlock_t tx_lock = SPINLOCK_INIT("serial-tx");    // The ISR may run on another CPU
+// Lock-free like the keyboard ring: the IRQ only writes rx_head
+static char rx_ring[SERIAL_RX_SIZE];
+static volatile uint32_t rx_head;
+static volatile uint32_t rx_tail;
+
+static int serial_present;
+static int serial_irq_ready;
+static uint8_t serial_ier;
+
+static void serial_sink_write(const char* data, size_t size);
+static void serial_sync(void);
+
+static struct terminal_sink serial_sink = {
+    "serial", serial_sink_write, serial_sync, NULL, 1, NULL
+};
+
+static inline uint8_t uart_read(uint16_t reg) {
+    return inb(COM1_PORT + reg);
+}
+
+static inline void uart_write(uint16_t reg, uint8_t value) {
+    outb(COM1_PORT + reg, value);
+}
+
+// Move queued bytes into the transmit FIFO if it is empty. Callers
+// hold interrupts off.
+static void serial_tx_fill(void) {
+    if (!(uart_read(UART_LSR) & LSR_THRE)) {
+        return;
+    }
+    for (int i = 0; i < UART_FIFO_SIZE && tx_tail != tx_head; i++) {
+        uart_write(UART_DATA, tx_ring[tx_tail++ & (SERIAL_TX_SIZE - 1)]);
+    }
+}
+
+// THRE interrupts only while there is something to send
+static void serial_tx_update_ier(void) {
+    uint8_t ier = tx_tail != tx_head ? serial_ier | IER_THRE : serial_ier & ~IER_THRE;
+    if (ier != serial_ier) {
+        serial_ier = ier;
+        uart_write(UART_IER, ier);
+    }
+}
+
+// Drain the whole ring by polling; for early boot and panics
+static void serial_sync(void) {
+    uint32_t flags = spin_lock_irqsave(&tx_lock);
+    while (tx_tail != tx_head) {
+        serial_tx_fill();
+        asm volatile("pause");
+    }
+    spin_unlock_irqrestore(&tx_lock, flags);
+}
+
+static void serial_tx_push(char c) {
+    while (tx_head - tx_tail == SERIAL_TX_SIZE) {
+        // Ring full: wait for the FIFO instead of the interrupt
+        serial_tx_fill();
+        asm volatile("pause");
+    }
+    tx_ring[tx_head++ & (SERIAL_TX_SIZE - 1)] = c;
+}
+
+static void serial_sink_write(const char* data, size_t size) {
+    if (!serial_present) {
+        return;
+    }
+
+    uint32_t flags = spin_lock_irqsave(&tx_lock);
+    for (size_t i = 0; i < size; i++) {
+        if (data[i] == '\n') {
+            serial_tx_push('\r');
+        }
+        serial_tx_push(data[i]);
+    }
+
+    if (serial_irq_ready) {
+        serial_tx_fill();
+        serial_tx_update_ier();
+    }
+    spin_unlock_irqrestore(&tx_lock, flags);
+
+    if (!serial_irq_ready) {
+        serial_sync();
+    }
+}
+
+static void serial_irq_handler(struct interrupt_frame* frame) {
+    UNUSED(frame);
+    uint8_t iir;
+    while (!((iir = uart_read(UART_IIR)) & IIR_NONE)) {
+        switch ((iir >> 1) & 0x7) {
+            case 0:     // Modem status
+                uart_read(UART_MSR);
+                break;
+            case 1:     // Transmit FIFO empty
+                spin_lock(&tx_lock);
+                serial_tx_fill();
+                serial_tx_update_ier();
+                spin_unlock(&tx_lock);
+                break;
+            case 2:     // Received data
+            case 6:     // Character timeout
+                while (uart_read(UART_LSR) & LSR_DATA) {
+                    uint8_t c = uart_read(UART_DATA);
+                    uint32_t head = rx_head;
+                    if (head - rx_tail < SERIAL_RX_SIZE) {
+                        rx_ring[head & (SERIAL_RX_SIZE - 1)] = c;
+                        ring_barrier();
+                        rx_head = head + 1;
+                    }
+                }
+                input_wake();
+                break;
+            case 3:     // Line status
+                uart_read(UART_LSR);
+                break;
+        }
+    }
+}
+
+// Program COM1 and add it as a terminal sink; output is polled until
+// serial_enable_irq. Does nothing when no UART answers.
+void serial_init(void) {
+    uart_write(UART_IER, 0);
+
+    // A missing UART will not echo a byte back in loopback mode
+    uart_write(UART_MCR, MCR_LOOP | MCR_DTR_RTS);
+    uart_write(UART_DATA, 0xAE);
+    if (uart_read(UART_DATA) != 0xAE) {
+        return;
+    }
+
+    uint16_t divisor = 115200 / SERIAL_BAUD;
+    uart_write(UART_LCR, LCR_DLAB);
+    uart_write(UART_DATA, divisor & 0xFF);
+    uart_write(UART_IER, divisor >> 8);
+    uart_write(UART_LCR, LCR_8N1);
+    uart_write(UART_FCR, FCR_ENABLE);
+    uart_write(UART_MCR, MCR_DTR_RTS | MCR_OUT2);
+
+    serial_present = 1;
+    terminal_add_sink(&serial_sink);
+}
+
+// Output for COM1 alone, whichever sinks the console has enabled
+void serial_write(const char* data, size_t size) {
+    serial_sink_write(data, size);
+}
+
+// Switch to interrupt-driven TX and RX once the IDT and PIC are up
+void serial_enable_irq(void) {
+    if (!serial_present) {
+        return;
+    }
+    register_irq_handler(COM1_IRQ, serial_irq_handler);
+
+    uint32_t flags = spin_lock_irqsave(&tx_lock);
+    serial_ier = IER_RX;
+    uart_write(UART_IER, serial_ier);
+    serial_irq_ready = 1;
+    serial_tx_update_ier();
+    spin_unlock_irqrestore(&tx_lock, flags);
+}
+
+int serial_has_input(void) {
+    return rx_head != rx_tail;
+}
+
+// Editing keys arrive as ANSI escape sequences: ESC [ A for up, or
+// ESC [ 3 ~ for Delete, with an optional numeric parameter
+static int serial_escape_key(char final, int param) {
+    switch (final) {
+        case 'A': return KEY_UP;
+        case 'B': return KEY_DOWN;
+        case 'C': return KEY_RIGHT;
+        case 'D': return KEY_LEFT;
+        case 'H': return KEY_HOME;
+        case 'F': return KEY_END;
+        case '~':
+            switch (param) {
+                case 1: case 7: return KEY_HOME;
+                case 2: return KEY_INSERT;
+                case 3: return KEY_DELETE;
+                case 4: case 8: return KEY_END;
+                case 5: return KEY_PAGE_UP;
+                case 6: return KEY_PAGE_DOWN;
+            }
+            break;
+    }
+    return 0;
+}
+
+// Feed received characters to the shell (main loop only)
+void serial_process_input(void) {
+    static int escape_state;        // 0, 1 after ESC, 2 inside ESC [ or ESC O
+    static int escape_param;
+
+    uint32_t tail = rx_tail;
+    while (tail != rx_head) {
+        ring_barrier();
+        char c = rx_ring[tail & (SERIAL_RX_SIZE - 1)];
+        ring_barrier();
+        rx_tail = ++tail;
+
+        if (escape_state == 1) {
+            escape_state = (c == '[' || c == 'O') ? 2 : 0;
+            escape_param = 0;
+            continue;
+        }
+        if (escape_state == 2) {
+            if (c >= '0' && c <= '9') {
+                escape_param = escape_param * 10 + (c - '0');
+                continue;
+            }
+            escape_state = 0;
+            int key = serial_escape_key(c, escape_param);
+            if (key) {
+                shell_input_char(key);
+            }
+            continue;
+        }
+        if (c == 0x1B) {
+            escape_state = 1;
+            continue;
+        }
+
+        // Terminals send CR for Enter and DEL for Backspace
+        if (c == '\r') {
+            c = '\n';
+        } else if (c == 0x7F) {
+            c = '\b';
+        }
+        shell_input_char((uint8_t)c);
+    }
+}
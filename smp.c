@@ -0,0 +1,352 @@
+/*
+ * smp.c - Multiprocessor bring-up
+ * The ACPI MADT lists the CPUs. Each application processor is started
+ * with INIT-SIPI-SIPI at a real-mode trampoline copied below 1MB, sets
+ * up its own IDT, paging and APIC timer, and then joins the scheduler
+ * on its idle task.
+ */
+
+#include "kernel.h"
+
+#define SMP_TRAMPOLINE      0x8000      // Page below 1MB, free after boot
+#define AP_START_TIMEOUT_MS 100
+#define NMI_VECTOR          2
+
+#define BDA_EBDA_SEGMENT    0x40E       // Segment of the extended BIOS data area
+#define BIOS_ROM_START      0xE0000
+#define BIOS_ROM_END        0x100000
+
+#define MADT_LOCAL_APIC     0
+#define MADT_CPU_ENABLED    0x1
+
+// Interrupt command register values
+#define ICR_INIT            0x00004500  // INIT, level assert
+#define ICR_STARTUP         0x00004600  // Startup IPI; the low byte is the page
+#define ICR_FIXED           0x00004000
+#define ICR_NMI             0x00004400
+#define ICR_ALL_BUT_SELF    0x000C0000
+
+#define STR_(x) #x
+#define STR(x) STR_(x)
+
+struct acpi_rsdp {
+    char signature[8];          // "RSD PTR "
+    uint8_t checksum;
+    char oem_id[6];
+    uint8_t revision;
+    uint32_t rsdt_address;
+} __attribute__((packed));
+
+struct acpi_header {
+    char signature[4];
+    uint32_t length;
+    uint8_t revision;
+    uint8_t checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+} __attribute__((packed));
+
+struct acpi_madt {
+    struct acpi_header header;
+    uint32_t lapic_address;
+    uint32_t flags;
+} __attribute__((packed));
+
+struct madt_local_apic {
+    uint8_t type;
+    uint8_t length;
+    uint8_t acpi_id;
+    uint8_t apic_id;
+    uint32_t flags;
+} __attribute__((packed));
+
+// Parameters the BSP leaves in the trampoline for the next AP
+struct trampoline_data {
+    uint16_t reserved;
+    struct gdt_descriptor gdt;
+    uint32_t stack;
+    struct cpu* cpu;
+} __attribute__((packed));
+
+static struct cpu cpus[SMP_MAX_CPUS];
+static size_t cpu_count;
+static size_t cpus_listed;          // Enabled CPUs in the MADT, even past SMP_MAX_CPUS
+static int smp_started;
+
+// The SIPI starts this at SMP_TRAMPOLINE:0 in real mode. It loads the
+// kernel GDT, enters protected mode and calls ap_entry on the stack
+// the BSP picked. It runs from the copy, so only absolute addresses.
+extern uint8_t smp_trampoline[];
+extern uint8_t smp_trampoline_data[];
+extern uint8_t smp_trampoline_end[];
+asm(
+    ".pushsection .rodata\n"
+    ".global smp_trampoline, smp_trampoline_data, smp_trampoline_end\n"
+    ".code16\n"
+    "smp_trampoline:\n"
+    "    cli\n"
+    "    cld\n"
+    "    xor %ax, %ax\n"
+    "    mov %ax, %ds\n"
+    "    lgdtl smp_trampoline_data + 2 - smp_trampoline + " STR(SMP_TRAMPOLINE) "\n"
+    "    mov %cr0, %eax\n"
+    "    or $1, %eax\n"
+    "    mov %eax, %cr0\n"
+    "    ljmpl $0x08, $(1f - smp_trampoline + " STR(SMP_TRAMPOLINE) ")\n"
+    ".code32\n"
+    "1:  mov $0x10, %ax\n"
+    "    mov %ax, %ds\n"
+    "    mov %ax, %es\n"
+    "    mov %ax, %fs\n"
+    "    mov %ax, %gs\n"
+    "    mov %ax, %ss\n"
+    "    mov smp_trampoline_data + 8 - smp_trampoline + " STR(SMP_TRAMPOLINE) ", %esp\n"
+    "    pushl smp_trampoline_data + 12 - smp_trampoline + " STR(SMP_TRAMPOLINE) "\n"
+    "    mov $ap_entry, %eax\n"
+    "    call *%eax\n"
+    "2:  cli\n"
+    "    hlt\n"
+    "    jmp 2b\n"
+    ".balign 4\n"
+    "smp_trampoline_data:\n"
+    "    .fill 16, 1, 0\n"             // struct trampoline_data
+    "smp_trampoline_end:\n"
+    ".popsection\n"
+);
+
+static int acpi_checksum_ok(const void* table, size_t length) {
+    const uint8_t* bytes = table;
+    uint8_t sum = 0;
+    for (size_t i = 0; i < length; i++) {
+        sum += bytes[i];
+    }
+    return sum == 0;
+}
+
+static const struct acpi_rsdp* rsdp_scan(uintptr_t start, uintptr_t end) {
+    for (uintptr_t addr = start; addr + sizeof(struct acpi_rsdp) <= end; addr += 16) {
+        const struct acpi_rsdp* rsdp = (const struct acpi_rsdp*)addr;
+        if (memcmp(rsdp->signature, "RSD PTR ", 8) == 0 && acpi_checksum_ok(rsdp, sizeof(*rsdp))) {
+            return rsdp;
+        }
+    }
+    return NULL;
+}
+
+// The RSDP is in the first KB of the EBDA or in the BIOS ROM area.
+// Only called before paging, while page 0 is still readable.
+static const struct acpi_rsdp* rsdp_find(void) {
+    uintptr_t bda = BDA_EBDA_SEGMENT;
+    asm("" : "+r"(bda));            // Not a null pointer, whatever GCC thinks
+    uintptr_t ebda = (uintptr_t)*(const volatile uint16_t*)bda << 4;
+
+    const struct acpi_rsdp* rsdp = ebda ? rsdp_scan(ebda, ebda + 1024) : NULL;
+    return rsdp ? rsdp : rsdp_scan(BIOS_ROM_START, BIOS_ROM_END);
+}
+
+static const struct acpi_madt* madt_find(void) {
+    const struct acpi_rsdp* rsdp = rsdp_find();
+    if (!rsdp) {
+        return NULL;
+    }
+
+    const struct acpi_header* rsdt = (const struct acpi_header*)(uintptr_t)rsdp->rsdt_address;
+    if (memcmp(rsdt->signature, "RSDT", 4) != 0 || !acpi_checksum_ok(rsdt, rsdt->length)) {
+        return NULL;
+    }
+
+    const uint32_t* entries = (const uint32_t*)(rsdt + 1);
+    size_t count = (rsdt->length - sizeof(*rsdt)) / sizeof(uint32_t);
+    for (size_t i = 0; i < count; i++) {
+        const struct acpi_header* table = (const struct acpi_header*)(uintptr_t)entries[i];
+        if (memcmp(table->signature, "APIC", 4) == 0 && acpi_checksum_ok(table, table->length)) {
+            return (const struct acpi_madt*)table;
+        }
+    }
+    return NULL;
+}
+
+// Flat-limit data descriptor covering one struct cpu
+static uint64_t cpu_segment(const struct cpu* cpu) {
+    uint32_t base = (uint32_t)cpu;
+    uint32_t limit = sizeof(struct cpu) - 1;
+    return (limit & 0xFFFF) | ((uint64_t)(base & 0xFFFFFF) << 16) |
+           ((uint64_t)0x92 << 40) | ((uint64_t)((limit >> 16) & 0xF) << 48) |
+           ((uint64_t)0x4 << 52) | ((uint64_t)(base >> 24) << 56);
+}
+
+static void cpu_add(uint32_t apic_id) {
+    struct cpu* cpu = &cpus[cpu_count];
+    cpu->self = cpu;
+    cpu->index = cpu_count;
+    cpu->apic_id = apic_id;
+    spin_lock_init(&cpu->lock, "runqueue");
+    kernel_gdt[GDT_CPU_FIRST + cpu_count] = cpu_segment(cpu);
+    cpu_count++;
+}
+
+static void cpu_load_segment(const struct cpu* cpu) {
+    uint16_t selector = (GDT_CPU_FIRST + cpu->index) * 8;
+    asm volatile("mov %0, %%fs" : : "r"(selector) : "memory");
+}
+
+// Set up the boot CPU's struct cpu and list the others from the MADT.
+// Runs first in kernel_main: nothing per-CPU works before it.
+void smp_early_init(void) {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    uint32_t bsp_apic_id = ebx >> 24;
+
+    cpu_add(bsp_apic_id);
+    cpu_load_segment(&cpus[0]);
+    cpus[0].online = 1;
+    cpus_listed = 1;
+
+    const struct acpi_madt* madt = madt_find();
+    if (!madt) {
+        return;
+    }
+
+    uintptr_t entry = (uintptr_t)(madt + 1);
+    uintptr_t end = (uintptr_t)madt + madt->header.length;
+    while (entry + 2 <= end) {
+        const struct madt_local_apic* lapic = (const struct madt_local_apic*)entry;
+        if (lapic->length < 2) {
+            break;
+        }
+        if (lapic->type == MADT_LOCAL_APIC && (lapic->flags & MADT_CPU_ENABLED) &&
+            lapic->apic_id != bsp_apic_id) {
+            cpus_listed++;
+            if (cpu_count < SMP_MAX_CPUS) {
+                cpu_add(lapic->apic_id);
+            }
+        }
+        entry += lapic->length;
+    }
+}
+
+// First C code on an application processor, on its idle task's stack
+ASMLINKAGE void ap_entry(struct cpu* cpu) {
+    cpu_load_segment(cpu);
+    idt_load();
+    string_init();
+    paging_init_cpu();
+    timer_init_cpu();
+    sched_start_cpu(cpu);
+}
+
+static void spin_delay_us(uint32_t us) {
+    uint64_t end = ktime_ns() + (uint64_t)us * 1000;
+    while (ktime_ns() < end) {
+        asm volatile("pause");
+    }
+}
+
+static int cpu_start(struct cpu* cpu) {
+    uintptr_t stack = sched_init_cpu(cpu);
+    if (!stack) {
+        return 0;
+    }
+
+    struct trampoline_data* data = (struct trampoline_data*)
+        (SMP_TRAMPOLINE + (smp_trampoline_data - smp_trampoline));
+    data->gdt = kernel_gdt_descriptor;
+    data->stack = stack;
+    data->cpu = cpu;
+
+    // INIT, then up to two startup IPIs as the MP specification asks
+    lapic_send_ipi(cpu->apic_id, ICR_INIT);
+    sleep_ms(10);
+    for (int attempt = 0; attempt < 2 && !cpu->online; attempt++) {
+        lapic_send_ipi(cpu->apic_id, ICR_STARTUP | (SMP_TRAMPOLINE >> 12));
+        spin_delay_us(200);
+    }
+
+    for (int waited = 0; waited < AP_START_TIMEOUT_MS && !cpu->online; waited++) {
+        sleep_ms(1);
+    }
+    return cpu->online;
+}
+
+static void reschedule_handler(struct interrupt_frame* frame) {
+    UNUSED(frame);
+    lapic_eoi();                    // interrupt_dispatch preempts on the way out
+}
+
+static void nmi_halt_handler(struct interrupt_frame* frame) {
+    UNUSED(frame);
+    while (1) {
+        asm volatile("cli; hlt");
+    }
+}
+
+static void cmd_cpus(int argc, char** argv) {
+    UNUSED(argc);
+    UNUSED(argv);
+
+    printf("CPU APIC STATE   READY  STEALS  BUSY%% CURRENT\n");
+    for (size_t i = 0; i < cpu_count; i++) {
+        struct cpu* cpu = &cpus[i];
+        uint32_t busy = cpu->ticks ? (cpu->ticks - cpu->idle_ticks) * 100 / cpu->ticks : 0;
+        struct task* current = cpu->current;
+        printf("%3u %4u %-7s %5u %7u %5u%% %s\n", cpu->index, cpu->apic_id,
+               cpu->online ? "online" : "offline", cpu->nr_ready, cpu->steals, busy,
+               current ? current->name : "-");
+    }
+    if (cpus_listed > cpu_count) {
+        printf("%u more CPUs beyond SMP_MAX_CPUS\n", (unsigned)(cpus_listed - cpu_count));
+    }
+}
+
+// Start every CPU found by smp_early_init; needs the scheduler and timer
+void smp_init(void) {
+    shell_register_command("cpus", cmd_cpus, "Show per-CPU scheduler state");
+    if (cpu_count < 2) {
+        return;
+    }
+    if (!lapic_present()) {
+        printf("SMP: %u CPUs but no local APIC, using one\n", (unsigned)cpu_count);
+        return;
+    }
+
+    register_interrupt_handler(SMP_RESCHEDULE_VECTOR, reschedule_handler);
+    register_interrupt_handler(NMI_VECTOR, nmi_halt_handler);
+    memcpy((void*)SMP_TRAMPOLINE, smp_trampoline, smp_trampoline_end - smp_trampoline);
+    smp_started = 1;
+
+    // One at a time: they share the trampoline parameters
+    size_t online = 1;
+    for (size_t i = 1; i < cpu_count; i++) {
+        if (cpu_start(&cpus[i])) {
+            online++;
+        } else {
+            printf("SMP: CPU %u (APIC %u) did not start\n", (unsigned)i, cpus[i].apic_id);
+        }
+    }
+    printf("SMP: %u of %u CPUs online\n", (unsigned)online, (unsigned)cpu_count);
+}
+
+size_t smp_cpu_count(void) {
+    return cpu_count;
+}
+
+struct cpu* smp_cpu(size_t index) {
+    return index < cpu_count ? &cpus[index] : NULL;
+}
+
+// Make another CPU look at its runqueue now instead of at its next tick
+void smp_send_reschedule(struct cpu* cpu) {
+    if (smp_started && cpu->online) {
+        lapic_send_ipi(cpu->apic_id, ICR_FIXED | SMP_RESCHEDULE_VECTOR);
+    }
+}
+
+// Stop the other CPUs with an NMI, e.g. before printing a panic
+void smp_halt_others(void) {
+    if (smp_started) {
+        lapic_send_ipi(0, ICR_NMI | ICR_ALL_BUT_SELF);
+    }
+}
@@ -0,0 +1,350 @@
+/*
+ * string.c - Freestanding string and memory routines
+ * rep movsd/stosd for bulk work, word-at-a-time strlen and an
+ * SSE2 path for large blocks that is enabled at boot through CPUID
+ */
+
+#include "kernel.h"
+
+// Below this size the setup cost of the SSE2 loops is not worth it
+#define STRING_SSE2_THRESHOLD 512
+// From here on stores bypass the cache so big copies don't evict everything
+#define STRING_NT_THRESHOLD (256 * 1024)
+
+#define CPUID_EDX_FXSR (1u << 24)
+#define CPUID_EDX_SSE  (1u << 25)
+#define CPUID_EDX_SSE2 (1u << 26)
+
+#define CR0_MP         (1u << 1)
+#define CR0_EM         (1u << 2)
+#define CR4_OSFXSR     (1u << 9)
+#define CR4_OSXMMEXCPT (1u << 10)
+
+// The kernel itself is built without SSE, so xmm registers only need to
+// be declared clobbered when the compiler might be using them too
+#ifdef __SSE__
+#define SSE_CLOBBERS , "xmm0", "xmm1", "xmm2", "xmm3"
+#else
+#define SSE_CLOBBERS
+#endif
+
+// Word type allowed to alias any object, for the word-at-a-time loops
+typedef uint32_t __attribute__((may_alias)) string_word_t;
+
+// The word loops read whole aligned dwords past the end of a string,
+// which AddressSanitizer reports in the host test build
+#ifdef __SANITIZE_ADDRESS__
+#define WORD_READS __attribute__((no_sanitize_address))
+#else
+#define WORD_READS
+#endif
+
+static int string_sse2;
+
+// xmm registers are not saved on interrupts or task switches, so only
+// one SSE2 copy per CPU may be in flight; anything nested inside it (a
+// page fault, an IRQ) takes the integer path instead. Preemption stays
+// off meanwhile, so the copy cannot migrate to another CPU's registers.
+static inline int xmm_claim(void) {
+    if (!string_sse2) {
+        return 0;
+    }
+    preempt_disable();
+    struct cpu* cpu = this_cpu();
+    if (cpu->xmm_busy) {
+        preempt_enable();
+        return 0;
+    }
+    cpu->xmm_busy = 1;
+    return 1;
+}
+
+static inline void xmm_release(void) {
+    this_cpu()->xmm_busy = 0;
+    preempt_enable();
+}
+
+// Detect SSE2 and turn on the FXSR/XMM state so the SSE2 paths can run;
+// every CPU calls this for its own CR0 and CR4
+void string_init(void) {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+
+    uint32_t needed = CPUID_EDX_FXSR | CPUID_EDX_SSE | CPUID_EDX_SSE2;
+    if ((edx & needed) != needed) {
+        return;
+    }
+
+    uintptr_t cr0, cr4;
+    asm volatile("mov %%cr0, %0" : "=r"(cr0));
+    cr0 = (cr0 & ~(uintptr_t)CR0_EM) | CR0_MP;
+    asm volatile("mov %0, %%cr0" : : "r"(cr0));
+
+    asm volatile("mov %%cr4, %0" : "=r"(cr4));
+    cr4 |= CR4_OSFXSR | CR4_OSXMMEXCPT;
+    asm volatile("mov %0, %%cr4" : : "r"(cr4));
+
+    string_sse2 = 1;
+}
+
+int string_has_sse2(void) {
+    return string_sse2;
+}
+
+// Copy 'n' bytes with 16-byte aligned stores; n >= STRING_SSE2_THRESHOLD
+static void memcpy_sse2(uint8_t* d, const uint8_t* s, size_t n) {
+    size_t head = (0 - (uintptr_t)d) & 15;
+    n -= head;
+    asm volatile("rep movsb" : "+D"(d), "+S"(s), "+c"(head) : : "memory");
+
+    size_t blocks = n / 64;
+    if (n >= STRING_NT_THRESHOLD) {
+        asm volatile(
+            "1:\n\t"
+            "movdqu   (%1), %%xmm0\n\t"
+            "movdqu 16(%1), %%xmm1\n\t"
+            "movdqu 32(%1), %%xmm2\n\t"
+            "movdqu 48(%1), %%xmm3\n\t"
+            "movntdq %%xmm0,   (%0)\n\t"
+            "movntdq %%xmm1, 16(%0)\n\t"
+            "movntdq %%xmm2, 32(%0)\n\t"
+            "movntdq %%xmm3, 48(%0)\n\t"
+            "add $64, %0\n\t"
+            "add $64, %1\n\t"
+            "dec %2\n\t"
+            "jnz 1b\n\t"
+            "sfence"
+            : "+r"(d), "+r"(s), "+r"(blocks) : : "memory" SSE_CLOBBERS);
+    } else {
+        asm volatile(
+            "1:\n\t"
+            "movdqu   (%1), %%xmm0\n\t"
+            "movdqu 16(%1), %%xmm1\n\t"
+            "movdqu 32(%1), %%xmm2\n\t"
+            "movdqu 48(%1), %%xmm3\n\t"
+            "movdqa %%xmm0,   (%0)\n\t"
+            "movdqa %%xmm1, 16(%0)\n\t"
+            "movdqa %%xmm2, 32(%0)\n\t"
+            "movdqa %%xmm3, 48(%0)\n\t"
+            "add $64, %0\n\t"
+            "add $64, %1\n\t"
+            "dec %2\n\t"
+            "jnz 1b"
+            : "+r"(d), "+r"(s), "+r"(blocks) : : "memory" SSE_CLOBBERS);
+    }
+
+    size_t tail = n & 63;
+    asm volatile("rep movsb" : "+D"(d), "+S"(s), "+c"(tail) : : "memory");
+}
+
+// Fill 'n' bytes with the splatted pattern; n >= STRING_SSE2_THRESHOLD
+static void memset_sse2(uint8_t* d, uint32_t pattern, size_t n) {
+    size_t head = (0 - (uintptr_t)d) & 15;
+    n -= head;
+    asm volatile("rep stosb" : "+D"(d), "+c"(head) : "a"(pattern) : "memory");
+
+    size_t blocks = n / 64;
+    if (n >= STRING_NT_THRESHOLD) {
+        asm volatile(
+            "movd %2, %%xmm0\n\t"
+            "pshufd $0, %%xmm0, %%xmm0\n\t"
+            "1:\n\t"
+            "movntdq %%xmm0,   (%0)\n\t"
+            "movntdq %%xmm0, 16(%0)\n\t"
+            "movntdq %%xmm0, 32(%0)\n\t"
+            "movntdq %%xmm0, 48(%0)\n\t"
+            "add $64, %0\n\t"
+            "dec %1\n\t"
+            "jnz 1b\n\t"
+            "sfence"
+            : "+r"(d), "+r"(blocks) : "r"(pattern) : "memory" SSE_CLOBBERS);
+    } else {
+        asm volatile(
+            "movd %2, %%xmm0\n\t"
+            "pshufd $0, %%xmm0, %%xmm0\n\t"
+            "1:\n\t"
+            "movdqa %%xmm0,   (%0)\n\t"
+            "movdqa %%xmm0, 16(%0)\n\t"
+            "movdqa %%xmm0, 32(%0)\n\t"
+            "movdqa %%xmm0, 48(%0)\n\t"
+            "add $64, %0\n\t"
+            "dec %1\n\t"
+            "jnz 1b"
+            : "+r"(d), "+r"(blocks) : "r"(pattern) : "memory" SSE_CLOBBERS);
+    }
+
+    size_t tail = n & 63;
+    asm volatile("rep stosb" : "+D"(d), "+c"(tail) : "a"(pattern) : "memory");
+}
+
+void* memset(void* bufptr, int value, size_t size) {
+    uint8_t* d = (uint8_t*)bufptr;
+    uint32_t pattern = (uint8_t)value * 0x01010101u;
+
+    if (size >= STRING_SSE2_THRESHOLD && xmm_claim()) {
+        memset_sse2(d, pattern, size);
+        xmm_release();
+        return bufptr;
+    }
+
+    if (size >= 16) {
+        // Byte stores up to a dword boundary, then dwords
+        size_t head = (0 - (uintptr_t)d) & 3;
+        size -= head;
+        asm volatile("rep stosb" : "+D"(d), "+c"(head) : "a"(pattern) : "memory");
+
+        size_t words = size / 4;
+        size &= 3;
+        asm volatile("rep stosl" : "+D"(d), "+c"(words) : "a"(pattern) : "memory");
+    }
+
+    asm volatile("rep stosb" : "+D"(d), "+c"(size) : "a"(pattern) : "memory");
+    return bufptr;
+}
+
+// Fill 'count' 16-bit cells, e.g. VGA character/attribute pairs
+void* memset16(void* dest, uint16_t value, size_t count) {
+    uint16_t* d = (uint16_t*)dest;
+    uint32_t pattern = value | ((uint32_t)value << 16);
+
+    if (((uintptr_t)d & 2) && count) {
+        *d++ = value;
+        count--;
+    }
+
+    size_t words = count / 2;
+    asm volatile("rep stosl" : "+D"(d), "+c"(words) : "a"(pattern) : "memory");
+    if (count & 1) {
+        *d = value;
+    }
+    return dest;
+}
+
+void* memcpy(void* dest, const void* src, size_t n) {
+    uint8_t* d = (uint8_t*)dest;
+    const uint8_t* s = (const uint8_t*)src;
+
+    if (n >= STRING_SSE2_THRESHOLD && xmm_claim()) {
+        memcpy_sse2(d, s, n);
+        xmm_release();
+        return dest;
+    }
+
+    size_t words = n / 4;
+    size_t bytes = n & 3;
+    asm volatile("rep movsl\n\t"
+                 "mov %3, %2\n\t"
+                 "rep movsb"
+                 : "+D"(d), "+S"(s), "+c"(words)
+                 : "r"(bytes)
+                 : "memory");
+    return dest;
+}
+
+void* memmove(void* dest, const void* src, size_t n) {
+    uint8_t* d = (uint8_t*)dest;
+    const uint8_t* s = (const uint8_t*)src;
+
+    // Forward copying is safe unless dest starts inside the source
+    if (d <= s || d >= s + n) {
+        return memcpy(dest, src, n);
+    }
+
+    // Copy from the top down: trailing dwords first, then the leading bytes
+    size_t words = n / 4;
+    size_t bytes = n & 3;
+    uint8_t* dw = d + n - 4;
+    const uint8_t* sw = s + n - 4;
+    asm volatile("std\n\t"
+                 "rep movsl\n\t"
+                 "cld"
+                 : "+D"(dw), "+S"(sw), "+c"(words) : : "memory");
+
+    uint8_t* db = d + bytes - 1;
+    const uint8_t* sb = s + bytes - 1;
+    asm volatile("std\n\t"
+                 "rep movsb\n\t"
+                 "cld"
+                 : "+D"(db), "+S"(sb), "+c"(bytes) : : "memory");
+    return dest;
+}
+
+// A word has a zero byte when subtracting 1 from each byte borrows into it
+static inline uint32_t word_has_zero(uint32_t word) {
+    return (word - 0x01010101u) & ~word & 0x80808080u;
+}
+
+WORD_READS size_t strlen(const char* str) {
+    const char* p = str;
+
+    // Byte checks up to a dword boundary; an aligned dword read never
+    // crosses into the next page, so reading past the NUL is safe
+    while ((uintptr_t)p & 3) {
+        if (!*p) {
+            return p - str;
+        }
+        p++;
+    }
+
+    const string_word_t* w = (const string_word_t*)p;
+    while (!word_has_zero(*w)) {
+        w++;
+    }
+
+    p = (const char*)w;
+    while (*p) {
+        p++;
+    }
+    return p - str;
+}
+
+int memcmp(const void* ptr1, const void* ptr2, size_t size) {
+    const uint8_t* a = ptr1;
+    const uint8_t* b = ptr2;
+    for (size_t i = 0; i < size; i++) {
+        if (a[i] != b[i]) {
+            return a[i] - b[i];
+        }
+    }
+    return 0;
+}
+
+int strcmp(const char* str1, const char* str2) {
+    while (*str1 && *str1 == *str2) {
+        str1++;
+        str2++;
+    }
+    return (uint8_t)*str1 - (uint8_t)*str2;
+}
+
+// At most n characters; stops early at the end of either string
+int strncmp(const char* str1, const char* str2, size_t n) {
+    for (; n; n--, str1++, str2++) {
+        if (!*str1 || *str1 != *str2) {
+            return (uint8_t)*str1 - (uint8_t)*str2;
+        }
+    }
+    return 0;
+}
+
+char* strcpy(char* dest, const char* src) {
+    memcpy(dest, src, strlen(src) + 1);
+    return dest;
+}
+
+// Parse a decimal number; returns 0, or -1 on junk, an empty string or overflow
+int parse_uint(const char* str, uint32_t* value) {
+    uint32_t result = 0;
+    if (!str || !*str) {
+        return -1;
+    }
+    for (; *str; str++) {
+        uint32_t digit = (uint8_t)*str - '0';
+        if (digit > 9 || result > (0xFFFFFFFFu - digit) / 10) {
+            return -1;
+        }
+        result = result * 10 + digit;
+    }
+    *value = result;
+    return 0;
+}
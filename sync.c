@@ -0,0 +1,169 @@
+/*
+ * sync.c - Lock slow paths, lock statistics and RCU grace periods
+ * The lock fast paths are inline in kernel.h; only a lock that has to
+ * wait calls in here. With LOCK_STATS a lock joins the list shown by
+ * the locks command the first time it is taken, so it must stay
+ * allocated from then on (every lock in the kernel is static or
+ * per-CPU). An RCU grace period ends once every other online CPU has
+ * been seen outside a read section: switching tasks, or taking a timer
+ * tick while preemption was enabled.
+ */
+
+#include "kernel.h"
+
+#ifdef LOCK_STATS
+static struct lock_stats* lock_list;
+#endif
+
+// Spin on a plain read until the lock looks free, then retry the
+// atomic exchange; each failed exchange counts as a spin too
+uint32_t spin_lock_wait(volatile uint32_t* locked) {
+    uint64_t start = TRACE_BEGIN();
+    uint32_t spins = 0;
+    do {
+        spins++;
+        while (*locked) {
+            asm volatile("pause");
+            spins++;
+        }
+    } while (__sync_lock_test_and_set(locked, 1));
+    TRACE_END(TRACE_LOCK_WAIT, (uintptr_t)locked, start);
+    return spins;
+}
+
+uint32_t ticket_lock_wait(volatile uint16_t* owner, uint16_t ticket) {
+    uint64_t start = TRACE_BEGIN();
+    uint32_t spins = 0;
+    while (*owner != ticket) {
+        asm volatile("pause");
+        spins++;
+    }
+    ring_barrier();
+    TRACE_END(TRACE_LOCK_WAIT, (uintptr_t)owner, start);
+    return spins ? spins : 1;
+}
+
+#ifdef LOCK_STATS
+// Called with the lock held, so the counters need no atomics
+void lock_stats_acquired(struct lock_stats* stats, uint32_t spins) {
+    if (!stats->listed) {
+        stats->listed = 1;
+        struct lock_stats* head;
+        do {
+            head = lock_list;
+            stats->next = head;
+        } while (!__sync_bool_compare_and_swap(&lock_list, head, stats));
+    }
+    stats->acquisitions++;
+    if (spins) {
+        stats->contended++;
+        stats->spins += spins;
+    }
+    stats->acquired_at = rdtsc();
+}
+
+void lock_stats_released(struct lock_stats* stats) {
+    uint32_t held = (uint32_t)(rdtsc() - stats->acquired_at);
+    if (held > stats->max_hold) {
+        stats->max_hold = held;
+    }
+}
+#endif
+
+// Wait until every reader that may have loaded a pointer before it was
+// replaced has finished. Must not be called with preemption disabled
+// or from an interrupt handler: the other CPUs have to get a tick in.
+void synchronize_rcu(void) {
+    uint32_t seen[SMP_MAX_CPUS];
+    size_t count = smp_cpu_count();
+    for (size_t i = 0; i < count; i++) {
+        seen[i] = smp_cpu(i)->quiescent;
+    }
+
+    // Readers never sleep, so none can be waiting on this CPU
+    for (size_t i = 0; i < count; i++) {
+        struct cpu* cpu = smp_cpu(i);
+        if (cpu == this_cpu()) {
+            continue;
+        }
+        while (cpu->online && cpu->quiescent == seen[i]) {
+            asm volatile("pause");
+        }
+    }
+}
+
+struct mutex_waiter {
+    struct task* task;
+    struct mutex_waiter* next;
+};
+
+void mutex_lock(mutex_t* mutex) {
+    struct task* self = current_task();
+    uint32_t flags = spin_lock_irqsave(&mutex->lock);
+    if (!mutex->owner) {
+        mutex->owner = self;
+        spin_unlock_irqrestore(&mutex->lock, flags);
+        return;
+    }
+
+    // The waiter lives on this stack until mutex_unlock hands over
+    struct mutex_waiter waiter = { self, NULL };
+    if (mutex->waiters_tail) {
+        mutex->waiters_tail->next = &waiter;
+    } else {
+        mutex->waiters = &waiter;
+    }
+    mutex->waiters_tail = &waiter;
+    spin_unlock_irqrestore(&mutex->lock, flags);
+
+    while (rcu_dereference(mutex->owner) != self) {
+        sched_block();
+    }
+}
+
+void mutex_unlock(mutex_t* mutex) {
+    uint32_t flags = spin_lock_irqsave(&mutex->lock);
+    struct mutex_waiter* waiter = mutex->waiters;
+    struct task* next = NULL;
+    if (waiter) {
+        next = waiter->task;
+        mutex->waiters = waiter->next;
+        if (!mutex->waiters) {
+            mutex->waiters_tail = NULL;
+        }
+    }
+    mutex->owner = next;
+    spin_unlock_irqrestore(&mutex->lock, flags);
+    if (next) {
+        sched_wake(next);
+    }
+}
+
+static void cmd_locks(int argc, char** argv) {
+#ifdef LOCK_STATS
+    if (argc > 1 && strcmp(argv[1], "reset") == 0) {
+        for (struct lock_stats* stats = lock_list; stats; stats = stats->next) {
+            stats->acquisitions = 0;
+            stats->contended = 0;
+            stats->spins = 0;
+            stats->max_hold = 0;
+        }
+        printf("Lock statistics cleared\n");
+        return;
+    }
+
+    printf("LOCK          ACQUIRED  CONTENDED      SPINS  MAXHOLD(cycles)\n");
+    for (struct lock_stats* stats = lock_list; stats; stats = stats->next) {
+        printf("%-12s %9u %10u %10u %16u\n", stats->name ? stats->name : "?",
+               stats->acquisitions, stats->contended, stats->spins, stats->max_hold);
+    }
+#else
+    UNUSED(argc);
+    UNUSED(argv);
+    printf("locks: built without LOCK_STATS\n");
+#endif
+}
+
+void sync_init(void) {
+    shell_register_command("locks", cmd_locks, "Show lock contention (locks [reset])");
+}
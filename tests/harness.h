@@ -0,0 +1,65 @@
+/*
+ * harness.h - Unit tests for the host build of the kernel
+ * A test is a function in one of the per-area tables below; CHECK
+ * failures are counted and reported with the line, and the test goes
+ * on. All tests share one booted kernel and run in table order.
+ */
+
+#ifndef HARNESS_H
+#define HARNESS_H
+
+#include "../kernel.h"
+
+#define HOST_CAPTURE_SIZE 8192
+
+struct host_test {
+    const char* name;
+    void (*run)(void);
+};
+
+// Per-area tables, each ended by an entry with no name
+extern const struct host_test memory_tests[];
+extern const struct host_test shell_tests[];
+extern const struct host_test keyboard_tests[];
+extern const struct host_test string_tests[];
+
+void harness_check(int ok, const char* expression, const char* file, int line);
+
+#define CHECK(condition) harness_check((condition) != 0, #condition, __FILE__, __LINE__)
+#define CHECK_STR(actual, expected) \
+    harness_check(strcmp((actual), (expected)) == 0, #actual " == " #expected, __FILE__, __LINE__)
+
+// True when 'part' appears in 'text'
+static inline int contains(const char* text, const char* part) {
+    size_t len = strlen(part);
+    for (; *text; text++) {
+        if (memcmp(text, part, len) == 0) {
+            return 1;
+        }
+    }
+    return len == 0;
+}
+
+// The machine (stubs.c). pmm.c manages [HOST_RAM_BASE, +HOST_RAM_SIZE),
+// with its bitmaps at the start.
+#define HOST_RAM_BASE 0x10000000
+#define HOST_RAM_SIZE (32 * 1024 * 1024)
+
+void host_memory_init(void);
+void host_console_init(void);
+void host_keyboard_type(const uint8_t* scancodes, size_t count);
+uint32_t host_port_last(uint16_t port);
+
+// Terminal output between these goes into a buffer instead of stdout
+void capture_begin(void);
+const char* capture_end(void);
+
+// Only lines starting with prefix reach stdout from now on
+void host_console_filter(const char* prefix);
+
+// Kernel functions with no prototype in kernel.h
+void interrupt_dispatch(struct interrupt_frame* frame);
+int strcmpi(const char* str1, const char* str2);
+int starts_with(const char* str, const char* prefix);
+
+#endif // HARNESS_H
@@ -0,0 +1,88 @@
+/*
+ * host.c - The host C library side of the test harness
+ * The only file of the host build that includes libc headers, and the
+ * only one objcopy leaves alone (see tests/host.syms).
+ */
+
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "host.h"
+
+#define PANIC_STATUS 3      // Exit status of a child that panicked
+
+static int in_child;
+
+void host_write(const char* data, unsigned long size) {
+    while (size) {
+        ssize_t n = write(STDOUT_FILENO, data, size);
+        if (n <= 0) {
+            return;
+        }
+        data += n;
+        size -= n;
+    }
+}
+
+void* host_alloc(unsigned long size, unsigned long align) {
+    void* ptr = NULL;
+    if (posix_memalign(&ptr, align < sizeof(void*) ? sizeof(void*) : align, size) != 0) {
+        return NULL;
+    }
+    return ptr;
+}
+
+void host_free(void* ptr) {
+    free(ptr);
+}
+
+void* host_map_fixed(unsigned long address, unsigned long size) {
+#ifdef MAP_FIXED_NOREPLACE
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE;
+#else
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;    // Address as a hint only
+#endif
+    void* ptr = mmap((void*)address, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (ptr == MAP_FAILED) {
+        return NULL;
+    }
+    if (ptr != (void*)address) {
+        munmap(ptr, size);
+        return NULL;
+    }
+    return ptr;
+}
+
+unsigned long long host_nanoseconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+void host_exit(int status) {
+    exit(status);
+}
+
+void host_panic(void) {
+    _exit(in_child ? PANIC_STATUS : 2);
+}
+
+// Runs fn in a child process, so whatever a panic leaves behind (held
+// locks, half-updated lists) goes with it. Returns 1 when fn ended in
+// kernel_panic, 0 when it returned.
+int host_catch_panic(void (*fn)(void* arg), void* arg) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        in_child = 1;
+        fn(arg);
+        _exit(0);
+    }
+    int status;
+    if (pid < 0 || waitpid(pid, &status, 0) != pid) {
+        return 0;
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == PANIC_STATUS;
+}
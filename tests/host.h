@@ -0,0 +1,32 @@
+/*
+ * host.h - What the host test harness provides in place of hardware
+ * kernel.h includes this when built with HOST_TEST. Kernel code and the
+ * host C library never share a translation unit: host.c is the only
+ * file that includes libc headers, and these declarations use plain C
+ * types so both sides agree on them.
+ */
+
+#ifndef HOST_H
+#define HOST_H
+
+struct cpu;
+extern struct cpu host_cpu;                 // What this_cpu() returns
+extern unsigned short host_vga_memory[];    // Stands in for 0xB8000
+
+// Device ports, played by stubs.c
+void host_port_out(unsigned short port, unsigned int value);
+unsigned int host_port_in(unsigned short port);
+
+// The host side (host.c)
+void host_write(const char* data, unsigned long size);
+void* host_alloc(unsigned long size, unsigned long align);
+void host_free(void* ptr);
+void* host_map_fixed(unsigned long address, unsigned long size);    // NULL if taken
+unsigned long long host_nanoseconds(void);
+void host_exit(int status) __attribute__((noreturn));
+
+// kernel_panic ends here; outside host_catch_panic the harness fails
+void host_panic(void) __attribute__((noreturn));
+int host_catch_panic(void (*fn)(void* arg), void* arg);
+
+#endif // HOST_H
@@ -0,0 +1,103 @@
+/*
+ * main.c - Host test driver
+ * Usage: host-test [test-prefix...]
+ *        host-test -b [benchmark]
+ * Brings up the parts of the kernel the host build has, then runs the
+ * unit tests whose "area/name" starts with one of the prefixes (all of
+ * them by default), or with -b the kernel's own bench command.
+ */
+
+#include "harness.h"
+
+#define HOST_HEAP_SIZE (16 * 1024 * 1024)
+
+static const struct {
+    const char* name;
+    const struct host_test* tests;
+} areas[] = {
+    { "string", string_tests },
+    { "memory", memory_tests },
+    { "shell", shell_tests },
+    { "keyboard", keyboard_tests },
+};
+
+#define AREA_COUNT (sizeof(areas) / sizeof(areas[0]))
+
+static const char* current_test;
+static uint32_t test_failures;
+
+// Straight to stdout, so a failure inside a capture still shows
+void harness_check(int ok, const char* expression, const char* file, int line) {
+    if (ok) {
+        return;
+    }
+    char message[256];
+    int len = ksnprintf(message, sizeof(message), "  %s: %s:%d: %s\n", current_test, file, line,
+                        expression);
+    host_write(message, len < (int)sizeof(message) ? len : (int)sizeof(message) - 1);
+    test_failures++;
+}
+
+// What kernel_main does, minus the hardware
+static void host_boot(void) {
+    terminal_initialize();
+    host_console_init();
+
+    capture_begin();
+    host_memory_init();
+    pmm_init();
+    uintptr_t heap = (uintptr_t)host_alloc(HOST_HEAP_SIZE, PAGE_SIZE);
+    heap_init(heap, heap + HOST_HEAP_SIZE);
+    vfs_init();
+    trace_init();
+    sync_init();
+    bench_init();
+    init_interrupts();
+    init_shell();
+    capture_end();
+}
+
+static int selected(const char* name, int argc, char** argv) {
+    if (argc < 2) {
+        return 1;
+    }
+    for (int i = 1; i < argc; i++) {
+        if (starts_with(name, argv[i])) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int run_tests(int argc, char** argv) {
+    uint32_t run = 0, failed = 0;
+    char name[64];
+    for (size_t i = 0; i < AREA_COUNT; i++) {
+        for (const struct host_test* test = areas[i].tests; test->name; test++) {
+            ksnprintf(name, sizeof(name), "%s/%s", areas[i].name, test->name);
+            if (!selected(name, argc, argv)) {
+                continue;
+            }
+            current_test = name;
+            test_failures = 0;
+            test->run();
+            printf("%s %s\n", test_failures ? "FAIL" : "ok  ", name);
+            run++;
+            failed += test_failures != 0;
+        }
+    }
+    printf("%u tests, %u failed\n", run, failed);
+    return failed ? 1 : 0;
+}
+
+int main(int argc, char** argv) {
+    host_boot();
+    if (argc > 1 && strcmp(argv[1], "-b") == 0) {
+        // The terminal benchmarks' own output would bury the results
+        host_console_filter("BENCH");
+        argv[1] = "bench";
+        shell_execute(argc - 1, argv + 1);
+        return 0;
+    }
+    return run_tests(argc, argv);
+}
@@ -0,0 +1,227 @@
+/*
+ * stubs.c - The machine under the host test build
+ * One CPU, a VGA buffer in RAM, a keyboard whose scancodes the tests
+ * queue, and RAM at a fixed address for the real frame allocator. The
+ * scheduler, SMP and boot information are not part of the host build;
+ * what the built files call of them is answered here the way a single
+ * CPU with no other tasks would.
+ */
+
+#include "../kernel.h"
+#include "harness.h"
+
+#define HOST_PORTS      65536
+#define KEYBOARD_DATA   0x60
+#define KEYBOARD_QUEUE  256
+#define ISR_STUB_BYTES  (256 * 16)  // 256 vectors, 16-byte stubs
+#define KEYBOARD_VECTOR (IRQ_BASE + 1)
+
+struct cpu host_cpu = { .self = &host_cpu, .online = 1 };
+unsigned short host_vga_memory[VGA_MEMORY_SIZE / sizeof(uint16_t)];
+
+// init_idt points every vector into here; nothing ever jumps to it
+uint8_t isr_stubs[ISR_STUB_BYTES];
+
+// Ports: reads of the keyboard data port take the queued scancodes,
+// writes are remembered per port
+static uint32_t port_last[HOST_PORTS];
+static uint8_t keyboard_queue[KEYBOARD_QUEUE];
+static uint32_t keyboard_queue_head, keyboard_queue_tail;
+
+void host_port_out(unsigned short port, unsigned int value) {
+    port_last[port] = value;
+}
+
+unsigned int host_port_in(unsigned short port) {
+    if (port == KEYBOARD_DATA && keyboard_queue_tail != keyboard_queue_head) {
+        return keyboard_queue[keyboard_queue_tail++ % KEYBOARD_QUEUE];
+    }
+    return 0;
+}
+
+uint32_t host_port_last(uint16_t port) {
+    return port_last[port];
+}
+
+// Queue scancodes and raise IRQ1 once for each, as the controller would
+void host_keyboard_type(const uint8_t* scancodes, size_t count) {
+    struct interrupt_frame frame = { .vector = KEYBOARD_VECTOR };
+    for (size_t i = 0; i < count; i++) {
+        keyboard_queue[keyboard_queue_head++ % KEYBOARD_QUEUE] = scancodes[i];
+        interrupt_dispatch(&frame);
+    }
+}
+
+// Terminal output goes to stdout, or into a buffer while captured
+static char capture_buffer[HOST_CAPTURE_SIZE];
+static size_t capture_length;
+static int capturing;
+
+// With a filter set, whole lines are collected and most are dropped
+static const char* line_filter;
+static char line_buffer[256];
+static size_t line_length;
+
+static void filter_write(const char* data, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        if (line_length == sizeof(line_buffer) - 1) {
+            // Keep the tail, where a result line may have started
+            line_length = sizeof(line_buffer) / 2;
+            memmove(line_buffer, line_buffer + sizeof(line_buffer) / 2 - 1, line_length);
+        }
+        line_buffer[line_length++] = data[i];
+        if (data[i] != '\n') {
+            continue;
+        }
+        // The prefix may follow output that had no newline of its own
+        line_buffer[line_length] = '\0';
+        for (size_t start = 0; start < line_length; start++) {
+            if (starts_with(line_buffer + start, line_filter)) {
+                host_write(line_buffer + start, line_length - start);
+                break;
+            }
+        }
+        line_length = 0;
+    }
+}
+
+static void host_sink_write(const char* data, size_t size) {
+    if (!capturing) {
+        if (line_filter) {
+            filter_write(data, size);
+        } else {
+            host_write(data, size);
+        }
+        return;
+    }
+    size_t room = sizeof(capture_buffer) - 1 - capture_length;
+    if (size > room) {
+        size = room;
+    }
+    memcpy(capture_buffer + capture_length, data, size);
+    capture_length += size;
+    capture_buffer[capture_length] = '\0';
+}
+
+static struct terminal_sink host_sink = { "host", host_sink_write, NULL, NULL, 1, NULL };
+
+void host_console_init(void) {
+    terminal_add_sink(&host_sink);
+}
+
+void capture_begin(void) {
+    capture_length = 0;
+    capture_buffer[0] = '\0';
+    capturing = 1;
+}
+
+const char* capture_end(void) {
+    capturing = 0;
+    return capture_buffer;
+}
+
+void host_console_filter(const char* prefix) {
+    line_filter = prefix;
+    line_length = 0;
+}
+
+// Physical memory for pmm.c: one host mapping at a fixed low address,
+// so frame numbers fit in 32 bits. The "kernel image" ends where it
+// starts, which puts pmm.c's bitmaps at its bottom.
+#define HOST_RAM_STRING(x) #x
+#define HOST_RAM_AT(x) HOST_RAM_STRING(x)
+asm(".globl kernel_end\n.set kernel_end, " HOST_RAM_AT(HOST_RAM_BASE));
+
+static const struct multiboot_region host_ram = { HOST_RAM_BASE, HOST_RAM_SIZE };
+
+void host_memory_init(void) {
+    if (!host_map_fixed(HOST_RAM_BASE, HOST_RAM_SIZE)) {
+        kernel_panic("host: cannot map RAM at HOST_RAM_BASE");
+    }
+}
+
+size_t multiboot_memory_map(const struct multiboot_region** map) {
+    *map = &host_ram;
+    return 1;
+}
+
+size_t multiboot_module_count(void) {
+    return 0;
+}
+
+const struct multiboot_module* multiboot_module(size_t index) {
+    UNUSED(index);
+    return NULL;
+}
+
+// One CPU and no other tasks: nothing to wait for or switch to
+size_t smp_cpu_count(void) {
+    return 1;
+}
+
+struct cpu* smp_cpu(size_t index) {
+    return index == 0 ? &host_cpu : NULL;
+}
+
+void smp_halt_others(void) {
+}
+
+struct task* current_task(void) {
+    return NULL;
+}
+
+void preempt_disable(void) {
+    host_cpu.preempt_count++;
+}
+
+void preempt_enable(void) {
+    host_cpu.preempt_count--;
+}
+
+void sched_preempt(void) {
+}
+
+void sched_block(void) {
+}
+
+void sched_wake(struct task* task) {
+    UNUSED(task);
+}
+
+void sleep_ms(uint32_t ms) {
+    UNUSED(ms);
+}
+
+// Measured once against the host clock
+uint32_t tsc_khz(void) {
+    static uint32_t khz;
+    if (!khz) {
+        unsigned long long start_ns = host_nanoseconds();
+        uint64_t start = rdtsc();
+        while (host_nanoseconds() - start_ns < 20000000) {
+        }
+        uint64_t cycles = rdtsc() - start;
+        khz = (uint32_t)(cycles * 1000000 / (host_nanoseconds() - start_ns));
+    }
+    return khz;
+}
+
+int serial_has_input(void) {
+    return 0;
+}
+
+// Nothing to profile: there was no boot
+void bootprof_mark(const char* stage) {
+    UNUSED(stage);
+}
+
+void bootprof_report(void) {
+}
+
+// No boot loader, so no command line
+int multiboot_option(const char* name, char* value, size_t size) {
+    UNUSED(name);
+    UNUSED(value);
+    UNUSED(size);
+    return 0;
+}
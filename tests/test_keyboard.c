@@ -0,0 +1,168 @@
+/*
+ * test_keyboard.c - Scancode decoding, translation and the line editor
+ * Scancodes go in through port 0x60 and IRQ1, as on the real machine.
+ */
+
+#include "harness.h"
+
+#define SC_LSHIFT   0x2A
+#define SC_LCTRL    0x1D
+#define SC_CAPS     0x3A
+#define SC_ENTER    0x1C
+#define SC_BACK     0x0E
+#define SC_A        0x1E
+#define SC_C        0x2E
+#define SC_RELEASE  0x80
+#define PIC1_PORT   0x20
+#define PIC_EOI     0x20
+
+// Set 1 make codes by position, to find the key for a character
+static const char layout[] =
+    "\0\x1b" "1234567890-=\b\t"
+    "qwertyuiop[]\n\0as"
+    "dfghjkl;'`\0\\zxcv"
+    "bnm,./\0*\0 ";
+
+static void press(uint8_t scancode) {
+    uint8_t codes[2] = { scancode, scancode | SC_RELEASE };
+    host_keyboard_type(codes, 2);
+}
+
+static void press_e0(uint8_t scancode) {
+    uint8_t codes[4] = { 0xE0, scancode, 0xE0, scancode | SC_RELEASE };
+    host_keyboard_type(codes, 4);
+}
+
+// Queued events go to the shell, whose echo is not interesting
+static void deliver(void) {
+    capture_begin();
+    keyboard_process_input();
+    capture_end();
+}
+
+// Lower-case text, digits and spaces
+static void type(const char* text) {
+    for (; *text; text++) {
+        for (uint8_t code = 1; code < sizeof(layout) - 1; code++) {
+            if (layout[code] == *text) {
+                press(code);
+                break;
+            }
+        }
+    }
+    deliver();
+}
+
+static const char* enter(void) {
+    capture_begin();
+    press(SC_ENTER);
+    keyboard_process_input();
+    return capture_end();
+}
+
+static int translate(uint8_t keycode, uint8_t modifiers) {
+    struct key_event event = { keycode, modifiers, 0, 0 };
+    return keyboard_translate(event);
+}
+
+static void test_translate(void) {
+    CHECK(translate(SC_A, 0) == 'a');
+    CHECK(translate(SC_A, KEY_MOD_SHIFT) == 'A');
+    CHECK(translate(SC_A, KEY_MOD_CAPS) == 'A');
+    CHECK(translate(SC_A, KEY_MOD_CAPS | KEY_MOD_SHIFT) == 'a');
+    CHECK(translate(0x02, KEY_MOD_SHIFT) == '!');
+    CHECK(translate(0x02, KEY_MOD_CAPS) == '1');
+    CHECK(translate(SC_C, KEY_MOD_CTRL) == 0x03);
+    CHECK(translate(SC_ENTER, 0) == '\n');
+    CHECK(translate(KEY_KP_ENTER, 0) == '\n');
+    CHECK(translate(KEY_KP_SLASH, 0) == '/');
+    CHECK(translate(KEY_LEFT, 0) == KEY_LEFT);
+    CHECK(translate(KEY_RCTRL, 0) == 0);
+    CHECK(translate(SC_LSHIFT, 0) == 0);
+}
+
+static void test_irq_eoi(void) {
+    host_keyboard_type((const uint8_t[]){ SC_A | SC_RELEASE }, 1);
+    keyboard_process_input();
+    CHECK(host_port_last(PIC1_PORT) == PIC_EOI);
+    CHECK(!keyboard_has_input());
+}
+
+static void test_typing(void) {
+    type("echo hi there");
+    const char* out = enter();
+    CHECK(contains(out, "\nhi there\n"));
+}
+
+static void test_modifiers(void) {
+    // Shift held over one key only
+    type("echo ");
+    host_keyboard_type((const uint8_t[]){ SC_LSHIFT, SC_A, SC_A | SC_RELEASE,
+                                          SC_LSHIFT | SC_RELEASE, SC_A, SC_A | SC_RELEASE }, 6);
+    // Caps lock toggles on press; shift then undoes it
+    press(SC_CAPS);
+    host_keyboard_type((const uint8_t[]){ SC_A, SC_A | SC_RELEASE, SC_LSHIFT, SC_A,
+                                          SC_A | SC_RELEASE, SC_LSHIFT | SC_RELEASE }, 6);
+    press(SC_CAPS);
+    deliver();
+    CHECK(contains(enter(), "\nAaAa\n"));
+}
+
+static void test_editing(void) {
+    // "ecjo" fixed with backspace, then a word inserted after moving left
+    type("ecj");
+    press(SC_BACK);
+    type("ho world");
+    for (int i = 0; i < 5; i++) {
+        press_e0(0x4B);         // Left
+    }
+    type("big ");
+    CHECK(contains(enter(), "\nbig world\n"));
+
+    // Ctrl+C drops the line
+    type("echo lost");
+    host_keyboard_type((const uint8_t[]){ SC_LCTRL, SC_C, SC_C | SC_RELEASE,
+                                          SC_LCTRL | SC_RELEASE }, 4);
+    capture_begin();
+    keyboard_process_input();
+    CHECK(contains(capture_end(), "^C"));
+    CHECK(!contains(enter(), "lost"));
+}
+
+static void test_history(void) {
+    type("echo again");
+    enter();
+    press_e0(0x48);             // Up
+    deliver();
+    CHECK(contains(enter(), "\nagain\n"));
+}
+
+// Pause is one event, and the rest of its sequence is swallowed
+static void test_pause_sequence(void) {
+    host_keyboard_type((const uint8_t[]){ 0xE1, 0x1D, 0x45, 0xE1, 0x9D, 0xC5 }, 6);
+    type("echo ok");
+    CHECK(contains(enter(), "\nok\n"));
+}
+
+// Events beyond the ring are dropped and counted, not overwritten
+static void test_ring_overflow(void) {
+    uint32_t dropped = keyboard_dropped_count();
+    for (int i = 0; i < 300; i++) {
+        host_keyboard_type((const uint8_t[]){ SC_A | SC_RELEASE }, 1);
+    }
+    CHECK(keyboard_dropped_count() - dropped == 300 - 256);
+    keyboard_process_input();
+    CHECK(!keyboard_has_input());
+}
+
+const struct host_test keyboard_tests[] = {
+    { "translate", test_translate },
+    { "irq_eoi", test_irq_eoi },
+    { "typing", test_typing },
+    { "modifiers", test_modifiers },
+    { "editing", test_editing },
+    { "history", test_history },
+    { "pause_sequence", test_pause_sequence },
+    { "ring_overflow", test_ring_overflow },
+    { NULL, NULL },
+};
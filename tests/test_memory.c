@@ -0,0 +1,208 @@
+/*
+ * test_memory.c - Kernel heap
+ */
+
+#include "harness.h"
+
+#define CHURN_BLOCKS 512
+
+static uint32_t lcg_state = 12345;
+
+static uint32_t lcg(void) {
+    lcg_state = lcg_state * 1103515245u + 12345u;
+    return lcg_state >> 8;
+}
+
+static void test_zero_and_null(void) {
+    CHECK(kmalloc(0) == NULL);
+    kfree(NULL);
+    CHECK(kmalloc_aligned(16, 0) == NULL);
+    CHECK(kmalloc_aligned(16, 48) == NULL);
+    CHECK(kmalloc((size_t)HEAP_SIZE * 2) == NULL);
+}
+
+static void test_alignment(void) {
+    static const size_t sizes[] = { 1, 8, 16, 24, 100, 256, 300, 2048, 3000, 10000 };
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        uint8_t* p = kmalloc(sizes[i]);
+        CHECK(p != NULL);
+        CHECK(((uintptr_t)p & 7) == 0);
+        memset(p, 0xA5, sizes[i]);
+        kfree(p);
+    }
+    for (size_t align = 16; align <= 16384; align <<= 1) {
+        void* p = kmalloc_aligned(200, align);
+        CHECK(p != NULL && ((uintptr_t)p & (align - 1)) == 0);
+        kfree(p);
+    }
+}
+
+// Random sizes freed in random order; every block keeps its contents
+static void test_churn(void) {
+    static uint8_t* blocks[CHURN_BLOCKS];
+    static uint32_t sizes[CHURN_BLOCKS];
+    size_t before = get_available_memory();
+
+    for (int round = 0; round < 8; round++) {
+        for (int i = 0; i < CHURN_BLOCKS; i++) {
+            if (blocks[i] && (lcg() & 1)) {
+                continue;
+            }
+            kfree(blocks[i]);
+            sizes[i] = lcg() % (lcg() & 1 ? 128 : 6000) + 1;
+            blocks[i] = kmalloc(sizes[i]);
+            CHECK(blocks[i] != NULL);
+            if (blocks[i]) {
+                memset(blocks[i], (uint8_t)i, sizes[i]);
+            }
+        }
+        int intact = 1;
+        for (int i = 0; i < CHURN_BLOCKS; i++) {
+            for (uint32_t j = 0; blocks[i] && j < sizes[i]; j++) {
+                intact &= blocks[i][j] == (uint8_t)i;
+            }
+        }
+        CHECK(intact);
+    }
+
+    for (int i = 0; i < CHURN_BLOCKS; i++) {
+        kfree(blocks[i]);
+        blocks[i] = NULL;
+    }
+    // Slabs may stay cached; large blocks must have coalesced back
+    CHECK(get_available_memory() + 64 * PAGE_SIZE >= before);
+}
+
+// Freed neighbours merge, so a block as big as all of them fits again
+static void test_coalescing(void) {
+    void* blocks[16];
+    for (int i = 0; i < 16; i++) {
+        blocks[i] = kmalloc(64 * 1024);
+        CHECK(blocks[i] != NULL);
+    }
+    for (int i = 0; i < 16; i += 2) {
+        kfree(blocks[i]);
+    }
+    for (int i = 1; i < 16; i += 2) {
+        kfree(blocks[i]);
+    }
+    void* big = kmalloc(16 * 64 * 1024);
+    CHECK(big != NULL);
+    kfree(big);
+}
+
+// Page-aligned pointers outside the heap go to the frame allocator,
+// which takes only the start of a run it handed out
+static void test_frame_runs(void) {
+    static uint8_t not_frames[2 * PAGE_SIZE] __attribute__((aligned(PAGE_SIZE)));
+    size_t free_frames = pmm_free_count();
+    uint8_t* p = kmalloc_aligned(3 * PAGE_SIZE, PAGE_SIZE);
+    CHECK(p != NULL && pmm_owns((uintptr_t)p));
+    CHECK(pmm_free_count() == free_frames - 3);
+    CHECK(!pmm_owns((uintptr_t)(p + PAGE_SIZE)));
+    CHECK(!pmm_owns((uintptr_t)not_frames));
+    CHECK(!pmm_owns(HOST_RAM_BASE));
+    kfree(p);
+    CHECK(!pmm_owns((uintptr_t)p));
+    CHECK(pmm_free_count() == free_frames);
+}
+
+static void double_free(void* arg) {
+    UNUSED(arg);
+    void* p = kmalloc(40);
+    kfree(p);
+    kfree(p);
+}
+
+static void large_double_free(void* arg) {
+    UNUSED(arg);
+    void* p = kmalloc(5000);
+    kfree(p);
+    kfree(p);
+}
+
+static void overrun(void* arg) {
+    UNUSED(arg);
+    uint8_t* p = kmalloc(40);
+    p[40] = 0;
+    kfree(p);
+}
+
+static void foreign_pointer(void* arg) {
+    static uint8_t not_heap[64];
+    UNUSED(arg);
+    kfree(not_heap + 16);
+}
+
+// Page-aligned, but never handed out by the frame allocator
+static void foreign_page(void* arg) {
+    static uint8_t not_frames[2 * PAGE_SIZE] __attribute__((aligned(PAGE_SIZE)));
+    UNUSED(arg);
+    kfree(not_frames + PAGE_SIZE);
+}
+
+static void interior_page(void* arg) {
+    UNUSED(arg);
+    uint8_t* p = kmalloc_aligned(3 * PAGE_SIZE, PAGE_SIZE);
+    kfree(p + PAGE_SIZE);
+}
+
+// Straight to pmm.c, past the heap profile that catches bad kfrees first
+static void frames_interior(void* arg) {
+    UNUSED(arg);
+    uintptr_t frames = pmm_alloc_frames(3, 1);
+    pmm_free_frames(frames + PAGE_SIZE);
+}
+
+static void frames_reserved(void* arg) {
+    UNUSED(arg);
+    pmm_free_frames(HOST_RAM_BASE);     // pmm.c's own bitmaps
+}
+
+static void frames_double_free(void* arg) {
+    UNUSED(arg);
+    uintptr_t frames = pmm_alloc_frames(2, 1);
+    pmm_free_frames(frames);
+    pmm_free_frames(frames);
+}
+
+static void clean_free(void* arg) {
+    UNUSED(arg);
+    kfree(kmalloc(40));
+    kfree(kmalloc_aligned(3 * PAGE_SIZE, PAGE_SIZE));
+}
+
+static void test_panics(void) {
+    capture_begin();
+    CHECK(host_catch_panic(double_free, NULL));
+    CHECK(host_catch_panic(large_double_free, NULL));
+    CHECK(host_catch_panic(overrun, NULL));
+    CHECK(host_catch_panic(foreign_pointer, NULL));
+    CHECK(host_catch_panic(foreign_page, NULL));
+    CHECK(host_catch_panic(interior_page, NULL));
+    CHECK(host_catch_panic(frames_interior, NULL));
+    CHECK(host_catch_panic(frames_reserved, NULL));
+    CHECK(host_catch_panic(frames_double_free, NULL));
+    CHECK(!host_catch_panic(clean_free, NULL));
+    capture_end();
+}
+
+static void test_meminfo(void) {
+    void* p = kmalloc(1234);
+    capture_begin();
+    process_command("meminfo -v");
+    const char* out = capture_end();
+    CHECK(contains(out, "Heap start"));
+    kfree(p);
+}
+
+const struct host_test memory_tests[] = {
+    { "zero_and_null", test_zero_and_null },
+    { "alignment", test_alignment },
+    { "churn", test_churn },
+    { "coalescing", test_coalescing },
+    { "frame_runs", test_frame_runs },
+    { "panics", test_panics },
+    { "meminfo", test_meminfo },
+    { NULL, NULL },
+};
@@ -0,0 +1,115 @@
+/*
+ * test_shell.c - Command line parsing and the command registry
+ */
+
+#include "harness.h"
+
+#define ARGS_MAX 40
+
+// "args" records what a handler was given
+static int args_calls;
+static int args_argc;
+static char args_argv[ARGS_MAX][64];
+
+static void cmd_args(int argc, char** argv) {
+    args_calls++;
+    args_argc = argc;
+    for (int i = 0; i < argc && i < ARGS_MAX; i++) {
+        ksnprintf(args_argv[i], sizeof(args_argv[i]), "%s", argv[i]);
+    }
+    CHECK(argv[argc] == NULL);
+}
+
+static const char* run(const char* line) {
+    static int registered;
+    if (!registered) {
+        CHECK(shell_register_command("args", cmd_args, "Record arguments (tests)") == 0);
+        registered = 1;
+    }
+    args_calls = 0;
+    args_argc = 0;
+    capture_begin();
+    process_command(line);
+    return capture_end();
+}
+
+static void test_blanks(void) {
+    run("  args   a\tb  c  ");
+    CHECK(args_calls == 1);
+    CHECK(args_argc == 4);
+    CHECK_STR(args_argv[1], "a");
+    CHECK_STR(args_argv[3], "c");
+    run("");
+    run("   ;  ; ");
+    CHECK(args_calls == 0);
+}
+
+static void test_quotes_and_escapes(void) {
+    run("args 'b c' \"d \\\"e\\\"\" f\\ g 'x'\"y\"z '' \"a;b|c\"");
+    CHECK(args_argc == 7);
+    CHECK_STR(args_argv[1], "b c");
+    CHECK_STR(args_argv[2], "d \"e\"");
+    CHECK_STR(args_argv[3], "f g");
+    CHECK_STR(args_argv[4], "xyz");
+    CHECK_STR(args_argv[5], "");
+    CHECK_STR(args_argv[6], "a;b|c");
+    // No escapes inside single quotes
+    run("args 'a\\b'");
+    CHECK_STR(args_argv[1], "a\\b");
+}
+
+static void test_separators(void) {
+    run("args 1; args 2 3;args 4");
+    CHECK(args_calls == 3);
+    CHECK(args_argc == 2);
+    CHECK_STR(args_argv[1], "4");
+    CHECK(contains(run("args 1 | args 2"), "Pipes are not supported"));
+}
+
+static void test_errors(void) {
+    CHECK(contains(run("args 'open"), "Unterminated quote"));
+    CHECK(args_calls == 0);
+
+    char line[128] = "args";
+    for (int i = 0; i < 32; i++) {
+        strcpy(line + strlen(line), " x");
+    }
+    CHECK(contains(run(line), "Too many arguments"));
+    CHECK(args_calls == 0);
+    line[strlen(line) - 2] = '\0';
+    run(line);
+    CHECK(args_argc == 32);
+
+    char long_line[300];
+    memset(long_line, 'a', sizeof(long_line) - 1);
+    long_line[sizeof(long_line) - 1] = '\0';
+    CHECK(contains(run(long_line), "Command line too long"));
+
+    CHECK(contains(run("nosuchcommand"), "Unknown command: nosuchcommand"));
+}
+
+static void test_registry(void) {
+    run("ARGS upper");
+    CHECK(args_calls == 1);
+    CHECK(shell_register_command("args", cmd_args, "again") < 0);
+    CHECK(shell_register_command("Args", cmd_args, "again") < 0);
+    CHECK(contains(run("help"), "args"));
+    CHECK(contains(run("help"), "\n  help      - Show this help message\n"));
+}
+
+static void test_builtins(void) {
+    CHECK_STR(run("echo hello   'big world'"), "hello big world\n");
+    run("repeat 3 args x");
+    CHECK(args_calls == 3);
+    CHECK(contains(run("time true"), "cycles"));
+}
+
+const struct host_test shell_tests[] = {
+    { "blanks", test_blanks },
+    { "quotes_and_escapes", test_quotes_and_escapes },
+    { "separators", test_separators },
+    { "errors", test_errors },
+    { "registry", test_registry },
+    { "builtins", test_builtins },
+    { NULL, NULL },
+};
@@ -0,0 +1,134 @@
+/*
+ * test_string.c - String routines and formatted output
+ */
+
+#include "harness.h"
+
+static void test_ksnprintf_integers(void) {
+    char buf[64];
+    ksnprintf(buf, sizeof(buf), "%d %i %u", -42, 7, 4000000000u);
+    CHECK_STR(buf, "-42 7 4000000000");
+    ksnprintf(buf, sizeof(buf), "%x %X %o %#x", 0xbeef, 0xbeef, 8, 255);
+    CHECK_STR(buf, "beef BEEF 10 0xff");
+    ksnprintf(buf, sizeof(buf), "%llu %lld", 18446744073709551615ULL, -9000000000LL);
+    CHECK_STR(buf, "18446744073709551615 -9000000000");
+    ksnprintf(buf, sizeof(buf), "[%5d|%-5d|%05d|%+d|% d]", 42, 42, -42, 3, 3);
+    CHECK_STR(buf, "[   42|42   |-0042|+3| 3]");
+    ksnprintf(buf, sizeof(buf), "%.3d %08x", 5, 0x1234);
+    CHECK_STR(buf, "005 00001234");
+}
+
+static void test_ksnprintf_strings(void) {
+    char buf[64];
+    const char* volatile none = NULL;   // Hidden from the format checker
+    ksnprintf(buf, sizeof(buf), "[%s|%8s|%-8s|%.2s]", "abc", "abc", "abc", "abc");
+    CHECK_STR(buf, "[abc|     abc|abc     |ab]");
+    ksnprintf(buf, sizeof(buf), "%c%c %% %s", 'o', 'k', none);
+    CHECK_STR(buf, "ok % (null)");
+    ksnprintf(buf, sizeof(buf), "[%*d|%-*s]", 4, 7, 3, "x");
+    CHECK_STR(buf, "[   7|x  ]");
+}
+
+// The return value is the length the whole output would have had
+static void test_ksnprintf_truncation(void) {
+    char buf[8];
+    CHECK(ksnprintf(buf, sizeof(buf), "%s", "0123456789") == 10);
+    CHECK_STR(buf, "0123456");
+    CHECK(ksnprintf(buf, 1, "abc") == 3);
+    CHECK_STR(buf, "");
+    CHECK(ksnprintf(NULL, 0, "%d", 12345) == 5);
+}
+
+static void test_parse_uint(void) {
+    uint32_t value = 0;
+    CHECK(parse_uint("0", &value) == 0 && value == 0);
+    CHECK(parse_uint("4294967295", &value) == 0 && value == 4294967295u);
+    CHECK(parse_uint("4294967296", &value) < 0);
+    CHECK(parse_uint("", &value) < 0);
+    CHECK(parse_uint("12a", &value) < 0);
+    CHECK(parse_uint("-1", &value) < 0);
+    CHECK(parse_uint(NULL, &value) < 0);
+    CHECK(value == 4294967295u);
+}
+
+// Every start alignment and length up to a few words
+static void test_strlen_alignment(void) {
+    char buf[48] __attribute__((aligned(16)));
+    memset(buf, 'x', sizeof(buf));
+    for (size_t start = 0; start < 8; start++) {
+        for (size_t len = 0; len < 32; len++) {
+            buf[start + len] = '\0';
+            CHECK(strlen(buf + start) == len);
+            buf[start + len] = 'x';
+        }
+    }
+}
+
+static void test_compare(void) {
+    CHECK(strcmp("abc", "abc") == 0);
+    CHECK(strcmp("abc", "abd") < 0);
+    CHECK(strcmp("ab", "abc") < 0);
+    CHECK(strcmp("\xff", "a") > 0);
+    CHECK(strncmp("abcd", "abce", 3) == 0);
+    CHECK(strncmp("abcd", "abce", 4) < 0);
+    CHECK(strncmp("ab", "abc", 8) < 0);
+    CHECK(strncmp("ab", "ab", 8) == 0);
+    CHECK(strncmp("x", "y", 0) == 0);
+    CHECK(memcmp("abcd", "abce", 3) == 0);
+    CHECK(memcmp("abcd", "abce", 4) < 0);
+    CHECK(strcmpi("HeLLo", "hello") == 0);
+    CHECK(strcmpi("hello", "help") != 0);
+    CHECK(strcmpi("abc", "ABCD") != 0);
+    CHECK(starts_with("memory/kmalloc", "memory/"));
+    CHECK(!starts_with("mem", "memory"));
+}
+
+// Both directions of overlap, at offsets that defeat word copies
+static void test_memmove_overlap(void) {
+    char buf[64];
+    for (int shift = 1; shift < 9; shift++) {
+        for (int i = 0; i < 64; i++) {
+            buf[i] = (char)i;
+        }
+        memmove(buf + shift, buf, 40);
+        int ok = 1;
+        for (int i = 0; i < 40; i++) {
+            ok &= buf[i + shift] == (char)i;
+        }
+        CHECK(ok);
+
+        for (int i = 0; i < 64; i++) {
+            buf[i] = (char)i;
+        }
+        memmove(buf, buf + shift, 40);
+        ok = 1;
+        for (int i = 0; i < 40; i++) {
+            ok &= buf[i] == (char)(i + shift);
+        }
+        CHECK(ok);
+    }
+}
+
+static void test_memset16(void) {
+    uint16_t cells[13];
+    memset(cells, 0, sizeof(cells));
+    memset16(cells + 1, 0x0741, 11);
+    CHECK(cells[0] == 0 && cells[12] == 0);
+    int ok = 1;
+    for (int i = 1; i < 12; i++) {
+        ok &= cells[i] == 0x0741;
+    }
+    CHECK(ok);
+}
+
+const struct host_test string_tests[] = {
+    { "ksnprintf_integers", test_ksnprintf_integers },
+    { "ksnprintf_strings", test_ksnprintf_strings },
+    { "ksnprintf_truncation", test_ksnprintf_truncation },
+    { "parse_uint", test_parse_uint },
+    { "strlen_alignment", test_strlen_alignment },
+    { "compare", test_compare },
+    { "memmove_overlap", test_memmove_overlap },
+    { "memset16", test_memset16 },
+    { NULL, NULL },
+};
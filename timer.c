@@ -0,0 +1,395 @@
+/*
+ * timer.c - System timer and clocks
+ * 1ms ticks on IRQ0 (PIT) or the local APIC timer, a nanosecond clock
+ * from the TSC calibrated against the PIT, and a timer wheel for
+ * deferred callbacks
+ */
+
+#include "kernel.h"
+
+// PIT (8253/8254)
+#define PIT_FREQUENCY   1193182
+#define PIT_CHANNEL0    0x40
+#define PIT_CHANNEL2    0x42
+#define PIT_COMMAND     0x43
+#define PIT_GATE_PORT   0x61    // Bit 0: channel 2 gate, bit 1: speaker, bit 5: OUT2
+#define PIT_IRQ         0
+
+// Local APIC registers (offsets from the MMIO base)
+#define IA32_APIC_BASE_MSR  0x1B
+#define APIC_BASE_ENABLE    (1u << 11)
+#define LAPIC_ID            0x20
+#define LAPIC_EOI           0xB0
+#define LAPIC_SPURIOUS      0xF0
+#define LAPIC_ICR_LOW       0x300
+#define LAPIC_ICR_HIGH      0x310
+#define LAPIC_LVT_TIMER     0x320
+#define LAPIC_LVT_LINT0     0x350
+#define LAPIC_LVT_LINT1     0x360
+#define LAPIC_TIMER_INITIAL 0x380
+#define LAPIC_TIMER_CURRENT 0x390
+#define LAPIC_TIMER_DIVIDE  0x3E0
+#define LAPIC_SW_ENABLE     (1u << 8)
+#define LAPIC_TIMER_PERIODIC (1u << 17)
+#define LAPIC_DELIVERY_EXTINT (7u << 8)
+#define LAPIC_DELIVERY_NMI  (4u << 8)
+#define LAPIC_LVT_MASKED    (1u << 16)
+#define LAPIC_ICR_PENDING   (1u << 12)
+
+#define CPUID_EDX_TSC  (1u << 4)
+#define CPUID_EDX_APIC (1u << 9)
+
+// Calibration window, measured with PIT channel 2
+#define CALIBRATE_MS 10
+
+// Timer wheel: one slot per tick, timers further out than a lap stay
+// in their slot until the wheel comes around to their expiry tick
+#define WHEEL_SLOTS 256
+#define WHEEL_MASK  (WHEEL_SLOTS - 1)
+
+static volatile uint64_t ticks;
+static seqlock_t ticks_lock = SEQLOCK_INIT("ticks");   // For 64-bit readers
+static volatile uint32_t* lapic;        // NULL when the PIT drives the tick
+static uint32_t lapic_ticks_per_ms;
+
+// Nanoseconds = (TSC delta * tsc_mult) >> tsc_shift
+static int have_tsc;
+static uint32_t tsc_frequency_khz;
+static uint32_t tsc_mult;
+static unsigned tsc_shift;
+static uint64_t tsc_base;
+
+static struct timer* wheel[WHEEL_SLOTS];
+static spinlock_t wheel_lock = SPINLOCK_INIT("timers");
+static uint32_t wheel_tick;             // Last tick whose slot has been run
+static struct task* timer_task;         // Runs expired callbacks
+
+#define TIMER_TASK_PRIORITY 4
+
+static void timer_thread(void* arg);
+
+static inline uint64_t rdmsr(uint32_t msr) {
+    uint32_t lo, hi;
+    asm volatile("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static inline void wrmsr(uint32_t msr, uint64_t value) {
+    asm volatile("wrmsr" : : "c"(msr), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)));
+}
+
+static inline uint32_t lapic_read(uint32_t reg) {
+    return lapic[reg / 4];
+}
+
+static inline void lapic_write(uint32_t reg, uint32_t value) {
+    lapic[reg / 4] = value;
+}
+
+// Common tick work for both interrupt sources. Every CPU's APIC timer
+// ends time slices there, but only the boot CPU keeps time.
+static inline void timer_tick(void) {
+    if (this_cpu()->index == 0) {
+        write_seqlock(&ticks_lock);
+        uint32_t now = (uint32_t)++ticks;
+        write_sequnlock(&ticks_lock);
+        if (timer_task && wheel[now & WHEEL_MASK]) {
+            sched_wake(timer_task);
+        }
+    }
+    sched_tick((uint32_t)ticks);
+}
+
+// The PIC EOI is sent by interrupt_dispatch
+static void pit_irq_handler(struct interrupt_frame* frame) {
+    UNUSED(frame);
+    timer_tick();
+}
+
+static void lapic_timer_handler(struct interrupt_frame* frame) {
+    UNUSED(frame);
+    timer_tick();
+    lapic_write(LAPIC_EOI, 0);
+}
+
+// Start a one-shot countdown of 'ms' milliseconds on PIT channel 2
+static void pit_oneshot_start(uint32_t ms) {
+    uint32_t count = PIT_FREQUENCY / 1000 * ms;
+
+    // Gate on, speaker off
+    outb(PIT_GATE_PORT, (inb(PIT_GATE_PORT) & ~0x02) | 0x01);
+    outb(PIT_COMMAND, 0xB0);    // Channel 2, lobyte/hibyte, mode 0
+    outb(PIT_CHANNEL2, count & 0xFF);
+    outb(PIT_CHANNEL2, (count >> 8) & 0xFF);
+
+    // Reloading the count only starts it on a gate edge
+    uint8_t gate = inb(PIT_GATE_PORT);
+    outb(PIT_GATE_PORT, gate & ~0x01);
+    outb(PIT_GATE_PORT, gate | 0x01);
+}
+
+static int pit_oneshot_done(void) {
+    return inb(PIT_GATE_PORT) & 0x20;
+}
+
+// Measure the TSC, and the APIC timer when used, over one PIT window
+static void calibrate(void) {
+    if (lapic) {
+        lapic_write(LAPIC_TIMER_DIVIDE, 0x3);   // Divide by 16
+        lapic_write(LAPIC_TIMER_INITIAL, 0xFFFFFFFF);
+    }
+
+    pit_oneshot_start(CALIBRATE_MS);
+    uint64_t tsc_start = have_tsc ? rdtsc() : 0;
+    uint32_t apic_start = lapic ? lapic_read(LAPIC_TIMER_CURRENT) : 0;
+    while (!pit_oneshot_done()) {
+        asm volatile("pause");
+    }
+    uint64_t tsc_end = have_tsc ? rdtsc() : 0;
+    uint32_t apic_end = lapic ? lapic_read(LAPIC_TIMER_CURRENT) : 0;
+
+    if (lapic) {
+        lapic_ticks_per_ms = (apic_start - apic_end) / CALIBRATE_MS;
+        lapic_write(LAPIC_TIMER_INITIAL, 0);
+    }
+
+    if (have_tsc) {
+        tsc_frequency_khz = (uint32_t)(tsc_end - tsc_start) / CALIBRATE_MS;
+        if (tsc_frequency_khz == 0) {
+            have_tsc = 0;
+            return;
+        }
+
+        // Largest shift that keeps 10^6 << shift / kHz within 32 bits
+        tsc_shift = 32;
+        uint64_t mult;
+        while ((mult = div64_u32((uint64_t)1000000 << tsc_shift, tsc_frequency_khz, NULL)) > 0xFFFFFFFFu) {
+            tsc_shift--;
+        }
+        tsc_mult = (uint32_t)mult;
+        tsc_base = tsc_end;
+    }
+}
+
+// Periodic 1ms tick from the PIT on IRQ0
+static void pit_start(void) {
+    uint32_t divisor = (PIT_FREQUENCY + TIMER_HZ / 2) / TIMER_HZ;
+    outb(PIT_COMMAND, 0x34);    // Channel 0, lobyte/hibyte, rate generator
+    outb(PIT_CHANNEL0, divisor & 0xFF);
+    outb(PIT_CHANNEL0, (divisor >> 8) & 0xFF);
+
+    register_irq_handler(PIT_IRQ, pit_irq_handler);
+}
+
+// Program this CPU's APIC timer with the calibrated 1ms period
+static void lapic_timer_start(void) {
+    lapic_write(LAPIC_TIMER_DIVIDE, 0x3);   // Divide by 16, as calibrated
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_PERIODIC | LAPIC_TIMER_VECTOR);
+    lapic_write(LAPIC_TIMER_INITIAL, lapic_ticks_per_ms);
+}
+
+// Software-enable the local APIC, keeping the PIC routed through LINT0
+static int lapic_setup(void) {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    if (!(edx & CPUID_EDX_APIC)) {
+        return 0;
+    }
+
+    uint64_t base = rdmsr(IA32_APIC_BASE_MSR);
+    wrmsr(IA32_APIC_BASE_MSR, base | APIC_BASE_ENABLE);
+    lapic = map_mmio(base & 0xFFFFF000, PAGE_SIZE);
+    if (!lapic) {
+        return 0;
+    }
+
+    // Spurious APIC interrupts need no handler and must not get an EOI
+    register_interrupt_handler(LAPIC_TIMER_VECTOR, lapic_timer_handler);
+
+    lapic_write(LAPIC_SPURIOUS, LAPIC_SW_ENABLE | LAPIC_SPURIOUS_VECTOR);
+    lapic_write(LAPIC_LVT_LINT0, LAPIC_DELIVERY_EXTINT);   // Virtual wire
+    lapic_write(LAPIC_LVT_LINT1, LAPIC_DELIVERY_NMI);
+    return 1;
+}
+
+void timer_init(void) {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    have_tsc = (edx & CPUID_EDX_TSC) != 0;
+
+    lapic_setup();
+    calibrate();
+
+    if (lapic && lapic_ticks_per_ms) {
+        lapic_timer_start();
+    } else {
+        lapic = NULL;
+        pit_start();
+    }
+
+    timer_task = kthread_create("timer", timer_thread, NULL, TIMER_TASK_PRIORITY);
+    if (!timer_task) {
+        kernel_panic("timer: cannot create the timer thread");
+    }
+
+    printf("Timer: %s at %d Hz", timer_source(), TIMER_HZ);
+    if (have_tsc) {
+        printf(", TSC %u MHz", tsc_frequency_khz / 1000);
+    }
+    printf("\n");
+}
+
+// Local APIC and tick of an application processor. The PIC stays wired
+// to the boot CPU only, so LINT0 is masked here.
+void timer_init_cpu(void) {
+    uint64_t base = rdmsr(IA32_APIC_BASE_MSR);
+    wrmsr(IA32_APIC_BASE_MSR, base | APIC_BASE_ENABLE);
+    lapic_write(LAPIC_SPURIOUS, LAPIC_SW_ENABLE | LAPIC_SPURIOUS_VECTOR);
+    lapic_write(LAPIC_LVT_LINT0, LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_LVT_LINT1, LAPIC_DELIVERY_NMI);
+    lapic_timer_start();
+}
+
+int lapic_present(void) {
+    return lapic != NULL;
+}
+
+uint32_t lapic_id(void) {
+    return lapic_read(LAPIC_ID) >> 24;
+}
+
+// Send an inter-processor interrupt and wait until the APIC accepted it
+void lapic_send_ipi(uint32_t apic_id, uint32_t command) {
+    uint32_t flags = irq_save();
+    lapic_write(LAPIC_ICR_HIGH, apic_id << 24);
+    lapic_write(LAPIC_ICR_LOW, command);
+    while (lapic_read(LAPIC_ICR_LOW) & LAPIC_ICR_PENDING) {
+        asm volatile("pause");
+    }
+    irq_restore(flags);
+}
+
+void lapic_eoi(void) {
+    lapic_write(LAPIC_EOI, 0);
+}
+
+const char* timer_source(void) {
+    return lapic ? "local APIC" : "PIT";
+}
+
+// The boot CPU may bump the count between the two halves of a read;
+// reading until two results agree works around that
+uint64_t timer_ticks(void) {
+    uint64_t now;
+    uint32_t sequence;
+    do {
+        sequence = read_seqbegin(&ticks_lock);
+        now = ticks;
+    } while (read_seqretry(&ticks_lock, sequence));
+    return now;
+}
+
+uint32_t tsc_khz(void) {
+    return have_tsc ? tsc_frequency_khz : 0;
+}
+
+// Monotonic time since timer_init, TSC-precise when available
+uint64_t ktime_ns(void) {
+    if (!have_tsc) {
+        return timer_ticks() * (1000000000 / TIMER_HZ);
+    }
+    return mul_u64_u32_shr(rdtsc() - tsc_base, tsc_mult, tsc_shift);
+}
+
+// Block for at least 'ms' milliseconds; needs interrupts enabled
+void sleep_ms(uint32_t ms) {
+    if (sched_active()) {
+        kthread_sleep(ms);
+        return;
+    }
+
+    uint32_t target = (uint32_t)ticks + ms + 1;   // The current tick is partly over
+    while ((int32_t)((uint32_t)ticks - target) < 0) {
+        asm volatile("hlt");
+    }
+}
+
+// Queue 'callback' to run from timer_run_expired after 'delay_ms'
+void timer_add(struct timer* timer, uint32_t delay_ms, timer_callback_t callback, void* data) {
+    uint32_t flags = spin_lock_irqsave(&wheel_lock);
+    timer->callback = callback;
+    timer->data = data;
+    timer->expires = (uint32_t)ticks + (delay_ms ? delay_ms : 1);
+
+    struct timer** slot = &wheel[timer->expires & WHEEL_MASK];
+    timer->prev = NULL;
+    timer->next = *slot;
+    if (*slot) {
+        (*slot)->prev = timer;
+    }
+    *slot = timer;
+    spin_unlock_irqrestore(&wheel_lock, flags);
+}
+
+static void wheel_unlink(struct timer* timer) {
+    if (timer->prev) {
+        timer->prev->next = timer->next;
+    } else {
+        wheel[timer->expires & WHEEL_MASK] = timer->next;
+    }
+    if (timer->next) {
+        timer->next->prev = timer->prev;
+    }
+    timer->next = timer->prev = NULL;
+    timer->callback = NULL;
+}
+
+// Returns 1 when the timer was still pending
+int timer_cancel(struct timer* timer) {
+    uint32_t flags = spin_lock_irqsave(&wheel_lock);
+    int pending = timer->callback != NULL;
+    if (pending) {
+        wheel_unlink(timer);
+    }
+    spin_unlock_irqrestore(&wheel_lock, flags);
+    return pending;
+}
+
+// Run the callbacks of every tick that has passed since the last call.
+// Called from the timer thread, never from interrupt context. The wheel
+// is only touched with interrupts off and the wheel lock held;
+// callbacks run with neither.
+void timer_run_expired(void) {
+    uint32_t now = (uint32_t)ticks;
+
+    while (wheel_tick != now) {
+        wheel_tick++;
+        uint32_t flags = spin_lock_irqsave(&wheel_lock);
+        struct timer* timer = wheel[wheel_tick & WHEEL_MASK];
+        while (timer) {
+            if (timer->expires != wheel_tick) {
+                timer = timer->next;    // Due on a later lap
+                continue;
+            }
+
+            timer_callback_t callback = timer->callback;
+            void* data = timer->data;
+            wheel_unlink(timer);
+            spin_unlock_irqrestore(&wheel_lock, flags);
+            callback(data);
+            flags = spin_lock_irqsave(&wheel_lock);
+            // The callback may have added or cancelled timers in this slot
+            timer = wheel[wheel_tick & WHEEL_MASK];
+        }
+        spin_unlock_irqrestore(&wheel_lock, flags);
+    }
+}
+
+// Woken by the tick whenever a wheel slot is due
+static void timer_thread(void* arg) {
+    UNUSED(arg);
+    while (1) {
+        timer_run_expired();
+        sched_block();
+    }
+}
@@ -0,0 +1,150 @@
+/*
+ * mkinitrd.c - Pack a directory into an initrd image (host tool)
+ * Usage: mkinitrd <output> <directory>
+ * Every regular file below the directory is stored under its path
+ * relative to it, in sorted order so the same tree gives the same image.
+ */
+
+#include <dirent.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "../initrd.h"
+
+#define MAX_FILES 1024
+#define MAX_PATH  256
+
+struct file {
+    char path[MAX_PATH];        // Relative to the packed directory
+    uint32_t size;
+    uint32_t data_offset;
+};
+
+static struct file files[MAX_FILES];
+static unsigned file_count;
+
+static void fail(const char* message, const char* detail) {
+    fprintf(stderr, "mkinitrd: %s%s%s\n", message, detail ? ": " : "", detail ? detail : "");
+    exit(1);
+}
+
+static void collect(const char* root, const char* relative) {
+    char dir_path[MAX_PATH * 2];
+    snprintf(dir_path, sizeof(dir_path), "%s%s%s", root, relative[0] ? "/" : "", relative);
+    DIR* dir = opendir(dir_path);
+    if (!dir) {
+        fail("cannot open directory", dir_path);
+    }
+
+    struct dirent* entry;
+    while ((entry = readdir(dir))) {
+        if (entry->d_name[0] == '.') {
+            continue;           // Also skips editor dotfiles
+        }
+        char path[MAX_PATH];
+        if ((size_t)snprintf(path, sizeof(path), "%s%s%s", relative, relative[0] ? "/" : "",
+                             entry->d_name) >= sizeof(path)) {
+            fail("path too long", entry->d_name);
+        }
+
+        char full[MAX_PATH * 2];
+        snprintf(full, sizeof(full), "%s/%s", root, path);
+        struct stat st;
+        if (stat(full, &st) < 0) {
+            fail("cannot stat", full);
+        }
+        if (S_ISDIR(st.st_mode)) {
+            collect(root, path);
+        } else if (S_ISREG(st.st_mode)) {
+            if (file_count == MAX_FILES) {
+                fail("too many files", NULL);
+            }
+            strcpy(files[file_count].path, path);
+            files[file_count].size = (uint32_t)st.st_size;
+            file_count++;
+        }
+    }
+    closedir(dir);
+}
+
+static int compare_files(const void* a, const void* b) {
+    return strcmp(((const struct file*)a)->path, ((const struct file*)b)->path);
+}
+
+static uint32_t align_up(uint32_t value, uint32_t align) {
+    return (value + align - 1) & ~(align - 1);
+}
+
+int main(int argc, char** argv) {
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s <output> <directory>\n", argv[0]);
+        return 1;
+    }
+    collect(argv[2], "");
+    qsort(files, file_count, sizeof(files[0]), compare_files);
+
+    uint32_t slots = 1;
+    while (slots < file_count * 2) {
+        slots <<= 1;
+    }
+
+    // Metadata first, then page-aligned data
+    struct initrd_header header = { INITRD_MAGIC, INITRD_VERSION, file_count, 0, 0, slots, 0, 0, 0 };
+    header.entries_offset = sizeof(header);
+    header.index_offset = header.entries_offset + file_count * sizeof(struct initrd_entry);
+    header.names_offset = header.index_offset + slots * sizeof(uint32_t);
+    uint32_t names_size = 0;
+    for (unsigned i = 0; i < file_count; i++) {
+        names_size += strlen(files[i].path) + 1;
+    }
+    uint32_t offset = align_up(header.names_offset + names_size, INITRD_ALIGN);
+    for (unsigned i = 0; i < file_count; i++) {
+        files[i].data_offset = offset;
+        offset = align_up(offset + files[i].size, INITRD_ALIGN);
+    }
+    header.total_size = offset;
+
+    uint8_t* image = calloc(1, header.total_size);
+    if (!image) {
+        fail("out of memory", NULL);
+    }
+    memcpy(image, &header, sizeof(header));
+
+    struct initrd_entry* entries = (struct initrd_entry*)(image + header.entries_offset);
+    uint32_t* index = (uint32_t*)(image + header.index_offset);
+    char* names = (char*)(image + header.names_offset);
+    uint32_t name_offset = 0;
+    for (unsigned i = 0; i < file_count; i++) {
+        entries[i].name_offset = name_offset;
+        entries[i].hash = initrd_hash(files[i].path);
+        entries[i].data_offset = files[i].data_offset;
+        entries[i].size = files[i].size;
+        strcpy(names + name_offset, files[i].path);
+        name_offset += strlen(files[i].path) + 1;
+
+        uint32_t slot = entries[i].hash & (slots - 1);
+        while (index[slot]) {
+            slot = (slot + 1) & (slots - 1);
+        }
+        index[slot] = i + 1;
+
+        char full[MAX_PATH * 2];
+        snprintf(full, sizeof(full), "%s/%s", argv[2], files[i].path);
+        FILE* in = fopen(full, "rb");
+        if (!in || fread(image + files[i].data_offset, 1, files[i].size, in) != files[i].size) {
+            fail("cannot read", full);
+        }
+        fclose(in);
+    }
+
+    FILE* out = fopen(argv[1], "wb");
+    if (!out || fwrite(image, 1, header.total_size, out) != header.total_size || fclose(out) != 0) {
+        fail("cannot write", argv[1]);
+    }
+    printf("%s: %u files, %u bytes\n", argv[1], file_count, header.total_size);
+    free(image);
+    return 0;
+}
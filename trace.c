@@ -0,0 +1,167 @@
+/*
+ * trace.c - In-memory event trace
+ * Probe points record TSC-stamped events into a ring that overwrites
+ * the oldest entries. Slots are claimed with an atomic add, so probes
+ * in interrupt handlers can nest inside probes in ordinary code.
+ */
+
+#include "kernel.h"
+
+#define TRACE_RING_SIZE 4096        // Must be a power of two
+#define TRACE_DUMP_DEFAULT 20
+
+struct trace_event {
+    uint64_t tsc;
+    uint16_t id;
+    uint16_t reserved;
+    uint32_t arg0;
+    uint32_t arg1;              // Cycles spent, for span events
+};
+
+// Probes test this before doing anything else
+int trace_enabled;
+
+static struct trace_event trace_ring[TRACE_RING_SIZE];
+static volatile uint32_t trace_head;    // Next slot, runs freely
+
+static const struct {
+    const char* name;
+    int span;                   // arg1 holds a duration in cycles
+} trace_events[TRACE_EVENT_COUNT] = {
+    [TRACE_IRQ_ENTER] = { "irq-enter", 0 },
+    [TRACE_IRQ_EXIT]  = { "irq-exit",  1 },
+    [TRACE_KMALLOC]   = { "kmalloc",   1 },
+    [TRACE_KFREE]     = { "kfree",     1 },
+    [TRACE_SCROLL]    = { "scroll",    1 },
+    [TRACE_COMMAND]   = { "command",   1 },
+    [TRACE_LOCK_WAIT] = { "lock-wait", 1 },
+};
+
+void trace_record(uint32_t id, uint32_t arg0, uint32_t arg1) {
+    uint32_t slot = __sync_fetch_and_add(&trace_head, 1);
+    struct trace_event* event = &trace_ring[slot & (TRACE_RING_SIZE - 1)];
+    event->tsc = rdtsc();
+    event->id = id;
+    event->arg0 = arg0;
+    event->arg1 = arg1;
+}
+
+// Oldest recorded slot and the number of events since then
+static uint32_t trace_window(uint32_t* first) {
+    uint32_t head = trace_head;
+    uint32_t count = head < TRACE_RING_SIZE ? head : TRACE_RING_SIZE;
+    *first = head - count;
+    return count;
+}
+
+static uint32_t cycles_to_ns(uint64_t cycles) {
+    uint32_t khz = tsc_khz();
+    return khz ? (uint32_t)div64_u32(cycles * 1000000, khz, NULL) : 0;
+}
+
+static void trace_dump(uint32_t limit) {
+    uint32_t first;
+    uint32_t count = trace_window(&first);
+    if (limit < count) {
+        first += count - limit;
+        count = limit;
+    }
+    if (!count) {
+        printf("No events recorded\n");
+        return;
+    }
+
+    uint64_t base = trace_ring[first & (TRACE_RING_SIZE - 1)].tsc;
+    printf("      TIME(ns) EVENT          ARG0       ARG1\n");
+    for (uint32_t i = 0; i < count; i++) {
+        const struct trace_event* event = &trace_ring[(first + i) & (TRACE_RING_SIZE - 1)];
+        if (event->id >= TRACE_EVENT_COUNT) {
+            continue;
+        }
+        printf("%14u %-10s %#10x", cycles_to_ns(event->tsc - base),
+               trace_events[event->id].name, event->arg0);
+        if (event->id == TRACE_COMMAND) {
+            printf(" %10u  %s\n", cycles_to_ns(event->arg1), (const char*)(uintptr_t)event->arg0);
+        } else if (trace_events[event->id].span) {
+            printf(" %10u ns\n", cycles_to_ns(event->arg1));
+        } else {
+            printf(" %10u\n", event->arg1);
+        }
+    }
+}
+
+static void trace_summary(void) {
+    uint32_t counts[TRACE_EVENT_COUNT] = { 0 };
+    uint32_t min[TRACE_EVENT_COUNT];
+    uint32_t max[TRACE_EVENT_COUNT] = { 0 };
+    uint64_t sum[TRACE_EVENT_COUNT] = { 0 };
+    for (int id = 0; id < TRACE_EVENT_COUNT; id++) {
+        min[id] = 0xFFFFFFFFu;
+    }
+
+    uint32_t first;
+    uint32_t count = trace_window(&first);
+    for (uint32_t i = 0; i < count; i++) {
+        const struct trace_event* event = &trace_ring[(first + i) & (TRACE_RING_SIZE - 1)];
+        uint32_t id = event->id;
+        if (id >= TRACE_EVENT_COUNT) {
+            continue;
+        }
+        counts[id]++;
+        sum[id] += event->arg1;
+        if (event->arg1 < min[id]) min[id] = event->arg1;
+        if (event->arg1 > max[id]) max[id] = event->arg1;
+    }
+
+    printf("%u events (%u recorded in total)\n", count, trace_head);
+    printf("EVENT         COUNT    MIN(ns)    AVG(ns)    MAX(ns)\n");
+    for (int id = 0; id < TRACE_EVENT_COUNT; id++) {
+        if (!counts[id]) {
+            continue;
+        }
+        printf("%-10s %8u", trace_events[id].name, counts[id]);
+        if (trace_events[id].span) {
+            printf(" %10u %10u %10u", cycles_to_ns(min[id]),
+                   cycles_to_ns(div64_u32(sum[id], counts[id], NULL)), cycles_to_ns(max[id]));
+        }
+        printf("\n");
+    }
+}
+
+static void cmd_trace(int argc, char** argv) {
+    const char* action = argc > 1 ? argv[1] : "";
+
+    if (strcmp(action, "start") == 0) {
+        if (!tsc_khz()) {
+            printf("trace: needs a TSC\n");
+            return;
+        }
+        trace_head = 0;
+        trace_enabled = 1;
+        printf("Tracing started\n");
+    } else if (strcmp(action, "stop") == 0) {
+        trace_enabled = 0;
+        printf("Tracing stopped, %u events\n", trace_head);
+    } else if (strcmp(action, "dump") == 0 || strcmp(action, "summary") == 0) {
+        // Printing would trace itself, so pause while reading the ring
+        int was_enabled = trace_enabled;
+        trace_enabled = 0;
+        if (action[0] == 'd') {
+            uint32_t limit = TRACE_DUMP_DEFAULT;
+            if (argc > 2 && parse_uint(argv[2], &limit) < 0) {
+                printf("trace: bad event count '%s'\n", argv[2]);
+            } else {
+                trace_dump(limit);
+            }
+        } else {
+            trace_summary();
+        }
+        trace_enabled = was_enabled;
+    } else {
+        printf("Usage: trace start|stop|dump [count]|summary\n");
+    }
+}
+
+void trace_init(void) {
+    shell_register_command("trace", cmd_trace, "Record and show hot-path trace events");
+}
@@ -0,0 +1,173 @@
+/*
+ * vfs.c - File descriptors over the root filesystem
+ * The only filesystem so far is the read-only initrd, whose files are
+ * contiguous in memory: read copies out of the mapping and mmap hands
+ * it over. Also the ls and cat shell commands.
+ */
+
+#include "kernel.h"
+
+#define CAT_CHUNK 256
+
+struct open_file {
+    int used;
+    uint32_t node;
+    uint32_t size;
+    uint32_t offset;
+    const uint8_t* data;
+};
+
+static const struct filesystem* root_fs;
+static struct open_file open_files[VFS_MAX_OPEN];
+static spinlock_t open_files_lock = SPINLOCK_INIT("vfs");
+
+void vfs_mount_root(const struct filesystem* fs) {
+    root_fs = fs;
+}
+
+static const char* skip_root(const char* path) {
+    while (*path == '/') {
+        path++;
+    }
+    return path;
+}
+
+static struct open_file* file_of(int fd) {
+    if (fd < 0 || fd >= VFS_MAX_OPEN || !open_files[fd].used) {
+        return NULL;
+    }
+    return &open_files[fd];
+}
+
+// Returns a descriptor, or -1 when the file does not exist or too many are open
+int vfs_open(const char* path) {
+    uint32_t node, size;
+    if (!root_fs || root_fs->lookup(skip_root(path), &node, &size) < 0) {
+        return -1;
+    }
+
+    uint32_t flags = spin_lock_irqsave(&open_files_lock);
+    int fd = 0;
+    while (fd < VFS_MAX_OPEN && open_files[fd].used) {
+        fd++;
+    }
+    if (fd < VFS_MAX_OPEN) {
+        struct open_file* file = &open_files[fd];
+        file->used = 1;
+        file->node = node;
+        file->size = size;
+        file->offset = 0;
+        file->data = root_fs->map(node);
+    } else {
+        fd = -1;
+    }
+    spin_unlock_irqrestore(&open_files_lock, flags);
+    return fd;
+}
+
+// Bytes read, 0 at the end of the file, -1 for a bad descriptor
+int vfs_read(int fd, void* buffer, size_t size) {
+    struct open_file* file = file_of(fd);
+    if (!file) {
+        return -1;
+    }
+    uint32_t left = file->size - file->offset;
+    if (size > left) {
+        size = left;
+    }
+    memcpy(buffer, file->data + file->offset, size);
+    file->offset += size;
+    return size;
+}
+
+int vfs_seek(int fd, uint32_t offset) {
+    struct open_file* file = file_of(fd);
+    if (!file || offset > file->size) {
+        return -1;
+    }
+    file->offset = offset;
+    return 0;
+}
+
+// The whole file, read-only and in place; no copy is made
+const void* vfs_mmap(int fd, size_t* size) {
+    struct open_file* file = file_of(fd);
+    if (!file) {
+        return NULL;
+    }
+    *size = file->size;
+    return file->data;
+}
+
+int vfs_close(int fd) {
+    struct open_file* file = file_of(fd);
+    if (!file) {
+        return -1;
+    }
+    file->used = 0;
+    return 0;
+}
+
+int vfs_stat(const char* path, uint32_t* size) {
+    uint32_t node;
+    if (!root_fs) {
+        return -1;
+    }
+    return root_fs->lookup(skip_root(path), &node, size);
+}
+
+// Files in index order; -1 past the last one
+int vfs_readdir(uint32_t index, struct vfs_dirent* entry) {
+    return root_fs ? root_fs->readdir(index, entry) : -1;
+}
+
+// ls [dir]: files under 'dir', or all of them
+static void cmd_ls(int argc, char** argv) {
+    const char* dir = argc > 1 ? skip_root(argv[1]) : "";
+    size_t dir_len = strlen(dir);
+    while (dir_len && dir[dir_len - 1] == '/') {
+        dir_len--;
+    }
+
+    struct vfs_dirent entry;
+    uint32_t shown = 0;
+    for (uint32_t i = 0; vfs_readdir(i, &entry) == 0; i++) {
+        const char* name = entry.name;
+        if (dir_len) {
+            if (strncmp(name, dir, dir_len) != 0 || name[dir_len] != '/') {
+                continue;
+            }
+            name += dir_len + 1;
+        }
+        printf("%8u  %s\n", entry.size, name);
+        shown++;
+    }
+    if (!shown) {
+        printf(root_fs ? "ls: no files\n" : "ls: no filesystem mounted\n");
+    }
+}
+
+static void cmd_cat(int argc, char** argv) {
+    if (argc < 2) {
+        printf("Usage: cat <file>...\n");
+        return;
+    }
+    for (int i = 1; i < argc; i++) {
+        int fd = vfs_open(argv[i]);
+        if (fd < 0) {
+            printf("cat: %s: no such file\n", argv[i]);
+            continue;
+        }
+        char chunk[CAT_CHUNK];
+        int n;
+        while ((n = vfs_read(fd, chunk, sizeof(chunk))) > 0) {
+            terminal_write(chunk, n);
+        }
+        vfs_close(fd);
+    }
+}
+
+void vfs_init(void) {
+    shell_register_command("ls", cmd_ls, "List files (ls [dir])");
+    shell_register_command("cat", cmd_cat, "Print files");
+}